@@ -17,6 +17,75 @@
 
 #include "pblk.h"
 
+#ifdef CONFIG_PBLK_MULTIMAP
+static unsigned int pblk_write_nrb(struct pblk *pblk, struct bio *bio,
+							sector_t lba)
+{
+	unsigned int nrb;
+#ifdef PBLK_WRITE_HINT
+	int hint = pblk_hint_lstream(pblk, bio);
+#endif
+
+#ifdef EXT4_TEST
+	nrb = pblk_get_lstream(pblk, lba);
+#ifdef PBLK_WRITE_HINT
+	/* a mapped hint overrides the guess from the ext4 layout */
+	if (hint != PBLK_HINT_NONE)
+		nrb = hint;
+#else
+	if (nrb == DIR_STREAM) { 
+		if (bio->bi_write_hint > 0)
+			nrb = bio->bi_write_hint;
+	}
+#endif
+#else
+#ifdef PBLK_WRITE_HINT
+	/*
+	 * The first hinted write defines the stream of an lseg, as
+	 * REQ_OP_SETSTREAM would. Defined lsegs keep theirs: moving one
+	 * rebuilds its map.
+	 */
+	if (hint != PBLK_HINT_NONE && pblk_get_maptype(pblk, lba) == NONE_MAP) {
+		spin_lock(&pblk->trans_lock);
+		if (pblk_get_maptype(pblk, lba) == NONE_MAP)
+			pblk_set_lstream(pblk, lba, hint);
+		spin_unlock(&pblk->trans_lock);
+	}
+#endif
+	nrb = pblk_get_lstream(pblk, lba);
+#endif
+	if (nrb > MAX_LSTREAM)
+		nrb = 0;
+
+	return nrb;
+}
+#endif
+
+#ifdef PBLK_WRITE_BATCH
+/*
+ * Entries of a bio are inserted unit by unit so that PAGE_MAP streams can pad
+ * and reserve per page. Runs that stay on one non-PAGE_MAP stream need
+ * neither, so they take a single reservation on the ring (w_lock and rate
+ * limiter once per run instead of once per unit). Entries are still written
+ * in lba order into one contiguous ring range.
+ */
+static int pblk_write_batch_size(struct pblk *pblk, struct bio *bio,
+				 sector_t lba, int nr_entries, int unit)
+{
+	unsigned int nrb = pblk_write_nrb(pblk, bio, lba);
+	int size = unit;
+
+	if (pblk->lstream[nrb].map_type == PAGE_MAP)
+		return unit;
+
+	while (size < nr_entries && size + unit <= pblk->max_write_pgs &&
+			pblk_write_nrb(pblk, bio, lba + size) == nrb)
+		size += unit;
+
+	return min(size, nr_entries);
+}
+#endif
+
 static int __pblk_write_to_cache(struct pblk *pblk, struct bio *bio, unsigned long flags, sector_t lba, int nr_entries)
 {
 	struct pblk_w_ctx w_ctx;
@@ -36,6 +105,9 @@ static int __pblk_write_to_cache(struct pblk *pblk, struct bio *bio, unsigned lo
 	int start_i = 0;
 	user_rb_option = 0;
 #endif 
+#ifdef PBLK_GC_PARALLEL
+	ktime_t stall;
+#endif
 
 	/* Update the write buffer head (mem) with the entries that we can
 	 * write. The write in itself cannot fail, so there is no need to
@@ -49,20 +121,10 @@ retry:
 	} else if (user_rb_option == 2) {
 		nrb = pblk_rb_random(pblk->nr_rwb);
 	} else if (user_rb_option == 3) {
-		nrb = pblk_rb_remain_max(pblk, nr_entries);
-	}
-#else
-#ifdef EXT4_TEST
-	nrb = pblk_get_lstream(pblk, lba);
-	if (nrb == DIR_STREAM) { 
-		if (bio->bi_write_hint > 0)
-			nrb = bio->bi_write_hint;
+		nrb = pblk_rb_remain_max(pblk, nr_entries, pblk->nr_rwb);
 	}
 #else
-	nrb = pblk_get_lstream(pblk, lba);
-#endif
-	if (nrb > MAX_LSTREAM)
-		nrb = 0;
+	nrb = pblk_write_nrb(pblk, bio, lba);
 
 //	printk("[pblk_write_to_cache:1] nrb=%d\n", nrb);
 #endif
@@ -144,8 +206,15 @@ retry:
 #ifndef CONFIG_PBLK_MULTIMAP
 		if (user_rb_option == 1)
 			preempt_enable();
+#endif
+#ifdef PBLK_GC_PARALLEL
+		stall = ktime_get();
 #endif
 		io_schedule();
+#ifdef PBLK_GC_PARALLEL
+		atomic_long_add(ktime_us_delta(ktime_get(), stall),
+							&pblk->gc.stall_us);
+#endif
 		goto retry;
 	case NVM_IO_ERR:
 #ifndef CONFIG_PBLK_MULTIMAP
@@ -326,6 +395,9 @@ int pblk_write_to_cache(struct pblk *pblk, struct bio *bio, unsigned long flags)
 	int nr_entries = total_entries;
 	int ret = NVM_IO_DONE;
 	int unit = 4;
+#ifdef PBLK_RL_PID
+	ktime_t start;
+#endif
 
 	if ((nr_entries <= 0)) {
 //		printk("write_to_cache: case0 %lu %d\n", lba, nr_entries);
@@ -333,10 +405,28 @@ int pblk_write_to_cache(struct pblk *pblk, struct bio *bio, unsigned long flags)
 		return ret;		
 	}
 
+#ifdef PBLK_RL_PID
+	start = ktime_get();
+#endif
+
+#ifdef PBLK_WRITE_HINT
+	if (bio->bi_write_hint < PBLK_NR_HINTS)
+		atomic_long_add(nr_entries,
+				&pblk->hint_writes[bio->bi_write_hint]);
+#endif
+
 	while (1)
 	{
 		if (nr_entries > unit) {
 			int size = unit;
+#ifdef PBLK_WRITE_BATCH
+			size = pblk_write_batch_size(pblk, bio, temp_lba,
+							nr_entries, unit);
+			if (size == nr_entries) {
+				ret = __pblk_write_to_cache(pblk, bio, flags, temp_lba, size);
+				break;
+			}
+#endif
 //			printk("write_to_cache: case1 %lu %lu %d %d %d\n", lba, temp_lba, loff, size, nr_entries);
 			__pblk_write_to_cache(pblk, bio, flags, temp_lba, size);
 			nr_entries = nr_entries - size;
@@ -349,6 +439,9 @@ int pblk_write_to_cache(struct pblk *pblk, struct bio *bio, unsigned long flags)
 		}
 	};
 
+#ifdef PBLK_RL_PID
+	pblk_rl_lat_add(&pblk->rl, ktime_us_delta(ktime_get(), start));
+#endif
 	return ret; 
 }
 
@@ -466,10 +559,8 @@ retry_sector:
 		}
 		
 		spin_lock(&pblk->trans_lock);
-		if (pblk->preinvalid_map[lba_list[i]] == 1) {
+		if (pblk_preinvalid_clear(pblk, lba_list[i]))
 			atomic_long_inc(&pblk->preinvalid_gc[gc_line->pstream]);
-			pblk->preinvalid_map[lba_list[i]] = 0;
-		}
 		spin_unlock(&pblk->trans_lock); 
 
 		nrb = nrb_sector;
@@ -494,6 +585,10 @@ retry_sector:
 					"pblk: inconsistent GC write\n");
 #endif
 
+#ifdef PBLK_WRITE_HINT
+	atomic_long_add(valid_entries, &pblk->stream_gc[gc_line->pstream]);
+#endif
+
 #ifdef CONFIG_NVM_DEBUG
 #ifdef CONFIG_PBLK_MULTIMAP
 	atomic_long_add(valid_entries, &pblk->inflight_writes);
@@ -66,10 +66,29 @@ static void pblk_end_io_erase(struct nvm_rq *rqd)
 	mempool_free(rqd, pblk->g_rq_pool);
 }
 
+static void pblk_line_gc_move(struct pblk *pblk, struct pblk_line *line,
+			      struct list_head *move_list)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+
+	spin_lock(&l_mg->gc_lock);
+	spin_lock(&line->lock);
+	/* Prevent moving a line that has just been chosen for GC */
+	if (line->state == PBLK_LINESTATE_GC ||
+				line->state == PBLK_LINESTATE_FREE) {
+		spin_unlock(&line->lock);
+		spin_unlock(&l_mg->gc_lock);
+		return;
+	}
+	spin_unlock(&line->lock);
+
+	list_move_tail(&line->list, move_list);
+	spin_unlock(&l_mg->gc_lock);
+}
+
 void __pblk_map_invalidate(struct pblk *pblk, struct pblk_line *line,
 			   u64 paddr)
 {
-	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
 	struct list_head *move_list = NULL;
 
 	/* Lines being reclaimed (GC'ed) cannot be invalidated. Before the L2P
@@ -94,22 +113,25 @@ void __pblk_map_invalidate(struct pblk *pblk, struct pblk_line *line,
 		move_list = pblk_line_gc_list(pblk, line);
 	spin_unlock(&line->lock);
 
-	if (move_list) {
-		spin_lock(&l_mg->gc_lock);
-		spin_lock(&line->lock);
-		/* Prevent moving a line that has just been chosen for GC */
-		if (line->state == PBLK_LINESTATE_GC ||
-					line->state == PBLK_LINESTATE_FREE) {
-			spin_unlock(&line->lock);
-			spin_unlock(&l_mg->gc_lock);
-			return;
-		}
-		spin_unlock(&line->lock);
+	if (move_list)
+		pblk_line_gc_move(pblk, line, move_list);
+}
 
-		list_move_tail(&line->list, move_list);
-		spin_unlock(&l_mg->gc_lock);
-	}
+#ifdef PBLK_GC_PREINVALID
+/* A hint changed the reclaimable count of the line, not its vsc */
+void pblk_line_gc_regroup(struct pblk *pblk, struct pblk_line *line)
+{
+	struct list_head *move_list = NULL;
+
+	spin_lock(&line->lock);
+	if (line->state == PBLK_LINESTATE_CLOSED)
+		move_list = pblk_line_gc_list(pblk, line);
+	spin_unlock(&line->lock);
+
+	if (move_list)
+		pblk_line_gc_move(pblk, line, move_list);
 }
+#endif
 
 void pblk_map_invalidate(struct pblk *pblk, struct ppa_addr ppa)
 {
@@ -356,6 +378,8 @@ struct list_head *pblk_line_gc_list(struct pblk *pblk, struct pblk_line *line)
 	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
 	struct list_head *move_list = NULL;
 	int vsc = le32_to_cpu(*line->vsc);
+	/* hinted sectors are reclaimable, a corrupt vsc is kept as is */
+	int gc_vsc = (vsc > line->sec_in_line) ? vsc : pblk_line_gc_vsc(line);
 
 	lockdep_assert_held(&line->lock);
 
@@ -364,17 +388,17 @@ struct list_head *pblk_line_gc_list(struct pblk *pblk, struct pblk_line *line)
 			line->gc_group = PBLK_LINEGC_FULL;
 			move_list = &l_mg->gc_full_list;
 		}
-	} else if (vsc < lm->high_thrs) {
+	} else if (gc_vsc < lm->high_thrs) {
 		if (line->gc_group != PBLK_LINEGC_HIGH) {
 			line->gc_group = PBLK_LINEGC_HIGH;
 			move_list = &l_mg->gc_high_list;
 		}
-	} else if (vsc < lm->mid_thrs) {
+	} else if (gc_vsc < lm->mid_thrs) {
 		if (line->gc_group != PBLK_LINEGC_MID) {
 			line->gc_group = PBLK_LINEGC_MID;
 			move_list = &l_mg->gc_mid_list;
 		}
-	} else if (vsc < line->sec_in_line) {
+	} else if (gc_vsc < line->sec_in_line) {
 		if (line->gc_group != PBLK_LINEGC_LOW) {
 			line->gc_group = PBLK_LINEGC_LOW;
 			move_list = &l_mg->gc_low_list;
@@ -397,12 +421,17 @@ struct list_head *pblk_line_gc_list(struct pblk *pblk, struct pblk_line *line)
 	return move_list;
 }
 
+void pblk_discard_range(struct pblk *pblk, sector_t slba, sector_t nr_secs)
+{
+	pblk_invalidate_range(pblk, slba, nr_secs);
+}
+
 void pblk_discard(struct pblk *pblk, struct bio *bio)
 {
 	sector_t slba = pblk_get_lba(bio);
 	sector_t nr_secs = pblk_get_secs(bio);
 
-	pblk_invalidate_range(pblk, slba, nr_secs);
+	pblk_discard_range(pblk, slba, nr_secs);
 }
 
 struct ppa_addr pblk_get_lba_map(struct pblk *pblk, sector_t lba)
@@ -1054,6 +1083,10 @@ static int pblk_line_init_metadata(struct pblk *pblk, struct pblk_line *line,
 	/* Start metadata */
 	smeta_buf->seq_nr = cpu_to_le64(line->seq_nr);
 	smeta_buf->window_wr_lun = cpu_to_le32(geo->nr_luns);
+#ifdef PBLK_SNAPSHOT
+	if (pblk->snap.nr_lines)
+		smeta_buf->feat = cpu_to_le32(PBLK_FEAT_SNAP);
+#endif
 
 	/* Fill metadata among lines */
 	if (cur) {
@@ -1145,6 +1178,9 @@ static int pblk_line_init_bb(struct pblk *pblk, struct pblk_line *line,
 	line->nr_valid_lbas = 0;
 	line->left_msecs = line->sec_in_line;
 	*line->vsc = cpu_to_le32(line->sec_in_line);
+#ifdef PBLK_GC_PREINVALID
+	atomic_set(&line->pi_secs, 0);
+#endif
 
 	if (lm->sec_per_line - line->sec_in_line !=
 		bitmap_weight(line->invalid_bitmap, lm->sec_per_line)) {
@@ -1412,6 +1448,46 @@ retry_setup:
 	return line;
 }
 
+#ifdef CONFIG_PBLK_DFTL
+/*
+ * Map lines hold DFTL translation pages only. They carry no smeta/emeta and
+ * never enter the GC lists; pblk-dftl.c compacts and releases them.
+ */
+struct pblk_line *pblk_line_get_map(struct pblk *pblk)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_line *line;
+
+retry:
+	spin_lock(&l_mg->free_lock);
+	line = pblk_line_get(pblk);
+	if (!line) {
+		spin_unlock(&l_mg->free_lock);
+		return NULL;
+	}
+
+	line->seq_nr = l_mg->l_seq_nr++;
+	line->type = PBLK_LINETYPE_LOG;
+#ifdef CONFIG_PBLK_MULTIMAP
+	line->pstream = 0;
+	line->ctime = atomic_long_read(&pblk->g_writes);
+#endif
+	spin_unlock(&l_mg->free_lock);
+
+	pblk_rl_free_lines_dec(&pblk->rl, line);
+
+	if (pblk_line_erase(pblk, line) || !pblk_line_init_bb(pblk, line, 0)) {
+		pblk_line_free(pblk, line);
+		goto retry;
+	}
+
+	/* vsc counts live translation pages */
+	*line->vsc = cpu_to_le32(0);
+
+	return line;
+}
+#endif
+
 static void pblk_stop_writes(struct pblk *pblk, struct pblk_line *line, unsigned int nrb)
 {
 	lockdep_assert_held(&pblk->l_mg.free_lock);
@@ -1923,6 +1999,9 @@ void pblk_update_map_cache(struct pblk *pblk, sector_t lba, struct ppa_addr ppa)
 	spin_lock(&pblk->trans_lock);
 //	printk("pblk_update_map_cache: lba:%lu\n", lba);
 	l2p_ppa = pblk_trans_map_get(pblk, lba);
+#ifdef PBLK_SNAPSHOT
+	pblk_cache_set_prev(pblk, ppa, l2p_ppa);
+#endif
 
 	if (pblk_addr_in_cache(ppa)) {
 		l2p_ppa = pblk_cache_invalidate(pblk, l2p_ppa);
@@ -1989,6 +2068,9 @@ int pblk_update_map_gc(struct pblk *pblk, sector_t lba, struct ppa_addr ppa,
 		goto out;
 	}
 
+#ifdef PBLK_SNAPSHOT
+	pblk_cache_set_prev(pblk, ppa, l2p_ppa);
+#endif
 	pblk_trans_map_set(pblk, lba, ppa);
 out:
 //	printk("pblk_update_map_gc: trans_lock end\n");
@@ -1,249 +1,735 @@
 #include "pblk.h"
+#include <linux/hash.h>
 
 #ifdef CONFIG_PBLK_DFTL
-static struct map_entry* pblk_search_cmt(struct pblk *pblk, int lseg)
-{
-    struct rb_node *node = pblk->cmt_mgt.root.rb_node;
-    struct map_entry *me;
-
-    while (node) {
-        me = rb_entry(node, struct map_entry, rb_node);
-
-        if (lseg < me->lseg)
-            node = node->rb_left;
-        else if (lseg > me->lseg)
-            node = node->rb_right;
-        else {
-            return me;
-        }
-    }
-    return NULL;
-}
-
-static int pblk_insert_cmt(struct pblk *pblk, int lseg, int map_size, int nr_log, int dirty) {
-    struct rb_root *root = &pblk->cmt_mgt.root;
-    struct rb_node **p = &(root->rb_node);
-    struct rb_node *parent = NULL;
-    struct map_entry *me;
-
-    while (*p) {
-        parent = *p;
-        me = rb_entry(parent, struct map_entry, rb_node);
-
-        if (lseg < me->lseg)
-            p = &(*p)->rb_left;
-        else if (lseg > me->lseg)
-            p = &(*p)->rb_right;
-        else
-			return 0;
-    }
-
-    me = mempool_alloc(pblk->dftl_pool, GFP_ATOMIC);
-    me->lseg = lseg;
-    me->dirty = dirty;
-    me->nr_log = nr_log;
-    me->map_size = map_size;
-    INIT_LIST_HEAD(&me->list);
-
-    rb_link_node(&me->rb_node, parent, p);
-    rb_insert_color(&me->rb_node, root);
-
-    list_add_tail(&me->list, &pblk->cmt_mgt.map_list);
-	atomic_long_inc(&pblk->nr_mapread);
-
-	pblk->cmt_mgt.alloc_res += (map_size + nr_log);
+/*
+ * Cached mapping table: hash buckets plus a CLOCK list behind
+ * cmt_mgt.map_lock. All callers already hold trans_lock, which serializes
+ * the CMT anyway, so it is a single table rather than shards. A hit only
+ * sets the entry's reference bit; the CLOCK hand gives referenced entries
+ * a second chance when space is needed. Lookup, insert and eviction for
+ * one request run under one hold of map_lock, so an entry cannot go away
+ * between being loaded and being charged.
+ */
+static inline struct hlist_head *pblk_cmt_bucket(struct pblk *pblk, int lseg)
+{
+	return &pblk->cmt_mgt.hash[hash_32(lseg, CMT_HASH_BITS)];
+}
 
-//    me = pblk_search_cmt(pblk, lseg);
-//    if (me == NULL)
-  //      BUG_ON(1);
+static inline void pblk_map_io_kick(struct pblk *pblk)
+{
+	if (pblk->cmt_mgt.io_wq)
+		queue_work(pblk->cmt_mgt.io_wq, &pblk->cmt_mgt.io_ws);
+}
 
-    return 0;
+static inline int pblk_cmt_free_res(struct pblk *pblk)
+{
+	return (int)pblk->cmt_mgt.max_res - (int)pblk->cmt_mgt.alloc_res;
 }
 
-int pblk_delete_cmt(struct pblk *pblk, int lseg)
+/* map_lock held */
+static struct map_entry *pblk_search_cmt(struct pblk *pblk, int lseg)
 {
-    struct map_entry *me;
-    struct rb_root *root = &pblk->cmt_mgt.root;
+	struct map_entry *me;
+
+	hlist_for_each_entry(me, pblk_cmt_bucket(pblk, lseg), hnode)
+		if (me->lseg == lseg)
+			return me;
+	return NULL;
+}
 
-    me = pblk_search_cmt(pblk, lseg);
-    if (me != NULL) {
-        list_del_init(&me->list);
-        rb_erase(&me->rb_node, root);
+/* map_lock held */
+static struct map_entry *pblk_insert_cmt(struct pblk *pblk, int lseg,
+				int map_size, int nr_log, int dirty)
+{
+	struct map_entry *me;
+
+	me = mempool_alloc(pblk->dftl_pool, GFP_ATOMIC);
+	if (!me)
+		return NULL;
+	me->lseg = lseg;
+	me->dirty = dirty;
+	me->ref = 1;
+	me->nr_log = nr_log;
+	me->map_size = map_size;
+
+	hlist_add_head(&me->hnode, pblk_cmt_bucket(pblk, lseg));
+	list_add_tail(&me->list, &pblk->cmt_mgt.clock);
+	atomic_long_inc(&pblk->nr_mapread);
 
-        pblk->cmt_mgt.alloc_res = pblk->cmt_mgt.alloc_res - me->map_size - me->nr_log;
-        mempool_free(me, pblk->dftl_pool);
-    }
-    return 0;
+	pblk->cmt_mgt.alloc_res += map_size + nr_log;
+	return me;
 }
 
-static int pblk_evict_cmt(struct pblk *pblk, int need_res)
+int pblk_delete_cmt(struct pblk *pblk, int lseg)
 {
-    int free_res = pblk->cmt_mgt.max_res - pblk->cmt_mgt.alloc_res;
-    struct rb_root *root = &pblk->cmt_mgt.root;
-    unsigned int get_res = 0;
+	struct map_entry *me;
 
-//    printk("pblk_evict_cmt need_res:%d free:%d\n", need_res, free_res);
-    while (need_res > free_res)
-    {
-    	struct map_entry *me;
+	spin_lock(&pblk->cmt_mgt.map_lock);
+	me = pblk_search_cmt(pblk, lseg);
+	if (me != NULL) {
+		list_del(&me->list);
+		hlist_del(&me->hnode);
+		pblk->cmt_mgt.alloc_res -= me->map_size + me->nr_log;
+	}
+	spin_unlock(&pblk->cmt_mgt.map_lock);
 
-        if (list_empty(&pblk->cmt_mgt.map_list))
-            BUG_ON(1);
-        me = list_first_entry(&pblk->cmt_mgt.map_list, struct map_entry, list);
-        list_del_init(&me->list);
-        free_res = free_res + me->map_size + me->nr_log;
-        get_res = get_res + (me->map_size + me->nr_log);
+	if (me != NULL)
+		mempool_free(me, pblk->dftl_pool);
+	return 0;
+}
 
-        if (me->dirty) {
-            atomic_long_inc(&pblk->nr_mapwrite);
-            // TODO: SEARCH PAGE_MAP and dirty to clean
-        }
-        rb_erase(&me->rb_node, root);
-        mempool_free(me, pblk->dftl_pool);
-    }
-	pblk->cmt_mgt.alloc_res = pblk->cmt_mgt.alloc_res - get_res;
-//    printk("pblk_evict_cmt alloc_res:%u get_res:%u end\n", pblk->cmt_mgt.alloc_res, get_res);
+/* map_lock held; sweeps until @need_res fits or the CMT is empty */
+static void pblk_evict_cmt(struct pblk *pblk, int need_res)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	struct map_entry *me;
+
+	while (need_res > pblk_cmt_free_res(pblk) && !list_empty(&cm->clock)) {
+		me = list_first_entry(&cm->clock, struct map_entry, list);
+		if (me->ref) {
+			me->ref = 0;
+			list_move_tail(&me->list, &cm->clock);
+			continue;
+		}
 
-    return 0;
+		list_del(&me->list);
+		hlist_del(&me->hnode);
+		cm->alloc_res -= me->map_size + me->nr_log;
+
+		if (me->dirty) {
+			/* the entry itself is queued, io_ws writes and frees it */
+			atomic_long_inc(&pblk->nr_mapwrite);
+			spin_lock(&cm->io_lock);
+			list_add_tail(&me->list, &cm->wb_list);
+			spin_unlock(&cm->io_lock);
+			pblk_map_io_kick(pblk);
+			continue;
+		}
+		mempool_free(me, pblk->dftl_pool);
+	}
 }
 
-int pblk_load_cmt(struct pblk *pblk, int lseg, int dirty)
+/* map_lock held; returns the entry of @lseg, loading it on a miss */
+static struct map_entry *__pblk_load_cmt(struct pblk *pblk, int lseg,
+								int dirty)
 {
-	struct map_entry *me = NULL;
-	int type = PAGE_MAP;
+	struct map_entry *me;
 	struct pba_addr *bmap = (struct pba_addr *)pblk->trans_map;
 	struct pba_addr pba = bmap[lseg];
 	int lstream = (u64)pba.m.lstream;
- 	int map_size = pblk->lstream[lstream].map_size;
-	type = pblk->lstream[lstream].map_type;
+	int type = pblk_lseg_map_type(pblk, pba);
+	int log_size = 0;
+	int map_size = 4096;
 
-	if (type == BLOCK_MAP) {
-		me = &pblk->cmt_mgt.global_map;
-		if (bmap[lseg].m.is_cached == 0) {
-			return 0;
-		}
-	} 
 	me = pblk_search_cmt(pblk, lseg);
-
 	if (me != NULL) {
 		if (dirty)
 			me->dirty = 1;
-		list_move_tail(&me->list, &pblk->cmt_mgt.map_list);
-	}
-    else {
-		int log_size = 0;
-        int map_size = 4096;
-		int free_res;
-
-        if (type == PAGE_MAP) {
-            struct pba_addr *pmap = (struct pba_addr*) pba.pointer;
-            int pmap_entry_num = (1 << pblk->ppaf.blk_offset) >> pblk->ppaf.pln_offset;
-            int i;
-            for (i = 0; i < pmap_entry_num; i++) {
-                if (pmap[i].m.is_cached == 1)
-                    log_size += pblk->lstream[lstream].log_size;
-            }
-        }
-        else if (pba.m.map == BLOCK_MAP) {
-            map_size = pblk->lstream[lstream].log_size;
-        }
-
-        free_res = pblk->cmt_mgt.max_res - pblk->cmt_mgt.alloc_res;
-
-        if (free_res < map_size + log_size)
-            pblk_evict_cmt(pblk, map_size + log_size);
-        pblk_insert_cmt(pblk, lseg, map_size, log_size, dirty);
-    }
+		me->ref = 1;
+		atomic_long_inc(&pblk->nr_cmt_hit);
+		return me;
+	}
+
+	if (type == PAGE_MAP) {
+		struct pba_addr *pmap = (struct pba_addr*) pba.pointer;
+		int pmap_entry_num = (1 << pblk->ppaf.blk_offset) >> pblk->ppaf.pln_offset;
+		/* adapted lsegs of SECTOR_MAP streams log one group per entry */
+		int group_log = pblk->lstream[lstream].log_size ? :
+						(1 << pblk->ppaf.pln_offset);
+		int i;
+		for (i = 0; i < pmap_entry_num; i++) {
+			if (pmap[i].m.is_cached == 1)
+				log_size += group_log;
+		}
+	}
+	else if (pba.m.map == BLOCK_MAP) {
+		map_size = pblk->lstream[lstream].log_size;
+	}
+
+	if (pblk_cmt_free_res(pblk) < map_size + log_size)
+		pblk_evict_cmt(pblk, map_size + log_size);
+
+	/*
+	 * The caller holds trans_lock and the in-memory map stays
+	 * authoritative, so the translation pages are read in the background.
+	 * With cmt_sync set, readers then wait for it in pblk_cmt_wait().
+	 */
+	if (pblk->cmt_mgt.gtd &&
+			pblk->cmt_mgt.gtd[lseg * PBLK_TP_PER_LSEG] != ADDR_EMPTY &&
+			!test_and_set_bit(lseg, pblk->cmt_mgt.rd_pending))
+		pblk_map_io_kick(pblk);
+
+	return pblk_insert_cmt(pblk, lseg, map_size, log_size, dirty);
+}
+
+int pblk_load_cmt(struct pblk *pblk, int lseg, int dirty)
+{
+	struct pba_addr *bmap = (struct pba_addr *)pblk->trans_map;
+
+	if (pblk_lseg_map_type(pblk, bmap[lseg]) == BLOCK_MAP &&
+					bmap[lseg].m.is_cached == 0)
+		return 0;
+
+	spin_lock(&pblk->cmt_mgt.map_lock);
+	__pblk_load_cmt(pblk, lseg, dirty);
+	spin_unlock(&pblk->cmt_mgt.map_lock);
 
 	return 0;
 }
 
+/*
+ * Charge CMT misses of a host read to the read itself: called once
+ * trans_lock is dropped, sleeps until io_ws has read the translation pages
+ * of the lsegs in [@blba, @blba + @nr_secs). Without cmt_sync a miss only
+ * costs map-read bandwidth.
+ */
+void pblk_cmt_wait(struct pblk *pblk, sector_t blba, int nr_secs)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	unsigned long lseg = blba >> pblk->ppaf.blk_offset;
+	unsigned long last = (blba + nr_secs - 1) >> pblk->ppaf.blk_offset;
+	u64 start = 0;
+
+	if (!cm->sync_miss || !cm->rd_pending)
+		return;
+
+	for (; lseg <= last; lseg++) {
+		if (!test_bit(lseg, cm->rd_pending))
+			continue;
+		if (!start) {
+			start = ktime_get_ns();
+			atomic_long_inc(&cm->nr_miss_wait);
+		}
+		wait_event(cm->rd_wait, !test_bit(lseg, cm->rd_pending));
+	}
+
+	if (start)
+		atomic64_add(ktime_get_ns() - start, &cm->miss_wait_ns);
+}
+
 int pblk_alloc_log(struct pblk *pblk,
 								int lseg, int type, unsigned int log_size)
 {
-	unsigned int free_res;
 	struct map_entry *me = NULL;
 
 //	printk("pblk_alloc_log: %d T:%d log:%u\n",
 //					lseg, type, log_size);
 
-	if (type == BLOCK_MAP) {
-		me = &pblk->cmt_mgt.global_map;
-	}
-	else if (type == PAGE_MAP) {
-		me = pblk_search_cmt(pblk, lseg);
-		if (me == NULL) {
-			pblk_load_cmt(pblk, lseg, true);
-			me = pblk_search_cmt(pblk, lseg);
-			if (me == NULL)
-				BUG_ON(1);
-		}
-	}
-	else {
+	if (type != BLOCK_MAP && type != PAGE_MAP) {
 		printk("pblk_alloc_log: %d %d %u\n", lseg, type, log_size);
 		BUG_ON(1);
 	}
 
-	free_res = pblk->cmt_mgt.max_res - pblk->cmt_mgt.alloc_res;
-	if (free_res < log_size)
+	spin_lock(&pblk->cmt_mgt.map_lock);
+	if (pblk_cmt_free_res(pblk) < (int)log_size)
 		pblk_evict_cmt(pblk, log_size);
 
-	if (me == NULL) {
-		BUG_ON(1);
-	}
-
 	if (type == BLOCK_MAP) {
-		me = pblk_search_cmt(pblk, lseg);
-		if (me == NULL) {
+		if (!pblk_search_cmt(pblk, lseg))
 			pblk_insert_cmt(pblk, lseg, 0, log_size, true);
-		}
-	} else {
+		spin_unlock(&pblk->cmt_mgt.map_lock);
+		return 0;
+	}
+
+	/* a failed insert only loses the accounting of this log */
+	me = __pblk_load_cmt(pblk, lseg, true);
+	if (me) {
 		me->nr_log += log_size;
 		pblk->cmt_mgt.alloc_res += log_size;
-		me->dirty = 1;
 	}
+	spin_unlock(&pblk->cmt_mgt.map_lock);
 
 	return 0;
 }
 
-int pblk_free_log(struct pblk *pblk, int lseg, 
+int pblk_free_log(struct pblk *pblk, int lseg,
 								int type, unsigned int log_size)
 {
 	struct map_entry *me = NULL;
 
-	// printk("pblk_free_log: %d T:%d log:%u\n",
-//					lseg, type, log_size);
+	// printk("pblk_free_log: %d T:%d log:%u\n", lseg, type, log_size);
 
 	if (type == BLOCK_MAP) {
-		me = &pblk->cmt_mgt.global_map;
 		pblk_delete_cmt(pblk, lseg);
 		return 0;
 	}
-	else if (type == PAGE_MAP) {
-		me = pblk_search_cmt(pblk, lseg);
-		if (me == NULL) {
-			pblk_load_cmt(pblk, lseg, true);
-			me = pblk_search_cmt(pblk, lseg);
-			if (me == NULL)
-				BUG_ON(1);
-		}
-		me->nr_log -= log_size;
-		pblk->cmt_mgt.alloc_res -= log_size;
-	}
-	else {
+	else if (type != PAGE_MAP) {
 		printk("pblk_alloc_log: %d %d %u\n", lseg, type, log_size);
 		BUG_ON(1);
 	}
 
-	// printk("pblk_free_log free_log alloc_res:%u log_size:%u\n", pblk->cmt_mgt.alloc_res, log_size);
+	spin_lock(&pblk->cmt_mgt.map_lock);
+	me = __pblk_load_cmt(pblk, lseg, true);
+	if (me && me->nr_log >= log_size) {
+		me->nr_log -= log_size;
+		pblk->cmt_mgt.alloc_res -= log_size;
+	}
+	spin_unlock(&pblk->cmt_mgt.map_lock);
+
 	return 0;
 }
 
 int pblk_change_map(struct pblk *pblk, int lseg)
 {
 	pblk_delete_cmt(pblk, lseg);
-	pblk_load_cmt(pblk, lseg, true); 
+	pblk_load_cmt(pblk, lseg, true);
 	return 0;
 }
 
+/*
+ * Map-page I/O. Translation pages live on dedicated map lines
+ * (PBLK_LINETYPE_LOG) and are located through the GTD. A single work item
+ * serves CMT misses with reads, writes back evicted dirty entries in
+ * batches and compacts map lines; it owns the GTD and the map lines.
+ */
+static inline int pblk_tp_count(struct map_entry *me)
+{
+	int nr_tp = DIV_ROUND_UP(me->map_size + me->nr_log, PBLK_TP_ENTRIES);
+
+	return clamp(nr_tp, 1, PBLK_TP_PER_LSEG);
+}
+
+static void pblk_gtd_set(struct pblk *pblk, u64 tpn, u64 addr)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	u64 old = cm->gtd[tpn];
+
+	if (old != ADDR_EMPTY)
+		le32_add_cpu(pblk->lines[old >> 32].vsc, -1);
+	if (addr != ADDR_EMPTY)
+		le32_add_cpu(pblk->lines[addr >> 32].vsc, 1);
+	cm->gtd[tpn] = addr;
+}
+
+/* copy the slice of the lseg map covered by @tpn into @buf */
+static void pblk_map_fill(struct pblk *pblk, u64 tpn, void *buf)
+{
+	struct pba_addr *bmap = (struct pba_addr *)pblk->trans_map;
+	unsigned long lseg = tpn / PBLK_TP_PER_LSEG;
+	size_t off = (tpn % PBLK_TP_PER_LSEG) * PBLK_EXPOSED_PAGE_SIZE;
+	int entry_num = 1 << pblk->ppaf.blk_offset;
+	struct pba_addr pba;
+	size_t len = 0;
+
+	memset(buf, 0, PBLK_EXPOSED_PAGE_SIZE);
+
+	spin_lock(&pblk->trans_lock);
+	pba = bmap[lseg];
+	if (pba.m.map == SECTOR_MAP)
+		len = entry_num * sizeof(struct ppa_addr);
+	else if (pba.m.map == PAGE_MAP)
+		len = (entry_num >> pblk->ppaf.pln_offset) *
+						sizeof(struct pba_addr);
+
+	if (len) {
+		if (off < len)
+			memcpy(buf, (char *)pba.pointer + off,
+				min_t(size_t, len - off, PBLK_EXPOSED_PAGE_SIZE));
+	} else if (!off) {
+		memcpy(buf, &pba, sizeof(struct pba_addr));
+	}
+	spin_unlock(&pblk->trans_lock);
+}
+
+/*
+ * Synchronous I/O of @buf to/from @nr_secs sectors addressed as
+ * pblk_gtd_addr(). On writes, @tag goes into each sector's oob lba.
+ */
+int pblk_map_submit_buf(struct pblk *pblk, void *buf, u64 *addr, u64 *tag,
+							int nr_secs, int dir)
+{
+	struct nvm_tgt_dev *dev = pblk->dev;
+	struct pblk_sec_meta *meta_list;
+	struct bio *bio;
+	struct nvm_rq rqd;
+	int i, ret;
+	DECLARE_COMPLETION_ONSTACK(wait);
+
+	memset(&rqd, 0, sizeof(struct nvm_rq));
+
+	rqd.meta_list = nvm_dev_dma_alloc(dev->parent, GFP_KERNEL,
+							&rqd.dma_meta_list);
+	if (!rqd.meta_list)
+		return -ENOMEM;
+
+	rqd.ppa_list = rqd.meta_list + pblk_dma_meta_size;
+	rqd.dma_ppa_list = rqd.dma_meta_list + pblk_dma_meta_size;
+	meta_list = rqd.meta_list;
+
+	bio = bio_map_kern(dev->q, buf,
+				nr_secs * PBLK_EXPOSED_PAGE_SIZE, GFP_KERNEL);
+	if (IS_ERR(bio)) {
+		ret = PTR_ERR(bio);
+		goto free_ppa_list;
+	}
+
+	bio->bi_iter.bi_sector = 0; /* internal bio */
+
+	if (dir == WRITE) {
+		bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
+		rqd.opcode = NVM_OP_PWRITE;
+		rqd.flags = pblk_set_progr_mode(pblk, WRITE);
+	} else {
+		bio_set_op_attrs(bio, REQ_OP_READ, 0);
+		rqd.opcode = NVM_OP_PREAD;
+		rqd.flags = pblk_set_read_mode(pblk, PBLK_READ_RANDOM);
+	}
+
+	rqd.bio = bio;
+	rqd.nr_ppas = nr_secs;
+	rqd.end_io = pblk_end_io_sync;
+	rqd.private = &wait;
+
+	for (i = 0; i < nr_secs; i++) {
+		rqd.ppa_list[i] = addr_to_gen_ppa(pblk,
+				addr[i] & 0xffffffff, addr[i] >> 32);
+		if (dir == WRITE)
+			meta_list[i].lba = cpu_to_le64(tag ? tag[i] : ADDR_EMPTY);
+	}
+	if (nr_secs == 1)
+		rqd.ppa_addr = rqd.ppa_list[0];
+
+	/* map and snapshot lines have no other writer, no LUN semaphore */
+	ret = pblk_submit_io(pblk, &rqd);
+	if (ret) {
+		pr_err("pblk: map I/O submission failed: %d\n", ret);
+		bio_put(bio);
+		goto free_ppa_list;
+	}
+
+	if (!wait_for_completion_io_timeout(&wait,
+				msecs_to_jiffies(PBLK_COMMAND_TIMEOUT_MS))) {
+		pr_err("pblk: map I/O timed out\n");
+	}
+	atomic_dec(&pblk->inflight_io);
+
+	if (rqd.error) {
+		if (dir == WRITE)
+			pblk_log_write_err(pblk, &rqd);
+		else
+			pblk_log_read_err(pblk, &rqd);
+		ret = -EIO;
+	}
+
+free_ppa_list:
+	nvm_dev_dma_free(dev->parent, rqd.meta_list, rqd.dma_meta_list);
+
+	return ret;
+}
+
+/* synchronous I/O of io_buf to/from the first @nr_secs io_addr entries */
+static int pblk_map_submit(struct pblk *pblk, int nr_secs, int dir)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+
+	return pblk_map_submit_buf(pblk, cm->io_buf, cm->io_addr, cm->io_tpn,
+								nr_secs, dir);
+}
+
+static struct pblk_line *pblk_map_line_switch(struct pblk *pblk)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	struct pblk_line *line = cm->map_line;
+
+	if (line) {
+		spin_lock(&line->lock);
+		line->state = PBLK_LINESTATE_CLOSED;
+		spin_unlock(&line->lock);
+		list_add_tail(&line->list, &cm->map_full);
+	}
+
+	cm->map_line = pblk_line_get_map(pblk);
+	if (!cm->map_line) {
+		pr_err_ratelimited("pblk: no free line for map pages\n");
+		return NULL;
+	}
+	cm->nr_map_lines++;
+
+	return cm->map_line;
+}
+
+/* write the first @nr_secs pages of io_buf, tagged by io_tpn */
+static int pblk_map_write(struct pblk *pblk, int nr_secs)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	int min = pblk->min_write_pgs;
+	int nr_pad = round_up(nr_secs, min) - nr_secs;
+	int i, j, ret;
+
+	for (i = nr_secs; i < nr_secs + nr_pad; i++) {
+		memset(cm->io_buf + i * PBLK_EXPOSED_PAGE_SIZE, 0,
+						PBLK_EXPOSED_PAGE_SIZE);
+		cm->io_tpn[i] = ADDR_EMPTY;
+	}
+
+	for (i = 0; i < nr_secs + nr_pad; i += min) {
+		struct pblk_line *line = cm->map_line;
+		u64 paddr;
+
+		if (!line || line->left_msecs < min) {
+			line = pblk_map_line_switch(pblk);
+			if (!line)
+				return -ENOSPC;
+		}
+
+		paddr = pblk_alloc_page(pblk, line, min);
+		for (j = 0; j < min; j++)
+			cm->io_addr[i + j] = pblk_gtd_addr(line->id, paddr + j);
+	}
+
+	ret = pblk_map_submit(pblk, nr_secs + nr_pad, WRITE);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr_secs; i++)
+		pblk_gtd_set(pblk, cm->io_tpn[i], cm->io_addr[i]);
+
+	atomic_long_add(nr_secs, &pblk->nr_map_wr_io);
+	atomic_long_add(nr_pad, &pblk->nr_map_pad);
+	return 0;
+}
+
+/* the first @nr_done lsegs in io_tpn are fully read, release their waiters */
+static void pblk_map_read_done(struct pblk *pblk, int nr_done)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	int i;
+
+	for (i = 0; i < nr_done; i++)
+		clear_bit(cm->io_tpn[i], cm->rd_pending);
+	wake_up_all(&cm->rd_wait);
+}
+
+/*
+ * A pending bit stays set until all translation pages of its lseg are
+ * read, which is what pblk_cmt_wait() sleeps on. Every lseg in io_tpn has
+ * a page in the current batch, so there are at most io_secs of them.
+ */
+static void pblk_map_read_pending(struct pblk *pblk)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	unsigned long lseg;
+	int k, n = 0, nr_done = 0;
+
+	for_each_set_bit(lseg, cm->rd_pending, cm->nr_lseg) {
+		int nr_tp = 0;
+
+		for (k = 0; k < PBLK_TP_PER_LSEG; k++) {
+			u64 addr = cm->gtd[lseg * PBLK_TP_PER_LSEG + k];
+
+			if (addr == ADDR_EMPTY)
+				continue;
+
+			cm->io_addr[n++] = addr;
+			nr_tp++;
+			if (n == cm->io_secs) {
+				pblk_map_submit(pblk, n, READ);
+				atomic_long_add(n, &pblk->nr_map_rd_io);
+				pblk_map_read_done(pblk, nr_done);
+				n = nr_done = 0;
+			}
+		}
+
+		if (!n || !nr_tp) {
+			clear_bit(lseg, cm->rd_pending);
+			wake_up_all(&cm->rd_wait);
+		} else {
+			cm->io_tpn[nr_done++] = lseg;
+		}
+	}
+
+	if (n) {
+		pblk_map_submit(pblk, n, READ);
+		atomic_long_add(n, &pblk->nr_map_rd_io);
+	}
+	pblk_map_read_done(pblk, nr_done);
+}
+
+static void pblk_map_write_pending(struct pblk *pblk)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	struct map_entry *me, *tmp;
+	LIST_HEAD(wb_list);
+	int k, n = 0;
+
+	spin_lock(&cm->io_lock);
+	list_splice_init(&cm->wb_list, &wb_list);
+	spin_unlock(&cm->io_lock);
+
+	list_for_each_entry_safe(me, tmp, &wb_list, list) {
+		u64 base = (u64)me->lseg * PBLK_TP_PER_LSEG;
+		int nr_tp = pblk_tp_count(me);
+
+		for (k = 0; k < PBLK_TP_PER_LSEG; k++) {
+			/* pages past the current image size become stale */
+			if (k >= nr_tp) {
+				pblk_gtd_set(pblk, base + k, ADDR_EMPTY);
+				continue;
+			}
+
+			pblk_map_fill(pblk, base + k,
+				cm->io_buf + n * PBLK_EXPOSED_PAGE_SIZE);
+			cm->io_tpn[n++] = base + k;
+			if (n == cm->io_secs) {
+				pblk_map_write(pblk, n);
+				n = 0;
+			}
+		}
+
+		list_del(&me->list);
+		mempool_free(me, pblk->dftl_pool);
+	}
+
+	if (n)
+		pblk_map_write(pblk, n);
+}
+
+/* read the live pages of @line back and rewrite them to the open map line */
+static int pblk_map_gc_line(struct pblk *pblk, struct pblk_line *line)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	u64 tpn, nr_tpn = cm->nr_lseg * PBLK_TP_PER_LSEG;
+	int n = 0, ret = 0;
+
+	for (tpn = 0; tpn < nr_tpn && !ret; tpn++) {
+		u64 addr = cm->gtd[tpn];
+
+		if (addr == ADDR_EMPTY || (addr >> 32) != line->id)
+			continue;
+
+		cm->io_tpn[n] = tpn;
+		cm->io_addr[n++] = addr;
+		if (n < cm->io_secs)
+			continue;
+
+		ret = pblk_map_submit(pblk, n, READ);
+		if (!ret)
+			ret = pblk_map_write(pblk, n);
+		atomic_long_add(n, &pblk->nr_map_gc_io);
+		n = 0;
+	}
+
+	if (n && !ret) {
+		ret = pblk_map_submit(pblk, n, READ);
+		if (!ret)
+			ret = pblk_map_write(pblk, n);
+		atomic_long_add(n, &pblk->nr_map_gc_io);
+	}
+
+	return ret;
+}
+
+static void pblk_map_gc(struct pblk *pblk)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	struct pblk_line *line, *victim;
+
+	while (cm->nr_map_lines > PBLK_MAP_LINES) {
+		victim = NULL;
+		list_for_each_entry(line, &cm->map_full, list) {
+			if (!victim || le32_to_cpu(*line->vsc) <
+						le32_to_cpu(*victim->vsc))
+				victim = line;
+		}
+
+		/* not worth it while most translation pages are live */
+		if (!victim || le32_to_cpu(*victim->vsc) > victim->sec_in_line / 2)
+			return;
+
+		list_del(&victim->list);
+		if (pblk_map_gc_line(pblk, victim)) {
+			list_add_tail(&victim->list, &cm->map_full);
+			return;
+		}
+
+		spin_lock(&victim->lock);
+		victim->state = PBLK_LINESTATE_GC;
+		spin_unlock(&victim->lock);
+
+		cm->nr_map_lines--;
+		kref_put(&victim->ref, pblk_line_put);
+	}
+}
+
+static void pblk_map_io_ws(struct work_struct *work)
+{
+	struct pblk *pblk = container_of(work, struct pblk, cmt_mgt.io_ws);
+
+	pblk_map_read_pending(pblk);
+	pblk_map_write_pending(pblk);
+	pblk_map_gc(pblk);
+}
+
+int pblk_map_io_init(struct pblk *pblk, unsigned long nr_lseg)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	unsigned long i;
+
+	cm->nr_lseg = nr_lseg;
+	cm->io_secs = min_t(int, round_up(PBLK_MAP_BATCH, pblk->min_write_pgs),
+							PBLK_MAX_REQ_ADDRS);
+	spin_lock_init(&cm->io_lock);
+	init_waitqueue_head(&cm->rd_wait);
+	cm->sync_miss = 0;
+	atomic_long_set(&cm->nr_miss_wait, 0);
+	atomic64_set(&cm->miss_wait_ns, 0);
+	INIT_LIST_HEAD(&cm->wb_list);
+	INIT_LIST_HEAD(&cm->map_full);
+	INIT_WORK(&cm->io_ws, pblk_map_io_ws);
+	cm->map_line = NULL;
+	cm->nr_map_lines = 0;
+
+	cm->gtd = vmalloc(sizeof(u64) * nr_lseg * PBLK_TP_PER_LSEG);
+	cm->rd_pending = vzalloc(BITS_TO_LONGS(nr_lseg) * sizeof(long));
+	cm->io_buf = kmalloc(cm->io_secs * PBLK_EXPOSED_PAGE_SIZE, GFP_KERNEL);
+	cm->io_tpn = kmalloc_array(cm->io_secs, sizeof(u64), GFP_KERNEL);
+	cm->io_addr = kmalloc_array(cm->io_secs, sizeof(u64), GFP_KERNEL);
+	if (!cm->gtd || !cm->rd_pending || !cm->io_buf || !cm->io_tpn ||
+							!cm->io_addr)
+		goto fail;
+
+	for (i = 0; i < nr_lseg * PBLK_TP_PER_LSEG; i++)
+		cm->gtd[i] = ADDR_EMPTY;
+
+	cm->io_wq = alloc_workqueue("pblk-map-wq",
+			WQ_MEM_RECLAIM | WQ_UNBOUND, 1);
+	if (!cm->io_wq)
+		goto fail;
+
+	return 0;
+
+fail:
+	pblk_map_io_exit(pblk);
+	return -ENOMEM;
+}
+
+/* safe to call twice; map lines are reclaimed with the rest of the lines */
+void pblk_map_io_exit(struct pblk *pblk)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+	struct map_entry *me, *tmp;
+
+	if (cm->io_wq) {
+		destroy_workqueue(cm->io_wq);
+		cm->io_wq = NULL;
+	}
+
+	list_for_each_entry_safe(me, tmp, &cm->wb_list, list) {
+		list_del(&me->list);
+		mempool_free(me, pblk->dftl_pool);
+	}
+
+	vfree(cm->gtd);
+	vfree(cm->rd_pending);
+	kfree(cm->io_buf);
+	kfree(cm->io_tpn);
+	kfree(cm->io_addr);
+	cm->gtd = NULL;
+	cm->rd_pending = NULL;
+	cm->io_buf = NULL;
+	cm->io_tpn = NULL;
+	cm->io_addr = NULL;
+}
+
 #endif
@@ -18,10 +18,28 @@
 #include "pblk.h"
 #include <linux/delay.h>
 
-static void pblk_gc_free_gc_rq(struct pblk_gc_rq *gc_rq)
+static struct pblk_gc_rq *pblk_gc_alloc_gc_rq(struct pblk *pblk)
 {
-	vfree(gc_rq->data);
+#ifdef PBLK_GC_PARALLEL
+	return mempool_alloc(pblk->gc_rq_pool, GFP_KERNEL);
+#else
+	return kmalloc(sizeof(struct pblk_gc_rq), GFP_KERNEL);
+#endif
+}
+
+static void pblk_gc_put_gc_rq(struct pblk *pblk, struct pblk_gc_rq *gc_rq)
+{
+#ifdef PBLK_GC_PARALLEL
+	mempool_free(gc_rq, pblk->gc_rq_pool);
+#else
 	kfree(gc_rq);
+#endif
+}
+
+static void pblk_gc_free_gc_rq(struct pblk *pblk, struct pblk_gc_rq *gc_rq)
+{
+	vfree(gc_rq->data);
+	pblk_gc_put_gc_rq(pblk, gc_rq);
 }
 
 static int pblk_gc_write(struct pblk *pblk)
@@ -48,7 +66,7 @@ static int pblk_gc_write(struct pblk *pblk)
 
 		list_del(&gc_rq->list);
 		kref_put(&gc_rq->line->ref, pblk_line_put);
-		pblk_gc_free_gc_rq(gc_rq);
+		pblk_gc_free_gc_rq(pblk, gc_rq);
 	}
 
 	return 0;
@@ -94,6 +112,9 @@ static int pblk_gc_move_valid_secs(struct pblk *pblk, struct pblk_gc_rq *gc_rq)
 
 	gc_rq->data = data;
 	gc_rq->secs_to_gc = secs_to_gc;
+#ifdef PBLK_GC_PARALLEL
+	atomic_long_add(secs_to_gc, &gc->read_secs);
+#endif
 
 //	printk("JJY: move valid 4\n");
 retry:
@@ -114,7 +135,7 @@ retry:
 	return 0;
 
 free_rq:
-	kfree(gc_rq);
+	pblk_gc_put_gc_rq(pblk, gc_rq);
 free_data:
 	vfree(data);
 out:
@@ -167,6 +188,122 @@ static void pblk_gc_line_ws(struct work_struct *work)
 	mempool_free(line_rq_ws, pblk->line_ws_pool);
 }
 
+#ifdef PBLK_GC_PARALLEL
+static int pblk_gc_line_has_page_map(struct pblk *pblk, struct pblk_line *line,
+				     __le64 *lba_list)
+{
+#ifdef CONFIG_PBLK_MULTIMAP
+	struct pblk_line_meta *lm = &pblk->lm;
+	int bit = -1;
+
+	while (1) {
+		bit = find_next_zero_bit(line->invalid_bitmap, lm->sec_per_line,
+								bit + 1);
+		if (bit > line->emeta_ssec)
+			break;
+		if (pblk_get_maptype(pblk, le64_to_cpu(lba_list[bit])) == PAGE_MAP)
+			return 1;
+	}
+#endif
+	return 0;
+}
+
+/* Hands a GC request to the line reader workqueue. Frees gc_rq on failure. */
+static int pblk_gc_submit_rq(struct pblk *pblk, struct pblk_line *line,
+			     struct pblk_gc_rq *gc_rq)
+{
+	struct pblk_gc *gc = &pblk->gc;
+	struct pblk_line_ws *line_rq_ws;
+
+	line_rq_ws = mempool_alloc(pblk->line_ws_pool, GFP_KERNEL);
+	if (!line_rq_ws) {
+		pblk_gc_put_gc_rq(pblk, gc_rq);
+		return -ENOMEM;
+	}
+
+	line_rq_ws->pblk = pblk;
+	line_rq_ws->line = line;
+	line_rq_ws->priv = gc_rq;
+
+	down(&gc->gc_sem);
+	kref_get(&line->ref);
+
+	INIT_WORK(&line_rq_ws->ws, pblk_gc_line_ws);
+	queue_work(gc->gc_line_reader_wq, &line_rq_ws->ws);
+
+	return 0;
+}
+
+/*
+ * Build GC requests per LUN of the victim line instead of in line order, so
+ * that each request is a single multi-page read on one LUN and the reader
+ * workqueue keeps all LUNs busy at once. Lines holding PAGE_MAP lbas keep the
+ * in-order split, which must end requests on page-aligned lbas.
+ */
+static int pblk_gc_line_prepare_luns(struct pblk *pblk, struct pblk_line *line,
+				     __le64 *lba_list)
+{
+	struct nvm_geo *geo = &pblk->dev->geo;
+	struct pblk_line_meta *lm = &pblk->lm;
+	struct pblk_gc_rq **lun_rq;
+	struct pblk_gc_rq *gc_rq;
+	int sec_left = pblk_line_vsc(line);
+	int bit = -1;
+	int pos, ret = 0;
+
+	lun_rq = kcalloc(geo->nr_luns, sizeof(struct pblk_gc_rq *), GFP_KERNEL);
+	if (!lun_rq)
+		return -ENOMEM;
+
+	while (sec_left > 0) {
+		struct ppa_addr ppa;
+
+		bit = find_next_zero_bit(line->invalid_bitmap, lm->sec_per_line,
+								bit + 1);
+		if (bit > line->emeta_ssec)
+			break;
+
+		ppa = addr_to_gen_ppa(pblk, bit, line->id);
+		pos = pblk_ppa_to_pos(geo, ppa);
+
+		gc_rq = lun_rq[pos];
+		if (!gc_rq) {
+			gc_rq = pblk_gc_alloc_gc_rq(pblk);
+			if (!gc_rq) {
+				ret = -ENOMEM;
+				break;
+			}
+			gc_rq->nr_secs = 0;
+			gc_rq->line = line;
+			lun_rq[pos] = gc_rq;
+		}
+
+		gc_rq->lba_list[gc_rq->nr_secs++] = le64_to_cpu(lba_list[bit]);
+		sec_left--;
+
+		if (gc_rq->nr_secs == pblk->max_write_pgs) {
+			lun_rq[pos] = NULL;
+			ret = pblk_gc_submit_rq(pblk, line, gc_rq);
+			if (ret)
+				break;
+		}
+	}
+
+	for (pos = 0; pos < geo->nr_luns; pos++) {
+		gc_rq = lun_rq[pos];
+		if (!gc_rq)
+			continue;
+		if (ret)
+			pblk_gc_put_gc_rq(pblk, gc_rq);
+		else
+			ret = pblk_gc_submit_rq(pblk, line, gc_rq);
+	}
+
+	kfree(lun_rq);
+	return ret;
+}
+#endif
+
 static void pblk_gc_line_prepare_ws(struct work_struct *work)
 {
 	struct pblk_line_ws *line_ws = container_of(work, struct pblk_line_ws,
@@ -217,8 +354,16 @@ static void pblk_gc_line_prepare_ws(struct work_struct *work)
 	}
 
 	bit = -1;
+#ifdef PBLK_GC_PARALLEL
+	if (!pblk_gc_line_has_page_map(pblk, line, lba_list)) {
+		if (pblk_gc_line_prepare_luns(pblk, line, lba_list))
+			goto fail_free_emeta;
+		goto out;
+	}
+#endif
+
 next_rq:
-	gc_rq = kmalloc(sizeof(struct pblk_gc_rq), GFP_KERNEL);
+	gc_rq = pblk_gc_alloc_gc_rq(pblk);
 	if (!gc_rq)
 		goto fail_free_emeta;
 
@@ -249,7 +394,7 @@ next_rq:
 	} while (nr_secs < pblk->max_write_pgs);
 
 	if (unlikely(!nr_secs)) {
-		kfree(gc_rq);
+		pblk_gc_put_gc_rq(pblk, gc_rq);
 		goto out;
 	}
 
@@ -285,7 +430,7 @@ out:
 	return;
 
 fail_free_gc_rq:
-	kfree(gc_rq);
+	pblk_gc_put_gc_rq(pblk, gc_rq);
 fail_free_emeta:
 	pblk_mfree(emeta_buf, l_mg->emeta_alloc_type);
 	pblk_put_line_back(pblk, line);
@@ -441,7 +586,7 @@ static struct pblk_line *pblk_gc_get_victim_line(struct pblk *pblk,
 #ifdef PBLK_FORCE_GC_CB
 	victim_vsc = le32_to_cpu(*victim->vsc);
 
-	u = (victim_vsc * 100) >> 12;
+	u = (pblk_line_gc_vsc(victim) * 100) >> 12;
 
 	if (pblk->min_seq > victim->seq_nr)
 		pblk->min_seq = victim->seq_nr;
@@ -480,7 +625,7 @@ static struct pblk_line *pblk_gc_get_victim_line(struct pblk *pblk,
 			continue;
 		}
 #ifdef PBLK_FORCE_GC_CB
-		u = (line_vsc * 100) >> 12;
+		u = (pblk_line_gc_vsc(line) * 100) >> 12;
 
 		if (pblk->min_seq > line->seq_nr)
 			pblk->min_seq = line->seq_nr;
@@ -522,8 +667,9 @@ static struct pblk_line *pblk_gc_get_victim_line(struct pblk *pblk,
 			victim = line;
 			continue;
 		}
-		line_vsc = le32_to_cpu(*line->vsc);
-		victim_vsc = le32_to_cpu(*victim->vsc);
+		/* hinted (preinvalid) sectors are not counted as copy cost */
+		line_vsc = pblk_line_gc_vsc(line);
+		victim_vsc = pblk_line_gc_vsc(victim);
 		if (line_vsc < victim_vsc)
 			victim = line;
 #endif
@@ -633,6 +779,13 @@ next_gc_group:
 		if (line != NULL) {
 			int line_vsc = le32_to_cpu(*line->vsc);
 			trace_printk("[PBLK-GC]\t%d\t%d\n", line_vsc, line->pstream);
+#ifdef PBLK_GC_PREINVALID
+			/* what the hints promised at selection, vs copied */
+			atomic_long_add(line_vsc,
+					&pblk->gc_victim_vsc[line->pstream]);
+			atomic_long_add(atomic_read(&line->pi_secs),
+					&pblk->gc_victim_pi[line->pstream]);
+#endif
 		}
 
 		spin_lock(&gc->r_lock);
@@ -680,6 +833,12 @@ static int pblk_gc_ts(void *data)
 
 	while (!kthread_should_stop()) {
 		pblk_gc_run(pblk);
+#ifdef PBLK_MAP_ADAPT
+		pblk_map_adapt(pblk);
+#endif
+#ifdef PBLK_SNAPSHOT
+		pblk_snap_kick(pblk);
+#endif
 		set_current_state(TASK_INTERRUPTIBLE);
 		io_schedule();
 	}
@@ -829,8 +988,15 @@ int pblk_gc_init(struct pblk *pblk)
 	/* Workqueue that reads valid sectors from a line and submit them to the
 	 * GC writer to be recycled.
 	 */
+#ifdef PBLK_GC_PARALLEL
+	/* one reader per LUN so per-LUN requests are read concurrently */
+	gc->gc_line_reader_wq = alloc_workqueue("pblk-gc-line-reader-wq",
+			WQ_MEM_RECLAIM | WQ_UNBOUND,
+			max_t(int, PBLK_GC_MAX_READERS, pblk->dev->geo.nr_luns));
+#else
 	gc->gc_line_reader_wq = alloc_workqueue("pblk-gc-line-reader-wq",
 			WQ_MEM_RECLAIM | WQ_UNBOUND, PBLK_GC_MAX_READERS);
+#endif
 	if (!gc->gc_line_reader_wq) {
 		pr_err("pblk: could not allocate GC line reader workqueue\n");
 		ret = -ENOMEM;
@@ -838,8 +1004,14 @@ int pblk_gc_init(struct pblk *pblk)
 	}
 
 	/* Workqueue that prepare lines for GC */
+#ifdef PBLK_GC_PARALLEL
+	/* prepare every line in flight (PBLK_GC_L_QD), not one at a time */
+	gc->gc_reader_wq = alloc_workqueue("pblk-gc-line_wq",
+					WQ_MEM_RECLAIM | WQ_UNBOUND, PBLK_GC_L_QD);
+#else
 	gc->gc_reader_wq = alloc_workqueue("pblk-gc-line_wq",
 					WQ_MEM_RECLAIM | WQ_UNBOUND, 1);
+#endif
 	if (!gc->gc_reader_wq) {
 		pr_err("pblk: could not allocate GC reader workqueue\n");
 		ret = -ENOMEM;
@@ -855,6 +1027,11 @@ int pblk_gc_init(struct pblk *pblk)
 	INIT_LIST_HEAD(&gc->w_list);
 	INIT_LIST_HEAD(&gc->r_list);
 
+#ifdef PBLK_GC_PARALLEL
+	atomic_long_set(&gc->read_secs, 0);
+	atomic_long_set(&gc->stall_us, 0);
+#endif
+
 	return 0;
 
 fail_free_reader_line_wq:
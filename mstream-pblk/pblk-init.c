@@ -25,6 +25,9 @@ static struct kmem_cache *pblk_blk_ws_cache, *pblk_rec_cache, *pblk_g_rq_cache,
 #ifdef CONFIG_PBLK_DFTL
 static struct kmem_cache *pblk_dftl_cache;
 #endif
+#ifdef PBLK_GC_PARALLEL
+static struct kmem_cache *pblk_gc_rq_cache;
+#endif
 static DECLARE_RWSEM(pblk_lock);
 struct bio_set *pblk_bio_set;
 
@@ -33,6 +36,9 @@ static int pblk_rw_io(struct request_queue *q, struct pblk *pblk,
 {
 	int ret;
 
+#ifdef CONFIG_PBLK_DFTL
+	atomic_long_inc(&pblk->nr_host_io);
+#endif
 	/* Read requests must be <= 256kb due to NVMe's 64 bit completion bitmap
 	 * constraint. Writes can be of arbitrary size.
 	 */
@@ -87,6 +93,67 @@ static int pblk_set_expect_lifetime(struct pblk *pblk, int cluster, int min, int
 } 
 #endif
 
+#if (defined CONFIG_PBLK_MULTIMAP && !defined EXT4_TEST)
+#define PREINVALID_ID 100
+#define PREINVALID_BATCH_ID 101
+
+/* batch of invalidated ranges from f2fs, see f2fs_flush_preinvalid() */
+struct preinvalid_range {
+	u32 lba;
+	u32 len;
+} __packed;
+
+struct preinvalid_batch {
+	int id;
+	int nr;
+	struct preinvalid_range range[0];
+} __packed;
+
+static void pblk_set_preinvalid_batch(struct pblk *pblk,
+					struct preinvalid_batch *pb)
+{
+	sector_t nr_secs = pblk->rl.nr_secs;
+	unsigned long nr_blks = 0;
+	int i;
+
+	spin_lock(&pblk->trans_lock);
+	for (i = 0; i < pb->nr; i++) {
+		sector_t lba = pb->range[i].lba;
+		sector_t len = pb->range[i].len;
+
+		if (lba >= nr_secs)
+			continue;
+		if (len > nr_secs - lba)
+			len = nr_secs - lba;
+#ifdef PBLK_GC_PREINVALID
+		nr_blks += len;
+		while (len--)
+			pblk_preinvalid_set(pblk, lba++);
+#else
+		bitmap_set(pblk->preinvalid_map, lba, len);
+		nr_blks += len;
+#endif
+	}
+	spin_unlock(&pblk->trans_lock);
+
+#ifdef PREINVALID_TRIM
+	/* as a single hint would be; the trim takes trans_lock itself */
+	for (i = 0; i < pb->nr; i++) {
+		sector_t lba = pb->range[i].lba;
+		sector_t len = pb->range[i].len;
+
+		if (lba >= nr_secs)
+			continue;
+		pblk_discard_range(pblk, lba, min_t(sector_t, len,
+							nr_secs - lba));
+	}
+#endif
+
+	atomic_long_inc(&pblk->nr_preinvalid_bio);
+	atomic_long_add(nr_blks, &pblk->nr_preinvalid_blk);
+}
+#endif
+
 static blk_qc_t pblk_make_rq(struct request_queue *q, struct bio *bio)
 {
 	struct pblk *pblk = q->queuedata;
@@ -108,22 +175,28 @@ static blk_qc_t pblk_make_rq(struct request_queue *q, struct bio *bio)
 		int* lstream_p = (int*)bio->bi_private;
 		sector_t lba = pblk_get_lba(bio);
 		int total_entries = pblk_get_secs(bio);
-		pblk->stream_map[lba] = *lstream_p;
+		/* two sectors share a byte of the map */
+		spin_lock(&pblk->trans_lock);
+		pblk_stream_map_set(pblk, lba, *lstream_p);
+		spin_unlock(&pblk->trans_lock);
 		bio_endio(bio);
 		return BLK_QC_T_NONE;
 	}
 #else
-#define PREINVALID_ID 100
 	if (bio->bi_opf & REQ_OP_SETSTREAM)
 	{
 		int* lstream_p = (int*)bio->bi_private;
 		sector_t lba = pblk_get_lba(bio);
 
-		if (*lstream_p == PREINVALID_ID) {
+		if (*lstream_p == PREINVALID_BATCH_ID) {
+			pblk_set_preinvalid_batch(pblk,
+				(struct preinvalid_batch *)bio->bi_private);
+		}
+		else if (*lstream_p == PREINVALID_ID) {
 			int i;
 			int total_entries = pblk_get_secs(bio);
 			spin_lock(&pblk->trans_lock);
-			pblk->preinvalid_map[lba] = 1;
+			pblk_preinvalid_set(pblk, lba);
 			spin_unlock(&pblk->trans_lock);
 			#ifdef PREINVALID_TRIM
 			pblk_discard(pblk, bio);
@@ -175,6 +248,12 @@ static blk_qc_t pblk_make_rq(struct request_queue *q, struct bio *bio)
 
 static void pblk_l2p_free(struct pblk *pblk)
 {
+#ifdef PBLK_SNAPSHOT
+	pblk_snap_exit(pblk);
+#endif
+#ifdef CONFIG_PBLK_DFTL
+	pblk_map_io_exit(pblk);
+#endif
 #ifdef CONFIG_PBLK_MULTIMAP
 	unsigned long long nr_seg = (pblk->rl.nr_secs >> pblk->ppaf.blk_offset) + 1;
 	int i;
@@ -185,7 +264,26 @@ static void pblk_l2p_free(struct pblk *pblk)
 			struct ppa_addr *sector_map = (struct ppa_addr*)map[i].pointer;
 			vfree(sector_map);
 		}
+#ifdef PBLK_MAP_ADAPT
+		else if (map[i].m.map == PAGE_MAP) {
+			struct pba_addr *pmap = (struct pba_addr*)map[i].pointer;
+			int pmap_entry_num = (1 << pblk->ppaf.blk_offset) >> pblk->ppaf.pln_offset;
+			int j;
+
+			for (j = 0; j < pmap_entry_num; j++)
+				if (pmap[j].m.is_cached == 1)
+					vfree(pmap[j].pointer);
+			vfree(pmap);
+		}
+#endif
 	}
+#ifdef PBLK_MAP_ADAPT
+	vfree(pblk->lseg_heat);
+#endif
+	vfree(pblk->preinvalid_map);
+#endif
+#ifdef EXT4_TEST
+	vfree(pblk->stream_map);
 #endif
 	vfree(pblk->trans_map);
 }
@@ -204,6 +302,9 @@ static int pblk_l2p_init(struct pblk *pblk)
 	unsigned long long nr_seg = (pblk->rl.nr_secs >> pblk->ppaf.blk_offset) + 1;
 	struct pba_addr *map;
 	int entry_num = (1 << (pblk->ppaf.blk_offset));
+#ifdef PBLK_WRITE_HINT
+	int j;
+#endif
 	printk("nr_sec:%llu, nr_seg:%llu\n", pblk->rl.nr_secs, nr_seg);
 	printk("blk_offset:%d\n", pblk->ppaf.blk_offset);
 	printk("pg_offset:%d\n", pblk->ppaf.pg_offset);
@@ -213,18 +314,30 @@ static int pblk_l2p_init(struct pblk *pblk)
 	printk("sec_offset:%d\n", pblk->ppaf.sec_offset);
 
 	pblk->trans_map = vmalloc(entry_size * nr_seg);
-	pblk->preinvalid_map = vmalloc(entry_size * pblk->rl.nr_secs);
+	if (!pblk->trans_map)
+		return -ENOMEM;
+	/* vzalloc'ed pages are zeroed by the allocator, no init loop */
+	pblk->preinvalid_map = vzalloc(BITS_TO_LONGS(pblk->rl.nr_secs) *
+							sizeof(unsigned long));
+	if (!pblk->preinvalid_map)
+		goto fail;
 
 #endif
 #ifdef EXT4_TEST
-	pblk->stream_map = vmalloc(entry_size * pblk->rl.nr_secs);
-	for (i = 0; i < pblk->rl.nr_secs; i++)
-		pblk->stream_map[i] = 0;
+	pblk->stream_map = vzalloc((pblk->rl.nr_secs + 1) >> 1);
+	if (!pblk->stream_map)
+		goto fail;
 #endif
 
 	if (!pblk->trans_map)
 		return -ENOMEM;
 
+#ifdef CONFIG_PBLK_MULTIMAP
+	printk("l2p: trans_map %llu KB preinvalid %lu KB\n",
+		(entry_size * nr_seg) >> 10,
+		(BITS_TO_LONGS(pblk->rl.nr_secs) * sizeof(unsigned long)) >> 10);
+#endif
+
 #ifndef CONFIG_PBLK_MULTIMAP
 	pblk_ppa_set_empty(&ppa);
 
@@ -246,8 +359,18 @@ static int pblk_l2p_init(struct pblk *pblk)
 	}
 	printk("check l2p\n");
 
-	for (i = 0; i < pblk->rl.nr_secs; i++)
-		pblk->preinvalid_map[i] = 0;		
+#ifdef PBLK_MAP_ADAPT
+	pblk->lseg_heat = vzalloc(nr_seg);
+	if (!pblk->lseg_heat)
+		goto fail;
+	pblk->map_adapt = 0;	/* "1" in sysfs map_adapt */
+	pblk->map_adapt_cursor = 0;
+	pblk->map_bytes = 0;
+	pblk->map_bytes_acc = 0;
+	atomic_long_set(&pblk->nr_map_promote, 0);
+	atomic_long_set(&pblk->nr_map_demote, 0);
+#endif
+
 
 	//pblk->nr_lstream = 13;
 	pblk->nr_lstream = MAX_PSTREAM;
@@ -266,6 +389,19 @@ static int pblk_l2p_init(struct pblk *pblk)
 		pblk->lstream[i].expect_lifetime = -1;
 	}
 
+#ifdef PBLK_WRITE_HINT
+	/* WRITE_LIFE_SHORT..EXTREME go to the data streams, hot to cold */
+	memset(pblk->hint_lstream, PBLK_HINT_NONE, PBLK_NR_HINTS);
+	for (j = 0; j < NR_DATA &&
+			WRITE_LIFE_SHORT + j <= WRITE_LIFE_EXTREME; j++) {
+		int lstream = DATA_START_STREAM + j;
+
+		if (lstream >= pblk->nr_lstream || lstream >= pblk->nr_rwb)
+			break;
+		pblk->hint_lstream[WRITE_LIFE_SHORT + j] = lstream;
+	}
+#endif
+
 /*
 	pblk->lstream[1].map_type = BLOCK_MAP;
 	pblk->lstream[1].log_size = entry_num;
@@ -319,14 +455,48 @@ static int pblk_l2p_init(struct pblk *pblk)
 	pblk->cmt_mgt.global_map.map_size = 4;
 
 	spin_lock_init(&pblk->cmt_mgt.map_lock);
-	INIT_LIST_HEAD(&pblk->cmt_mgt.map_list);
+	for (i = 0; i < (1 << CMT_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&pblk->cmt_mgt.hash[i]);
+	INIT_LIST_HEAD(&pblk->cmt_mgt.clock);
+
+#ifdef CONFIG_PBLK_DFTL
+	if (pblk_map_io_init(pblk, nr_seg))
+		goto fail;
+#endif
 #endif
 
 #ifdef PBLK_GC_STREAM
     pblk->kmeans_history = vmalloc(sizeof(struct kmeans_history) * MAX_HISTORY);
     pblk->kmeans_count = 0;
 #endif
+
+#ifdef PBLK_SNAPSHOT
+	if (pblk_snap_init(pblk)) {
+		pblk_map_io_exit(pblk);
+		goto fail;
+	}
+#endif
 	return 0;
+
+	/* the caller skips pblk_l2p_free(); no lseg has a map of its own yet */
+fail:
+#ifdef CONFIG_PBLK_MULTIMAP
+#ifdef PBLK_MAP_ADAPT
+	vfree(pblk->lseg_heat);
+	pblk->lseg_heat = NULL;
+#endif
+	vfree(pblk->lstream);
+	pblk->lstream = NULL;
+	vfree(pblk->preinvalid_map);
+	pblk->preinvalid_map = NULL;
+#endif
+#ifdef EXT4_TEST
+	vfree(pblk->stream_map);
+	pblk->stream_map = NULL;
+#endif
+	vfree(pblk->trans_map);
+	pblk->trans_map = NULL;
+	return -ENOMEM;
 }
 
 static void pblk_rwb_free(struct pblk *pblk)
@@ -481,6 +651,19 @@ static int pblk_init_global_caches(struct pblk *pblk)
 	error
 #endif
 
+#ifdef PBLK_GC_PARALLEL
+	pblk_gc_rq_cache = kmem_cache_create("pblk_gc_rq",
+				sizeof(struct pblk_gc_rq), 0, 0, NULL);
+	if (!pblk_gc_rq_cache) {
+		kmem_cache_destroy(pblk_blk_ws_cache);
+		kmem_cache_destroy(pblk_rec_cache);
+		kmem_cache_destroy(pblk_g_rq_cache);
+		kmem_cache_destroy(pblk_w_rq_cache);
+		up_write(&pblk_lock);
+		return -ENOMEM;
+	}
+#endif
+
 	snprintf(cache_name, sizeof(cache_name), "pblk_line_m_%s",
 							pblk->disk->disk_name);
 	pblk_line_meta_cache = kmem_cache_create(cache_name,
@@ -490,6 +673,9 @@ static int pblk_init_global_caches(struct pblk *pblk)
 		kmem_cache_destroy(pblk_rec_cache);
 		kmem_cache_destroy(pblk_g_rq_cache);
 		kmem_cache_destroy(pblk_w_rq_cache);
+#ifdef PBLK_GC_PARALLEL
+		kmem_cache_destroy(pblk_gc_rq_cache);
+#endif
 		up_write(&pblk_lock);
 		return -ENOMEM;
 	}
@@ -554,10 +740,17 @@ static int pblk_core_init(struct pblk *pblk)
 	if (!pblk->line_meta_pool)
 		goto free_w_rq_pool;
 
+#ifdef PBLK_GC_PARALLEL
+	pblk->gc_rq_pool = mempool_create_slab_pool(PBLK_GC_RQ_POOL_SIZE,
+							pblk_gc_rq_cache);
+	if (!pblk->gc_rq_pool)
+		goto free_line_meta_pool;
+#endif
+
 	pblk->close_wq = alloc_workqueue("pblk-close-wq",
 			WQ_MEM_RECLAIM | WQ_UNBOUND, PBLK_NR_CLOSE_JOBS);
 	if (!pblk->close_wq)
-		goto free_line_meta_pool;
+		goto free_gc_rq_pool;
 
 	pblk->bb_wq = alloc_workqueue("pblk-bb-wq",
 			WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
@@ -580,6 +773,10 @@ free_bb_wq:
 	destroy_workqueue(pblk->bb_wq);
 free_close_wq:
 	destroy_workqueue(pblk->close_wq);
+free_gc_rq_pool:
+#ifdef PBLK_GC_PARALLEL
+	mempool_destroy(pblk->gc_rq_pool);
+#endif
 free_line_meta_pool:
 	mempool_destroy(pblk->line_meta_pool);
 free_w_rq_pool:
@@ -609,12 +806,18 @@ static void pblk_core_free(struct pblk *pblk)
 	mempool_destroy(pblk->g_rq_pool);
 	mempool_destroy(pblk->w_rq_pool);
 	mempool_destroy(pblk->line_meta_pool);
+#ifdef PBLK_GC_PARALLEL
+	mempool_destroy(pblk->gc_rq_pool);
+#endif
 
 	kmem_cache_destroy(pblk_blk_ws_cache);
 	kmem_cache_destroy(pblk_rec_cache);
 	kmem_cache_destroy(pblk_g_rq_cache);
 	kmem_cache_destroy(pblk_w_rq_cache);
 	kmem_cache_destroy(pblk_line_meta_cache);
+#ifdef PBLK_GC_PARALLEL
+	kmem_cache_destroy(pblk_gc_rq_cache);
+#endif
 }
 
 static void pblk_luns_free(struct pblk *pblk)
@@ -642,6 +845,10 @@ static void pblk_lines_free(struct pblk *pblk)
 		pblk_free_line_bitmaps(line);
 	}
 	spin_unlock(&l_mg->free_lock);
+
+#ifdef PBLK_SNAPSHOT
+	pblk_snap_release(pblk);
+#endif
 }
 
 static void pblk_line_meta_free(struct pblk *pblk)
@@ -1205,11 +1412,21 @@ static void pblk_tear_down(struct pblk *pblk)
 	pblk_writer_stop(pblk);
 	for (i = 0; i < nr_rwb; i++)
 		pblk_rb_sync_l2p(&pblk->rb_ctx[i].rwb);
+#ifdef PBLK_SNAPSHOT
+	/* a queued periodic snapshot would run after the buffers are gone */
+	if (pblk->snap.wq)
+		cancel_work_sync(&pblk->snap.ws);
+	pblk_snap_write(pblk);
+#endif
 	pblk_rwb_free(pblk);
 	for (i = 0; i < nr_rwb; i++)
 		pblk_rl_free(&pblk->rb_ctx[i].rb_rl);
 
 	vfree(pblk->rb_ctx);
+#ifdef CONFIG_PBLK_DFTL
+	/* drain map-page write-back while the lines are still set up */
+	pblk_map_io_exit(pblk);
+#endif
 
 	pr_debug("pblk: consistent tear down\n");
 }
@@ -1239,6 +1456,9 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 	struct request_queue *bqueue = dev->q;
 	struct request_queue *tqueue = tdisk->queue;
 	struct pblk *pblk;
+#ifdef PBLK_SNAPSHOT
+	long nr_free_blks;
+#endif
 	int ret, i;
 
 	if (dev->identity.dom & NVM_RSP_L2P) {
@@ -1320,6 +1540,20 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 		atomic_long_set(&pblk->nr_gcskip[i], 0);
 		atomic_long_set(&pblk->preinvalid_gc[i], 0);
 	}
+#ifdef PBLK_WRITE_HINT
+	for (i = 0; i < PBLK_NR_HINTS; i++)
+		atomic_long_set(&pblk->hint_writes[i], 0);
+	for (i = 0; i < MAX_LSTREAM; i++)
+		atomic_long_set(&pblk->stream_gc[i], 0);
+#endif
+#ifdef PBLK_GC_PREINVALID
+	for (i = 0; i < MAX_LSTREAM; i++) {
+		atomic_long_set(&pblk->gc_victim_vsc[i], 0);
+		atomic_long_set(&pblk->gc_victim_pi[i], 0);
+	}
+#endif
+	atomic_long_set(&pblk->nr_preinvalid_bio, 0);
+	atomic_long_set(&pblk->nr_preinvalid_blk, 0);
 	atomic_long_set(&pblk->nr_definemap, 0);
 	atomic_long_set(&pblk->nr_sectormap, 0);
 	atomic_long_set(&pblk->nr_pagemap, 0);
@@ -1327,6 +1561,12 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 	atomic_long_set(&pblk->nr_pagelog, 0);
 	atomic_long_set(&pblk->nr_mapread, 0);
 	atomic_long_set(&pblk->nr_mapwrite, 0);
+	atomic_long_set(&pblk->nr_cmt_hit, 0);
+	atomic_long_set(&pblk->nr_map_rd_io, 0);
+	atomic_long_set(&pblk->nr_map_wr_io, 0);
+	atomic_long_set(&pblk->nr_map_gc_io, 0);
+	atomic_long_set(&pblk->nr_map_pad, 0);
+	atomic_long_set(&pblk->nr_host_io, 0);
 #endif
 
 	atomic_long_set(&pblk->read_failed, 0);
@@ -1354,6 +1594,17 @@ static void *pblk_init(struct nvm_tgt_dev *dev, struct gendisk *tdisk,
 		goto fail_free_line_meta;
 	}
 
+#ifdef PBLK_SNAPSHOT
+	/* the format check reads smeta, so it waits for the core */
+	nr_free_blks = pblk->rl.total_blocks;
+	ret = pblk_snap_reserve(pblk, flags, &nr_free_blks);
+	if (ret) {
+		pr_err("pblk: could not reserve snapshot lines\n");
+		goto fail_free_core;
+	}
+	pblk_set_provision(pblk, nr_free_blks);
+#endif
+
 	ret = pblk_l2p_init(pblk);
 	if (ret) {
 		pr_err("pblk: could not initialize maps\n");
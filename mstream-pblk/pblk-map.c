@@ -183,3 +183,274 @@ retry:
 		erase_ppa->g.blk = e_line->id;
 	}
 }
+
+#ifdef PBLK_MAP_ADAPT
+/*
+ * Groups (1 << pln_offset sectors) of an lseg that cannot be held as a single
+ * page entry. Reads the current representation directly so the scan does not
+ * disturb the CMT.
+ */
+static int pblk_map_unaligned(struct pblk *pblk, struct pba_addr pba)
+{
+	int entry_num = (1 << pblk->ppaf.blk_offset);
+	int pmap_entry_num = entry_num >> pblk->ppaf.pln_offset;
+	int unaligned = 0;
+	int i, j;
+
+	if (pba.m.map == PAGE_MAP) {
+		struct pba_addr *pmap = (struct pba_addr *)pba.pointer;
+
+		for (i = 0; i < pmap_entry_num; i++)
+			if (pmap[i].m.is_cached)
+				unaligned++;
+	} else if (pba.m.map == SECTOR_MAP) {
+		struct ppa_addr *smap = (struct ppa_addr *)pba.pointer;
+
+		for (i = 0; i < entry_num; i += 4) {
+			struct ppa_addr *g = &smap[i];
+			u32 ppa32;
+
+			if (g[0].ppa == ADDR_EMPTY && g[1].ppa == ADDR_EMPTY &&
+			    g[2].ppa == ADDR_EMPTY && g[3].ppa == ADDR_EMPTY)
+				continue;
+
+			if (g[0].ppa == ADDR_EMPTY || g[0].c.is_cached ||
+			    g[0].g.sec != 0) {
+				unaligned++;
+				continue;
+			}
+
+			ppa32 = pblk_ppa64_to_ppa32(pblk, g[0]);
+			for (j = 1; j < 4; j++) {
+				if (g[j].ppa == ADDR_EMPTY || g[j].c.is_cached ||
+				    pblk_ppa64_to_ppa32(pblk, g[j]) != ppa32 + j)
+					break;
+			}
+			if (j < 4)
+				unaligned++;
+		}
+	}
+
+	return unaligned;
+}
+
+static unsigned long pblk_map_bytes(struct pblk *pblk, struct pba_addr pba,
+				    int unaligned)
+{
+	int entry_num = (1 << pblk->ppaf.blk_offset);
+	int pmap_entry_num = entry_num >> pblk->ppaf.pln_offset;
+
+	switch (pba.m.map) {
+	case SECTOR_MAP:
+		return sizeof(struct ppa_addr) * entry_num;
+	case PAGE_MAP:
+		return sizeof(struct pba_addr) * pmap_entry_num +
+				sizeof(struct ppa_addr) * 4 * unaligned;
+	case BLOCK_MAP:
+		if (pba.m.is_cached)
+			return sizeof(struct ppa_addr) * entry_num;
+		return 0;
+	}
+	return 0;
+}
+
+/*
+ * Rebuild a cold SECTOR_MAP lseg as a PAGE_MAP. The maps are allocated up
+ * front with trans_lock dropped; the lseg is rechecked once the lock is
+ * taken and left alone if it changed or grew more unaligned groups than
+ * @nr_logs.
+ */
+static void pblk_map_adapt_page(struct pblk *pblk, unsigned long lseg,
+				struct pba_addr old, int nr_logs)
+{
+	struct pba_addr *bmap = (struct pba_addr *)pblk->trans_map;
+	int entry_num = (1 << pblk->ppaf.blk_offset);
+	int pmap_entry_num = entry_num >> pblk->ppaf.pln_offset;
+	sector_t start_lba = (sector_t)lseg << pblk->ppaf.blk_offset;
+	struct pba_addr *pmap;
+	void **logs;
+	int i, index, used = 0, done = 0;
+
+	pmap = vzalloc(sizeof(struct pba_addr) * pmap_entry_num);
+	logs = kcalloc(max(nr_logs, 1), sizeof(void *), GFP_KERNEL);
+	if (!pmap || !logs)
+		goto out;
+	for (i = 0; i < nr_logs; i++) {
+		logs[i] = vzalloc(sizeof(struct ppa_addr) * 4);
+		if (!logs[i])
+			goto out;
+	}
+
+	spin_lock(&pblk->trans_lock);
+	if (bmap[lseg].pba != old.pba)
+		goto unlock;
+
+	for (i = 0, index = 0; i < entry_num; i += 4, index++) {
+		struct pba_addr page_addr;
+		struct ppa_addr copy_ppa[4];
+		struct ppa_addr *pmt_log;
+
+		page_addr.pba = ADDR_EMPTY;
+
+		if (pblk_check_page_align(pblk, start_lba + i, copy_ppa)) {
+			if (copy_ppa[0].ppa != ADDR_EMPTY) {
+				page_addr.pba = 0;
+				page_addr.b.blk = copy_ppa[0].g.blk;
+				page_addr.b.pg = copy_ppa[0].g.pg;
+				page_addr.b.pl = copy_ppa[0].g.pl;
+				page_addr.b.lun = copy_ppa[0].g.lun;
+				page_addr.b.ch = copy_ppa[0].g.ch;
+			}
+			page_addr.m.is_cached = 0;
+			pmap[index] = page_addr;
+			continue;
+		}
+
+		if (used == nr_logs)
+			goto unlock;
+
+		page_addr.pointer = logs[used++];
+		page_addr.m.is_cached = 1;
+		pmt_log = (struct ppa_addr *)page_addr.pointer;
+		memcpy(pmt_log, copy_ppa, sizeof(copy_ppa));
+		pmap[index] = page_addr;
+	}
+
+	bmap[lseg].pointer = pmap;
+	bmap[lseg].m.map = PAGE_MAP;
+#ifdef CONFIG_NVM_DEBUG
+	atomic_long_inc(&pblk->nr_pagemap);
+	atomic_long_add(used, &pblk->nr_pagelog);
+	atomic_long_dec(&pblk->nr_sectormap);
+#endif
+#ifdef CONFIG_PBLK_DFTL
+	pblk_change_map(pblk, lseg);
+#endif
+	done = 1;
+unlock:
+	spin_unlock(&pblk->trans_lock);
+
+	if (done) {
+		vfree(old.pointer);
+		pmap = NULL;
+		atomic_long_inc(&pblk->nr_map_promote);
+	} else {
+		used = 0;
+	}
+out:
+	if (logs) {
+		for (i = used; i < nr_logs; i++)
+			vfree(logs[i]);
+		kfree(logs);
+	}
+	vfree(pmap);
+}
+
+/* Inverse of pblk_map_adapt_page, for a fragmented PAGE_MAP lseg */
+static void pblk_map_adapt_sector(struct pblk *pblk, unsigned long lseg,
+				  struct pba_addr old)
+{
+	struct pba_addr *bmap = (struct pba_addr *)pblk->trans_map;
+	int entry_num = (1 << pblk->ppaf.blk_offset);
+	int pmap_entry_num = entry_num >> pblk->ppaf.pln_offset;
+	sector_t start_lba = (sector_t)lseg << pblk->ppaf.blk_offset;
+	struct pba_addr *pmap = NULL;
+	struct ppa_addr *smap;
+	int i;
+
+	smap = vzalloc(sizeof(struct ppa_addr) * entry_num);
+	if (!smap)
+		return;
+
+	spin_lock(&pblk->trans_lock);
+	if (bmap[lseg].pba == old.pba) {
+		for (i = 0; i < entry_num; i++)
+			smap[i] = pblk_trans_map_get(pblk, start_lba + i);
+
+		pmap = (struct pba_addr *)bmap[lseg].pointer;
+		bmap[lseg].pointer = smap;
+		bmap[lseg].m.map = SECTOR_MAP;
+		bmap[lseg].m.is_cached = 0;
+		smap = NULL;
+#ifdef CONFIG_NVM_DEBUG
+		atomic_long_dec(&pblk->nr_pagemap);
+		atomic_long_inc(&pblk->nr_sectormap);
+#endif
+#ifdef CONFIG_PBLK_DFTL
+		pblk_change_map(pblk, lseg);
+#endif
+	}
+	spin_unlock(&pblk->trans_lock);
+
+	vfree(smap);
+	if (!pmap)
+		return;
+
+	/* detached above, nobody else can reach it */
+	for (i = 0; i < pmap_entry_num; i++) {
+		if (pmap[i].m.is_cached == 1) {
+			vfree(pmap[i].pointer);
+#ifdef CONFIG_NVM_DEBUG
+			atomic_long_dec(&pblk->nr_pagelog);
+#endif
+		}
+	}
+	vfree(pmap);
+	atomic_long_inc(&pblk->nr_map_demote);
+}
+
+/*
+ * Called from the GC thread. Visits MAP_ADAPT_SCAN lsegs per pass; cold lsegs
+ * of SECTOR_MAP streams whose groups are mostly page aligned are held as a
+ * PAGE_MAP, and a PAGE_MAP lseg that has become fragmented goes back to a
+ * SECTOR_MAP. Only the lookup structure changes, no data is moved.
+ */
+void pblk_map_adapt(struct pblk *pblk)
+{
+	struct pba_addr *bmap = (struct pba_addr *)pblk->trans_map;
+	unsigned long nr_seg = (pblk->rl.nr_secs >> pblk->ppaf.blk_offset) + 1;
+	int pmap_entry_num = (1 << pblk->ppaf.blk_offset) >> pblk->ppaf.pln_offset;
+	int n;
+
+	if (!pblk->map_adapt)
+		return;
+
+	for (n = 0; n < MAP_ADAPT_SCAN; n++) {
+		unsigned long lseg = pblk->map_adapt_cursor;
+		struct pba_addr pba;
+		int unaligned, heat;
+		int to = NONE_MAP;
+
+		spin_lock(&pblk->trans_lock);
+		pba = bmap[lseg];
+		heat = pblk->lseg_heat[lseg];
+		pblk->lseg_heat[lseg] = heat >> 1;
+
+		unaligned = pblk_map_unaligned(pblk, pba);
+		pblk->map_bytes_acc += pblk_map_bytes(pblk, pba, unaligned);
+
+		if (pba.m.map != NONE_MAP &&
+		    pblk->lstream[pba.m.lstream].map_type == SECTOR_MAP) {
+			if (pba.m.map == SECTOR_MAP && heat < MAP_ADAPT_COLD &&
+			    unaligned * 4 < pmap_entry_num)
+				to = PAGE_MAP;
+			else if (pba.m.map == PAGE_MAP &&
+				 unaligned * 2 > pmap_entry_num)
+				to = SECTOR_MAP;
+		}
+		spin_unlock(&pblk->trans_lock);
+
+		/* the maps are (de)allocated without trans_lock */
+		if (to == PAGE_MAP)
+			pblk_map_adapt_page(pblk, lseg, pba, unaligned);
+		else if (to == SECTOR_MAP)
+			pblk_map_adapt_sector(pblk, lseg, pba);
+
+		if (++pblk->map_adapt_cursor >= nr_seg) {
+			pblk->map_adapt_cursor = 0;
+			pblk->map_bytes = pblk->map_bytes_acc;
+			pblk->map_bytes_acc = 0;
+		}
+	}
+}
+#endif
@@ -44,12 +44,12 @@ unsigned int pblk_rb_remain_max(struct pblk *pblk, int nr_entries, int nr_rwb)
 	rl = &pblk->rl;	
 	rb_rl = &pblk->rb_ctx[nrb].rb_rl;
 
-        remain_max = rl->rb_user_max - atomic_read(&rb_rl->rb_user_cnt);
+        remain_max = pblk_rl_user_max(rl, rb_rl) - atomic_read(&rb_rl->rb_user_cnt);
 
         for (i = nrb+1; i < nr_rwb; i++) {
-		rb_rl = &pblk->rb_ctx[nrb].rb_rl;
-                remain_cnt = rl->rb_user_max - atomic_read(&rb_rl->rb_user_cnt);
-                if ( (remain_max >= nr_entries) && (remain_max < remain_cnt) ) {
+		rb_rl = &pblk->rb_ctx[i].rb_rl;
+                remain_cnt = pblk_rl_user_max(rl, rb_rl) - atomic_read(&rb_rl->rb_user_cnt);
+                if ( (remain_cnt >= nr_entries) && (remain_max < remain_cnt) ) {
                         nrb = i;
                         remain_max = remain_cnt;
                 }
@@ -69,12 +69,12 @@ unsigned int pblk_rb_gc_remain_max(struct pblk *pblk, int nr_entries)
 	rl = &pblk->rl;	
 	rb_rl = &pblk->rb_ctx[nrb].rb_rl;
 
-        remain_max = rl->rb_gc_max - atomic_read(&rb_rl->rb_gc_cnt);
+        remain_max = pblk_rl_gc_max(rl, rb_rl) - atomic_read(&rb_rl->rb_gc_cnt);
 
         for (i = nrb+1; i < pblk->nr_rwb; i++) {
-		rb_rl = &pblk->rb_ctx[nrb].rb_rl;
-                remain_cnt = rl->rb_gc_max - atomic_read(&rb_rl->rb_gc_cnt);
-                if ( (remain_max >= nr_entries) && (remain_max < remain_cnt) ) {
+		rb_rl = &pblk->rb_ctx[i].rb_rl;
+                remain_cnt = pblk_rl_gc_max(rl, rb_rl) - atomic_read(&rb_rl->rb_gc_cnt);
+                if ( (remain_cnt >= nr_entries) && (remain_max < remain_cnt) ) {
                         nrb = i;
                         remain_max = remain_cnt;
                 }
@@ -229,6 +229,9 @@ try:
 	smp_store_release(&w_ctx->flags, PBLK_WRITABLE_ENTRY);
 	smp_store_release(&w_ctx->submit_flags, PBLK_WRITABLE_ENTRY);
 	pblk_ppa_set_empty(&w_ctx->ppa);
+#ifdef PBLK_SNAPSHOT
+	pblk_ppa_set_empty(&w_ctx->prev_ppa);
+#endif
 	spin_unlock(&pblk->trans_lock);
 	w_ctx->lba = ADDR_EMPTY;
 }
@@ -521,6 +524,9 @@ void pblk_rb_reserved_entry(struct pblk_rb *rb,
 
 	// printk("rb_reserved_entry:%lu\n", w_ctx.lba);
 	l2p_ppa = pblk_trans_map_get(pblk, w_ctx.lba);
+#ifdef PBLK_SNAPSHOT
+	entry->w_ctx.prev_ppa = pblk_cache_prev_addr(pblk, l2p_ppa);
+#endif
 	
 	entry->w_ctx.lba = w_ctx.lba;
 	entry->w_ctx.ppa = l2p_ppa;
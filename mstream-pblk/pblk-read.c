@@ -58,6 +58,9 @@ static void pblk_read_ppalist_rq(struct pblk *pblk, struct nvm_rq *rqd,
 	}
 
 	pblk_lookup_l2p_seq(pblk, ppas, blba, nr_secs);
+#ifdef CONFIG_PBLK_DFTL
+	pblk_cmt_wait(pblk, blba, nr_secs);
+#endif
 
 	for (i = 0; i < nr_secs; i++) {
 		struct ppa_addr p = ppas[i];
@@ -279,6 +282,9 @@ static void pblk_read_rq(struct pblk *pblk, struct nvm_rq *rqd,
 	}
 
 	pblk_lookup_l2p_seq(pblk, &ppa, lba, 1);
+#ifdef CONFIG_PBLK_DFTL
+	pblk_cmt_wait(pblk, lba, 1);
+#endif
 
 #ifdef CONFIG_NVM_DEBUG
 	atomic_long_inc(&pblk->inflight_reads);
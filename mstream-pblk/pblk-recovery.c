@@ -137,6 +137,49 @@ __le64 *pblk_recov_get_lba_list(struct pblk *pblk, struct line_emeta *emeta_buf)
 	return emeta_to_lbas(pblk, emeta_buf);
 }
 
+#ifdef PBLK_SNAPSHOT
+/* @a was written before @b */
+static int pblk_recov_ppa_older(struct pblk *pblk, struct ppa_addr a,
+							struct ppa_addr b)
+{
+	struct pblk_line *la = &pblk->lines[pblk_tgt_ppa_to_line(a)];
+	struct pblk_line *lb = &pblk->lines[pblk_tgt_ppa_to_line(b)];
+
+	if (la != lb)
+		return la->seq_nr < lb->seq_nr;
+	return pblk_dev_ppa_to_line_addr(pblk, a) <
+					pblk_dev_ppa_to_line_addr(pblk, b);
+}
+#endif
+
+/*
+ * Lines are replayed in seq_nr order, so a plain map update keeps the
+ * newest copy. A loaded snapshot may already map a sector to a newer line
+ * though; the replayed copy is then only invalidated.
+ */
+static void pblk_recov_update_map(struct pblk *pblk, sector_t lba,
+							struct ppa_addr ppa)
+{
+#ifdef PBLK_SNAPSHOT
+	struct ppa_addr l2p_ppa;
+
+	if (pblk->snap.loaded && lba < pblk->rl.nr_secs) {
+		spin_lock(&pblk->trans_lock);
+		l2p_ppa = pblk_trans_map_get(pblk, lba);
+		spin_unlock(&pblk->trans_lock);
+
+		if (l2p_ppa.ppa == ppa.ppa)
+			return;
+		if (!pblk_ppa_empty(l2p_ppa) && !pblk_addr_in_cache(l2p_ppa) &&
+				pblk_recov_ppa_older(pblk, ppa, l2p_ppa)) {
+			pblk_map_invalidate(pblk, ppa);
+			return;
+		}
+	}
+#endif
+	pblk_update_map(pblk, lba, ppa);
+}
+
 static int pblk_recov_l2p_from_emeta(struct pblk *pblk, struct pblk_line *line)
 {
 	struct nvm_tgt_dev *dev = pblk->dev;
@@ -179,7 +222,7 @@ static int pblk_recov_l2p_from_emeta(struct pblk *pblk, struct pblk_line *line)
 			continue;
 		}
 
-		pblk_update_map(pblk, le64_to_cpu(lba_list[i]), ppa);
+		pblk_recov_update_map(pblk, le64_to_cpu(lba_list[i]), ppa);
 		nr_lbas++;
 	}
 
@@ -320,7 +363,7 @@ next_read_rq:
 		if (lba == ADDR_EMPTY || lba > pblk->rl.nr_secs)
 			continue;
 
-		pblk_update_map(pblk, lba, rqd->ppa_list[i]);
+		pblk_recov_update_map(pblk, lba, rqd->ppa_list[i]);
 	}
 
 	left_ppas -= rq_ppas;
@@ -611,7 +654,7 @@ next_rq:
 			if (lba == ADDR_EMPTY || lba > pblk->rl.nr_secs)
 				continue;
 
-			pblk_update_map(pblk, lba, rqd->ppa_list[i]);
+			pblk_recov_update_map(pblk, lba, rqd->ppa_list[i]);
 		}
 	}
 
@@ -765,7 +808,7 @@ next_rq:
 		if (lba == ADDR_EMPTY || lba > pblk->rl.nr_secs)
 			continue;
 
-		pblk_update_map(pblk, lba, rqd->ppa_list[i]);
+		pblk_recov_update_map(pblk, lba, rqd->ppa_list[i]);
 	}
 
 	left_ppas -= rq_ppas;
@@ -870,9 +913,9 @@ struct pblk_line *pblk_recov_l2p(struct pblk *pblk)
 	int i, valid_uuid = 0;
 	LIST_HEAD(recov_list);
 
-	/* TODO: Implement FTL snapshot */
-
-	/* Scan recovery - takes place when FTL snapshot fails */
+	/* Lines closed at the last snapshot are restored from it; the rest
+	 * is scanned. Without a snapshot every line is scanned.
+	 */
 	spin_lock(&l_mg->free_lock);
 	meta_line = find_first_zero_bit(&l_mg->meta_bitmap, PBLK_DATA_LINES);
 	set_bit(meta_line, &l_mg->meta_bitmap);
@@ -887,6 +930,11 @@ struct pblk_line *pblk_recov_l2p(struct pblk *pblk)
 
 		line = &pblk->lines[i];
 
+#ifdef PBLK_SNAPSHOT
+		if (pblk_snap_line(pblk, line))
+			continue;
+#endif
+
 		memset(smeta, 0, lm->smeta_len);
 		line->smeta = smeta;
 		line->lun_bitmap = ((void *)(smeta_buf)) +
@@ -903,6 +951,12 @@ struct pblk_line *pblk_recov_l2p(struct pblk *pblk)
 		if (le32_to_cpu(smeta_buf->header.identifier) != PBLK_MAGIC)
 			continue;
 
+#ifdef PBLK_SNAPSHOT
+		/* a slot line left over when snapshots could not be reserved */
+		if (le32_to_cpu(smeta_buf->feat) & PBLK_FEAT_SNAP_SLOT)
+			continue;
+#endif
+
 		if (le16_to_cpu(smeta_buf->header.version) != 1) {
 			pr_err("pblk: found incompatible line version %u\n",
 					smeta_buf->header.version);
@@ -955,6 +1009,10 @@ struct pblk_line *pblk_recov_l2p(struct pblk *pblk)
 		goto out;
 	}
 
+#ifdef PBLK_SNAPSHOT
+	pblk_snap_load(pblk);
+#endif
+
 	/* Verify closed blocks and recover this portion of L2P table*/
 	list_for_each_entry_safe(line, tline, &recov_list, list) {
 		int off, nr_bb;
@@ -967,6 +1025,14 @@ struct pblk_line *pblk_recov_l2p(struct pblk *pblk)
 
 		line->emeta_ssec = off;
 		line->emeta = emeta;
+
+#ifdef PBLK_SNAPSHOT
+		/* map and valid sectors already come from the snapshot */
+		if (pblk_snap_covers(pblk, line)) {
+			line->left_msecs = 0;
+			goto next;
+		}
+#endif
 		memset(line->emeta->buf, 0, lm->emeta_len[0]);
 
 		if (pblk_line_read_emeta(pblk, line, line->emeta->buf)) {
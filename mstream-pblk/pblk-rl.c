@@ -40,7 +40,7 @@ int pblk_rl_user_may_insert(struct pblk_rl *rl, struct pblk_rl_per_rb *rb_rl, in
 	if (unlikely(rb_space >= 0) && (rb_space - nr_entries < 0))
 		return NVM_IO_ERR;
 
-	if (rb_user_cnt >= rl->rb_user_max) {
+	if (rb_user_cnt >= pblk_rl_user_max(rl, rb_rl)) {
 //		printk("pblk_rl_user_may_insert: %d %d\n", rb_user_cnt, rl->rb_user_max);
 		return NVM_IO_REQUEUE;
 	}
@@ -63,7 +63,7 @@ int pblk_rl_gc_may_insert(struct pblk_rl *rl, struct pblk_rl_per_rb *rb_rl, int
 
 	/* If there is no user I/O let GC take over space on the write buffer */
 	rb_user_active = READ_ONCE(rb_rl->rb_user_active);
-	return (!(rb_gc_cnt >= rl->rb_gc_max && rb_user_active));
+	return (!(rb_gc_cnt >= pblk_rl_gc_max(rl, rb_rl) && rb_user_active));
 }
 
 void pblk_rl_user_in(struct pblk_rl_per_rb *rb_rl, int nr_entries)
@@ -93,6 +93,95 @@ unsigned long pblk_rl_nr_free_blks(struct pblk_rl *rl)
 	return atomic_read(&rl->free_blocks);
 }
 
+#ifdef PBLK_RL_PID
+/*
+ * PID control of the free block count. Below the setpoint the user share of
+ * the buffer shrinks with the deficit (P), with how long it lasted (I) and
+ * with how fast free blocks drain (D), instead of flipping from full speed to
+ * a stall at one threshold. The cut is applied per stream in proportion to
+ * the free blocks each stream took lately, so the streams draining the pool
+ * give way to GC first. Under the GC reserve user I/O stops as before.
+ */
+static int pblk_rl_pid_update(struct pblk_rl *rl, unsigned long max,
+			      unsigned long free_blocks)
+{
+	struct pblk *pblk = rl->pblk;
+	long blk_per_line = pblk->lm.blk_per_line;
+	unsigned int max_load = 1;
+	long err, slope, out;
+	int i;
+
+	rl->rb_state = (free_blocks < rl->setpoint) ? PBLK_RL_LOW : PBLK_RL_HIGH;
+
+	/* the reserve is enforced at once, the rest once per period */
+	if (free_blocks > rl->rsv_blocks && time_before(jiffies,
+			rl->pid_stamp + msecs_to_jiffies(PBLK_RL_PID_MS)))
+		return rl->rb_state;
+
+	if (!spin_trylock(&rl->pid_lock))
+		return rl->rb_state;
+
+	/* error and slope in 1/PBLK_RL_ONE lines */
+	err = ((long)free_blocks - (long)rl->setpoint) * PBLK_RL_ONE /
+								blk_per_line;
+	slope = rl->pid_steps ? ((long)free_blocks - rl->pid_free) *
+						PBLK_RL_ONE / blk_per_line : 0;
+	rl->pid_slope = (3 * rl->pid_slope + slope) / 4;
+	rl->pid_free = free_blocks;
+	rl->pid_stamp = jiffies;
+	rl->pid_steps++;
+
+	if (err >= 0) {
+		/* GC stops above the setpoint, let go of the history */
+		rl->pid_integral /= 2;
+	} else {
+		rl->pid_integral += err;
+		/* anti-windup: the I term alone may not cut more than all */
+		if (rl->ki && rl->pid_integral * rl->ki <
+					-(long)PBLK_RL_ONE * PBLK_RL_ONE)
+			rl->pid_integral = -(long)PBLK_RL_ONE * PBLK_RL_ONE /
+								rl->ki;
+	}
+
+	out = PBLK_RL_ONE + (rl->kp * err + rl->ki * rl->pid_integral +
+				rl->kd * rl->pid_slope) / PBLK_RL_ONE;
+	if (free_blocks <= rl->rsv_blocks)
+		out = 0;
+	out = clamp_t(long, out, 0, PBLK_RL_ONE);
+	rl->pid_out = out;
+
+	for (i = 0; i < pblk->nr_rwb; i++) {
+		struct pblk_rl_per_rb *rb_rl = &pblk->rb_ctx[i].rb_rl;
+
+		rb_rl->rb_load = rb_rl->rb_load / 2 +
+					atomic_xchg(&rb_rl->rb_taken, 0);
+		max_load = max(max_load, rb_rl->rb_load);
+	}
+
+	for (i = 0; i < pblk->nr_rwb; i++) {
+		struct pblk_rl_per_rb *rb_rl = &pblk->rb_ctx[i].rb_rl;
+		long cut = (PBLK_RL_ONE - out) * rb_rl->rb_load / max_load;
+		int user_max = 0;
+
+		if (free_blocks > rl->rsv_blocks) {
+			user_max = max - max * cut / PBLK_RL_ONE;
+			/* keep one window open so no stream starves */
+			if (user_max < PBLK_MAX_REQ_ADDRS)
+				user_max = min_t(int, max, PBLK_MAX_REQ_ADDRS);
+		}
+
+		WRITE_ONCE(rb_rl->rb_user_max, user_max);
+		WRITE_ONCE(rb_rl->rb_gc_max, max - user_max);
+	}
+
+	rl->rb_user_max = max * out / PBLK_RL_ONE;
+	rl->rb_gc_max = max - rl->rb_user_max;
+	spin_unlock(&rl->pid_lock);
+
+	return rl->rb_state;
+}
+#endif
+
 /*
  * We check for (i) the number of free blocks in the current LUN and (ii) the
  * total number of free blocks in the pblk instance. This is to even out the
@@ -104,6 +193,11 @@ static int pblk_rl_update_rates(struct pblk_rl *rl, unsigned long max)
 {
 	unsigned long free_blocks = pblk_rl_nr_free_blks(rl);
 
+#ifdef PBLK_RL_PID
+	if (READ_ONCE(rl->pid_on))
+		return pblk_rl_pid_update(rl, max, free_blocks);
+#endif
+
 	if (free_blocks >= rl->high) {
 //		printk("JJY: update %d %d\n", free_blocks, rl->high);
 		rl->rb_user_max = max;
@@ -158,6 +252,13 @@ void pblk_rl_free_lines_dec(struct pblk_rl *rl, struct pblk_line *line)
 
 	atomic_sub(blk_in_line, &rl->free_blocks);
 //	printk("JJY: free_dec %d\n", rl->free_blocks);
+#ifdef PBLK_RL_PID
+	if (line->pstream < rl->pblk->nr_rwb)
+		atomic_add(blk_in_line,
+			&rl->pblk->rb_ctx[line->pstream].rb_rl.rb_taken);
+	if (READ_ONCE(rl->pid_on))
+		pblk_rl_update_rates(rl, rl->rb_budget);
+#endif
 }
 
 // JJY: TODO: rl
@@ -176,6 +277,11 @@ void pblk_gc_should_kick(struct pblk *pblk)
 
 int pblk_rl_high_thrs(struct pblk_rl *rl)
 {
+#ifdef PBLK_RL_PID
+	/* GC runs across the whole controlled band */
+	if (READ_ONCE(rl->pid_on))
+		return rl->setpoint;
+#endif
 	return rl->high;
 }
 
@@ -207,6 +313,67 @@ void pblk_rl_free(struct pblk_rl_per_rb *rb_rl)
 	del_timer(&rb_rl->u_timer);
 }
 
+#ifdef PBLK_RL_PID
+/* Switch between the controller and the threshold limiter */
+void pblk_rl_pid_set(struct pblk_rl *rl, int on)
+{
+	struct pblk *pblk = rl->pblk;
+	int i;
+
+	spin_lock(&rl->pid_lock);
+	rl->pid_steps = 0;
+	rl->pid_slope = 0;
+	rl->pid_integral = 0;
+	rl->pid_out = PBLK_RL_ONE;
+	rl->pid_stamp = jiffies - msecs_to_jiffies(PBLK_RL_PID_MS);
+	for (i = 0; i < pblk->nr_rwb; i++) {
+		struct pblk_rl_per_rb *rb_rl = &pblk->rb_ctx[i].rb_rl;
+
+		WRITE_ONCE(rb_rl->rb_user_max, rl->rb_budget);
+		WRITE_ONCE(rb_rl->rb_gc_max, 0);
+		rb_rl->rb_load = 0;
+	}
+	/* latency is compared per limiter */
+	for (i = 0; i < PBLK_RL_LAT_BUCKETS; i++)
+		atomic_long_set(&rl->lat_hist[i], 0);
+	WRITE_ONCE(rl->pid_on, on);
+	spin_unlock(&rl->pid_lock);
+
+	pblk_gc_should_kick(pblk);
+}
+
+/* Bucket b holds latencies in [2^(b-1), 2^b) us */
+void pblk_rl_lat_add(struct pblk_rl *rl, s64 us)
+{
+	int b = (us > 0) ? fls64(us) : 0;
+
+	if (b >= PBLK_RL_LAT_BUCKETS)
+		b = PBLK_RL_LAT_BUCKETS - 1;
+	atomic_long_inc(&rl->lat_hist[b]);
+}
+
+/* Upper bound in us of the given latency percentile (in permille) */
+unsigned long pblk_rl_lat_pct(struct pblk_rl *rl, int permille)
+{
+	unsigned long total = 0, sum = 0, want;
+	int b;
+
+	for (b = 0; b < PBLK_RL_LAT_BUCKETS; b++)
+		total += atomic_long_read(&rl->lat_hist[b]);
+	if (!total)
+		return 0;
+
+	want = div_u64((u64)total * permille + 999, 1000);
+	for (b = 0; b < PBLK_RL_LAT_BUCKETS; b++) {
+		sum += atomic_long_read(&rl->lat_hist[b]);
+		if (sum >= want)
+			break;
+	}
+
+	return 1UL << min(b, PBLK_RL_LAT_BUCKETS - 1);
+}
+#endif
+
 void pblk_rl_init(struct pblk *pblk, struct pblk_rl *rl, int budget)
 {
 	struct pblk_line_meta *lm = &pblk->lm;
@@ -243,6 +410,24 @@ void pblk_rl_init(struct pblk *pblk, struct pblk_rl *rl, int budget)
 	rl->rb_gc_max = 0;
 	rl->rb_state = PBLK_RL_HIGH;
 
+#ifdef PBLK_RL_PID
+	spin_lock_init(&rl->pid_lock);
+	rl->kp = PBLK_RL_ONE / 4;
+	rl->ki = PBLK_RL_ONE / 64;
+	rl->kd = PBLK_RL_ONE / 2;
+	rl->setpoint = max_t(unsigned int, rl->high, rl->rsv_blocks) +
+				lm->blk_per_line * PBLK_RL_PID_LINES;
+	rl->pid_free = 0;
+	rl->pid_steps = 0;
+	rl->pid_slope = 0;
+	rl->pid_integral = 0;
+	rl->pid_out = PBLK_RL_ONE;
+	rl->pid_stamp = jiffies;
+	for (i = 0; i < PBLK_RL_LAT_BUCKETS; i++)
+		atomic_long_set(&rl->lat_hist[i], 0);
+	rl->pid_on = 0;
+#endif
+
 	for (i = 0; i < nr_rwb; i++) {
 		struct pblk_rb_ctx *rb_ctx = &pblk->rb_ctx[i];
 		
@@ -253,6 +438,12 @@ void pblk_rl_init(struct pblk *pblk, struct pblk_rl *rl, int budget)
 		rb_ctx->rb_rl.rb_gc_active = 0;
 
 		atomic_set(&rb_ctx->rb_rl.rb_space, -1);
+#ifdef PBLK_RL_PID
+		rb_ctx->rb_rl.rb_user_max = budget;
+		rb_ctx->rb_rl.rb_gc_max = 0;
+		atomic_set(&rb_ctx->rb_rl.rb_taken, 0);
+		rb_ctx->rb_rl.rb_load = 0;
+#endif
 
 		setup_timer(&rb_ctx->rb_rl.u_timer, pblk_rl_u_timer, (unsigned long)&rb_ctx->rb_rl);
 	}
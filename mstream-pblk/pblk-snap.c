@@ -0,0 +1,968 @@
+/*
+ * pblk-snap.c - L2P snapshot
+ *
+ * The translation map, the per-stream state and the GC lifetime history
+ * are dumped to one of two slots of reserved lines, on clean shutdown and
+ * every PBLK_SNAP_INTERVAL seconds. The header is written last, alone in
+ * the last page, so recovery only trusts a slot whose header checks out.
+ * Each slot line starts with an smeta tagged PBLK_FEAT_SNAP_SLOT that
+ * records its place in the slots, so the next mount finds the same lines.
+ *
+ * Payload, in order: seq_nr of every line closed when the snapshot was
+ * taken (PBLK_SNAP_NOSEQ otherwise), per-stream records, the lifetime
+ * history, the stream of each lseg, the per-sector stream map and the
+ * device address of every sector.
+ */
+
+#include "pblk.h"
+
+#ifdef PBLK_SNAPSHOT
+#define PBLK_SNAP_MAGIC		0x70616e73	/* "snap" */
+#define PBLK_SNAP_NOSEQ		(~0ULL)
+#define PBLK_SNAP_NOSTREAM	(0xff)
+#define PBLK_SNAP_BLANK		(-1)	/* no smeta of this instance */
+#define PBLK_SNAP_DATA		(-2)	/* data line of this instance */
+
+struct pblk_snap_hdr {
+	__le32 magic;
+	__le32 crc;		/* of the header past this field */
+	__u8 uuid[16];
+	__le64 snap_nr;
+	__le64 d_seq_nr;
+	__le64 nr_secs;
+	__le64 payload_len;
+	__le32 payload_crc;
+	__le32 nr_lines;
+	__le32 nr_lstream;
+	__le32 rsvd;
+};
+
+struct pblk_snap_stream {
+	__le32 map_type;
+	__le32 map_size;
+	__le32 expect_lifetime;
+};
+
+static u32 pblk_snap_hdr_crc(struct pblk_snap_hdr *hdr)
+{
+	u32 crc = ~(u32)0;
+
+	crc = crc32_le(crc, (unsigned char *)hdr + 2 * sizeof(__le32),
+				sizeof(struct pblk_snap_hdr) - 2 * sizeof(__le32));
+
+	return crc;
+}
+
+static size_t pblk_snap_len(struct pblk *pblk, sector_t nr_secs,
+				unsigned long nr_seg, int nr_lstream)
+{
+	size_t len;
+
+	len = pblk->l_mg.nr_lines * sizeof(__le64);
+	len += nr_lstream * sizeof(struct pblk_snap_stream);
+#ifdef PBLK_GC_STREAM
+	len += sizeof(__le32) + MAX_HISTORY * sizeof(struct kmeans_history);
+#endif
+	len += nr_seg;
+#ifdef EXT4_TEST
+	len += (nr_secs + 1) >> 1;
+#endif
+	len += nr_secs * sizeof(__le64);
+
+	return len;
+}
+
+/* payload pages plus the header page, in whole write units */
+static unsigned long pblk_snap_pages(struct pblk *pblk, size_t len)
+{
+	unsigned long nr_pages = DIV_ROUND_UP(len, PBLK_EXPOSED_PAGE_SIZE) + 1;
+
+	return round_up(nr_pages, pblk->min_write_pgs);
+}
+
+/* snapshot pages per slot line, past its tag smeta */
+static inline unsigned long pblk_snap_line_pages(struct pblk *pblk)
+{
+	return pblk->lm.sec_per_line - pblk->lm.smeta_sec;
+}
+
+/*
+ * Read the smeta of every line. @kind gets the slot index of each slot
+ * line, PBLK_SNAP_DATA for data lines and PBLK_SNAP_BLANK otherwise, for
+ * the instance of the first valid smeta as in pblk_recov_l2p. Returns 0 if
+ * that instance was formatted without snapshots: its tail lines may hold
+ * data and the device would shrink.
+ */
+static int pblk_snap_probe(struct pblk *pblk, int *kind)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_line_meta *lm = &pblk->lm;
+	struct pblk_smeta *smeta;
+	struct line_smeta *smeta_buf;
+	u8 uuid[16];
+	int meta_line, i, valid_uuid = 0, ret = 1;
+
+	spin_lock(&l_mg->free_lock);
+	meta_line = find_first_zero_bit(&l_mg->meta_bitmap, PBLK_DATA_LINES);
+	set_bit(meta_line, &l_mg->meta_bitmap);
+	smeta = l_mg->sline_meta[meta_line];
+	smeta_buf = (struct line_smeta *)smeta;
+	spin_unlock(&l_mg->free_lock);
+
+	for (i = 0; i < l_mg->nr_lines; i++) {
+		struct pblk_line *line = &pblk->lines[i];
+		u32 feat;
+		int found;
+
+		kind[i] = PBLK_SNAP_BLANK;
+
+		memset(smeta, 0, lm->smeta_len);
+		line->smeta = smeta;
+		found = !pblk_line_read_smeta(pblk, line) &&
+			le32_to_cpu(smeta_buf->crc) ==
+				pblk_calc_smeta_crc(pblk, smeta_buf) &&
+			le32_to_cpu(smeta_buf->header.identifier) == PBLK_MAGIC;
+		line->smeta = NULL;
+		if (!found)
+			continue;
+
+		feat = le32_to_cpu(smeta_buf->feat);
+		if (!valid_uuid) {
+			memcpy(uuid, smeta_buf->header.uuid, 16);
+			ret = !!(feat & PBLK_FEAT_SNAP);
+			valid_uuid = 1;
+		}
+		if (memcmp(uuid, smeta_buf->header.uuid, 16))
+			continue;
+
+		if (feat & PBLK_FEAT_SNAP_SLOT)
+			kind[i] = (int)le64_to_cpu(smeta_buf->seq_nr);
+		else
+			kind[i] = PBLK_SNAP_DATA;
+	}
+
+	spin_lock(&l_mg->free_lock);
+	clear_bit(meta_line, &l_mg->meta_bitmap);
+	spin_unlock(&l_mg->free_lock);
+
+	return ret;
+}
+
+/* a free line can hold a slot unless it is bad or holds live data */
+static int pblk_snap_usable(struct pblk *pblk, struct pblk_line *line,
+								int *kind)
+{
+	if (!bitmap_empty(line->blk_bitmap, pblk->lm.blk_per_line))
+		return 0;
+
+	return !kind || kind[line->id] != PBLK_SNAP_DATA;
+}
+
+static void pblk_snap_take(struct pblk *pblk, struct pblk_line *line,
+					int idx, long *nr_free_blks)
+{
+	struct pblk_snap *snap = &pblk->snap;
+
+	list_del_init(&line->list);
+	pblk->l_mg.nr_free_lines--;
+	*nr_free_blks -= pblk->lm.blk_per_line;
+
+	line->type = PBLK_LINETYPE_LOG;
+	line->state = PBLK_LINESTATE_CLOSED;
+	set_bit(line->id, snap->line_bitmap);
+	snap->lines[idx] = line;
+}
+
+/*
+ * Take two slots of lines, sized for the whole device. Called by pblk_init
+ * before provisioning and recovery. Slot lines tagged on media keep their
+ * place; the others come from the end of the free list, never from a data
+ * line of this instance. Every line written afterwards carries
+ * PBLK_FEAT_SNAP in its smeta.
+ */
+int pblk_snap_reserve(struct pblk *pblk, int flags, long *nr_free_blks)
+{
+	struct nvm_tgt_dev *dev = pblk->dev;
+	struct nvm_geo *geo = &dev->geo;
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_snap *snap = &pblk->snap;
+	struct pblk_line *line, *tline;
+	sector_t nr_secs = *nr_free_blks * geo->sec_per_blk;
+	unsigned long nr_pages;
+	int *kind = NULL;
+	int nr_good = 0, n = 0, ret = 0;
+
+	snap->nr_lines = 0;
+
+	/* a factory target ignores whatever an old instance left behind */
+	if (!(flags & NVM_TARGET_FACTORY)) {
+		kind = kmalloc_array(l_mg->nr_lines, sizeof(int), GFP_KERNEL);
+		if (!kind)
+			return -ENOMEM;
+
+		if (!pblk_snap_probe(pblk, kind)) {
+			pr_info("pblk: device formatted without snapshots\n");
+			goto out;
+		}
+	}
+
+	nr_pages = pblk_snap_pages(pblk, pblk_snap_len(pblk, nr_secs,
+				nr_secs / geo->sec_per_blk + 1, MAX_PSTREAM));
+	snap->nr_lines = DIV_ROUND_UP(nr_pages, pblk_snap_line_pages(pblk));
+
+	list_for_each_entry(line, &l_mg->free_list, list)
+		if (pblk_snap_usable(pblk, line, kind))
+			nr_good++;
+
+	if (nr_good < 2 * snap->nr_lines ||
+			l_mg->nr_free_lines - 2 * snap->nr_lines <
+						l_mg->nr_lines / 2) {
+		pr_warn("pblk: no room for snapshots (%d lines), disabled\n",
+							2 * snap->nr_lines);
+		snap->nr_lines = 0;
+		goto out;
+	}
+
+	snap->lines = kcalloc(2 * snap->nr_lines, sizeof(struct pblk_line *),
+								GFP_KERNEL);
+	snap->line_bitmap = kcalloc(BITS_TO_LONGS(l_mg->nr_lines),
+						sizeof(unsigned long), GFP_KERNEL);
+	snap->covered = kcalloc(BITS_TO_LONGS(l_mg->nr_lines),
+						sizeof(unsigned long), GFP_KERNEL);
+	if (!snap->lines || !snap->line_bitmap || !snap->covered) {
+		pblk_snap_release(pblk);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (kind) {
+		list_for_each_entry_safe(line, tline, &l_mg->free_list, list) {
+			int idx = kind[line->id];
+
+			if (idx < 0 || idx >= 2 * snap->nr_lines ||
+					snap->lines[idx] ||
+					!pblk_snap_usable(pblk, line, kind))
+				continue;
+			pblk_snap_take(pblk, line, idx, nr_free_blks);
+		}
+	}
+
+	/* slots that lost their line, or a fresh device */
+	list_for_each_entry_safe_reverse(line, tline, &l_mg->free_list, list) {
+		while (n < 2 * snap->nr_lines && snap->lines[n])
+			n++;
+		if (n == 2 * snap->nr_lines)
+			break;
+		if (!pblk_snap_usable(pblk, line, kind))
+			continue;
+		pblk_snap_take(pblk, line, n, nr_free_blks);
+	}
+
+out:
+	kfree(kind);
+	return ret;
+}
+
+void pblk_snap_release(struct pblk *pblk)
+{
+	struct pblk_snap *snap = &pblk->snap;
+
+	kfree(snap->lines);
+	kfree(snap->line_bitmap);
+	kfree(snap->covered);
+	snap->lines = NULL;
+	snap->line_bitmap = NULL;
+	snap->covered = NULL;
+	snap->nr_lines = 0;
+}
+
+static struct pblk_line *pblk_snap_slot_line(struct pblk *pblk, int slot,
+							unsigned long page)
+{
+	struct pblk_snap *snap = &pblk->snap;
+
+	return snap->lines[slot * snap->nr_lines +
+					page / pblk_snap_line_pages(pblk)];
+}
+
+/* address @nr pages of the current slot from io_page on */
+static void pblk_snap_io_addr(struct pblk *pblk, int nr)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		unsigned long page = snap->io_page + i;
+		struct pblk_line *line = pblk_snap_slot_line(pblk,
+							snap->io_slot, page);
+
+		snap->addr[i] = pblk_gtd_addr(line->id, pblk->lm.smeta_sec +
+					page % pblk_snap_line_pages(pblk));
+	}
+}
+
+static void pblk_snap_io_start(struct pblk *pblk, int slot)
+{
+	struct pblk_snap *snap = &pblk->snap;
+
+	snap->io_slot = slot;
+	snap->io_page = 0;
+	snap->io_off = 0;
+	snap->crc = ~(u32)0;
+}
+
+static int pblk_snap_flush(struct pblk *pblk)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	int nr = DIV_ROUND_UP(snap->io_off, PBLK_EXPOSED_PAGE_SIZE);
+	int ret;
+
+	if (!nr)
+		return 0;
+
+	memset(snap->buf + snap->io_off, 0,
+			nr * PBLK_EXPOSED_PAGE_SIZE - snap->io_off);
+	pblk_snap_io_addr(pblk, nr);
+
+	ret = pblk_map_submit_buf(pblk, snap->buf, snap->addr, NULL, nr, WRITE);
+	snap->io_page += nr;
+	snap->io_off = 0;
+
+	return ret;
+}
+
+/* append @len bytes of @src to the slot, zeroes if @src is NULL */
+static int pblk_snap_put(struct pblk *pblk, const void *src, size_t len)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	size_t batch = (size_t)snap->io_pgs * PBLK_EXPOSED_PAGE_SIZE;
+	const u8 *p = src;
+	int ret;
+
+	while (len) {
+		size_t n = min(len, batch - snap->io_off);
+		void *dst = snap->buf + snap->io_off;
+
+		if (p) {
+			memcpy(dst, p, n);
+			p += n;
+		} else {
+			memset(dst, 0, n);
+		}
+		snap->crc = crc32_le(snap->crc, dst, n);
+		snap->io_off += n;
+		len -= n;
+
+		if (snap->io_off == batch) {
+			ret = pblk_snap_flush(pblk);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int pblk_snap_read(struct pblk *pblk, int slot, unsigned long page,
+							void *dst, int nr)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	int ret;
+
+	snap->io_slot = slot;
+	snap->io_page = page;
+	pblk_snap_io_addr(pblk, nr);
+
+	ret = pblk_map_submit_buf(pblk, snap->buf, snap->addr, NULL, nr, READ);
+	if (!ret)
+		memcpy(dst, snap->buf, nr * PBLK_EXPOSED_PAGE_SIZE);
+
+	return ret;
+}
+
+/* write the smeta that tags @line as line @idx of the snapshot slots */
+static int pblk_snap_tag(struct pblk *pblk, struct pblk_line *line, int idx)
+{
+	struct nvm_tgt_dev *dev = pblk->dev;
+	struct pblk_line_meta *lm = &pblk->lm;
+	struct pblk_snap *snap = &pblk->snap;
+	struct line_smeta *smeta_buf = snap->tag;
+	int i;
+
+	memset(smeta_buf, 0, lm->smeta_sec * PBLK_EXPOSED_PAGE_SIZE);
+
+	smeta_buf->header.identifier = cpu_to_le32(PBLK_MAGIC);
+	memcpy(smeta_buf->header.uuid, pblk->instance_uuid, 16);
+	smeta_buf->header.id = cpu_to_le32(line->id);
+	smeta_buf->header.type = cpu_to_le16(PBLK_LINETYPE_LOG);
+	smeta_buf->header.version = cpu_to_le16(1);
+	smeta_buf->header.crc = cpu_to_le32(
+			pblk_calc_meta_header_crc(pblk, &smeta_buf->header));
+
+	smeta_buf->prev_id = cpu_to_le32(PBLK_LINE_EMPTY);
+	smeta_buf->seq_nr = cpu_to_le64(idx);
+	smeta_buf->window_wr_lun = cpu_to_le32(dev->geo.nr_luns);
+	smeta_buf->feat = cpu_to_le32(PBLK_FEAT_SNAP | PBLK_FEAT_SNAP_SLOT);
+	smeta_buf->crc = cpu_to_le32(pblk_calc_smeta_crc(pblk, smeta_buf));
+
+	for (i = 0; i < lm->smeta_sec; i++)
+		snap->addr[i] = pblk_gtd_addr(line->id, i);
+
+	return pblk_map_submit_buf(pblk, snap->tag, snap->addr, NULL,
+							lm->smeta_sec, WRITE);
+}
+
+static int pblk_snap_erase(struct pblk *pblk, int slot)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	struct pblk_line_meta *lm = &pblk->lm;
+	int nr_lines = DIV_ROUND_UP(snap->nr_pages, pblk_snap_line_pages(pblk));
+	int i, ret;
+
+	for (i = 0; i < nr_lines; i++) {
+		int idx = slot * snap->nr_lines + i;
+		struct pblk_line *line = snap->lines[idx];
+
+		spin_lock(&line->lock);
+		bitmap_zero(line->erase_bitmap, lm->blk_per_line);
+		atomic_set(&line->left_eblks, lm->blk_per_line);
+		atomic_set(&line->left_seblks, lm->blk_per_line);
+		spin_unlock(&line->lock);
+
+		ret = pblk_line_erase(pblk, line);
+		if (!ret)
+			ret = pblk_snap_tag(pblk, line, idx);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int pblk_snap_put_lines(struct pblk *pblk)
+{
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	int i, ret;
+
+	for (i = 0; i < l_mg->nr_lines; i++) {
+		struct pblk_line *line = &pblk->lines[i];
+		__le64 seq = cpu_to_le64(PBLK_SNAP_NOSEQ);
+
+		spin_lock(&line->lock);
+		if (line->type == PBLK_LINETYPE_DATA &&
+				line->state == PBLK_LINESTATE_CLOSED)
+			seq = cpu_to_le64(line->seq_nr);
+		spin_unlock(&line->lock);
+
+		ret = pblk_snap_put(pblk, &seq, sizeof(seq));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int pblk_snap_put_streams(struct pblk *pblk)
+{
+	int i, ret;
+
+	for (i = 0; i < pblk->nr_lstream; i++) {
+		struct pblk_lstream *log = &pblk->lstream[i];
+		struct pblk_snap_stream rec;
+
+		rec.map_type = cpu_to_le32(log->map_type);
+		rec.map_size = cpu_to_le32(log->map_size);
+		rec.expect_lifetime = cpu_to_le32(log->expect_lifetime);
+
+		ret = pblk_snap_put(pblk, &rec, sizeof(rec));
+		if (ret)
+			return ret;
+	}
+
+#ifdef PBLK_GC_STREAM
+	{
+		__le32 count = cpu_to_le32(pblk->kmeans_count);
+
+		ret = pblk_snap_put(pblk, &count, sizeof(count));
+		if (ret)
+			return ret;
+		ret = pblk_snap_put(pblk, pblk->kmeans_history,
+				MAX_HISTORY * sizeof(struct kmeans_history));
+		if (ret)
+			return ret;
+	}
+#endif
+
+	return 0;
+}
+
+static int pblk_snap_put_map(struct pblk *pblk)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	struct pba_addr *bmap = (struct pba_addr *)pblk->trans_map;
+	unsigned long nr_seg = (pblk->rl.nr_secs >> pblk->ppaf.blk_offset) + 1;
+	int entry_num = 1 << pblk->ppaf.blk_offset;
+	unsigned long lseg;
+	int i, ret;
+
+	for (lseg = 0; lseg < nr_seg; lseg++) {
+		u8 lstream = PBLK_SNAP_NOSTREAM;
+
+		spin_lock(&pblk->trans_lock);
+		if (bmap[lseg].m.map != NONE_MAP)
+			lstream = bmap[lseg].m.lstream;
+		spin_unlock(&pblk->trans_lock);
+
+		ret = pblk_snap_put(pblk, &lstream, sizeof(lstream));
+		if (ret)
+			return ret;
+	}
+
+#ifdef EXT4_TEST
+	ret = pblk_snap_put(pblk, pblk->stream_map, (pblk->rl.nr_secs + 1) >> 1);
+	if (ret)
+		return ret;
+#endif
+
+	for (lseg = 0; lseg < nr_seg; lseg++) {
+		sector_t lba = (sector_t)lseg << pblk->ppaf.blk_offset;
+		int n;
+
+		if (lba >= pblk->rl.nr_secs)
+			break;
+		n = min_t(sector_t, entry_num, pblk->rl.nr_secs - lba);
+
+		/* the walk must not churn the CMT, hence no load */
+		spin_lock(&pblk->trans_lock);
+		for (i = 0; i < n; i++) {
+			struct ppa_addr ppa = __pblk_trans_map_get(pblk,
+								lba + i, 0);
+
+			/* a cached sector keeps the media copy it supersedes;
+			 * the newer copy, once on media, is replayed over it
+			 */
+			if (pblk_addr_in_cache(ppa))
+				ppa = pblk_cache_prev_addr(pblk, ppa);
+			snap->lseg_buf[i] = cpu_to_le64(ppa.ppa);
+		}
+		spin_unlock(&pblk->trans_lock);
+
+		ret = pblk_snap_put(pblk, snap->lseg_buf, n * sizeof(u64));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int pblk_snap_write(struct pblk *pblk)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_snap_hdr hdr;
+	unsigned long start = jiffies;
+	u32 payload_crc;
+	int slot, i, ret;
+
+	if (!snap->nr_pages)
+		return -ENOSPC;
+
+	mutex_lock(&snap->lock);
+	slot = snap->slot ^ 1;
+
+	ret = pblk_snap_erase(pblk, slot);
+	if (ret)
+		goto out;
+
+	memset(&hdr, 0, sizeof(struct pblk_snap_hdr));
+	spin_lock(&l_mg->free_lock);
+	hdr.d_seq_nr = cpu_to_le64(l_mg->d_seq_nr);
+	spin_unlock(&l_mg->free_lock);
+
+	pblk_snap_io_start(pblk, slot);
+
+	ret = pblk_snap_put_lines(pblk);
+	if (ret)
+		goto out;
+
+	/* the writes of every line closed above are complete; map them
+	 * before the walk so a covered line is never only in the ring
+	 */
+	for (i = 0; i < pblk->nr_rwb; i++)
+		pblk_rb_sync_l2p(&pblk->rb_ctx[i].rwb);
+
+	ret = pblk_snap_put_streams(pblk);
+	if (!ret)
+		ret = pblk_snap_put_map(pblk);
+	if (ret)
+		goto out;
+
+	payload_crc = snap->crc;
+
+	ret = pblk_snap_put(pblk, NULL, (snap->nr_pages - 1) *
+			PBLK_EXPOSED_PAGE_SIZE - snap->payload_len);
+	if (ret)
+		goto out;
+
+	hdr.magic = cpu_to_le32(PBLK_SNAP_MAGIC);
+	memcpy(hdr.uuid, pblk->instance_uuid, 16);
+	hdr.snap_nr = cpu_to_le64(snap->snap_nr + 1);
+	hdr.nr_secs = cpu_to_le64(pblk->rl.nr_secs);
+	hdr.payload_len = cpu_to_le64(snap->payload_len);
+	hdr.payload_crc = cpu_to_le32(payload_crc);
+	hdr.nr_lines = cpu_to_le32(l_mg->nr_lines);
+	hdr.nr_lstream = cpu_to_le32(pblk->nr_lstream);
+	hdr.crc = cpu_to_le32(pblk_snap_hdr_crc(&hdr));
+
+	ret = pblk_snap_put(pblk, &hdr, sizeof(struct pblk_snap_hdr));
+	if (!ret)
+		ret = pblk_snap_put(pblk, NULL, PBLK_EXPOSED_PAGE_SIZE -
+						sizeof(struct pblk_snap_hdr));
+	if (!ret)
+		ret = pblk_snap_flush(pblk);
+	if (ret)
+		goto out;
+
+	snap->slot = slot;
+	snap->snap_nr++;
+	snap->write_ms = jiffies_to_msecs(jiffies - start);
+
+out:
+	mutex_unlock(&snap->lock);
+	if (ret)
+		pr_err("pblk: snapshot to slot %d failed (%d)\n", slot, ret);
+
+	return ret;
+}
+
+static void pblk_snap_ws(struct work_struct *work)
+{
+	struct pblk *pblk = container_of(work, struct pblk, snap.ws);
+
+	pblk_snap_write(pblk);
+}
+
+/* queue a periodic snapshot once the interval has passed */
+void pblk_snap_kick(struct pblk *pblk)
+{
+	struct pblk_snap *snap = &pblk->snap;
+
+	if (!snap->wq)
+		return;
+	if (time_before(jiffies, snap->next))
+		return;
+
+	snap->next = jiffies + PBLK_SNAP_INTERVAL * HZ;
+	queue_work(snap->wq, &snap->ws);
+}
+
+static int pblk_snap_read_hdr(struct pblk *pblk, int slot,
+						struct pblk_snap_hdr *hdr)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	struct pblk_snap_hdr *buf = snap->buf;
+
+	snap->io_slot = slot;
+	snap->io_page = snap->nr_pages - 1;
+	pblk_snap_io_addr(pblk, 1);
+
+	if (pblk_map_submit_buf(pblk, snap->buf, snap->addr, NULL, 1, READ))
+		return -EIO;
+
+	if (le32_to_cpu(buf->magic) != PBLK_SNAP_MAGIC ||
+			le32_to_cpu(buf->crc) != pblk_snap_hdr_crc(buf))
+		return -EINVAL;
+
+	if (memcmp(buf->uuid, pblk->instance_uuid, 16) ||
+			le64_to_cpu(buf->nr_secs) != pblk->rl.nr_secs ||
+			le64_to_cpu(buf->payload_len) != snap->payload_len ||
+			le32_to_cpu(buf->nr_lines) != pblk->l_mg.nr_lines ||
+			le32_to_cpu(buf->nr_lstream) != pblk->nr_lstream)
+		return -EINVAL;
+
+	*hdr = *buf;
+
+	return 0;
+}
+
+/*
+ * Mark the lines the snapshot covers: closed when it was taken and found
+ * with the same seq_nr by the smeta scan. Their valid sectors are exactly
+ * the snapshot entries that point to them.
+ */
+static void pblk_snap_cover(struct pblk *pblk, __le64 *seq)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_line_meta *lm = &pblk->lm;
+	int i;
+
+	bitmap_zero(snap->covered, l_mg->nr_lines);
+
+	for (i = 0; i < l_mg->nr_lines; i++) {
+		struct pblk_line *line = &pblk->lines[i];
+
+		if (le64_to_cpu(seq[i]) == PBLK_SNAP_NOSEQ)
+			continue;
+		if (line->state != PBLK_LINESTATE_OPEN ||
+				line->seq_nr != le64_to_cpu(seq[i]))
+			continue;
+
+		set_bit(i, snap->covered);
+
+		spin_lock(&line->lock);
+		bitmap_fill(line->invalid_bitmap, lm->sec_per_line);
+		*line->vsc = cpu_to_le32(0);
+		spin_unlock(&line->lock);
+	}
+}
+
+static void pblk_snap_restore_streams(struct pblk *pblk, u8 **p)
+{
+	struct pblk_snap_stream *rec = (struct pblk_snap_stream *)*p;
+	int i;
+
+	for (i = 0; i < pblk->nr_lstream; i++) {
+		struct pblk_lstream *log = &pblk->lstream[i];
+
+		log->map_type = le32_to_cpu(rec[i].map_type);
+		log->map_size = le32_to_cpu(rec[i].map_size);
+		log->expect_lifetime = le32_to_cpu(rec[i].expect_lifetime);
+	}
+	*p += pblk->nr_lstream * sizeof(struct pblk_snap_stream);
+
+#ifdef PBLK_GC_STREAM
+	pblk->kmeans_count = le32_to_cpu(*(__le32 *)*p);
+	*p += sizeof(__le32);
+	memcpy(pblk->kmeans_history, *p,
+			MAX_HISTORY * sizeof(struct kmeans_history));
+	*p += MAX_HISTORY * sizeof(struct kmeans_history);
+#endif
+}
+
+/* returns the number of sectors restored */
+static unsigned long pblk_snap_restore_map(struct pblk *pblk, u8 **p)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	unsigned long nr_seg = (pblk->rl.nr_secs >> pblk->ppaf.blk_offset) + 1;
+	int entry_num = 1 << pblk->ppaf.blk_offset;
+	u8 *lstream = *p;
+	__le64 *ppa_list;
+	unsigned long lseg, nr_restored = 0;
+	int i;
+
+	for (lseg = 0; lseg < nr_seg; lseg++) {
+		if (lstream[lseg] == PBLK_SNAP_NOSTREAM)
+			continue;
+
+		spin_lock(&pblk->trans_lock);
+		pblk_set_lstream(pblk, (sector_t)lseg << pblk->ppaf.blk_offset,
+								lstream[lseg]);
+		spin_unlock(&pblk->trans_lock);
+	}
+	*p += nr_seg;
+
+#ifdef EXT4_TEST
+	memcpy(pblk->stream_map, *p, (pblk->rl.nr_secs + 1) >> 1);
+	*p += (pblk->rl.nr_secs + 1) >> 1;
+#endif
+
+	ppa_list = (__le64 *)*p;
+	for (lseg = 0; lseg < nr_seg; lseg++) {
+		sector_t lba = (sector_t)lseg << pblk->ppaf.blk_offset;
+		int n;
+
+		if (lba >= pblk->rl.nr_secs)
+			break;
+		n = min_t(sector_t, entry_num, pblk->rl.nr_secs - lba);
+
+		for (i = 0; i < n; i++) {
+			struct pblk_line *line;
+			struct ppa_addr ppa;
+			int line_id;
+
+			ppa.ppa = le64_to_cpu(ppa_list[lba + i]);
+			if (pblk_ppa_empty(ppa))
+				continue;
+
+			/* the line was reused or lost since, it is replayed */
+			line_id = pblk_tgt_ppa_to_line(ppa);
+			if (line_id >= pblk->l_mg.nr_lines ||
+					!test_bit(line_id, snap->covered))
+				continue;
+
+			spin_lock(&pblk->trans_lock);
+			pblk_trans_map_set(pblk, lba + i, ppa);
+			spin_unlock(&pblk->trans_lock);
+
+			line = &pblk->lines[line_id];
+			spin_lock(&line->lock);
+			if (test_and_clear_bit(pblk_dev_ppa_to_line_addr(pblk, ppa),
+							line->invalid_bitmap))
+				le32_add_cpu(line->vsc, 1);
+			spin_unlock(&line->lock);
+
+			nr_restored++;
+		}
+	}
+	*p += pblk->rl.nr_secs * sizeof(__le64);
+
+	return nr_restored;
+}
+
+/*
+ * Load the newest valid snapshot on top of the lines found by the smeta
+ * scan. Called by pblk_recov_l2p before any line is replayed; returns 0 if
+ * a snapshot was applied.
+ */
+int pblk_snap_load(struct pblk *pblk)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	struct pblk_line_mgmt *l_mg = &pblk->l_mg;
+	struct pblk_snap_hdr hdr, cur;
+	unsigned long start = jiffies;
+	unsigned long nr_data, page, nr_restored;
+	u8 *data, *p;
+	int slot = -1;
+	int i, ret;
+
+	if (!snap->nr_pages)
+		return -ENOENT;
+
+	memset(&hdr, 0, sizeof(struct pblk_snap_hdr));
+	for (i = 0; i < 2; i++) {
+		if (pblk_snap_read_hdr(pblk, i, &cur))
+			continue;
+		if (slot < 0 || le64_to_cpu(cur.snap_nr) >
+						le64_to_cpu(hdr.snap_nr)) {
+			hdr = cur;
+			slot = i;
+		}
+	}
+	if (slot < 0)
+		return -ENOENT;
+
+	nr_data = snap->nr_pages - 1;
+	data = vmalloc(nr_data * PBLK_EXPOSED_PAGE_SIZE);
+	if (!data)
+		return -ENOMEM;
+
+	for (page = 0; page < nr_data; page += snap->io_pgs) {
+		int nr = min_t(unsigned long, snap->io_pgs, nr_data - page);
+
+		ret = pblk_snap_read(pblk, slot, page,
+				data + page * PBLK_EXPOSED_PAGE_SIZE, nr);
+		if (ret)
+			goto out;
+	}
+
+	if (crc32_le(~(u32)0, data, snap->payload_len) !=
+					le32_to_cpu(hdr.payload_crc)) {
+		pr_err("pblk: snapshot %llu in slot %d is corrupted\n",
+					le64_to_cpu(hdr.snap_nr), slot);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	p = data;
+	pblk_snap_cover(pblk, (__le64 *)p);
+	p += l_mg->nr_lines * sizeof(__le64);
+
+	pblk_snap_restore_streams(pblk, &p);
+	nr_restored = pblk_snap_restore_map(pblk, &p);
+
+	spin_lock(&l_mg->free_lock);
+	if (le64_to_cpu(hdr.d_seq_nr) > l_mg->d_seq_nr)
+		l_mg->d_seq_nr = le64_to_cpu(hdr.d_seq_nr);
+	spin_unlock(&l_mg->free_lock);
+
+	snap->slot = slot;
+	snap->snap_nr = le64_to_cpu(hdr.snap_nr);
+	snap->loaded = 1;
+	snap->load_ms = jiffies_to_msecs(jiffies - start);
+
+	pr_info("pblk: snapshot %llu loaded: %d lines, %lu sectors, %u ms\n",
+			snap->snap_nr, bitmap_weight(snap->covered,
+			l_mg->nr_lines), nr_restored, snap->load_ms);
+	ret = 0;
+
+out:
+	vfree(data);
+	return ret;
+}
+
+int pblk_snap_init(struct pblk *pblk)
+{
+	struct pblk_snap *snap = &pblk->snap;
+	struct pblk_line_meta *lm = &pblk->lm;
+	unsigned long nr_seg = (pblk->rl.nr_secs >> pblk->ppaf.blk_offset) + 1;
+	int entry_num = 1 << pblk->ppaf.blk_offset;
+
+	mutex_init(&snap->lock);
+	INIT_WORK(&snap->ws, pblk_snap_ws);
+	snap->next = jiffies + PBLK_SNAP_INTERVAL * HZ;
+	snap->slot = 1;		/* the first snapshot goes to slot 0 */
+	snap->snap_nr = 0;
+	snap->loaded = 0;
+	snap->write_ms = 0;
+	snap->load_ms = 0;
+	snap->nr_pages = 0;
+
+	if (!snap->nr_lines)
+		return 0;
+
+	snap->payload_len = pblk_snap_len(pblk, pblk->rl.nr_secs, nr_seg,
+							pblk->nr_lstream);
+	if (pblk_snap_pages(pblk, snap->payload_len) >
+			snap->nr_lines * pblk_snap_line_pages(pblk)) {
+		pr_err("pblk: snapshot does not fit its lines, disabled\n");
+		return 0;
+	}
+
+	snap->io_pgs = rounddown(pblk->max_write_pgs, pblk->min_write_pgs);
+	snap->buf = kmalloc(snap->io_pgs * PBLK_EXPOSED_PAGE_SIZE, GFP_KERNEL);
+	snap->addr = kmalloc_array(max_t(int, snap->io_pgs, lm->smeta_sec),
+						sizeof(u64), GFP_KERNEL);
+	snap->tag = kmalloc(lm->smeta_sec * PBLK_EXPOSED_PAGE_SIZE, GFP_KERNEL);
+	snap->lseg_buf = vmalloc(entry_num * sizeof(u64));
+	if (!snap->buf || !snap->addr || !snap->tag || !snap->lseg_buf)
+		goto fail;
+
+	snap->wq = alloc_workqueue("pblk-snap-wq",
+			WQ_MEM_RECLAIM | WQ_UNBOUND, 1);
+	if (!snap->wq)
+		goto fail;
+
+	snap->nr_pages = pblk_snap_pages(pblk, snap->payload_len);
+
+	printk("snapshot: %d lines per slot, %lu pages\n",
+					snap->nr_lines, snap->nr_pages);
+	return 0;
+
+fail:
+	pblk_snap_exit(pblk);
+	return -ENOMEM;
+}
+
+/* safe to call twice */
+void pblk_snap_exit(struct pblk *pblk)
+{
+	struct pblk_snap *snap = &pblk->snap;
+
+	if (snap->wq) {
+		destroy_workqueue(snap->wq);
+		snap->wq = NULL;
+	}
+
+	kfree(snap->buf);
+	kfree(snap->addr);
+	kfree(snap->tag);
+	vfree(snap->lseg_buf);
+	snap->buf = NULL;
+	snap->addr = NULL;
+	snap->tag = NULL;
+	snap->lseg_buf = NULL;
+	snap->nr_pages = 0;
+}
+
+#endif
@@ -84,8 +84,16 @@ static ssize_t pblk_sysfs_gc_state_show(struct pblk *pblk, char *page)
 	int gc_enabled, gc_active;
 
 	pblk_gc_sysfs_state_show(pblk, &gc_enabled, &gc_active);
+#ifdef PBLK_GC_PARALLEL
+	return snprintf(page, PAGE_SIZE,
+			"gc_enabled=%d, gc_active=%d, gc_read_secs=%lu, user_stall_us=%lu\n",
+			gc_enabled, gc_active,
+			atomic_long_read(&pblk->gc.read_secs),
+			atomic_long_read(&pblk->gc.stall_us));
+#else
 	return snprintf(page, PAGE_SIZE, "gc_enabled=%d, gc_active=%d\n",
 					gc_enabled, gc_active);
+#endif
 }
 
 static ssize_t pblk_sysfs_stats(struct pblk *pblk, char *page)
@@ -313,6 +321,9 @@ static ssize_t pblk_sysfs_stats_debug(struct pblk *pblk, char *page)
 	struct pblk_lstream *lstream;
 	int nr_seg = (pblk->rl.nr_secs >> pblk->ppaf.blk_offset) + 1;
 	long gc_write = 0;
+#ifdef PBLK_GC_PREINVALID
+	unsigned long victim_vsc = 0, victim_pi = 0;
+#endif
 
 	for (i = 0; i < NR_STREAM; i++) {
 		stream_count[i] = 0;
@@ -375,6 +386,32 @@ static ssize_t pblk_sysfs_stats_debug(struct pblk *pblk, char *page)
 		gc_write += atomic_long_read(&pblk->recov_gc_writes[i]);
 	}
 
+	sz += snprintf(page + sz, PAGE_SIZE - sz,
+				"[PREINVALID] bio sector\n%lu\t%lu\n",
+			atomic_long_read(&pblk->nr_preinvalid_bio),
+			atomic_long_read(&pblk->nr_preinvalid_blk));
+
+#ifdef PBLK_GC_PREINVALID
+	/*
+	 * Victims are picked by valid minus hinted sectors: vsc and hinted
+	 * are read at selection, copied is what GC then wrote
+	 */
+	sz += snprintf(page + sz, PAGE_SIZE - sz,
+				"[PREINVALID GC] vsc hinted copied\n");
+	for (i = 0; i < pblk->nr_rwb; i++) {
+		sz += snprintf(page + sz, PAGE_SIZE - sz,
+				"%d\t%lu\t%lu\t%lu\n", i,
+				atomic_long_read(&pblk->gc_victim_vsc[i]),
+				atomic_long_read(&pblk->gc_victim_pi[i]),
+				atomic_long_read(&pblk->recov_gc_writes[i]));
+		victim_vsc += atomic_long_read(&pblk->gc_victim_vsc[i]);
+		victim_pi += atomic_long_read(&pblk->gc_victim_pi[i]);
+	}
+	sz += snprintf(page + sz, PAGE_SIZE - sz,
+				"total\t%lu\t%lu\t%ld\n",
+				victim_vsc, victim_pi, gc_write);
+#endif
+
 	sz += snprintf(page + sz, PAGE_SIZE - sz,
 				"\n\n\n\n\n[MAP] define BMT SMT PMT plog blog\n");
 
@@ -388,12 +425,32 @@ static ssize_t pblk_sysfs_stats_debug(struct pblk *pblk, char *page)
 		atomic_long_read(&pblk->nr_blocklog));
 
 	sz += snprintf(page + sz, PAGE_SIZE - sz,
-				"\n[MAP] mapwrite mapread\n");
+				"\n[MAP] mapwrite mapread cmthit\n");
 
 	sz += snprintf(page + sz, PAGE_SIZE - sz,
-		"%lu\t%lu\n",
+		"%lu\t%lu\t%lu\n",
 		atomic_long_read(&pblk->nr_mapwrite), 
-		atomic_long_read(&pblk->nr_mapread));
+		atomic_long_read(&pblk->nr_mapread),
+		atomic_long_read(&pblk->nr_cmt_hit));
+
+	{
+		unsigned long host_io = atomic_long_read(&pblk->nr_host_io);
+		unsigned long rd_io = atomic_long_read(&pblk->nr_map_rd_io);
+		unsigned long wr_io = atomic_long_read(&pblk->nr_map_wr_io);
+		unsigned long gc_io = atomic_long_read(&pblk->nr_map_gc_io);
+
+		/* per-mille of translation pages per host request */
+		sz += snprintf(page + sz, PAGE_SIZE - sz,
+			"\n[MAPIO] tp_read tp_write tp_gc tp_pad maplines host_io rd/host wr/host\n");
+
+		sz += snprintf(page + sz, PAGE_SIZE - sz,
+			"%lu\t%lu\t%lu\t%lu\t%d\t%lu\t%lu\t%lu\n",
+			rd_io, wr_io, gc_io,
+			atomic_long_read(&pblk->nr_map_pad),
+			pblk->cmt_mgt.nr_map_lines, host_io,
+			host_io ? rd_io * 1000 / host_io : 0,
+			host_io ? (wr_io + gc_io) * 1000 / host_io : 0);
+	}
 
 	sz += snprintf(page + sz, PAGE_SIZE - sz,
 				"\n[ETC] if_writes if_reads nrflush paddedwrite paddedwb sync_write recov_write recov_gc_reads cache_reads sync_reads\n");
@@ -476,6 +533,247 @@ static ssize_t pblk_sysfs_set_sec_per_write(struct pblk *pblk,
 	return len;
 }
 
+#ifdef PBLK_MAP_ADAPT
+static ssize_t pblk_sysfs_map_adapt_show(struct pblk *pblk, char *page)
+{
+	struct pba_addr *bmap = (struct pba_addr *)pblk->trans_map;
+	unsigned long nr_seg = (pblk->rl.nr_secs >> pblk->ppaf.blk_offset) + 1;
+	unsigned long nr_sector = 0, nr_page = 0;
+	unsigned long i;
+
+	for (i = 0; i < nr_seg; i++) {
+		if (bmap[i].m.map == SECTOR_MAP)
+			nr_sector++;
+		else if (bmap[i].m.map == PAGE_MAP)
+			nr_page++;
+	}
+
+	return snprintf(page, PAGE_SIZE,
+		"enable promote demote sector_lsegs page_lsegs map_bytes\n"
+		"%d\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+		pblk->map_adapt,
+		atomic_long_read(&pblk->nr_map_promote),
+		atomic_long_read(&pblk->nr_map_demote),
+		nr_sector, nr_page, pblk->map_bytes);
+}
+
+static ssize_t pblk_sysfs_map_adapt_store(struct pblk *pblk,
+					  const char *page, size_t len)
+{
+	size_t c_len;
+	int enable;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &enable))
+		return -EINVAL;
+
+	if (enable > 1)
+		return -EINVAL;
+
+	pblk->map_adapt = enable;
+
+	return len;
+}
+#endif
+
+#ifdef CONFIG_PBLK_DFTL
+static ssize_t pblk_sysfs_cmt_sync_show(struct pblk *pblk, char *page)
+{
+	struct pblk_cmt_mgt *cm = &pblk->cmt_mgt;
+
+	return snprintf(page, PAGE_SIZE,
+		"enable waits wait_us\n%d\t%lu\t%llu\n",
+		cm->sync_miss,
+		atomic_long_read(&cm->nr_miss_wait),
+		(u64)atomic64_read(&cm->miss_wait_ns) / NSEC_PER_USEC);
+}
+
+static ssize_t pblk_sysfs_cmt_sync_store(struct pblk *pblk,
+					 const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int enable;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &enable))
+		return -EINVAL;
+
+	if (enable > 1)
+		return -EINVAL;
+
+	pblk->cmt_mgt.sync_miss = enable;
+
+	return len;
+}
+#endif
+
+#ifdef PBLK_WRITE_HINT
+static ssize_t pblk_sysfs_write_hints_show(struct pblk *pblk, char *page)
+{
+	ssize_t sz;
+	int i;
+
+	sz = snprintf(page, PAGE_SIZE, "hint lstream writes stream_gc\n");
+	for (i = 0; i < PBLK_NR_HINTS; i++) {
+		int lstream = READ_ONCE(pblk->hint_lstream[i]);
+
+		if (lstream == PBLK_HINT_NONE)
+			sz += snprintf(page + sz, PAGE_SIZE - sz,
+				"%d\t-\t%lu\t-\n", i,
+				atomic_long_read(&pblk->hint_writes[i]));
+		else
+			sz += snprintf(page + sz, PAGE_SIZE - sz,
+				"%d\t%d\t%lu\t%lu\n", i, lstream,
+				atomic_long_read(&pblk->hint_writes[i]),
+				atomic_long_read(&pblk->stream_gc[lstream]));
+	}
+
+	return sz;
+}
+
+/* "<hint> <lstream>" maps a hint, a negative lstream unmaps it */
+static ssize_t pblk_sysfs_write_hints_store(struct pblk *pblk,
+					    const char *page, size_t len)
+{
+	size_t c_len;
+	unsigned int hint;
+	int lstream;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (sscanf(page, "%u %d", &hint, &lstream) != 2)
+		return -EINVAL;
+
+	if (hint >= PBLK_NR_HINTS)
+		return -EINVAL;
+
+	if (lstream < 0)
+		lstream = PBLK_HINT_NONE;
+	else if (lstream >= pblk->nr_lstream || lstream >= pblk->nr_rwb)
+		return -EINVAL;
+
+	WRITE_ONCE(pblk->hint_lstream[hint], lstream);
+
+	return len;
+}
+#endif
+
+#ifdef PBLK_SNAPSHOT
+static ssize_t pblk_sysfs_snapshot_show(struct pblk *pblk, char *page)
+{
+	struct pblk_snap *snap = &pblk->snap;
+
+	return snprintf(page, PAGE_SIZE,
+		"snap_nr slot lines pages loaded write_ms load_ms\n"
+		"%llu\t%d\t%d\t%lu\t%d\t%u\t%u\n",
+		snap->snap_nr, snap->slot, snap->nr_lines, snap->nr_pages,
+		snap->loaded, snap->write_ms, snap->load_ms);
+}
+
+/* writing 1 takes a snapshot and returns when it is on the media */
+static ssize_t pblk_sysfs_snapshot_store(struct pblk *pblk,
+					 const char *page, size_t len)
+{
+	size_t c_len;
+	int force;
+	int ret;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (kstrtouint(page, 0, &force))
+		return -EINVAL;
+
+	if (force != 1)
+		return -EINVAL;
+
+	ret = pblk_snap_write(pblk);
+	if (ret)
+		return ret;
+
+	return len;
+}
+#endif
+
+#ifdef PBLK_RL_PID
+static ssize_t pblk_sysfs_rate_pid_show(struct pblk *pblk, char *page)
+{
+	struct pblk_rl *rl = &pblk->rl;
+	ssize_t sz;
+	int i;
+
+	sz = snprintf(page, PAGE_SIZE,
+		"on kp ki kd setpoint rsv free\n%d\t%d\t%d\t%d\t%u\t%d\t%lu\n",
+			READ_ONCE(rl->pid_on), rl->kp, rl->ki, rl->kd,
+			rl->setpoint, rl->rsv_blocks,
+			pblk_rl_nr_free_blks(rl));
+	sz += snprintf(page + sz, PAGE_SIZE - sz,
+		"steps slope integral out\n%lu\t%ld\t%ld\t%d\n",
+			rl->pid_steps, rl->pid_slope, rl->pid_integral,
+			rl->pid_out);
+
+	sz += snprintf(page + sz, PAGE_SIZE - sz,
+				"stream user_max gc_max load\n");
+	for (i = 0; i < pblk->nr_rwb; i++) {
+		struct pblk_rl_per_rb *rb_rl = &pblk->rb_ctx[i].rb_rl;
+
+		sz += snprintf(page + sz, PAGE_SIZE - sz, "%d\t%d\t%d\t%u\n",
+				i, pblk_rl_user_max(rl, rb_rl),
+				pblk_rl_gc_max(rl, rb_rl), rb_rl->rb_load);
+	}
+
+	/* bucket upper bounds, reset when the limiter is switched */
+	sz += snprintf(page + sz, PAGE_SIZE - sz,
+				"lat_us p50 p99 p999\n%lu\t%lu\t%lu\n",
+			pblk_rl_lat_pct(rl, 500),
+			pblk_rl_lat_pct(rl, 990),
+			pblk_rl_lat_pct(rl, 999));
+
+	return sz;
+}
+
+/* "<on|kp|ki|kd|setpoint> <value>", switching "on" resets the history */
+static ssize_t pblk_sysfs_rate_pid_store(struct pblk *pblk,
+					 const char *page, size_t len)
+{
+	struct pblk_rl *rl = &pblk->rl;
+	char key[16];
+	size_t c_len;
+	int val;
+
+	c_len = strcspn(page, "\n");
+	if (c_len >= len)
+		return -EINVAL;
+
+	if (sscanf(page, "%15s %d", key, &val) != 2 || val < 0)
+		return -EINVAL;
+
+	if (strcmp(key, "on") == 0)
+		pblk_rl_pid_set(rl, !!val);
+	else if (strcmp(key, "kp") == 0)
+		WRITE_ONCE(rl->kp, val);
+	else if (strcmp(key, "ki") == 0)
+		WRITE_ONCE(rl->ki, val);
+	else if (strcmp(key, "kd") == 0)
+		WRITE_ONCE(rl->kd, val);
+	else if (strcmp(key, "setpoint") == 0 && val > rl->rsv_blocks)
+		WRITE_ONCE(rl->setpoint, val);
+	else
+		return -EINVAL;
+
+	return len;
+}
+#endif
+
 static struct attribute sys_write_luns = {
 	.name = "write_luns",
 	.mode = 0444,
@@ -526,6 +824,41 @@ static struct attribute sys_max_sec_per_write = {
 	.mode = 0644,
 };
 
+#ifdef PBLK_MAP_ADAPT
+static struct attribute sys_map_adapt = {
+	.name = "map_adapt",
+	.mode = 0644,
+};
+#endif
+
+#ifdef CONFIG_PBLK_DFTL
+static struct attribute sys_cmt_sync = {
+	.name = "cmt_sync",
+	.mode = 0644,
+};
+#endif
+
+#ifdef PBLK_WRITE_HINT
+static struct attribute sys_write_hints = {
+	.name = "write_hints",
+	.mode = 0644,
+};
+#endif
+
+#ifdef PBLK_SNAPSHOT
+static struct attribute sys_snapshot = {
+	.name = "snapshot",
+	.mode = 0644,
+};
+#endif
+
+#ifdef PBLK_RL_PID
+static struct attribute sys_rate_pid = {
+	.name = "rate_pid",
+	.mode = 0644,
+};
+#endif
+
 #ifdef CONFIG_NVM_DEBUG
 static struct attribute sys_stats_debug_attr = {
 	.name = "stats",
@@ -544,6 +877,21 @@ static struct attribute *pblk_attrs[] = {
 	&sys_stats_ppaf_attr,
 	&sys_lines_attr,
 	&sys_lines_info_attr,
+#ifdef PBLK_MAP_ADAPT
+	&sys_map_adapt,
+#endif
+#ifdef CONFIG_PBLK_DFTL
+	&sys_cmt_sync,
+#endif
+#ifdef PBLK_WRITE_HINT
+	&sys_write_hints,
+#endif
+#ifdef PBLK_SNAPSHOT
+	&sys_snapshot,
+#endif
+#ifdef PBLK_RL_PID
+	&sys_rate_pid,
+#endif
 #ifdef CONFIG_NVM_DEBUG
 	&sys_stats_debug_attr,
 #endif
@@ -573,6 +921,26 @@ static ssize_t pblk_sysfs_show(struct kobject *kobj, struct attribute *attr,
 		return pblk_sysfs_lines_info(pblk, buf);
 	else if (strcmp(attr->name, "max_sec_per_write") == 0)
 		return pblk_sysfs_get_sec_per_write(pblk, buf);
+#ifdef PBLK_MAP_ADAPT
+	else if (strcmp(attr->name, "map_adapt") == 0)
+		return pblk_sysfs_map_adapt_show(pblk, buf);
+#endif
+#ifdef CONFIG_PBLK_DFTL
+	else if (strcmp(attr->name, "cmt_sync") == 0)
+		return pblk_sysfs_cmt_sync_show(pblk, buf);
+#endif
+#ifdef PBLK_WRITE_HINT
+	else if (strcmp(attr->name, "write_hints") == 0)
+		return pblk_sysfs_write_hints_show(pblk, buf);
+#endif
+#ifdef PBLK_SNAPSHOT
+	else if (strcmp(attr->name, "snapshot") == 0)
+		return pblk_sysfs_snapshot_show(pblk, buf);
+#endif
+#ifdef PBLK_RL_PID
+	else if (strcmp(attr->name, "rate_pid") == 0)
+		return pblk_sysfs_rate_pid_show(pblk, buf);
+#endif
 #ifdef CONFIG_NVM_DEBUG
 	else if (strcmp(attr->name, "stats") == 0)
 		return pblk_sysfs_stats_debug(pblk, buf);
@@ -589,6 +957,26 @@ static ssize_t pblk_sysfs_store(struct kobject *kobj, struct attribute *attr,
 		return pblk_sysfs_gc_force(pblk, buf, len);
 	else if (strcmp(attr->name, "max_sec_per_write") == 0)
 		return pblk_sysfs_set_sec_per_write(pblk, buf, len);
+#ifdef PBLK_MAP_ADAPT
+	else if (strcmp(attr->name, "map_adapt") == 0)
+		return pblk_sysfs_map_adapt_store(pblk, buf, len);
+#endif
+#ifdef CONFIG_PBLK_DFTL
+	else if (strcmp(attr->name, "cmt_sync") == 0)
+		return pblk_sysfs_cmt_sync_store(pblk, buf, len);
+#endif
+#ifdef PBLK_WRITE_HINT
+	else if (strcmp(attr->name, "write_hints") == 0)
+		return pblk_sysfs_write_hints_store(pblk, buf, len);
+#endif
+#ifdef PBLK_SNAPSHOT
+	else if (strcmp(attr->name, "snapshot") == 0)
+		return pblk_sysfs_snapshot_store(pblk, buf, len);
+#endif
+#ifdef PBLK_RL_PID
+	else if (strcmp(attr->name, "rate_pid") == 0)
+		return pblk_sysfs_rate_pid_store(pblk, buf, len);
+#endif
 
 	return 0;
 }
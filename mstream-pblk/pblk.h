@@ -56,6 +56,7 @@
 #define PBLK_WS_POOL_SIZE (128)
 #define PBLK_META_POOL_SIZE (128)
 #define PBLK_READ_REQ_POOL_SIZE (1024)
+#define PBLK_GC_RQ_POOL_SIZE (128)
 
 #define PBLK_NR_CLOSE_JOBS (4)
 
@@ -90,6 +91,41 @@
 //#define DB_PMT
 #define EXT4_TEST
 
+#ifdef CONFIG_PBLK_MULTIMAP
+#define PBLK_MAP_ADAPT		// SECTOR/PAGE map per lseg of SECTOR_MAP streams
+#endif
+#define MAP_ADAPT_SCAN	(8)	// lsegs visited per GC tick
+#define MAP_ADAPT_COLD	(4)	// max decayed write count to promote
+
+#ifdef CONFIG_PBLK_MULTIMAP
+#define PBLK_WRITE_BATCH	// one ring reservation per same-stream bio run
+#endif
+
+#define PBLK_GC_PARALLEL	// per-LUN GC reads, gc_rq mempool
+
+#if defined(CONFIG_PBLK_MULTIMAP) && defined(CONFIG_PBLK_DFTL)
+#define PBLK_SNAPSHOT		// L2P snapshots on reserved lines
+#endif
+#define PBLK_SNAP_INTERVAL	(60)	// seconds between periodic snapshots
+
+#ifdef CONFIG_PBLK_MULTIMAP
+#define PBLK_WRITE_HINT		// bio write hints select the lstream
+#endif
+#define PBLK_NR_HINTS		(16)	// write hints / stream ids in the table
+#define PBLK_HINT_NONE		(0xff)	// hint left to the default placement
+
+#if defined(CONFIG_PBLK_MULTIMAP) && !defined(EXT4_TEST)
+#define PBLK_GC_PREINVALID	// preinvalid hints count as reclaimable in GC
+#endif
+
+#ifdef CONFIG_PBLK_MULTIMAP
+#define PBLK_RL_PID		// PID split of the buffer between user and GC
+#endif
+#define PBLK_RL_PID_MS		(100)	// controller period
+#define PBLK_RL_PID_LINES	(4)	// default band above the GC reserve, in lines
+#define PBLK_RL_ONE		(1024)	// fixed point 1.0 for shares and gains
+#define PBLK_RL_LAT_BUCKETS	(24)	// log2 us buckets of user write latency
+
 ////////////////////////////////////// GC 
 //#define PBLK_FORCE_GC_CB
 //#define PBLK_GC_STREAM			// MUST ENABLE with PBLK_FORCE_GC_CB
@@ -197,6 +233,9 @@ struct pblk_w_ctx {
 #ifdef GC_TIME
 	u64 write_time;
 #endif
+#ifdef PBLK_SNAPSHOT
+	struct ppa_addr prev_ppa;	/* media copy the entry supersedes */
+#endif
 };
 
 struct pblk_rb_entry {
@@ -308,6 +347,11 @@ struct pblk_gc {
 	spinlock_t lock;
 	spinlock_t w_lock;
 	spinlock_t r_lock;
+
+#ifdef PBLK_GC_PARALLEL
+	atomic_long_t read_secs;	/* sectors read for relocation */
+	atomic_long_t stall_us;		/* user writes waiting for buffer */
+#endif
 };
 
 struct pblk_rl {
@@ -372,6 +416,21 @@ struct pblk_rl {
 	unsigned long long nr_secs;
 	unsigned long total_blocks;
 	atomic_t free_blocks;
+
+#ifdef PBLK_RL_PID
+	/* Feedback split of the buffer, see pblk_rl_pid_update() */
+	int pid_on;		/* off by default, "on 1" in sysfs rate_pid */
+	int kp, ki, kd;		/* gains, PBLK_RL_ONE = whole buffer per line */
+	unsigned int setpoint;	/* free blocks the controller holds */
+	spinlock_t pid_lock;
+	unsigned long pid_stamp;	/* jiffies of the last step */
+	unsigned long pid_steps;
+	long pid_free;		/* free blocks at the last step */
+	long pid_slope;		/* filtered free block change per step */
+	long pid_integral;
+	int pid_out;		/* user share of the buffer, 0..PBLK_RL_ONE */
+	atomic_long_t lat_hist[PBLK_RL_LAT_BUCKETS];	/* user write latency */
+#endif
 };
 
 #define PBLK_LINE_EMPTY (~0U)
@@ -423,7 +482,8 @@ struct line_smeta {
 	/* Active writers */
 	__le32 window_wr_lun;	/* Number of parallel LUNs to write */
 
-	__le32 rsvd[2];
+	__le32 feat;		/* PBLK_FEAT_* the instance was formatted with */
+	__le32 rsvd;
 
 	__le64 lun_bitmap[];
 };
@@ -502,6 +562,9 @@ struct pblk_line {
 	u8 pstream;
 	unsigned long ctime;
 #endif
+#ifdef PBLK_GC_PREINVALID
+	atomic_t pi_secs;		/* Valid secs hinted preinvalid */
+#endif
 
 	unsigned int sec_in_line;	/* Number of usable secs in line */
 
@@ -650,6 +713,13 @@ struct pblk_rl_per_rb {
 	int rb_gc_active;
 
 	struct timer_list u_timer;
+
+#ifdef PBLK_RL_PID
+	int rb_user_max;	/* stream share set by the controller */
+	int rb_gc_max;
+	atomic_t rb_taken;	/* free blocks taken since the last step */
+	unsigned int rb_load;	/* decayed rb_taken */
+#endif
 };
 
 struct pblk_rb_ctx {
@@ -696,23 +766,61 @@ struct pblk_lstream
 };
 
 struct map_entry {
-	struct rb_node rb_node;
+	struct hlist_node hnode;
 	int lseg;
 	int dirty;
+	int ref;			/* CLOCK reference bit, set on a hit */
 	unsigned int nr_log;
 	unsigned int map_size;
-	struct list_head list;
+	struct list_head list;		/* CLOCK order, then write-back */
 };
 
+#define CMT_HASH_BITS	(10)		/* CMT hash buckets */
+
+/*
+ * Translation pages. Each lseg owns PBLK_TP_PER_LSEG slots in the global
+ * translation directory (GTD); a slot holds the line and sector its page
+ * was last written to (pblk_gtd_addr), or ADDR_EMPTY.
+ */
+#define PBLK_TP_ENTRIES		(PBLK_EXPOSED_PAGE_SIZE / 4)
+#define PBLK_TP_PER_LSEG	(8)
+#define PBLK_MAP_BATCH		(16)	/* sectors per map I/O */
+#define PBLK_MAP_LINES		(4)	/* map lines kept before map GC */
+
+static inline u64 pblk_gtd_addr(unsigned int line_id, u64 paddr)
+{
+	return ((u64)line_id << 32) | paddr;
+}
+
 struct pblk_cmt_mgt
 {
 	unsigned int max_res;		// unit: entry(4 byte)
 	unsigned int alloc_res;
 	unsigned int list_size;
-	struct rb_root root;
 	struct map_entry global_map;
-	struct list_head map_list;
+	struct hlist_head hash[1 << CMT_HASH_BITS];
+	struct list_head clock;		/* CLOCK order */
 	spinlock_t map_lock;
+
+	/* map-page I/O, all but the queues are owned by io_ws */
+	u64 *gtd;
+	unsigned long nr_lseg;
+	unsigned long *rd_pending;	/* lsegs missed in the CMT, until read */
+	int sync_miss;			/* sysfs cmt_sync: readers wait for it */
+	wait_queue_head_t rd_wait;	/* woken as pending lsegs are read */
+	atomic_long_t nr_miss_wait;
+	atomic64_t miss_wait_ns;
+	struct list_head wb_list;	/* dirty entries evicted from the CMT */
+	spinlock_t io_lock;		/* wb_list */
+	struct workqueue_struct *io_wq;
+	struct work_struct io_ws;
+	struct pblk_line *map_line;	/* open map line */
+	struct list_head map_full;	/* closed map lines */
+	int nr_map_lines;
+	int io_secs;
+	void *io_buf;
+	u64 *io_tpn;
+	u64 *io_addr;
 };
 
 #ifdef PBLK_GC_STREAM
@@ -723,6 +831,45 @@ struct kmeans_history {
 }; 
 #endif
 
+#ifdef PBLK_SNAPSHOT
+/*
+ * L2P snapshot. Two slots of reserved lines are written in turn, header
+ * page last, so a torn snapshot leaves the previous slot valid. Lines that
+ * were closed when the snapshot was taken are restored from it; all other
+ * lines are replayed from emeta/oob on top of it.
+ */
+struct pblk_snap {
+	struct pblk_line **lines;	/* nr_lines per slot, slot 0 first */
+	unsigned long *line_bitmap;	/* lines reserved for snapshots */
+	unsigned long *covered;		/* lines restored from the snapshot */
+	int nr_lines;
+	unsigned long nr_pages;		/* pages per snapshot, header last */
+	size_t payload_len;
+
+	struct mutex lock;		/* one snapshot at a time */
+	struct workqueue_struct *wq;
+	struct work_struct ws;
+	unsigned long next;		/* jiffies of the next periodic one */
+
+	u64 snap_nr;
+	int slot;			/* slot holding the newest snapshot */
+	int loaded;
+	unsigned int write_ms;
+	unsigned int load_ms;
+
+	/* page stream, owned by the lock holder */
+	void *buf;
+	u64 *addr;
+	void *tag;			/* smeta of a slot line */
+	u64 *lseg_buf;
+	int io_pgs;
+	int io_slot;
+	unsigned long io_page;
+	size_t io_off;
+	u32 crc;
+};
+#endif
+
 
 
 #endif
@@ -821,6 +968,14 @@ struct pblk {
 	atomic_long_t nr_blocklog;
 	atomic_long_t nr_mapread;
 	atomic_long_t nr_mapwrite;
+	atomic_long_t nr_cmt_hit;
+	atomic_long_t nr_map_rd_io;	/* translation pages read */
+	atomic_long_t nr_map_wr_io;	/* translation pages written */
+	atomic_long_t nr_map_gc_io;	/* translation pages moved by map GC */
+	atomic_long_t nr_map_pad;
+	atomic_long_t nr_host_io;
+	atomic_long_t nr_preinvalid_bio;	/* hint bios from the host */
+	atomic_long_t nr_preinvalid_blk;	/* sectors marked preinvalid */
 #endif
 	spinlock_t lock;
 
@@ -839,19 +994,44 @@ struct pblk {
 	 */
 	unsigned char *trans_map;
 #ifdef CONFIG_PBLK_MULTIMAP
-	unsigned char *preinvalid_map;
+	unsigned long *preinvalid_map;	/* one bit per sector */
 #endif
 
 #ifdef EXT4_TEST
-	unsigned char *stream_map;
+	unsigned char *stream_map;	/* 4-bit lstream per sector */
 #endif
 	spinlock_t trans_lock;
 
+#ifdef PBLK_MAP_ADAPT
+	int map_adapt;			/* online map granularity on/off */
+	unsigned long map_adapt_cursor;
+	u8 *lseg_heat;			/* decayed write count per lseg */
+	unsigned long map_bytes;	/* map memory seen by the last pass */
+	unsigned long map_bytes_acc;
+	atomic_long_t nr_map_promote;	/* SECTOR_MAP -> PAGE_MAP */
+	atomic_long_t nr_map_demote;	/* PAGE_MAP -> SECTOR_MAP */
+#endif
+
 #ifdef PBLK_GC_STREAM
 	struct kmeans_history *kmeans_history;
 	int kmeans_count;
 #endif
 
+#ifdef PBLK_SNAPSHOT
+	struct pblk_snap snap;
+#endif
+
+#ifdef PBLK_WRITE_HINT
+	u8 hint_lstream[PBLK_NR_HINTS];		/* write hint -> lstream */
+	atomic_long_t hint_writes[PBLK_NR_HINTS];	/* user sectors per hint */
+	atomic_long_t stream_gc[MAX_LSTREAM];	/* sectors moved by GC */
+#endif
+
+#ifdef PBLK_GC_PREINVALID
+	atomic_long_t gc_victim_vsc[MAX_LSTREAM];	/* valid secs at selection */
+	atomic_long_t gc_victim_pi[MAX_LSTREAM];	/* of which hinted */
+#endif
+
 #ifdef CONFIG_PBLK_MULTIMAP
 	unsigned int min_seq;
 	unsigned int max_seq;
@@ -864,6 +1044,9 @@ struct pblk {
 	mempool_t *g_rq_pool;
 	mempool_t *w_rq_pool;
 	mempool_t *line_meta_pool;
+#ifdef PBLK_GC_PARALLEL
+	mempool_t *gc_rq_pool;
+#endif
 #ifdef CONFIG_PBLK_DFTL
 	mempool_t *dftl_pool;
 #else
@@ -960,6 +1143,7 @@ int pblk_setup_w_rec_rq(struct pblk *pblk, struct nvm_rq *rqd,
 void pblk_free_rqd(struct pblk *pblk, struct nvm_rq *rqd, int rw);
 void pblk_wait_for_meta(struct pblk *pblk);
 struct ppa_addr pblk_get_lba_map(struct pblk *pblk, sector_t lba);
+void pblk_discard_range(struct pblk *pblk, sector_t slba, sector_t nr_secs);
 void pblk_discard(struct pblk *pblk, struct bio *bio);
 void pblk_log_write_err(struct pblk *pblk, struct nvm_rq *rqd);
 void pblk_log_read_err(struct pblk *pblk, struct nvm_rq *rqd);
@@ -970,6 +1154,9 @@ struct bio *pblk_bio_map_addr(struct pblk *pblk, void *data,
 			      int alloc_type, gfp_t gfp_mask);
 struct pblk_line *pblk_line_get(struct pblk *pblk);
 struct pblk_line *pblk_line_get_first_data(struct pblk *pblk, unsigned int nrb);
+#ifdef CONFIG_PBLK_DFTL
+struct pblk_line *pblk_line_get_map(struct pblk *pblk);
+#endif
 void pblk_line_replace_data(struct pblk *pblk, unsigned int nrb);
 int pblk_line_recov_alloc(struct pblk *pblk, struct pblk_line *line);
 void pblk_line_recov_close(struct pblk *pblk, struct pblk_line *line);
@@ -1015,6 +1202,9 @@ void pblk_bio_free_pages(struct pblk *pblk, struct bio *bio, int off,
 void pblk_map_invalidate(struct pblk *pblk, struct ppa_addr ppa);
 void __pblk_map_invalidate(struct pblk *pblk, struct pblk_line *line,
 			   u64 paddr);
+#ifdef PBLK_GC_PREINVALID
+void pblk_line_gc_regroup(struct pblk *pblk, struct pblk_line *line);
+#endif
 void pblk_update_map(struct pblk *pblk, sector_t lba, struct ppa_addr ppa);
 void pblk_update_map_cache(struct pblk *pblk, sector_t lba,
 			   struct ppa_addr ppa);
@@ -1050,6 +1240,9 @@ void pblk_map_erase_rq(struct pblk *pblk, struct nvm_rq *rqd,
 void pblk_map_rq(struct pblk *pblk, struct nvm_rq *rqd, unsigned int sentry,
 		 unsigned long *lun_bitmap, unsigned int valid_secs,
 		 unsigned int off, unsigned int nrb);
+#ifdef PBLK_MAP_ADAPT
+void pblk_map_adapt(struct pblk *pblk);
+#endif
 
 /*
  * pblk write thread
@@ -1121,6 +1314,32 @@ void pblk_rl_free_lines_inc(struct pblk_rl *rl, struct pblk_line *line);
 void pblk_rl_free_lines_dec(struct pblk_rl *rl, struct pblk_line *line);
 void pblk_rl_set_space_limit(struct pblk_rl *rl, int entries_left);
 int pblk_rl_is_limit(struct pblk_rl_per_rb *rb_rl);
+#ifdef PBLK_RL_PID
+void pblk_rl_pid_set(struct pblk_rl *rl, int on);
+void pblk_rl_lat_add(struct pblk_rl *rl, s64 us);
+unsigned long pblk_rl_lat_pct(struct pblk_rl *rl, int permille);
+#endif
+
+/* Buffer entries a stream may hold for user and for GC I/O */
+static inline int pblk_rl_user_max(struct pblk_rl *rl,
+				   struct pblk_rl_per_rb *rb_rl)
+{
+#ifdef PBLK_RL_PID
+	if (READ_ONCE(rl->pid_on))
+		return READ_ONCE(rb_rl->rb_user_max);
+#endif
+	return rl->rb_user_max;
+}
+
+static inline int pblk_rl_gc_max(struct pblk_rl *rl,
+				 struct pblk_rl_per_rb *rb_rl)
+{
+#ifdef PBLK_RL_PID
+	if (READ_ONCE(rl->pid_on))
+		return READ_ONCE(rb_rl->rb_gc_max);
+#endif
+	return rl->rb_gc_max;
+}
 
 /*
  * pblk sysfs
@@ -1130,12 +1349,44 @@ void pblk_sysfs_exit(struct gendisk *tdisk);
 
 #ifdef CONFIG_PBLK_DFTL
 int pblk_load_cmt(struct pblk *pblk, int lseg, int dirty);
+void pblk_cmt_wait(struct pblk *pblk, sector_t blba, int nr_secs);
 int pblk_delete_cmt(struct pblk *pblk, int lseg);
 int pblk_alloc_log(struct pblk *pblk,
 								int lseg, int type, unsigned int log_size);
 int pblk_free_log(struct pblk *pblk, int lseg, 
 								int type, unsigned int log_size);
 int pblk_change_map(struct pblk *pblk, int lseg);
+int pblk_map_io_init(struct pblk *pblk, unsigned long nr_lseg);
+void pblk_map_io_exit(struct pblk *pblk);
+int pblk_map_submit_buf(struct pblk *pblk, void *buf, u64 *addr, u64 *tag,
+							int nr_secs, int dir);
+#endif
+
+#ifdef PBLK_SNAPSHOT
+/*
+ * pblk snapshot
+ */
+#define PBLK_FEAT_SNAP		(1 << 0)	/* smeta: snapshot lines reserved */
+#define PBLK_FEAT_SNAP_SLOT	(1 << 1)	/* smeta: snapshot slot, seq_nr its index */
+
+int pblk_snap_reserve(struct pblk *pblk, int flags, long *nr_free_blks);
+void pblk_snap_release(struct pblk *pblk);
+int pblk_snap_init(struct pblk *pblk);
+void pblk_snap_exit(struct pblk *pblk);
+int pblk_snap_write(struct pblk *pblk);
+void pblk_snap_kick(struct pblk *pblk);
+int pblk_snap_load(struct pblk *pblk);
+
+static inline int pblk_snap_line(struct pblk *pblk, struct pblk_line *line)
+{
+	return pblk->snap.line_bitmap && test_bit(line->id,
+						pblk->snap.line_bitmap);
+}
+
+static inline int pblk_snap_covers(struct pblk *pblk, struct pblk_line *line)
+{
+	return pblk->snap.loaded && test_bit(line->id, pblk->snap.covered);
+}
 #endif
 
 static inline void *pblk_malloc(size_t size, int type, gfp_t flags)
@@ -1184,6 +1435,18 @@ static inline int pblk_line_vsc(struct pblk_line *line)
 	return vsc;
 }
 
+/* Valid sectors GC expects to copy; hinted ones are likely gone by then */
+static inline int pblk_line_gc_vsc(struct pblk_line *line)
+{
+	int vsc = le32_to_cpu(*line->vsc);
+#ifdef PBLK_GC_PREINVALID
+	int pi_secs = atomic_read(&line->pi_secs);
+
+	vsc -= min(vsc, pi_secs);
+#endif
+	return vsc;
+}
+
 #define NVM_MEM_PAGE_WRITE (8)
 
 static inline int pblk_pad_distance(struct pblk *pblk)
@@ -1314,8 +1577,25 @@ static inline struct ppa_addr addr_to_pblk_ppa(struct pblk *pblk, u64 paddr,
 	return ppa;
 }
 
-static inline struct ppa_addr pblk_trans_map_get(struct pblk *pblk,
-								sector_t lba)
+#ifdef CONFIG_PBLK_MULTIMAP
+/*
+ * Map structure of an lseg. It follows the lstream, except that lsegs of a
+ * SECTOR_MAP stream may be held as a PAGE_MAP (PBLK_MAP_ADAPT); placement,
+ * padding and GC still follow the lstream (pblk_get_maptype).
+ */
+static inline int pblk_lseg_map_type(struct pblk *pblk, struct pba_addr pba)
+{
+	int type = pblk->lstream[pba.m.lstream].map_type;
+
+	if (type == SECTOR_MAP && pba.m.map == PAGE_MAP)
+		return PAGE_MAP;
+	return type;
+}
+#endif
+
+/* @load: account the lookup in the CMT; map walkers pass 0 */
+static inline struct ppa_addr __pblk_trans_map_get(struct pblk *pblk,
+						sector_t lba, int load)
 {
 	struct ppa_addr ppa;
 #ifndef CONFIG_PBLK_MULTIMAP
@@ -1328,9 +1608,7 @@ static inline struct ppa_addr pblk_trans_map_get(struct pblk *pblk,
 		ppa = map[lba];
 	}
 #ifdef CONFIG_PBLK_DFTL
-	spin_lock(&pblk->cmt_mgt.map_lock);
 	pblk_load_cmt(pblk, lseg, 0);
-	spin_unlock(&pblk->cmt_mgt.map_lock);
 #else
 error
 #endif
@@ -1342,6 +1620,7 @@ error
 	struct pba_addr pba = bmap[lseg];
 	int lstream; 
 	struct pblk_lstream *log;
+	int map_type;
 	int loff = lba & (entry_num - 1);
 
 	if (pba.m.map == NONE_MAP)
@@ -1356,20 +1635,20 @@ error
 		BUG_ON(lstream >= pblk->nr_lstream);
 	}
 	log = &(pblk->lstream[lstream]);
+	map_type = pblk_lseg_map_type(pblk, pba);
 
 //	if (log->map_type == PAGE_MAP)
 //		printk("pblk_trans_map_get: start lba:%lu lseg %lu map %d loff %d\n", lba, lseg, pba.m.map, loff);
 //	printk("pblk_trans_map_get: start lba:%lu lseg %lu map %d loff %d\n", lba, lseg, pba.m.map, loff);
 
 #ifdef CONFIG_PBLK_DFTL
-	spin_lock(&pblk->cmt_mgt.map_lock);
-	pblk_load_cmt(pblk, lseg, 0);
-	spin_unlock(&pblk->cmt_mgt.map_lock);
+	if (load)
+		pblk_load_cmt(pblk, lseg, 0);
 #else
 error
 #endif
 
-	if (log->map_type == SECTOR_MAP)
+	if (map_type == SECTOR_MAP)
 	{
 		struct ppa_addr* smap = (struct ppa_addr*) pba.pointer;
 		if (pba.m.map != SECTOR_MAP) {
@@ -1387,7 +1666,7 @@ error
 		}
 		return ppa;
 	}
-	else if (log->map_type == BLOCK_MAP)
+	else if (map_type == BLOCK_MAP)
 	{
 		if (pba.m.map != BLOCK_MAP)
 			BUG_ON(1);
@@ -1427,7 +1706,7 @@ error
 			}
 		}
 	}
-	else if (log->map_type == PAGE_MAP)
+	else if (map_type == PAGE_MAP)
 	{
 		struct pba_addr* pmap = (struct pba_addr*) pba.pointer;
 		int pindex = loff >> pblk->ppaf.pln_offset;
@@ -1464,6 +1743,71 @@ error
 	return ppa;
 }
 
+static inline struct ppa_addr pblk_trans_map_get(struct pblk *pblk,
+								sector_t lba)
+{
+	return __pblk_trans_map_get(pblk, lba, 1);
+}
+
+#ifdef CONFIG_PBLK_MULTIMAP
+#ifdef PBLK_GC_PREINVALID
+/*
+ * Line holding the media copy of an lba, NULL otherwise. Any map type, so
+ * that map adaptation of the lseg does not change which line is charged.
+ */
+static inline struct pblk_line *pblk_preinvalid_line(struct pblk *pblk,
+								sector_t lba)
+{
+	struct ppa_addr ppa;
+
+	ppa = __pblk_trans_map_get(pblk, lba, 0);
+	if (pblk_addr_in_cache(ppa) || pblk_ppa_empty(ppa))
+		return NULL;
+
+	return &pblk->lines[pblk_tgt_ppa_to_line(ppa)];
+}
+#endif
+
+/* Caller holds trans_lock, the lba is still mapped to its old ppa */
+static inline void pblk_preinvalid_set(struct pblk *pblk, sector_t lba)
+{
+#ifdef PBLK_GC_PREINVALID
+	struct pblk_line *line;
+
+	if (test_and_set_bit(lba, pblk->preinvalid_map))
+		return;
+
+	line = pblk_preinvalid_line(pblk, lba);
+	if (line) {
+		atomic_inc(&line->pi_secs);
+		pblk_line_gc_regroup(pblk, line);
+	}
+#else
+	set_bit(lba, pblk->preinvalid_map);
+#endif
+}
+
+/* Caller holds trans_lock; returns whether the lba was hinted */
+static inline int pblk_preinvalid_clear(struct pblk *pblk, sector_t lba)
+{
+#ifdef PBLK_GC_PREINVALID
+	struct pblk_line *line;
+
+	if (!test_and_clear_bit(lba, pblk->preinvalid_map))
+		return 0;
+
+	/* hints taken while the lba sat in the cache were never counted */
+	line = pblk_preinvalid_line(pblk, lba);
+	if (line && atomic_dec_if_positive(&line->pi_secs) >= 0)
+		pblk_line_gc_regroup(pblk, line);
+
+	return 1;
+#else
+	return test_and_clear_bit(lba, pblk->preinvalid_map);
+#endif
+}
+#endif
+
 #ifdef CONFIG_PBLK_MULTIMAP
 static inline struct ppa_addr pblk_cache_invalidate(struct pblk *pblk, struct ppa_addr r_ppa)
 {
@@ -1588,6 +1932,48 @@ static inline struct ppa_addr pblk_get_reserved_old_addr2(struct pblk *pblk, str
 	return ppa;
 }
 
+#ifdef PBLK_SNAPSHOT
+/*
+ * Media copy behind a map entry: the entry itself, or for a cached one the
+ * copy its ring entry supersedes. Reserved entries still hold it in ppa
+ * until their data arrives. Called under trans_lock.
+ */
+static inline struct ppa_addr pblk_cache_prev_addr(struct pblk *pblk,
+						   struct ppa_addr r_ppa)
+{
+	struct pblk_rb *rb;
+	struct pblk_rb_entry *entry;
+	struct ppa_addr ppa;
+	int flags;
+
+	if (!pblk_addr_in_cache(r_ppa))
+		return r_ppa;
+
+	rb = &pblk->rb_ctx[r_ppa.c.nrb].rwb;
+	entry = &rb->entries[pblk_rb_wrap_pos(rb, r_ppa.c.line)];
+	flags = READ_ONCE(entry->w_ctx.flags);
+
+	ppa = entry->w_ctx.prev_ppa;
+	if ((flags & (PBLK_RESERVED_ENTRY | PBLK_WAITREAD_ENTRY)) &&
+			!pblk_ppa_empty(entry->w_ctx.ppa) &&
+			!pblk_addr_in_cache(entry->w_ctx.ppa))
+		ppa = entry->w_ctx.ppa;
+
+	return ppa;
+}
+
+/* @c_ppa now maps a sector that @l2p_ppa mapped; remember its media copy */
+static inline void pblk_cache_set_prev(struct pblk *pblk, struct ppa_addr c_ppa,
+				       struct ppa_addr l2p_ppa)
+{
+	struct pblk_rb *rb = &pblk->rb_ctx[c_ppa.c.nrb].rwb;
+	struct pblk_rb_entry *entry;
+
+	entry = &rb->entries[pblk_rb_wrap_pos(rb, c_ppa.c.line)];
+	entry->w_ctx.prev_ppa = pblk_cache_prev_addr(pblk, l2p_ppa);
+}
+#endif
+
 /*
 enum EXT4_STREAM
 {
@@ -1601,6 +1987,34 @@ enum EXT4_STREAM
 }
 */
 
+#ifdef EXT4_TEST
+static inline void pblk_stream_map_set(struct pblk *pblk, sector_t lba,
+								int lstream)
+{
+	unsigned char *p = &pblk->stream_map[lba >> 1];
+	int shift = (lba & 1) << 2;
+
+	*p = (*p & ~(0xf << shift)) | ((lstream & 0xf) << shift);
+}
+
+static inline int pblk_stream_map_get(struct pblk *pblk, sector_t lba)
+{
+	return (pblk->stream_map[lba >> 1] >> ((lba & 1) << 2)) & 0xf;
+}
+#endif
+
+#ifdef PBLK_WRITE_HINT
+/* lstream the bio's write hint maps to, PBLK_HINT_NONE if unmapped */
+static inline int pblk_hint_lstream(struct pblk *pblk, struct bio *bio)
+{
+	unsigned int hint = bio->bi_write_hint;
+
+	if (hint >= PBLK_NR_HINTS)
+		return PBLK_HINT_NONE;
+	return READ_ONCE(pblk->hint_lstream[hint]);
+}
+#endif
+
 static inline int pblk_get_lstream(struct pblk *pblk,
 								sector_t lba)
 {
@@ -1675,6 +2089,7 @@ static inline int pblk_get_lstream(struct pblk *pblk,
 }
 
 
+/* placement type of lba: how its stream writes, pads and collects it */
 static inline int pblk_get_maptype(struct pblk *pblk,
 								sector_t lba)
 {
@@ -1683,7 +2098,9 @@ static inline int pblk_get_maptype(struct pblk *pblk,
 
 	struct pba_addr pba = bmap[lseg];
 
-	return pba.m.map;
+	if (pba.m.map == NONE_MAP)
+		return NONE_MAP;
+	return pblk->lstream[pba.m.lstream].map_type;
 }
 
 static inline int pblk_get_log_maptype(struct pblk *pblk,
@@ -1710,7 +2127,9 @@ static inline int pblk_get_reserved_addr(struct pblk *pblk,
 
 //	printk("pblk_get_reserved_addr: lba:%lu lseg:%d\n", lba, lseg);
 	pba = bmap[lseg];
-	if (pba.m.map == PAGE_MAP) {
+	/* reservations follow the stream, not an adapted lseg (PBLK_MAP_ADAPT) */
+	if (pba.m.map == PAGE_MAP &&
+			pblk->lstream[pba.m.lstream].map_type == PAGE_MAP) {
 		//printk("PAGEMAP pblk_get_reserved_addr: lba:%lu lseg:%d\n", lba, lseg);
 		*r_ppa = pblk_trans_map_get(pblk, lba);
 		if (r_ppa->c.is_reserved == 1 && (!pblk_ppa_empty(*r_ppa))) {
@@ -1733,7 +2152,7 @@ static inline void pblk_empty_map_set(struct pblk *pblk, sector_t lba)
 	sector_t lseg = lba >> pblk->ppaf.blk_offset;
 	struct pba_addr pba = bmap[lseg];
 
-	pblk->preinvalid_map[lba] = 0;
+	pblk_preinvalid_clear(pblk, lba);
 
 	if (pba.m.map == SECTOR_MAP)
 	{
@@ -1776,9 +2195,7 @@ static inline void pblk_empty_map_set(struct pblk *pblk, sector_t lba)
 #endif
 	}
 #ifdef CONFIG_PBLK_DFTL
-	spin_lock(&pblk->cmt_mgt.map_lock);
 	pblk_delete_cmt(pblk, lseg);
-	spin_unlock(&pblk->cmt_mgt.map_lock);
 #endif
 	pba.m.map = BLOCK_MAP;
 	pba.pba = ADDR_EMPTY;
@@ -1786,9 +2203,7 @@ static inline void pblk_empty_map_set(struct pblk *pblk, sector_t lba)
 	bmap[lseg] = pba;
 
 	#ifdef CONFIG_PBLK_DFTL
-	spin_lock(&pblk->cmt_mgt.map_lock);
 	pblk_change_map(pblk, lseg);
-	spin_unlock(&pblk->cmt_mgt.map_lock);
 	#endif
 }
 #endif
@@ -1927,13 +2342,10 @@ static inline void pblk_setting_page_map(struct pblk *pblk, sector_t lba)
 	bmap[lseg].m.map = PAGE_MAP;
 
 	#ifdef CONFIG_PBLK_DFTL
-	spin_lock(&pblk->cmt_mgt.map_lock);
 	pblk_change_map(pblk, lseg);
-	spin_unlock(&pblk->cmt_mgt.map_lock);
 	#endif
 }
 
-
 static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 						struct ppa_addr ppa)
 {
@@ -1944,9 +2356,10 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 	struct pba_addr pba = bmap[lseg];
 	int lstream;
 	struct pblk_lstream *log;
+	int map_type;
 	int loff = lba & (entry_num - 1);
 
-	pblk->preinvalid_map[lba] = 0;
+	pblk_preinvalid_clear(pblk, lba);
 
 //	printk("pblk_trans_map_set start %lu %lu\n", lba, lseg);
 
@@ -1975,17 +2388,13 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 		bmap[lseg] = pba;
 		printk("none_map allocation(map_set): %lu %lu\n", lba, lseg);
 		#ifdef CONFIG_PBLK_DFTL
-		spin_lock(&pblk->cmt_mgt.map_lock);
 		pblk_change_map(pblk, lseg);
-		spin_unlock(&pblk->cmt_mgt.map_lock);
 		#else
 		error
 		#endif
 	}
 	#ifdef CONFIG_PBLK_DFTL
-	spin_lock(&pblk->cmt_mgt.map_lock);
 	pblk_load_cmt(pblk, lseg, 1);
-	spin_unlock(&pblk->cmt_mgt.map_lock);
 	#else
 	error
 	#endif
@@ -1993,8 +2402,9 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 	lstream = (u64)pba.m.lstream;
 	BUG_ON(lstream >= pblk->nr_lstream);
 	log = &(pblk->lstream[lstream]); 
+	map_type = pblk_lseg_map_type(pblk, pba);
 //	printk("set lstream %d map_type %d lseg %ld\n", lstream, log->map_type, lseg);
-	if (log->map_type == SECTOR_MAP)
+	if (map_type == SECTOR_MAP)
 	{
 		struct ppa_addr *smap; 
 		if (pba.m.map != SECTOR_MAP)
@@ -2004,7 +2414,7 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 		smap = pba.pointer;
 		smap[loff] = ppa;
 	}
-	else if (log->map_type == BLOCK_MAP)
+	else if (map_type == BLOCK_MAP)
 	{
 		struct ppa_addr *bmtlog;
 		if ((loff < 8) || (loff >= entry_num - 16))
@@ -2021,9 +2431,7 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 			}
 			atomic_long_inc(&pblk->nr_blocklog);
 			#ifdef CONFIG_PBLK_DFTL
-			spin_lock(&pblk->cmt_mgt.map_lock);
 			pblk_alloc_log(pblk, lseg, BLOCK_MAP, entry_num);
-			spin_unlock(&pblk->cmt_mgt.map_lock);
 			#else
 			error
 			#endif
@@ -2041,9 +2449,7 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 			if (pblk_ppa_empty(bmtlog[8]) && pblk_ppa_empty(bmtlog[entry_num - 17]))
 			{
 				#ifdef CONFIG_PBLK_DFTL
-				spin_lock(&pblk->cmt_mgt.map_lock);
 				pblk_free_log(pblk, lseg, BLOCK_MAP, entry_num);
-				spin_unlock(&pblk->cmt_mgt.map_lock);
 				#else
 				error
 				#endif
@@ -2059,7 +2465,7 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 			}
 		}
 	}
-	else if (log->map_type == PAGE_MAP)
+	else if (map_type == PAGE_MAP)
 	{
 		struct pba_addr *pmap;
 		int pindex = loff >> pblk->ppaf.pln_offset;
@@ -2086,9 +2492,7 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 			atomic_long_inc(&pblk->nr_pagelog);
 			#endif
 			#ifdef CONFIG_PBLK_DFTL
-			spin_lock(&pblk->cmt_mgt.map_lock);
 			pblk_alloc_log(pblk, lseg, PAGE_MAP, log_entry_num);
-			spin_unlock(&pblk->cmt_mgt.map_lock);
 			#endif
 			for (i = 0; i < log_entry_num; i++) {
 				struct ppa_addr copy_ppa = pblk_trans_map_get(pblk, start_lba + i);
@@ -2115,15 +2519,13 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 				else {
 					page_addr.pba = 0;
 					page_addr.b.blk = copy_ppa[0].g.blk;
-					page_addr.b.pg = copy_ppa[0].g.blk;
+					page_addr.b.pg = copy_ppa[0].g.pg;
 					page_addr.b.pl = copy_ppa[0].g.pl;
 					page_addr.b.lun = copy_ppa[0].g.lun;
 					page_addr.b.ch = copy_ppa[0].g.ch;
 				}
 				#ifdef CONFIG_PBLK_DFTL
-				spin_lock(&pblk->cmt_mgt.map_lock);
 				pblk_free_log(pblk, lseg, PAGE_MAP, log_entry_num);
-				spin_unlock(&pblk->cmt_mgt.map_lock);
 				#endif
 				page_addr.m.is_cached = 0;
 				vfree(pmtlog);
@@ -2132,7 +2534,7 @@ static inline void pblk_trans_map_set(struct pblk *pblk, sector_t lba,
 				#endif
 				pmap[pindex] = page_addr;
 			}
-			else
+			else if (log->map_type == PAGE_MAP)
 			{
 				printk("map_set no align: 0 %d %d %d %d %d %d %d, 1 %d %d %d %d %d %d %d, 2 %d %d %d %d %d %d %d, 3 %d %d %d %d %d %d %d\n",
 				copy_ppa[0].c.is_cached, copy_ppa[0].g.blk, copy_ppa[0].g.pg, copy_ppa[0].g.sec, copy_ppa[0].g.pl, copy_ppa[0].g.lun, copy_ppa[0].g.ch,
@@ -2171,20 +2573,20 @@ static inline void pblk_dev_map_set(struct pblk *pblk, sector_t lba,
 	int entry_num = (1ULL << pblk->ppaf.blk_offset);
 	int loff = lba & (entry_num - 1);
 	struct pblk_lstream *log;
+	int map_type;
 
 	BUG_ON(lstream >= pblk->nr_lstream);
 
 	log = &(pblk->lstream[lstream]);
+	map_type = pblk_lseg_map_type(pblk, pba);
 
 	#ifdef CONFIG_PBLK_DFTL
-	spin_lock(&pblk->cmt_mgt.map_lock);
 	pblk_load_cmt(pblk, lseg, 1);
-	spin_unlock(&pblk->cmt_mgt.map_lock);
 	#else
 	error
 	#endif
 
-	if (log->map_type == SECTOR_MAP)
+	if (map_type == SECTOR_MAP)
 	{
 		u64 *map; 
 		if (pba.m.map != SECTOR_MAP)
@@ -2192,7 +2594,7 @@ static inline void pblk_dev_map_set(struct pblk *pblk, sector_t lba,
 		map = (u64 *)pba.pointer;
 		map[loff] = ppa.ppa;
 	}
-	else if (log->map_type == BLOCK_MAP)
+	else if (map_type == BLOCK_MAP)
 	{
 		struct ppa_addr *bmtlog;
 		int poff = 0; 
@@ -2222,9 +2624,7 @@ static inline void pblk_dev_map_set(struct pblk *pblk, sector_t lba,
 						(pblk_dev_ppa_to_line(bmtlog[8]) == pblk_dev_ppa_to_line(bmtlog[loff])))
 			{
 #ifdef CONFIG_PBLK_DFTL
-				spin_lock(&pblk->cmt_mgt.map_lock);
 				pblk_free_log(pblk, lseg, BLOCK_MAP, entry_num);
-				spin_unlock(&pblk->cmt_mgt.map_lock);
 #endif
 #ifdef CONFIG_NVM_DEBUG
 				atomic_long_dec(&pblk->nr_blocklog);
@@ -2246,7 +2646,7 @@ static inline void pblk_dev_map_set(struct pblk *pblk, sector_t lba,
 			BUG_ON(1);
 		}
 	}
-	else if (log->map_type == PAGE_MAP)
+	else if (map_type == PAGE_MAP)
 	{
 		struct pba_addr *pmap;
 		int loff = lba & (entry_num - 1);
@@ -2288,9 +2688,7 @@ static inline void pblk_dev_map_set(struct pblk *pblk, sector_t lba,
 					page_addr.b.ch = copy_ppa[0].g.ch;
 				}
 				#ifdef CONFIG_PBLK_DFTL
-				spin_lock(&pblk->cmt_mgt.map_lock);
 				pblk_free_log(pblk, lseg, PAGE_MAP, log_entry_num);
-				spin_unlock(&pblk->cmt_mgt.map_lock);
 				#endif
 
 				page_addr.m.is_cached = 0;
@@ -2300,7 +2698,7 @@ static inline void pblk_dev_map_set(struct pblk *pblk, sector_t lba,
 #endif
 				pmap[pindex] = page_addr;
 			}
-			else {
+			else if (log->map_type == PAGE_MAP) {
 				printk("dev_map_set no align: start_lba:%lu lba:%lu poffset:%d ppa: %d %d %d %d %d %d\n", 
 								start_lba, lba, poffset, ppa.c.is_cached, ppa.g.blk, ppa.g.pg, ppa.g.sec, ppa.g.pl, ppa.g.ch);
 				printk("dev_map_set no align: off0 c%d r%d %d %d %d %d %d %d, off1 c%d r%d %d %d %d %d %d %d, off2 c%d r%d %d %d %d %d %d %d, off3 c%d r%d %d %d %d %d %d %d\n",
@@ -2323,10 +2721,15 @@ static inline int pblk_cache_map_set(struct pblk *pblk, sector_t lba,
 	struct pba_addr pba = bmap[lseg];
 	int entry_num = (1 << pblk->ppaf.blk_offset);
 	struct pblk_lstream *log;
+	int map_type;
 	int lstream;
 	int loff = lba & (entry_num - 1);
 
-	pblk->preinvalid_map[lba] = 0;
+	pblk_preinvalid_clear(pblk, lba);
+#ifdef PBLK_MAP_ADAPT
+	if (pblk->lseg_heat[lseg] < U8_MAX)
+		pblk->lseg_heat[lseg]++;
+#endif
 
 	if (pba.m.map == NONE_MAP) {
 		u64 *smap = vzalloc(8 * entry_num);
@@ -2343,9 +2746,7 @@ static inline int pblk_cache_map_set(struct pblk *pblk, sector_t lba,
 		#endif
 
 		#ifdef CONFIG_PBLK_DFTL
-		spin_lock(&pblk->cmt_mgt.map_lock);
 		pblk_change_map(pblk, lseg);
-		spin_unlock(&pblk->cmt_mgt.map_lock);
 		#endif
 
 		for (i = 0; i < entry_num; i++) {
@@ -2363,9 +2764,7 @@ static inline int pblk_cache_map_set(struct pblk *pblk, sector_t lba,
 	}
 
 	#ifdef CONFIG_PBLK_DFTL
-	spin_lock(&pblk->cmt_mgt.map_lock);
 	pblk_load_cmt(pblk, lseg, 1);
-	spin_unlock(&pblk->cmt_mgt.map_lock);
 	#else
 	error
 	#endif
@@ -2374,11 +2773,12 @@ static inline int pblk_cache_map_set(struct pblk *pblk, sector_t lba,
 	BUG_ON(lstream >= pblk->nr_lstream);
 
 	log = &(pblk->lstream[lstream]); 
+	map_type = pblk_lseg_map_type(pblk, pba);
 
 //	if (log->map_type == PAGE_MAP)
 //		printk("cache_map_set: lstream %d map_type %d lseg %ld loff %d\n", lstream, log->map_type, lseg, loff);
 
-	if (log->map_type == SECTOR_MAP)
+	if (map_type == SECTOR_MAP)
 	{
 		u64 *map;
 		if (pba.m.map != SECTOR_MAP)
@@ -2388,7 +2788,7 @@ static inline int pblk_cache_map_set(struct pblk *pblk, sector_t lba,
 		map = (u64 *)pba.pointer;
 		map[loff] = ppa.ppa;
 	}
-	else if (log->map_type == BLOCK_MAP) 
+	else if (map_type == BLOCK_MAP) 
 	{
 		struct ppa_addr *bmtlog; 
 		int i;
@@ -2405,9 +2805,7 @@ static inline int pblk_cache_map_set(struct pblk *pblk, sector_t lba,
 				bmtlog[i] = copy_ppa;
 			}
 			#ifdef CONFIG_PBLK_DFTL
-			spin_lock(&pblk->cmt_mgt.map_lock);
 			pblk_alloc_log(pblk, lseg, BLOCK_MAP, entry_num);
-			spin_unlock(&pblk->cmt_mgt.map_lock);
 			#endif
 			pba.m.is_cached = 1;
 			atomic_long_inc(&pblk->nr_blocklog);
@@ -2420,7 +2818,7 @@ static inline int pblk_cache_map_set(struct pblk *pblk, sector_t lba,
 
 		bmtlog[loff] = ppa;
 	}
-	else if (log->map_type == PAGE_MAP)
+	else if (map_type == PAGE_MAP)
 	{
 		struct pba_addr *pmap;
 		int pindex = loff >> pblk->ppaf.pln_offset;
@@ -2443,9 +2841,7 @@ static inline int pblk_cache_map_set(struct pblk *pblk, sector_t lba,
 			pmtlog = (struct ppa_addr*) vzalloc(8 * log_entry_num);
 			atomic_long_inc(&pblk->nr_pagelog);
 			#ifdef CONFIG_PBLK_DFTL
-			spin_lock(&pblk->cmt_mgt.map_lock);
 			pblk_alloc_log(pblk, lseg, PAGE_MAP, log_entry_num);
-			spin_unlock(&pblk->cmt_mgt.map_lock);
 			#endif
 			for (i = 0; i < log_entry_num; i++) {
 				struct ppa_addr copy_ppa = pblk_trans_map_get(pblk, start_lba + i);
@@ -2729,9 +3125,7 @@ static inline int pblk_set_lstream(struct pblk *pblk,
 		bmap[lseg].m.is_cached = 0;
 		bmap[lseg].m.lstream = lstream;
 		#ifdef CONFIG_PBLK_DFTL
-		spin_lock(&pblk->cmt_mgt.map_lock);
 		pblk_change_map(pblk, lseg);
-		spin_unlock(&pblk->cmt_mgt.map_lock);
 		#endif
 		return 0;
 	}
@@ -2833,7 +3227,7 @@ static inline int pblk_set_lstream(struct pblk *pblk,
 #if 1
 	if (log->map_type == SECTOR_MAP)
 	{
-		if (log_old->map_type != SECTOR_MAP)
+		if (bmap[lseg].m.map != SECTOR_MAP)
 		{
 			struct ppa_addr *smap;
 			sector_t start_lba = lseg << pblk->ppaf.blk_offset;
@@ -2910,13 +3304,11 @@ static inline int pblk_set_lstream(struct pblk *pblk,
 			bmap[lseg].m.map = SECTOR_MAP;
 			bmap[lseg].m.is_cached = 0;
 			#ifdef CONFIG_PBLK_DFTL
-			spin_lock(&pblk->cmt_mgt.map_lock);
 			pblk_change_map(pblk, lseg);
-			spin_unlock(&pblk->cmt_mgt.map_lock);
 			#endif
 		}
 	}
-	else if ((log->map_type == BLOCK_MAP) && (log_old->map_type != BLOCK_MAP))
+	else if ((log->map_type == BLOCK_MAP) && (bmap[lseg].m.map != BLOCK_MAP))
 	{
 		struct ppa_addr ppa;
 		sector_t lba_temp;
@@ -2934,7 +3326,7 @@ static inline int pblk_set_lstream(struct pblk *pblk,
 	}
 	else if (log->map_type == PAGE_MAP)
 	{
-		if (log_old->map_type != PAGE_MAP) {
+		if (bmap[lseg].m.map != PAGE_MAP) {
 			pblk_setting_page_map(pblk, lba);
 		}
 	}
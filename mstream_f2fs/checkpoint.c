@@ -588,6 +588,16 @@ int recover_orphan_inodes(struct f2fs_sb_info *sbi)
 
 	start_blk = __start_cp_addr(sbi) + 1 + __cp_payload(sbi);
 	orphan_blocks = __start_sum_addr(sbi) - 1 - __cp_payload(sbi);
+#ifdef F2FS_FGROUP
+	/* the fgroup model sits between the orphan blocks and the summaries */
+	if (is_set_ckpt_flags(sbi, CP_FGROUP_MODEL_FLAG)) {
+		struct page *page = get_meta_page(sbi, start_blk);
+
+		orphan_blocks = le16_to_cpu(((struct f2fs_orphan_block *)
+					page_address(page))->blk_count);
+		f2fs_put_page(page, 1);
+	}
+#endif
 
 	ra_meta_pages(sbi, start_blk, orphan_blocks, META_CP, true);
 
@@ -815,6 +825,109 @@ fail_no_cp:
 	return -EINVAL;
 }
 
+#ifdef F2FS_FGROUP
+#define MODEL_CRC_OFFSET	(2 * sizeof(__le32))
+
+static void seal_model_block(struct f2fs_sb_info *sbi, void *blk)
+{
+	__le32 *crc = (__le32 *)blk + 1;
+
+	*crc = cpu_to_le32(f2fs_crc32(sbi, (char *)blk + MODEL_CRC_OFFSET,
+					F2FS_BLKSIZE - MODEL_CRC_OFFSET));
+}
+
+static bool model_block_valid(struct f2fs_sb_info *sbi, void *blk)
+{
+	__le32 *magic = (__le32 *)blk;
+
+	if (le32_to_cpu(*magic) != F2FS_MODEL_MAGIC)
+		return false;
+	return f2fs_crc_valid(sbi, le32_to_cpu(*(magic + 1)),
+			(char *)blk + MODEL_CRC_OFFSET,
+			F2FS_BLKSIZE - MODEL_CRC_OFFSET);
+}
+
+static void write_fgroup_model(struct f2fs_sb_info *sbi, void *model,
+				unsigned int nr_blocks, block_t start_blk)
+{
+	struct f2fs_model_header *hdr = (struct f2fs_model_header *)
+			((char *)model + (nr_blocks - 1) * F2FS_BLKSIZE);
+	int i;
+
+	hdr->cp_ver = cpu_to_le64(cur_cp_version(F2FS_CKPT(sbi)));
+	for (i = 0; i < nr_blocks; i++) {
+		void *blk = (char *)model + i * F2FS_BLKSIZE;
+
+		seal_model_block(sbi, blk);
+		update_meta_page(sbi, blk, start_blk + i);
+	}
+}
+
+/*
+ * Reload the fgroup model written by the last umount checkpoint.  It ends
+ * right before the data summaries, header block last.  The model is only
+ * a hint, so anything unexpected just leaves it empty.
+ */
+void f2fs_load_fgroup_model(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
+	struct f2fs_model_header *hdr;
+	struct page *page;
+	block_t hdr_blk;
+	unsigned int nr_blocks, i;
+	void *model;
+
+	if (!is_set_ckpt_flags(sbi, CP_FGROUP_MODEL_FLAG))
+		return;
+
+	hdr_blk = start_sum_block(sbi) - 1;
+	page = get_meta_page(sbi, hdr_blk);
+	hdr = (struct f2fs_model_header *)page_address(page);
+	nr_blocks = le32_to_cpu(hdr->nr_blocks) + 1;
+
+	if (!model_block_valid(sbi, hdr) ||
+			le64_to_cpu(hdr->cp_ver) != cur_cp_version(ckpt) ||
+			nr_blocks > MODEL_MAX_BLOCKS) {
+		f2fs_put_page(page, 1);
+		f2fs_msg(sbi->sb, KERN_WARNING, "invalid fgroup model, ignored");
+		return;
+	}
+
+	model = kvzalloc(nr_blocks * F2FS_BLKSIZE, GFP_KERNEL);
+	if (!model) {
+		f2fs_put_page(page, 1);
+		return;
+	}
+	memcpy((char *)model + (nr_blocks - 1) * F2FS_BLKSIZE, hdr,
+							F2FS_BLKSIZE);
+	f2fs_put_page(page, 1);
+
+	hdr_blk -= nr_blocks - 1;
+	for (i = 0; i < nr_blocks - 1; i++) {
+		void *blk = (char *)model + i * F2FS_BLKSIZE;
+
+		page = get_meta_page(sbi, hdr_blk + i);
+		memcpy(blk, page_address(page), F2FS_BLKSIZE);
+		f2fs_put_page(page, 1);
+
+		if (!model_block_valid(sbi, blk) ||
+			le32_to_cpu(((struct f2fs_model_block *)blk)->index) != i) {
+			f2fs_msg(sbi->sb, KERN_WARNING,
+					"invalid fgroup model, ignored");
+			goto out;
+		}
+	}
+
+	f2fs_restore_fgroup_model(sbi, model, nr_blocks);
+	f2fs_msg(sbi->sb, KERN_INFO, "fgroup model loaded: %u entries",
+					le32_to_cpu(((struct f2fs_model_header *)
+					((char *)model + (nr_blocks - 1) *
+					F2FS_BLKSIZE))->nr_entries));
+out:
+	kvfree(model);
+}
+#endif
+
 static void __add_dirty_inode(struct inode *inode, enum inode_type type)
 {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
@@ -1117,6 +1230,8 @@ static int do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	struct super_block *sb = sbi->sb;
 	struct curseg_info *seg_i = CURSEG_I(sbi, CURSEG_HOT_NODE);
 	u64 kbytes_written;
+	void *model = NULL;
+	unsigned int model_blocks = 0;
 
 	/* Flush all the NAT/SIT pages */
 	while (get_pages(sbi, F2FS_DIRTY_META)) {
@@ -1158,17 +1273,33 @@ static int do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	spin_unlock_irqrestore(&sbi->cp_lock, flags);
 
 	orphan_blocks = GET_ORPHAN_BLOCKS(orphan_num);
+
+#ifdef F2FS_FGROUP
+	/*
+	 * keep the learned lifetime model for the next mount; it goes ahead
+	 * of the summaries, which are located from the end of the pack
+	 */
+	if (cpc->reason & CP_UMOUNT)
+		model = f2fs_build_fgroup_model(sbi, &model_blocks);
+	spin_lock_irqsave(&sbi->cp_lock, flags);
+	if (model)
+		__set_ckpt_flags(ckpt, CP_FGROUP_MODEL_FLAG);
+	else
+		__clear_ckpt_flags(ckpt, CP_FGROUP_MODEL_FLAG);
+	spin_unlock_irqrestore(&sbi->cp_lock, flags);
+#endif
+
 	ckpt->cp_pack_start_sum = cpu_to_le32(1 + cp_payload_blks +
-			orphan_blocks);
+			orphan_blocks + model_blocks);
 
 	if (__remain_node_summaries(cpc->reason))
 		ckpt->cp_pack_total_block_count = cpu_to_le32(F2FS_CP_PACKS+
 				cp_payload_blks + data_sum_blocks +
-				orphan_blocks + NR_CURSEG_NODE_TYPE);
+				orphan_blocks + NR_CURSEG_NODE_TYPE + model_blocks);
 	else
 		ckpt->cp_pack_total_block_count = cpu_to_le32(F2FS_CP_PACKS +
 				cp_payload_blks + data_sum_blocks +
-				orphan_blocks);
+				orphan_blocks + model_blocks);
 
 	/* update ckpt flag for checkpoint */
 	update_ckpt_flags(sbi, cpc);
@@ -1200,15 +1331,19 @@ static int do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 		/* Flush all the NAT BITS pages */
 		while (get_pages(sbi, F2FS_DIRTY_META)) {
 			sync_meta_pages(sbi, META, LONG_MAX);
-			if (unlikely(f2fs_cp_error(sbi)))
+			if (unlikely(f2fs_cp_error(sbi))) {
+				kvfree(model);
 				return -EIO;
+			}
 		}
 	}
 
 	/* need to wait for end_io results */
 	wait_on_all_pages_writeback(sbi);
-	if (unlikely(f2fs_cp_error(sbi)))
+	if (unlikely(f2fs_cp_error(sbi))) {
+		kvfree(model);
 		return -EIO;
+	}
 
 	/* write out checkpoint buffer at block 0 */
 	update_meta_page(sbi, ckpt, start_blk++);
@@ -1222,6 +1357,14 @@ static int do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 		start_blk += orphan_blocks;
 	}
 
+#ifdef F2FS_FGROUP
+	if (model) {
+		write_fgroup_model(sbi, model, model_blocks, start_blk);
+		start_blk += model_blocks;
+		kvfree(model);
+	}
+#endif
+
 	write_data_summaries(sbi, start_blk);
 	start_blk += data_sum_blocks;
 
@@ -1284,11 +1427,25 @@ static int do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 /*
  * We guarantee that this checkpoint procedure will not fail.
  */
+#ifdef F2FS_CP_GROUP
+static void cp_time_end(struct f2fs_sb_info *sbi, int phase, u64 start)
+{
+	u64 t = ktime_get_ns() - start;
+
+	sbi->cp_time[phase] += t;
+	if (t > sbi->cp_time_max[phase])
+		sbi->cp_time_max[phase] = t;
+}
+#endif
+
 int write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 {
 	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
 	unsigned long long ckpt_ver;
 	int err = 0;
+#ifdef F2FS_CP_GROUP
+	u64 cp_start, ph_start;
+#endif
 
 	mutex_lock(&sbi->cp_mutex);
 
@@ -1307,6 +1464,9 @@ int write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 
 	trace_f2fs_write_checkpoint(sbi->sb, cpc->reason, "start block_ops");
 
+#ifdef F2FS_CP_GROUP
+	cp_start = ktime_get_ns();
+#endif
 	err = block_operations(sbi);
 	if (err)
 		goto out;
@@ -1341,11 +1501,24 @@ int write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	ckpt->checkpoint_ver = cpu_to_le64(++ckpt_ver);
 
 	/* write cached NAT/SIT entries to NAT/SIT area */
+#ifdef F2FS_CP_GROUP
+	cp_time_end(sbi, CP_PH_BLOCK_OPS, cp_start);
+	ph_start = ktime_get_ns();
+#endif
 	flush_nat_entries(sbi, cpc);
 	flush_sit_entries(sbi, cpc);
+#ifdef F2FS_CP_GROUP
+	cp_time_end(sbi, CP_PH_NAT_SIT, ph_start);
+	ph_start = ktime_get_ns();
+#endif
 
 	/* unlock all the fs_lock[] in do_checkpoint() */
 	err = do_checkpoint(sbi, cpc);
+#ifdef F2FS_CP_GROUP
+	cp_time_end(sbi, CP_PH_DO_CP, ph_start);
+	cp_time_end(sbi, CP_PH_TOTAL, cp_start);
+	sbi->cp_timed++;
+#endif
 	if (err)
 		release_discard_addrs(sbi);
 	else {
@@ -1386,6 +1559,10 @@ void init_ino_entry_info(struct f2fs_sb_info *sbi)
 	sbi->max_orphans = (sbi->blocks_per_seg - F2FS_CP_PACKS -
 			NR_CURSEG_TYPE - __cp_payload(sbi)) *
 				F2FS_ORPHANS_PER_BLOCK;
+#ifdef F2FS_FGROUP
+	/* the umount pack also carries the fgroup model */
+	sbi->max_orphans -= MODEL_MAX_BLOCKS * F2FS_ORPHANS_PER_BLOCK;
+#endif
 }
 
 int __init create_checkpoint_caches(void)
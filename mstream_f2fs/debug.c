@@ -17,6 +17,8 @@
 #include <linux/blkdev.h>
 #include <linux/debugfs.h>
 #include <linux/seq_file.h>
+#include <linux/relay.h>
+#include <linux/sched/clock.h>
 
 #include "f2fs.h"
 #include "node.h"
@@ -131,6 +133,11 @@ static void update_general_status(struct f2fs_sb_info *sbi)
 		}
 		si->type_gc[j] = sbi->type_gc[j];
 		si->type_gc_calls[j] = sbi->type_gc_calls[j];
+#ifdef F2FS_GC_RELOC
+		if (j < NR_CURSEG_DATA_TYPE)
+			memcpy(si->gc_reloc[j], sbi->gc_reloc[j],
+						sizeof(si->gc_reloc[j]));
+#endif
 #ifdef F2FS_TRACE_ENABLE
 		si->type_segment_invalid[j] = sbi->type_segment_invalid[j];
 		si->type_gc_invalid[j] = sbi->type_gc_invalid[j];
@@ -533,23 +540,69 @@ static int mstat_show(struct seq_file *s, void *v)
 
 #ifdef F2FS_FGROUP
 		seq_printf(s, "PSTREAM\tKMEANS_CENTER\tKMEANS_MAX\tQ1\tQ3\n");
-		for (i = 0; i < NR_CLUSTER; i++) {
+		for (i = 0; i < si->sbi->nr_cluster; i++) {
 			unsigned int kmeans_count = si->sbi->kmeans_count;
 			if (kmeans_count > 0) {
 				kmeans_count--;
 				seq_printf(s, "%d\t%llu\t%llu\t%u\t%u\n",
-					CLUSTER_START_TYPE+i, si->sbi->kmeans_center[i], si->sbi->kmeans_max[i],
+					cluster_to_curseg(si->sbi, i), si->sbi->kmeans_center[i], si->sbi->kmeans_max[i],
 							si->sbi->kmeans_history[kmeans_count].q1[i],
 							si->sbi->kmeans_history[kmeans_count].q3[i]);
 			}
 			else {
 				seq_printf(s, "%d\t%llu\t%llu\t%u\t%u\n",
-					CLUSTER_START_TYPE+i, si->sbi->kmeans_center[i], si->sbi->kmeans_max[i],
+					cluster_to_curseg(si->sbi, i), si->sbi->kmeans_center[i], si->sbi->kmeans_max[i],
 								0, 0);
 			}
 		}
 #endif
 
+#ifdef F2FS_GC_RELOC
+		seq_printf(s, "GC-RELOC(policy %u)", si->sbi->gc_reloc_policy);
+		for (j = 0; j < NR_CURSEG_DATA_TYPE; j++)
+			seq_printf(s, "\t->%d", j);
+		seq_putc(s, '\n');
+		for (i = 0; i < NR_CURSEG_DATA_TYPE; i++) {
+			seq_printf(s, "%d", i);
+			for (j = 0; j < NR_CURSEG_DATA_TYPE; j++)
+				seq_printf(s, "\t%u", si->gc_reloc[i][j]);
+			seq_putc(s, '\n');
+		}
+#endif
+#ifdef F2FS_GC_RESEG
+		seq_printf(s, "RESEG(budget %u)\tPASSES\tSEGS\tMOVED\tSAVED\tUNNEEDED\n",
+				si->sbi->reseg_budget);
+		seq_printf(s, "\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+				si->sbi->reseg_passes, si->sbi->reseg_segs,
+				si->sbi->reseg_blocks, si->sbi->reseg_saved,
+				si->sbi->reseg_unneeded);
+#endif
+#ifdef F2FS_SSR_LIFETIME
+		seq_printf(s, "SSR(policy %u)\tSAME\tCROSS\tREJECTED\n",
+				si->sbi->ssr_policy);
+		seq_printf(s, "\t%llu\t%llu\t%llu\n", si->sbi->ssr_same,
+				si->sbi->ssr_cross, si->sbi->ssr_rejected);
+#endif
+#ifdef F2FS_CP_GROUP
+		{
+			static const char *cp_phase[NR_CP_PHASE] = {
+				"BLOCK_OPS", "NAT_SIT", "DO_CP", "TOTAL",
+			};
+			unsigned long long n = si->sbi->cp_timed;
+
+			seq_printf(s, "CHECKPOINT(%llu, group %s)\tAVG(us)\tMAX(us)\n",
+				n, si->sbi->cp_group ? "on" : "off");
+			for (j = 0; j < NR_CP_PHASE; j++)
+				seq_printf(s, "%s\t%llu\t%llu\n", cp_phase[j],
+					n ? div64_u64(si->sbi->cp_time[j], n * 1000) : 0,
+					div64_u64(si->sbi->cp_time_max[j], 1000));
+			seq_printf(s, "CP-DNODES");
+			for (j = 0; j < si->sbi->nr_cluster; j++)
+				seq_printf(s, "\t%llu", si->sbi->cp_dnodes[j]);
+			seq_putc(s, '\n');
+		}
+#endif
+
 #ifdef F2FS_TRACE_ENABLE
 		seq_printf(s, "PSTREAM\tALLOC\tGC\tALLOC-I\tGC-I\tGC-SELF\tGC-COLD\tGC-n\n");
 		for (i = 0; i < NR_CURSEG_TYPE; i++) {
@@ -563,8 +616,29 @@ static int mstat_show(struct seq_file *s, void *v)
 		seq_printf(s, "NODE COLD\tNODE UPDATE\n");
 		seq_printf(s, "%u\t%u\n", si->sbi->node_cold, si->sbi->node_update);
 #endif
+#ifdef F2FS_PREINVALID_WAF
+		seq_printf(s, "PREINVALID\tBLOCKS\tRANGES\tBIOS\tDROPPED\n");
+		seq_printf(s, "\t%llu\t%llu\t%llu\t%llu\n",
+				SIT_I(si->sbi)->pi_blocks, SIT_I(si->sbi)->pi_ranges,
+				SIT_I(si->sbi)->pi_bios, SIT_I(si->sbi)->pi_dropped);
+#endif
 #ifdef F2FS_FGROUP
 		seq_printf(s, "kmeans count: %d\n", si->sbi->kmeans_count);
+		seq_printf(s, "ADAPTIVE-K(%s, k=%d)\tROUNDS\tUSER\tGC\tWAF(%%)\tCOST\n",
+				si->sbi->adaptive_k ? "on" : "off",
+				si->sbi->kmeans_k);
+		for (j = 0; j < si->sbi->nr_cluster - 1; j++) {
+			unsigned long long user = si->sbi->kmeans_k_user[j];
+			unsigned long long gc = si->sbi->kmeans_k_gc[j];
+
+			seq_printf(s, "\t%d\t%u\t%llu\t%llu\t%llu\t%llu\n",
+				j + 1, si->sbi->kmeans_k_rounds[j], user, gc,
+				user ? div64_u64((user + gc) * 100, user) : 0,
+				si->sbi->kmeans_k_cost[j]);
+		}
+		seq_printf(s, "LIFETIME\tFILE\tSAMPLE\tFGROUP\n");
+		seq_printf(s, "\t%lu\t%lu\t%lu\n", si->sbi->nr_file_entries,
+				si->sbi->nr_file_samples, si->sbi->nr_fgroup_entries);
 #endif
 
 #ifdef GC_TIME
@@ -634,6 +708,305 @@ static const struct file_operations sstat_fops = {
 
 #endif
 
+#ifdef F2FS_TRACE_ENABLE
+static struct dentry *mtrace_create_buf_file(const char *filename,
+		struct dentry *parent, umode_t mode,
+		struct rchan_buf *buf, int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+					&relay_file_operations);
+}
+
+static int mtrace_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static struct rchan_callbacks mtrace_relay_callbacks = {
+	.create_buf_file = mtrace_create_buf_file,
+	.remove_buf_file = mtrace_remove_buf_file,
+};
+
+static void f2fs_build_mtrace(struct f2fs_sb_info *sbi)
+{
+	char name[BDEVNAME_SIZE + 8];
+
+	sbi->mtrace_chan = NULL;
+	if (!f2fs_debugfs_root)
+		return;
+
+	snprintf(name, sizeof(name), "mtrace-%s-", sbi->sb->s_id);
+	sbi->mtrace_chan = relay_open(name, f2fs_debugfs_root,
+			MTRACE_SUBBUF_SIZE, MTRACE_N_SUBBUFS,
+			&mtrace_relay_callbacks, NULL);
+	if (!sbi->mtrace_chan)
+		f2fs_msg(sbi->sb, KERN_WARNING,
+			"failed to create mtrace channel, tracing disabled");
+}
+
+static void f2fs_destroy_mtrace(struct f2fs_sb_info *sbi)
+{
+	if (!sbi->mtrace_chan)
+		return;
+	relay_close(sbi->mtrace_chan);
+	sbi->mtrace_chan = NULL;
+}
+
+/*
+ * Events are dropped, not blocked on, once a cpu's sub-buffers are full;
+ * the reader is expected to drain the debugfs files while tracing.
+ */
+void f2fs_mtrace(struct f2fs_sb_info *sbi, unsigned int event, int arg,
+		u64 v0, u64 v1, u64 v2, u64 v3, u64 v4, u64 v5,
+		const char *key, const char *name)
+{
+	struct f2fs_mtrace_entry e;
+
+	if (!sbi->mtrace_chan)
+		return;
+
+	e.time = local_clock();
+	e.event = event;
+	e.arg = arg;
+	e.val[0] = v0;
+	e.val[1] = v1;
+	e.val[2] = v2;
+	e.val[3] = v3;
+	e.val[4] = v4;
+	e.val[5] = v5;
+	strncpy(e.key, key ? key : "", MTRACE_KEY_LEN - 1);
+	e.key[MTRACE_KEY_LEN - 1] = '\0';
+	strncpy(e.name, name ? name : "", MTRACE_NAME_LEN - 1);
+	e.name[MTRACE_NAME_LEN - 1] = '\0';
+
+	relay_write(sbi->mtrace_chan, &e, sizeof(e));
+}
+#endif
+
+#ifdef F2FS_FSYNC_STAT
+static const char *fsync_phase_name[NR_FSYNC_PHASE] = {
+	"FILEMAP", "INODE", "SYNCFS", "NODE", "NODEW", "FLUSH", "TOTAL",
+};
+
+static const char *fsync_ftype_name[NR_FSYNC_FTYPE] = {
+	"DB", "WAL", "JOURNAL", "CACHE", "OTHER",
+};
+
+static int fsync_ftype(struct inode *inode)
+{
+#ifdef F2FS_FGROUP
+	switch (F2FS_I(inode)->i_filetype) {
+	case FGROUP_DATABASES:
+	case FGROUP_EXT_DBETC:
+		return FSYNC_FT_DB;
+	case FGROUP_EXT_WAL:
+		return FSYNC_FT_WAL;
+	case FGROUP_EXT_JOURNAL:
+	case FGROUP_EXT_SPECIAL_JOURNAL:
+		return FSYNC_FT_JOURNAL;
+	case FGROUP_CACHE:
+	case FGROUP_CACHE_INDEX:
+		return FSYNC_FT_CACHE;
+	}
+#endif
+	return FSYNC_FT_OTHER;
+}
+
+/* bucket 0: < 1us, bucket b: [2^(b-1), 2^b) us */
+static inline int fsync_bucket(u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	return min_t(int, fls64(us), NR_FSYNC_BUCKET - 1);
+}
+
+void f2fs_fsync_stat(struct f2fs_sb_info *sbi, struct inode *inode, u64 *phase)
+{
+	struct f2fs_fsync_hist *h;
+	int type = fsync_ftype(inode);
+	int i;
+
+	if (!sbi->fsync_hist)
+		return;
+
+	h = get_cpu_ptr(sbi->fsync_hist);
+	for (i = 0; i < NR_FSYNC_PHASE; i++) {
+		/* phases that were not reached stay at zero */
+		if (phase[i])
+			h->count[type][i][fsync_bucket(phase[i])]++;
+	}
+	put_cpu_ptr(sbi->fsync_hist);
+}
+
+static int fsync_show(struct seq_file *s, void *v)
+{
+	struct f2fs_stat_info *si;
+	unsigned long count[NR_FSYNC_BUCKET];
+	unsigned long total, sum;
+	int type, ph, b, cpu, p99;
+
+	mutex_lock(&f2fs_stat_mutex);
+	list_for_each_entry(si, &f2fs_stat_list, stat_list) {
+		if (!si->sbi->fsync_hist)
+			continue;
+		seq_printf(s, "FSYNC(%s)\tPHASE\tCOUNT\tP99(us)",
+						si->sbi->sb->s_id);
+		for (b = 0; b < NR_FSYNC_BUCKET; b++)
+			seq_printf(s, "\t<%lu", 1UL << b);
+		seq_putc(s, '\n');
+
+		for (type = 0; type < NR_FSYNC_FTYPE; type++) {
+			for (ph = 0; ph < NR_FSYNC_PHASE; ph++) {
+				struct f2fs_fsync_hist *h;
+
+				memset(count, 0, sizeof(count));
+				for_each_possible_cpu(cpu) {
+					h = per_cpu_ptr(si->sbi->fsync_hist, cpu);
+					for (b = 0; b < NR_FSYNC_BUCKET; b++)
+						count[b] += h->count[type][ph][b];
+				}
+				total = 0;
+				for (b = 0; b < NR_FSYNC_BUCKET; b++)
+					total += count[b];
+				if (!total)
+					continue;
+
+				sum = 0;
+				for (p99 = 0; p99 < NR_FSYNC_BUCKET - 1; p99++) {
+					sum += count[p99];
+					if (sum * 100 >= total * 99)
+						break;
+				}
+				seq_printf(s, "%s\t%s\t%lu\t%lu",
+					fsync_ftype_name[type],
+					fsync_phase_name[ph], total, 1UL << p99);
+				for (b = 0; b < NR_FSYNC_BUCKET; b++)
+					seq_printf(s, "\t%lu", count[b]);
+				seq_putc(s, '\n');
+			}
+		}
+	}
+	mutex_unlock(&f2fs_stat_mutex);
+
+	return 0;
+}
+
+static int fsync_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fsync_show, inode->i_private);
+}
+
+/* any write clears the histograms, e.g. between benchmark runs */
+static ssize_t fsync_write(struct file *file, const char __user *buf,
+					size_t len, loff_t *ppos)
+{
+	struct f2fs_stat_info *si;
+	int cpu;
+
+	mutex_lock(&f2fs_stat_mutex);
+	list_for_each_entry(si, &f2fs_stat_list, stat_list) {
+		if (!si->sbi->fsync_hist)
+			continue;
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(si->sbi->fsync_hist, cpu), 0,
+					sizeof(struct f2fs_fsync_hist));
+	}
+	mutex_unlock(&f2fs_stat_mutex);
+
+	return len;
+}
+
+static const struct file_operations fsync_fops = {
+	.owner = THIS_MODULE,
+	.open = fsync_open,
+	.read = seq_read,
+	.write = fsync_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+#ifdef F2FS_LIFETIME_HIST
+static void lifetime_hist_show(struct seq_file *s, const char *name,
+			unsigned long (*hist)[NR_LIFETIME_BUCKET])
+{
+	int type, b;
+
+	seq_printf(s, "%s\tTOTAL", name);
+	for (b = 0; b < NR_LIFETIME_BUCKET; b++)
+		seq_printf(s, "\t<2^%d", b);
+	seq_putc(s, '\n');
+
+	for (type = 0; type < NR_CURSEG_TYPE; type++) {
+		unsigned long total = 0;
+
+		for (b = 0; b < NR_LIFETIME_BUCKET; b++)
+			total += hist[type][b];
+		if (!total)
+			continue;
+		seq_printf(s, "%d\t%lu", type, total);
+		for (b = 0; b < NR_LIFETIME_BUCKET; b++)
+			seq_printf(s, "\t%lu", hist[type][b]);
+		seq_putc(s, '\n');
+	}
+}
+
+static int lifetime_show(struct seq_file *s, void *v)
+{
+	struct f2fs_stat_info *si;
+
+	mutex_lock(&f2fs_stat_mutex);
+	list_for_each_entry(si, &f2fs_stat_list, stat_list) {
+		struct f2fs_sb_info *sbi = si->sbi;
+
+		seq_printf(s, "%s: block age by stream, in %s\n",
+			sbi->sb->s_id,
+			sbi->lifetime_clock == LIFETIME_CLOCK_TIME ?
+			"seconds" : "blocks written");
+		lifetime_hist_show(s, "INVALID", sbi->lifetime_hist);
+		lifetime_hist_show(s, "GC-MOVE", sbi->gc_age_hist);
+	}
+	mutex_unlock(&f2fs_stat_mutex);
+
+	return 0;
+}
+
+static int lifetime_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lifetime_show, inode->i_private);
+}
+
+/* any write clears the histograms */
+static ssize_t lifetime_write(struct file *file, const char __user *buf,
+					size_t len, loff_t *ppos)
+{
+	struct f2fs_stat_info *si;
+
+	mutex_lock(&f2fs_stat_mutex);
+	list_for_each_entry(si, &f2fs_stat_list, stat_list) {
+		struct f2fs_sb_info *sbi = si->sbi;
+
+		mutex_lock(&SIT_I(sbi)->sentry_lock);
+		memset(sbi->lifetime_hist, 0, sizeof(sbi->lifetime_hist));
+		memset(sbi->gc_age_hist, 0, sizeof(sbi->gc_age_hist));
+		mutex_unlock(&SIT_I(sbi)->sentry_lock);
+	}
+	mutex_unlock(&f2fs_stat_mutex);
+
+	return len;
+}
+
+static const struct file_operations lifetime_fops = {
+	.owner = THIS_MODULE,
+	.open = lifetime_open,
+	.read = seq_read,
+	.write = lifetime_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
 int f2fs_build_stats(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_super_block *raw_super = F2FS_RAW_SUPER(sbi);
@@ -669,10 +1042,18 @@ int f2fs_build_stats(struct f2fs_sb_info *sbi)
 	atomic_set(&sbi->max_aw_cnt, 0);
 	atomic_set(&sbi->max_vw_cnt, 0);
 
+#ifdef F2FS_FSYNC_STAT
+	/* optional, fsync just is not accounted without it */
+	sbi->fsync_hist = alloc_percpu(struct f2fs_fsync_hist);
+#endif
+
 	mutex_lock(&f2fs_stat_mutex);
 	list_add_tail(&si->stat_list, &f2fs_stat_list);
 	mutex_unlock(&f2fs_stat_mutex);
 
+#ifdef F2FS_TRACE_ENABLE
+	f2fs_build_mtrace(sbi);
+#endif
 	return 0;
 }
 
@@ -680,10 +1061,18 @@ void f2fs_destroy_stats(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_stat_info *si = F2FS_STAT(sbi);
 
+#ifdef F2FS_TRACE_ENABLE
+	f2fs_destroy_mtrace(sbi);
+#endif
 	mutex_lock(&f2fs_stat_mutex);
 	list_del(&si->stat_list);
 	mutex_unlock(&f2fs_stat_mutex);
 
+#ifdef F2FS_FSYNC_STAT
+	free_percpu(sbi->fsync_hist);
+	sbi->fsync_hist = NULL;
+#endif
+
 	kfree(si);
 }
 
@@ -714,6 +1103,26 @@ int __init f2fs_create_root_stats(void)
 	}
 #endif
 
+#ifdef F2FS_LIFETIME_HIST
+	file = debugfs_create_file("lifetime", S_IRUGO | S_IWUSR,
+			f2fs_debugfs_root, NULL, &lifetime_fops);
+	if (!file) {
+		debugfs_remove_recursive(f2fs_debugfs_root);
+		f2fs_debugfs_root = NULL;
+		return -ENOMEM;
+	}
+#endif
+
+#ifdef F2FS_FSYNC_STAT
+	file = debugfs_create_file("fsync", S_IRUGO | S_IWUSR,
+			f2fs_debugfs_root, NULL, &fsync_fops);
+	if (!file) {
+		debugfs_remove_recursive(f2fs_debugfs_root);
+		f2fs_debugfs_root = NULL;
+		return -ENOMEM;
+	}
+#endif
+
 	return 0;
 }
 
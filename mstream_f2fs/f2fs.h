@@ -198,6 +198,7 @@ struct discard_entry {
 #define GC_TIME
 //#define CLUSTER_TIME
 #define F2FS_TRACE_ENABLE
+#define F2FS_FSYNC_STAT		// per-phase fsync latency histograms
 #define F2FS_FGROUP		// ORG or mStream(vStream)
 //#define F2FS_ALL_PMT		// TL(ALL)
 #define F2FS_WNODE_BMT		// enble:TL(m,n) disable:TL(m,n,i)
@@ -221,6 +222,11 @@ struct discard_entry {
 #define GC_AGE_START 160	// select 1-100
 #define GC_AGE_SUM	(40)	// 100=2x 50=3x
 #endif
+#define F2FS_GC_RELOC		// GC moves blocks by remaining lifetime
+#define F2FS_LIFETIME_HIST	// per-stream block lifetime histograms
+#define F2FS_GC_RESEG		// idle pass moves blocks to their fgroup's stream
+#define F2FS_SSR_LIFETIME	// SSR across streams of similar lifetime
+#define F2FS_CP_GROUP		// checkpoint flushes dnodes stream by stream
 #endif
 //////////////////////////////////
 
@@ -230,14 +236,19 @@ struct discard_entry {
 //////////////////////////////
 
 #ifdef F2FS_FGROUP
-#define NR_CLUSTER	(4)
+#define NR_CLUSTER	(4)		/* default # of streams, see nr_streams= */
+
+/* what lifetimes are measured in, see lifetime_clock= */
+enum {
+	LIFETIME_CLOCK_BLOCKS,		/* user data blocks written */
+	LIFETIME_CLOCK_TIME,		/* seconds of the simulated clock */
+};
 //#define EMA_W_NUM	(3)
 #define EMA_W_NUM	(7)
 #define EMA_W_DIV	(10)
 #define EMA_SIZE	(4096)
 
 ///////////////////////////// prev conf
-//#define F2FS_FSYNC_TRACE
 //#define F2FS_NODE_AREA		// enable:HMC, disable:TL(ALL)/HC
 //#define F2FS_MHC_STREAM		// meta+hotnode+coldnode
 #define NR_DATABASE	(0)
@@ -268,7 +279,47 @@ error
 
 #define NR_COLD	(0)
 #define F2FS_VSTREAM_FILE	(0)
-#define	NR_CURSEG_DATA_TYPE	(NR_CLUSTER+NR_DATABASE+NR_COLD)
+
+/*
+ * Data logs are laid out for NR_CLUSTER streams, as mkfs.f2fs formats them.
+ * F2FS_WIDE_LOGS lays them out for MAX_CLUSTER instead and needs an
+ * mkfs.f2fs built to match; sanity_check_ckpt() refuses the other layout.
+ * nr_streams= picks how many of them the clustering actually uses.
+ */
+#define MAX_CLUSTER	(8)
+//#define F2FS_WIDE_LOGS
+#ifdef F2FS_WIDE_LOGS
+#define NR_CLUSTER_LOGS	(MAX_CLUSTER)
+#else
+#define NR_CLUSTER_LOGS	(NR_CLUSTER)
+#endif
+#define DEF_KMEANS_K_PENALTY	(5)	/* adaptive_k, see choose_cluster_count */
+#define NR_LIFETIME_BUCKET	(32)	/* see F2FS_LIFETIME_HIST */
+#define DEF_RESEG_BUDGET	(0)	/* blocks per idle pass, 0 = off (F2FS_GC_RESEG) */
+#define RESEG_SCAN_SEGS		(1024)	/* segments looked at per idle pass */
+
+#ifdef F2FS_CP_GROUP
+/* write_checkpoint() phases */
+enum {
+	CP_PH_BLOCK_OPS,	/* block_operations, node flush included */
+	CP_PH_NAT_SIT,		/* flush_nat_entries + flush_sit_entries */
+	CP_PH_DO_CP,		/* do_checkpoint, meta pages and cp pack */
+	CP_PH_TOTAL,
+	NR_CP_PHASE,
+};
+#endif
+#define	NR_CURSEG_DATA_TYPE	(NR_CLUSTER_LOGS+NR_DATABASE+NR_COLD)
+
+#if (NR_CURSEG_DATA_TYPE > MAX_ACTIVE_DATA_LOGS)
+error
+#endif
+#if (defined F2FS_GC_RESEG && \
+	!(defined F2FS_GC_RELOC && defined F2FS_LIFETIME_HIST))
+error
+#endif
+#if (NR_CLUSTER > MAX_CLUSTER || NR_CLUSTER < 2)
+error
+#endif
 
 #if (NR_COLD==2)
 #define CONFIG_F2FS_2LEVEL_COLD
@@ -284,34 +335,70 @@ error
 #endif
 
 #ifdef F2FS_FGROUP
-#define CLUSTER_NUM		(NR_CLUSTER)
+#define CLUSTER_NUM(sbi)	((sbi)->nr_cluster)
 
 // OH TEST
 //#define CLUSTER_T		(64 * 512 * 8)
 //#define PROFILE_T	(64 * 512 * 8)
-#define CLUSTER_T		(256 * 512 * 8)
-#define PROFILE_T	(1024 * 512 * 8)
+#define CLUSTER_T		(256 * 512 * 8)		/* user blocks */
+#define PROFILE_T	(1024 * 8)		/* lifetime units */
 
 #define MAX_HISTORY	(2048)
 
-#define MAX_SAMPLE (32)
-#define SAMPLE_RATE 2
+/* minimum gap between two clustering runs, bounds the worker's CPU use */
+#define DEF_CLUSTER_MIN_INTERVAL	1000	/* milliseconds */
+
+struct f2fs_cluster_kthread {
+	struct task_struct *f2fs_cluster_task;
+	wait_queue_head_t cluster_wait_queue_head;
+	unsigned long cluster_pending;		/* bit 0: wakeup requested */
+	unsigned int min_interval;
+};
+
 #define COLD_RATE (40)
 
+/*
+ * Per-page lifetime sketch, only allocated for FGROUP_DATABASES files.
+ * A page is sampled when the hash of its index falls below
+ * db_sample_pages / max_range, so the sampled subset only shrinks as the
+ * file grows and stays the same across k-means rounds.  Sampled pages sit
+ * in an open-addressed table holding the last write time as a u32 delta
+ * from base (0: empty slot), sized for db_sample_pages when the sketch is
+ * created.  Lifetimes feed a running sum that is halved on overflow and at
+ * every k-means round instead of being dropped.
+ */
+#define DEF_DB_SAMPLE_PAGES	48
+#define DB_SAMPLE_MAX_BITS	11
+#define DB_SAMPLE_MAX_PAGES	((1 << DB_SAMPLE_MAX_BITS) * 3 / 4)	/* max load */
+#define DB_SAMPLE_MAX_COUNT	(1 << 16)
+
+struct db_sample_slot {
+	u32 index;				/* page index */
+	u32 lastupdate;				/* write time - base + 1 */
+};
+
+struct file_sample {
+	unsigned long long base;
+	unsigned long long lifetime_sum;
+	unsigned int lifetime_count;
+	unsigned int nr_used;
+	unsigned int purge_range;		/* max_range at last purge */
+	unsigned int bits;			/* table has 1 << bits slots */
+	struct db_sample_slot slot[0];
+};
+
 struct file_entry {
 	struct rb_node rb_node;
+	struct list_head list;			/* lifetime_list, idle first */
+	unsigned long long fgroup;		/* fgroup valid was counted in */
 	unsigned int ino;
 	unsigned long last_0_update;
 	unsigned long last_offset;
 	unsigned long lifetime;
 
 	unsigned long sample_avglifetime; 
-	unsigned long sample_invalid[MAX_SAMPLE];
-	unsigned long sample_lifetime[MAX_SAMPLE];
-	unsigned long sample_lastupdate[MAX_SAMPLE];
-	long sample_index[MAX_SAMPLE];
+	struct file_sample *sample;
 	unsigned int last_kmeans;
-	unsigned int sample_rate;
 	unsigned int max_range;
 
 	int filetype;
@@ -345,12 +432,89 @@ struct fgroup_history {
 };
 
 struct kmeans_history {
-	unsigned int q1[NR_CLUSTER];
-	unsigned int q3[NR_CLUSTER];
+	unsigned int q1[MAX_CLUSTER];
+	unsigned int q3[MAX_CLUSTER];
 	unsigned int seq;
 };
+
+/*
+ * fgroup lifetime model saved in the umount checkpoint pack, between the
+ * orphan blocks and the summaries: entry blocks first, header last. The
+ * orphan limit leaves room for MODEL_MAX_BLOCKS of it.  Only the EMA state is kept; clusters are recomputed from it.
+ */
+#define CP_FGROUP_MODEL_FLAG	0x80000000
+#define F2FS_MODEL_MAGIC	0x6d535452	/* "mSTR" */
+#define MODEL_KEY_LEN		52
+
+struct f2fs_model_entry {
+	__le64 ema;
+	__le64 count;
+	__le64 latest_lifetime;
+	__le64 latest_count;
+	__u8 vtype;
+	__u8 update_ema;
+	__u8 reserved[2];
+	char keyword[MODEL_KEY_LEN];
+} __packed;
+
+#define MODEL_ENTRY_PER_BLOCK	((F2FS_BLKSIZE - 16) / \
+					sizeof(struct f2fs_model_entry))
+#define MODEL_MAX_BLOCKS	(DIV_ROUND_UP(MAX_HISTORY, \
+					MODEL_ENTRY_PER_BLOCK) + 1)
+
+struct f2fs_model_block {
+	__le32 magic;
+	__le32 crc;			/* of the block past this field */
+	__le32 index;
+	__le32 nr_entries;
+	struct f2fs_model_entry entries[MODEL_ENTRY_PER_BLOCK];
+} __packed;
+
+struct f2fs_model_header {
+	__le32 magic;
+	__le32 crc;			/* of the block past this field */
+	__le64 cp_ver;			/* checkpoint pack it belongs to */
+	__le32 nr_blocks;		/* entry blocks before the header */
+	__le32 nr_entries;
+	__le32 nr_cluster;
+	__le32 lifetime_clock;		/* LIFETIME_CLOCK_xxx, 0 in old packs */
+	__le64 kmeans_max[MAX_CLUSTER];
+	__le64 kmeans_center[MAX_CLUSTER];
+	__le32 q1[MAX_CLUSTER];
+	__le32 q3[MAX_CLUSTER];
+} __packed;
 #endif
 
+/*
+ * Binary trace records, one relay file per cpu in debugfs
+ * (f2fs/mtrace-<dev>-<cpu>); decoded by trace_replay/mtraceDecode.cpp.
+ * The layout is shared with the decoder, keep both in sync.
+ */
+enum {
+	MTRACE_EXPECTLIFE,	/* arg: 0, val: active invalid prev_ema life_invalid lifetime ema */
+	MTRACE_EXPECTLIFE_L0,	/* same as MTRACE_EXPECTLIFE, first EMA sample */
+	MTRACE_COLDRATE,	/* arg: cluster, val: age cold valid count vtype */
+	MTRACE_CLUSTER,		/* arg: cluster, val: lifetime cold valid count filetype */
+	MTRACE_DB_LIFETIME,	/* arg: kind, val: index lifetime 0 seq_or_avg */
+	MTRACE_GC,		/* arg: seg type, val: seg_lifetime cur_seq cost free */
+	NR_MTRACE_EVENT,
+};
+
+#define MTRACE_NR_VAL		6
+#define MTRACE_KEY_LEN		64
+#define MTRACE_NAME_LEN		128
+#define MTRACE_SUBBUF_SIZE	(256 * 1024)
+#define MTRACE_N_SUBBUFS	8
+
+struct f2fs_mtrace_entry {
+	__u64 time;			/* local_clock() in ns */
+	__u32 event;			/* MTRACE_* */
+	__s32 arg;
+	__u64 val[MTRACE_NR_VAL];
+	char key[MTRACE_KEY_LEN];	/* fgroup / inode keyword */
+	char name[MTRACE_NAME_LEN];	/* file name, DB events only */
+};
+
 /* max discard pend list number */
 #define MAX_PLIST_NUM		512
 #define plist_idx(blk_num)	((blk_num) >= MAX_PLIST_NUM ?		\
@@ -469,6 +633,7 @@ static inline bool __has_cursum_space(struct f2fs_journal *journal,
 						struct f2fs_flush_device)
 #define F2FS_IOC_GARBAGE_COLLECT_RANGE	_IOW(F2FS_IOCTL_MAGIC, 11,	\
 						struct f2fs_gc_range)
+#define F2FS_IOC_SIMUL_TIME		_IOW(F2FS_IOCTL_MAGIC, 12, __u64)
 
 #define F2FS_IOC_SET_ENCRYPTION_POLICY	FS_IOC_SET_ENCRYPTION_POLICY
 #define F2FS_IOC_GET_ENCRYPTION_POLICY	FS_IOC_GET_ENCRYPTION_POLICY
@@ -1271,6 +1436,12 @@ struct f2fs_sb_info {
 	 */
 #ifdef CONFIG_F2FS_STAT_FS
 	struct f2fs_stat_info *stat_info;	/* FS status information */
+#ifdef F2FS_TRACE_ENABLE
+	struct rchan *mtrace_chan;		/* binary mStream event trace */
+#endif
+#ifdef F2FS_FSYNC_STAT
+	struct f2fs_fsync_hist __percpu *fsync_hist;
+#endif
 	unsigned int segment_count[2];		/* # of allocated segments */
 	unsigned int block_count[2];		/* # of allocated blocks */
 	atomic_t inplace_count;		/* # of inplace update */
@@ -1292,8 +1463,18 @@ struct f2fs_sb_info {
 	unsigned int type_block[2][NR_CURSEG_TYPE];
 	unsigned int type_gc[NR_CURSEG_TYPE];
 	unsigned int type_gc_calls[NR_CURSEG_TYPE];
+#ifdef F2FS_GC_RELOC
+	/* blocks moved by GC, [victim log][destination log] */
+	unsigned int gc_reloc[NR_CURSEG_DATA_TYPE][NR_CURSEG_DATA_TYPE];
+#endif
 	block_t total_blocks;
 	unsigned int cur_node_gc;
+	unsigned int cur_data_gc;		/* data segment being migrated */
+#ifdef F2FS_LIFETIME_HIST
+	/* log2 of block age in lifetime clock ticks, under sentry_lock */
+	unsigned long lifetime_hist[NR_CURSEG_TYPE][NR_LIFETIME_BUCKET];
+	unsigned long gc_age_hist[NR_CURSEG_TYPE][NR_LIFETIME_BUCKET];
+#endif
 
 #ifdef F2FS_TRACE_ENABLE
 	unsigned int type_segment_invalid[NR_CURSEG_TYPE];
@@ -1314,8 +1495,13 @@ struct f2fs_sb_info {
 #ifdef F2FS_FGROUP
 	unsigned int fgroup_count[FGROUP_ETC];
 	struct rb_root lifetime_tree;
+	struct list_head lifetime_list;		/* file entries, LRU order */
+	unsigned long nr_file_entries;
+	unsigned long nr_file_samples;
+	unsigned int db_sample_pages;		/* sampled pages per DB file */
 	spinlock_t ltree_lock;
 	struct rb_root fgroup_tree;
+	unsigned long nr_fgroup_entries;
 	spinlock_t ftree_lock;
 #endif
 
@@ -1330,9 +1516,49 @@ struct f2fs_sb_info {
 	unsigned int *seg_lifetime;
 #endif
 #ifdef F2FS_FGROUP
+	int nr_cluster;				/* # of streams (nr_streams=) */
+	unsigned int lifetime_clock;		/* lifetime_clock= */
+	atomic64_t simul_offset;		/* simulated - boot time, secs */
 	unsigned long long *kmeans_max;
 	unsigned long long *kmeans_center;
 	unsigned int kmeans_count;
+	seqlock_t kmeans_lock;			/* publishes max/center/count */
+	int kmeans_k;				/* clusters in use, < nr_cluster */
+	unsigned int adaptive_k;		/* sysfs: choose k every round */
+	unsigned int kmeans_k_penalty;		/* % of W(1) an extra k costs */
+	unsigned long long kmeans_k_cost[MAX_CLUSTER];	/* last round */
+	unsigned int kmeans_k_rounds[MAX_CLUSTER];	/* per k, index k-1 */
+	unsigned long long kmeans_k_user[MAX_CLUSTER];
+	unsigned long long kmeans_k_gc[MAX_CLUSTER];
+	unsigned long long kmeans_k_last_user;
+	unsigned long long kmeans_k_last_gc;
+	struct f2fs_cluster_kthread *cluster_thread;
+#ifdef F2FS_GC_RELOC
+	unsigned int gc_reloc_policy;		/* GC_RELOC_xxx, via sysfs */
+#endif
+#ifdef F2FS_GC_RESEG
+	unsigned int reseg_budget;		/* sysfs: blocks per pass, 0: off */
+	unsigned int reseg_cursor;		/* next segment to scan */
+	unsigned short *reseg_moved;		/* blocks moved out, per segment */
+	unsigned long long reseg_passes;
+	unsigned long long reseg_segs;
+	unsigned long long reseg_blocks;	/* moved by the idle pass */
+	unsigned long long reseg_saved;		/* ... out of later GC victims */
+	unsigned long long reseg_unneeded;	/* ... out of segments never GCed */
+#endif
+#ifdef F2FS_SSR_LIFETIME
+	unsigned int ssr_policy;		/* SSR_xxx, via sysfs */
+	unsigned long long ssr_same;		/* data SSR segments, own stream */
+	unsigned long long ssr_cross;		/* ... taken from another stream */
+	unsigned long long ssr_rejected;	/* ... skipped, lifetime mismatch */
+#endif
+#ifdef F2FS_CP_GROUP
+	unsigned int cp_group;			/* sysfs: sync dnodes by stream */
+	unsigned long long cp_dnodes[MAX_CLUSTER];	/* per data stream */
+	unsigned long long cp_time[NR_CP_PHASE];	/* ns, under cp_mutex */
+	unsigned long long cp_time_max[NR_CP_PHASE];
+	unsigned long long cp_timed;		/* checkpoints in cp_time */
+#endif
 
 	struct kmeans_history *kmeans_history;
 	struct fgroup_history *fgroup_history;
@@ -1451,13 +1677,95 @@ static inline unsigned int user_data_blocks(struct f2fs_sb_info *sbi)
 	return data_blocks;
 }
 
-static inline void print_exec_time(const char *str, unsigned int fsyncID, u64 start_time, u64 end_time)
+#ifdef F2FS_FGROUP
+/* seconds; advanced by F2FS_IOC_SIMUL_TIME, otherwise follows boot time */
+static inline unsigned long long f2fs_simul_time(struct f2fs_sb_info *sbi)
 {
-	u64 exec_time = ktime_to_ns(ktime_sub(end_time, start_time));
-	trace_printk("%s\t%u\t%llu\n", str, fsyncID, exec_time);
+	return div_u64(ktime_get_boot_ns(), NSEC_PER_SEC) +
+				atomic64_read(&sbi->simul_offset);
 }
 #endif
 
+/* clock the lifetime model (file/fgroup/segment ages) is measured in */
+static inline unsigned long long f2fs_lifetime_clock(struct f2fs_sb_info *sbi)
+{
+#ifdef F2FS_FGROUP
+	if (sbi->lifetime_clock == LIFETIME_CLOCK_TIME)
+		return f2fs_simul_time(sbi);
+#endif
+	return user_data_blocks(sbi);
+}
+
+/*
+ * Clock ticks per lifetime unit, the unit k-means (q1/q3, kmeans_max) and
+ * the GC segment ages work in: a segment's worth of user blocks, or one
+ * simulated second.  Thresholds go through here so both clocks see them.
+ */
+static inline unsigned int f2fs_lifetime_unit(struct f2fs_sb_info *sbi)
+{
+#ifdef F2FS_FGROUP
+	if (sbi->lifetime_clock == LIFETIME_CLOCK_TIME)
+		return 1;
+#endif
+	return sbi->blocks_per_seg;
+}
+
+static inline unsigned long long f2fs_clock_to_seq(struct f2fs_sb_info *sbi,
+						unsigned long long clock)
+{
+	return div_u64(clock, f2fs_lifetime_unit(sbi));
+}
+
+static inline unsigned long long f2fs_seq_to_clock(struct f2fs_sb_info *sbi,
+						unsigned long long seq)
+{
+	return seq * f2fs_lifetime_unit(sbi);
+}
+
+static inline unsigned long long f2fs_cur_seq(struct f2fs_sb_info *sbi)
+{
+	return f2fs_clock_to_seq(sbi, f2fs_lifetime_clock(sbi));
+}
+
+#ifdef F2FS_FGROUP
+/* data log backing lifetime cluster @cluster; the last cluster is cold */
+static inline int cluster_to_curseg(struct f2fs_sb_info *sbi, int cluster)
+{
+	if (cluster >= sbi->nr_cluster - 1)
+		return CURSEG_COLD_DATA;
+	/* streams left unused by adaptive_k merge into the longest one */
+	if (cluster >= sbi->kmeans_k)
+		cluster = sbi->kmeans_k - 1;
+	return CLUSTER_START_TYPE + cluster;
+}
+
+static inline int curseg_to_cluster(struct f2fs_sb_info *sbi, int type)
+{
+	if (type == CURSEG_COLD_DATA)
+		return sbi->nr_cluster - 1;
+	return type - CLUSTER_START_TYPE;
+}
+
+/* second coldest log, what CURSEG_COLD_DATA - 1 is with all streams in use */
+static inline int cold_fallback_curseg(struct f2fs_sb_info *sbi)
+{
+	return cluster_to_curseg(sbi, (sbi->nr_cluster - 1) - 1);
+}
+
+/* called from the write path; kicks clustering once CLUSTER_T is crossed */
+static inline void f2fs_wake_cluster_thread(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_cluster_kthread *cl_th = sbi->cluster_thread;
+
+	if (!cl_th || user_data_blocks(sbi) < sbi->last_cluster)
+		return;
+	if (!test_and_set_bit(0, &cl_th->cluster_pending))
+		wake_up_interruptible(&cl_th->cluster_wait_queue_head);
+}
+#endif
+
+#endif
+
 /*
  * Inline functions
  */
@@ -2748,6 +3056,9 @@ void add_orphan_inode(struct inode *inode);
 void remove_orphan_inode(struct f2fs_sb_info *sbi, nid_t ino);
 int recover_orphan_inodes(struct f2fs_sb_info *sbi);
 int get_valid_checkpoint(struct f2fs_sb_info *sbi);
+#ifdef F2FS_FGROUP
+void f2fs_load_fgroup_model(struct f2fs_sb_info *sbi);
+#endif
 void update_dirty_page(struct inode *inode, struct page *page);
 void remove_dirty_inode(struct inode *inode);
 int sync_dirty_inodes(struct f2fs_sb_info *sbi, enum inode_type type);
@@ -2806,6 +3117,13 @@ block_t start_bidx_of_node(unsigned int node_ofs, struct inode *inode);
 int f2fs_gc(struct f2fs_sb_info *sbi, bool sync, bool background,
 			unsigned int segno);
 void build_gc_manager(struct f2fs_sb_info *sbi);
+#ifdef F2FS_GC_RELOC
+int f2fs_gc_reloc_type(struct f2fs_sb_info *sbi, struct inode *inode,
+						unsigned int segno);
+#endif
+#ifdef F2FS_GC_RESEG
+void f2fs_resegregate(struct f2fs_sb_info *sbi);
+#endif
 
 /*
  * recovery.c
@@ -2816,6 +3134,41 @@ bool space_for_roll_forward(struct f2fs_sb_info *sbi);
 /*
  * debug.c
  */
+#ifdef F2FS_FSYNC_STAT
+/* f2fs_do_sync_file() phases, see debugfs f2fs/fsync */
+enum {
+	FSYNC_PH_FILEMAP,	/* data writeback and wait */
+	FSYNC_PH_INODE,		/* f2fs_write_inode */
+	FSYNC_PH_SYNCFS,	/* checkpoint instead of roll-forward */
+	FSYNC_PH_NODE,		/* fsync_node_pages */
+	FSYNC_PH_NODEW,		/* wait on node writeback */
+	FSYNC_PH_FLUSH,		/* cache flush */
+	FSYNC_PH_TOTAL,
+	NR_FSYNC_PHASE,
+};
+
+enum {
+	FSYNC_FT_DB,
+	FSYNC_FT_WAL,
+	FSYNC_FT_JOURNAL,
+	FSYNC_FT_CACHE,
+	FSYNC_FT_OTHER,
+	NR_FSYNC_FTYPE,
+};
+
+#define NR_FSYNC_BUCKET		24	/* log2(usec), last one open-ended */
+
+struct f2fs_fsync_hist {
+	unsigned long count[NR_FSYNC_FTYPE][NR_FSYNC_PHASE][NR_FSYNC_BUCKET];
+};
+
+#define fsync_time_start(t)		((t) = ktime_get_ns())
+#define fsync_time_end(ph, t)		((ph) += ktime_get_ns() - (t))
+#else
+#define fsync_time_start(t)		do { } while (0)
+#define fsync_time_end(ph, t)		do { } while (0)
+#endif
+
 #ifdef CONFIG_F2FS_STAT_FS
 struct f2fs_stat_info {
 	struct list_head stat_list;
@@ -2858,6 +3211,9 @@ struct f2fs_stat_info {
 	unsigned int type_block[2][NR_CURSEG_TYPE];
 	unsigned int type_gc[NR_CURSEG_TYPE];
 	unsigned int type_gc_calls[NR_CURSEG_TYPE];
+#ifdef F2FS_GC_RELOC
+	unsigned int gc_reloc[NR_CURSEG_DATA_TYPE][NR_CURSEG_DATA_TYPE];
+#endif
 #ifdef F2FS_TRACE_ENABLE
 	unsigned int type_segment_invalid[NR_CURSEG_TYPE];
 	unsigned int type_gc_invalid[NR_CURSEG_TYPE];
@@ -2929,6 +3285,10 @@ static inline struct f2fs_stat_info *F2FS_STAT(struct f2fs_sb_info *sbi)
 		((sbi)->type_gc[type]++)
 #define stat_inc_gc_calls_mtype(sbi, type)				\
 		((sbi)->type_gc_calls[type]++)
+#ifdef F2FS_GC_RELOC
+#define stat_inc_gc_reloc(sbi, from, to)				\
+		((sbi)->gc_reloc[from][to]++)
+#endif
 
 #define stat_inc_seg_invalid(sbi, type)				\
 		((sbi)->type_segment_invalid[type]++)
@@ -3012,6 +3372,14 @@ int f2fs_build_stats(struct f2fs_sb_info *sbi);
 void f2fs_destroy_stats(struct f2fs_sb_info *sbi);
 int __init f2fs_create_root_stats(void);
 void f2fs_destroy_root_stats(void);
+#ifdef F2FS_FSYNC_STAT
+void f2fs_fsync_stat(struct f2fs_sb_info *sbi, struct inode *inode, u64 *phase);
+#endif
+#ifdef F2FS_TRACE_ENABLE
+void f2fs_mtrace(struct f2fs_sb_info *sbi, unsigned int event, int arg,
+		u64 v0, u64 v1, u64 v2, u64 v3, u64 v4, u64 v5,
+		const char *key, const char *name);
+#endif
 #else
 #define stat_inc_cp_count(si)				do { } while (0)
 #define stat_inc_bg_cp_count(si)			do { } while (0)
@@ -3047,6 +3415,17 @@ static inline int f2fs_build_stats(struct f2fs_sb_info *sbi) { return 0; }
 static inline void f2fs_destroy_stats(struct f2fs_sb_info *sbi) { }
 static inline int __init f2fs_create_root_stats(void) { return 0; }
 static inline void f2fs_destroy_root_stats(void) { }
+#ifdef F2FS_FSYNC_STAT
+static inline void f2fs_fsync_stat(struct f2fs_sb_info *sbi,
+				struct inode *inode, u64 *phase) { }
+#endif
+#endif
+
+#if (defined CONFIG_F2FS_MULTI_TYPE) && \
+	!(defined CONFIG_F2FS_STAT_FS && defined F2FS_TRACE_ENABLE)
+static inline void f2fs_mtrace(struct f2fs_sb_info *sbi, unsigned int event,
+		int arg, u64 v0, u64 v1, u64 v2, u64 v3, u64 v4, u64 v5,
+		const char *key, const char *name) { }
 #endif
 
 extern const struct file_operations f2fs_dir_operations;
@@ -3116,9 +3495,19 @@ int delete_file_entry(struct f2fs_sb_info *sbi, unsigned int ino);
 int check_hot_stream(unsigned long long fgroup);
 unsigned long long update_new_ema(struct f2fs_sb_info *sbi, struct fgroup_entry *re);
 int f2fs_lifetime_to_cluster(struct f2fs_sb_info *sbi, unsigned long long lifetime);
+void f2fs_set_simul_time(struct f2fs_sb_info *sbi, u64 simul_time);
+void *f2fs_build_fgroup_model(struct f2fs_sb_info *sbi, unsigned int *nr_blocks);
+void f2fs_restore_fgroup_model(struct f2fs_sb_info *sbi, void *model,
+						unsigned int nr_blocks);
+unsigned long f2fs_shrink_lifetime_entries(struct f2fs_sb_info *sbi,
+						unsigned long nr_shrink);
+void f2fs_destroy_lifetime_tree(struct f2fs_sb_info *sbi);
+int __init create_lifetime_caches(void);
+void destroy_lifetime_caches(void);
 
 /* kmeans.c */
 int start_cluster_thread(struct f2fs_sb_info *sbi);
+void stop_cluster_thread(struct f2fs_sb_info *sbi);
 #endif
 
 /*
@@ -204,38 +204,23 @@ static int f2fs_do_sync_file(struct file *file, loff_t start, loff_t end,
 		.nr_to_write = LONG_MAX,
 		.for_reclaim = 0,
 	};
-#ifdef F2FS_FSYNC_TRACE
-	volatile u64 fsync_start_time = 0, fsync_end_time = 0;
-	volatile u64 node_start_time = 0, node_end_time = 0;
-	volatile u64 nodew_start_time = 0, nodew_end_time = 0;
-	volatile u64 inode1_start_time = 0, inode1_end_time = 0;
-	volatile u64 inode2_start_time = 0, inode2_end_time = 0;
-	volatile u64 flush_start_time = 0, flush_end_time = 0;
-	volatile u64 filemap_start_time = 0, filemap_end_time = 0;
-	volatile u64 syncfs_start_time = 0, syncfs_end_time = 0;
-//	volatile uint64_t fsync_start = 0, fsync_end = 0;
-	unsigned int fsyncID = user_data_blocks(sbi);
+#ifdef F2FS_FSYNC_STAT
+	u64 phase[NR_FSYNC_PHASE] = {0, };
+	u64 fsync_start, t;
 #endif
 
 	if (unlikely(f2fs_readonly(inode->i_sb)))
 		return 0;
 
 	trace_f2fs_sync_file_enter(inode);
-#ifdef F2FS_FSYNC_TRACE
-	fsync_start_time = ktime_get();
-	//fsync_start = rdtsc();
-#endif
+	fsync_time_start(fsync_start);
 
 	/* if fdatasync is triggered, let's do in-place-update */
 	if (datasync || get_dirty_pages(inode) <= SM_I(sbi)->min_fsync_blocks)
 		set_inode_flag(inode, FI_NEED_IPU);
-#ifdef F2FS_FSYNC_TRACE
-	filemap_start_time = ktime_get();
-	ret = filemap_write_and_wait_range_fsync(inode->i_mapping, start, end, fsyncID);
-	filemap_end_time = ktime_get();
-#else
+	fsync_time_start(t);
 	ret = filemap_write_and_wait_range(inode->i_mapping, start, end);
-#endif
+	fsync_time_end(phase[FSYNC_PH_FILEMAP], t);
 	clear_inode_flag(inode, FI_NEED_IPU);
 
 	if (ret) {
@@ -245,13 +230,9 @@ static int f2fs_do_sync_file(struct file *file, loff_t start, loff_t end,
 
 	/* if the inode is dirty, let's recover all the time */
 	if (!f2fs_skip_inode_update(inode, datasync)) {
-#ifdef F2FS_FSYNC_TRACE
-		inode1_start_time = ktime_get();
-		f2fs_write_inode(inode, NULL);
-		inode1_end_time = ktime_get();
-#else
+		fsync_time_start(t);
 		f2fs_write_inode(inode, NULL);
-#endif
+		fsync_time_end(phase[FSYNC_PH_INODE], t);
 		goto go_write;
 	}
 
@@ -280,14 +261,10 @@ go_write:
 	up_read(&F2FS_I(inode)->i_sem);
 
 	if (need_cp) {
-		#ifdef F2FS_FSYNC_TRACE
-		syncfs_start_time = ktime_get();
+		fsync_time_start(t);
 		/* all the dirty node pages should be flushed for POR */
 		ret = f2fs_sync_fs(inode->i_sb, 1);
-		syncfs_end_time = ktime_get();
-		#else
-		ret = f2fs_sync_fs(inode->i_sb, 1);
-		#endif
+		fsync_time_end(phase[FSYNC_PH_SYNCFS], t);
 
 		/*
 		 * We've secured consistency through sync_fs. Following pino
@@ -299,13 +276,9 @@ go_write:
 		goto out;
 	}
 sync_nodes:
-#ifdef F2FS_FSYNC_TRACE
-	node_start_time += ktime_get();
-	ret = fsync_node_pages(sbi, inode, &wbc, atomic);
-	node_end_time += ktime_get();
-#else
+	fsync_time_start(t);
 	ret = fsync_node_pages(sbi, inode, &wbc, atomic);
-#endif
+	fsync_time_end(phase[FSYNC_PH_NODE], t);
 	if (ret)
 		goto out;
 
@@ -317,22 +290,14 @@ sync_nodes:
 
 	if (need_inode_block_update(sbi, ino)) {
 		f2fs_mark_inode_dirty_sync(inode, true);
-#ifdef F2FS_FSYNC_TRACE
-		inode2_start_time += ktime_get();
-		f2fs_write_inode(inode, NULL);
-		inode2_end_time += ktime_get();
-#else
+		fsync_time_start(t);
 		f2fs_write_inode(inode, NULL);
-#endif
+		fsync_time_end(phase[FSYNC_PH_INODE], t);
 		goto sync_nodes;
 	}
-#ifdef F2FS_FSYNC_TRACE
-	nodew_start_time = ktime_get();
+	fsync_time_start(t);
 	ret = wait_on_node_pages_writeback(sbi, ino);
-	nodew_end_time = ktime_get();
-#else 
-	ret = wait_on_node_pages_writeback(sbi, ino);
-#endif
+	fsync_time_end(phase[FSYNC_PH_NODEW], t);
 
 	if (ret)
 		goto out;
@@ -344,36 +309,15 @@ flush_out:
 	remove_ino_entry(sbi, ino, UPDATE_INO);
 	clear_inode_flag(inode, FI_UPDATE_WRITE);
 	if (!atomic) {
-#ifdef F2FS_FSYNC_TRACE
-		flush_start_time = ktime_get();
-		ret = f2fs_issue_flush(sbi);
-		flush_end_time = ktime_get();
-#else
+		fsync_time_start(t);
 		ret = f2fs_issue_flush(sbi);
-#endif
+		fsync_time_end(phase[FSYNC_PH_FLUSH], t);
 	}
 	f2fs_update_time(sbi, REQ_TIME);
 out:
-#ifdef F2FS_FSYNC_TRACE
-	fsync_end_time = ktime_get();
-//	fsync_end = rdtsc();
-
-	if (node_end_time > 0)
-		print_exec_time("[FSYNC-NODE]", fsyncID, node_start_time, node_end_time);
-	if (nodew_start_time > 0)
-		print_exec_time("[FSYNC-NODEW]", fsyncID, nodew_start_time, nodew_end_time);
-	if (inode1_end_time > 0)
-		print_exec_time("[FSYNC-INODE1]", fsyncID, inode1_start_time, inode1_end_time);
-	if (inode2_end_time > 0) 
-		print_exec_time("[FSYNC-INODE2]", fsyncID, inode2_start_time, inode2_end_time);
-	if (filemap_end_time > 0) 
-		print_exec_time("[FSYNC-FILEMAP]", fsyncID, filemap_start_time, filemap_end_time);
-	if (syncfs_end_time > 0) 
-		print_exec_time("[FSYNC-SYNCFS]", fsyncID, syncfs_start_time, syncfs_end_time);
-	if (flush_end_time > 0) 
-		print_exec_time("[FSYNC-FLUSH]", fsyncID, flush_start_time, flush_end_time);
-	print_exec_time("[FSYNC]", fsyncID, fsync_start_time, fsync_end_time);
-//	print_exec_time("[FSYNC-inst]", fsyncID, fsync_start, fsync_end);
+#ifdef F2FS_FSYNC_STAT
+	fsync_time_end(phase[FSYNC_PH_TOTAL], fsync_start);
+	f2fs_fsync_stat(sbi, inode, phase);
 #endif
 	trace_f2fs_sync_file_exit(inode, need_cp, datasync, ret);
 	f2fs_trace_ios(NULL, 1);
@@ -2592,6 +2536,27 @@ out:
 	return ret;
 }
 
+/* trace replay: advance the simulated wall clock to @arg seconds */
+static int f2fs_ioc_simul_time(struct file *filp, unsigned long arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	__u64 simul_time;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (get_user(simul_time, (__u64 __user *)arg))
+		return -EFAULT;
+
+#ifdef F2FS_FGROUP
+	f2fs_set_simul_time(sbi, simul_time);
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
 long f2fs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	switch (cmd) {
@@ -2633,6 +2598,8 @@ long f2fs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		return f2fs_ioc_move_range(filp, arg);
 	case F2FS_IOC_FLUSH_DEVICE:
 		return f2fs_ioc_flush_device(filp, arg);
+	case F2FS_IOC_SIMUL_TIME:
+		return f2fs_ioc_simul_time(filp, arg);
 	default:
 		return -ENOTTY;
 	}
@@ -2698,6 +2665,7 @@ long f2fs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case F2FS_IOC_DEFRAGMENT:
 	case F2FS_IOC_MOVE_RANGE:
 	case F2FS_IOC_FLUSH_DEVICE:
+	case F2FS_IOC_SIMUL_TIME:
 		break;
 	default:
 		return -ENOIOCTLCMD;
@@ -550,38 +550,6 @@ int filemap_write_and_wait(struct address_space *mapping)
 }
 EXPORT_SYMBOL(filemap_write_and_wait);
 
-int filemap_write_and_wait_range_fsync(struct address_space *mapping,
-				 loff_t lstart, loff_t lend, unsigned int fsyncID)
-{
-	int err = 0;
-
-	if ((!dax_mapping(mapping) && mapping->nrpages) ||
-	    (dax_mapping(mapping) && mapping->nrexceptional)) {
-		err = __filemap_fdatawrite_range(mapping, lstart, lend,
-						 WB_SYNC_ALL);
-		/* See comment of filemap_write_and_wait() */
-		if (err != -EIO) {
-			u64 start_time, end_time, exec_time;
-			int err2;
-			start_time = ktime_get();
-			err2 = filemap_fdatawait_range(mapping,
-						lstart, lend);
-			end_time = ktime_get();
-			exec_time = ktime_to_ns(ktime_sub(end_time, start_time)
-			trace_printk("[FSYNC-DATA]\t%u\t%llu\n", fsyncID, exec_time);
-			if (!err)
-				err = err2;
-		} else {
-			/* Clear any previously stored errors */
-			filemap_check_errors(mapping);
-		}
-	} else {
-		err = filemap_check_errors(mapping);
-	}
-	return err;
-}
-EXPORT_SYMBOL(filemap_write_and_wait_range_fsync);
-
 /**
  * filemap_write_and_wait_range - write out & wait on a file range
  * @mapping:	the address_space for the pages
@@ -2549,8 +2549,6 @@ extern bool filemap_range_has_page(struct address_space *, loff_t lstart,
 extern int filemap_write_and_wait(struct address_space *mapping);
 extern int filemap_write_and_wait_range(struct address_space *mapping,
 				        loff_t lstart, loff_t lend);
-extern int filemap_write_and_wait_range_fsync(struct address_space *mapping,
-				 loff_t lstart, loff_t lend, unsigned int fsyncID);
 extern int __filemap_fdatawrite_range(struct address_space *mapping,
 				loff_t start, loff_t end, int sync_mode);
 extern int filemap_fdatawrite_range(struct address_space *mapping,
@@ -91,6 +91,14 @@ static int gc_thread_func(void *data)
 		trace_f2fs_background_gc(sbi->sb, wait_ms,
 				prefree_segments(sbi), free_segments(sbi));
 
+#ifdef F2FS_GC_RESEG
+		if (sbi->reseg_budget && mutex_trylock(&sbi->gc_mutex)) {
+			if (is_idle(sbi))
+				f2fs_resegregate(sbi);
+			mutex_unlock(&sbi->gc_mutex);
+		}
+#endif
+
 		/* balancing f2fs's metadata periodically */
 		f2fs_balance_fs_bg(sbi);
 
@@ -290,13 +298,14 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 #endif
 	unsigned char u;
 	unsigned int i;
-	unsigned long long cur_seq = user_data_blocks(sbi) / 512;
+	unsigned long long cur_seq = f2fs_cur_seq(sbi);
 
 #if (defined F2FS_GC_DELAYED)
 	unsigned long long max_lifetime, centroid, lifetime, min_lifetime;
 	unsigned long long hot_lifetime, hot_centroid;
 	struct seg_entry *se = get_seg_entry(sbi, segno);
 	int type = se->type;
+	int cluster = 0;
 #ifdef STREAM_GC_STATIC
 	int kmeans_num = 0;
 #endif
@@ -305,17 +314,16 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 	if (type == CURSEG_DB_DATA) {
 		type = CURSEG_HOT_DATA;
 	}
-#else
-	if (0) {}
 #endif 
-	else if (type == CURSEG_COLD_DATA)
-		type = NR_CLUSTER - 1;
+	/* data logs past the cold cluster (GC logs) age as cold */
+	if (IS_DATASEG(type))
+		cluster = min(curseg_to_cluster(sbi, type), sbi->nr_cluster - 1);
 
 #endif
 
 	for (i = 0; i < sbi->segs_per_sec; i++) {
 #if (defined F2FS_FORCE_GC_CB || defined F2FS_GC_DELAYED)
-		mtime += (sbi->seg_lifetime[start + i] >> sbi->log_blocks_per_seg);
+		mtime += f2fs_clock_to_seq(sbi, sbi->seg_lifetime[start + i]);
 #else
 		mtime += get_seg_entry(sbi, start + i)->mtime;
 #endif
@@ -340,36 +348,32 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 		min_lifetime = 0;
 	}
 #ifdef STREAM_GC_STATIC
-	else if (type == CURSEG_HOT_DATA) {
+	else if (cluster == 0) {
 		max_lifetime = hot_lifetime;
 		min_lifetime = 0;
 	}
-	else if (type == CURSEG_COLD_DATA) {
+	else if (cluster == sbi->nr_cluster - 1) {
 //		max_lifetime = hot_lifetime;
 		max_lifetime = 0;
 		min_lifetime = 0;	
 	}
-	else if (type == CURSEG_COLD_DATA-1) {
-		max_lifetime = sbi->kmeans_history[kmeans_num].q3[type];
-		min_lifetime = sbi->kmeans_history[kmeans_num].q1[type];
+	else if (cluster == sbi->nr_cluster - 2) {
+		max_lifetime = sbi->kmeans_history[kmeans_num].q3[cluster];
+		min_lifetime = sbi->kmeans_history[kmeans_num].q1[cluster];
 
 		if (lifetime < min_lifetime) {
 			max_lifetime = hot_lifetime;
 			min_lifetime = 0; 
 		}
 	}
-	else if (type > CURSEG_HOT_DATA) {
-		max_lifetime = sbi->kmeans_history[kmeans_num].q3[type];
-		min_lifetime = sbi->kmeans_history[kmeans_num].q1[type];
-	}
 	else {
-		max_lifetime = sbi->kmeans_history[kmeans_num].q3[type];
-		min_lifetime = sbi->kmeans_history[kmeans_num].q1[type];
+		max_lifetime = sbi->kmeans_history[kmeans_num].q3[cluster];
+		min_lifetime = sbi->kmeans_history[kmeans_num].q1[cluster];
 	}
 #else
 	else {
-		max_lifetime = sbi->kmeans_max[type] * STREAM_WEIGHT;
-		centroid = sbi->kmeans_center[type] * STREAM_WEIGHT;
+		max_lifetime = sbi->kmeans_max[cluster] * STREAM_WEIGHT;
+		centroid = sbi->kmeans_center[cluster] * STREAM_WEIGHT;
 	}
 #endif
 
@@ -419,7 +423,7 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 #elif (defined STREAM_GC_PILOT)
 		age = GC_AGE_START - div64_u64(GC_AGE_START * lifetime,
 					centroid);
-		if (type >= CURSEG_COLD_DATA) {
+		if (IS_NODESEG(type) || cluster == sbi->nr_cluster - 1) {
 			unsigned char hot_age = 0;
 			if (lifetime >= hot_lifetime) {
 				hot_age = 100;
@@ -436,7 +440,7 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 			if (age > hot_age)
 				age = hot_age;
 		}
-		else if (type == CURSEG_HOT_DATA)
+		else if (cluster == 0)
 			age = 0;
 		age = GC_AGE_SUM + age;
 #else
@@ -498,6 +502,82 @@ static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 		return get_cb_cost(sbi, segno);
 }
 
+#ifdef F2FS_FGROUP
+/* lifetime units since @segno was opened, on the scale of q1/q3 */
+static inline unsigned long long seg_age(struct f2fs_sb_info *sbi,
+			unsigned int segno, unsigned long long cur_seq)
+{
+	unsigned long long mtime;
+
+	mtime = f2fs_clock_to_seq(sbi, sbi->seg_lifetime[segno]);
+	return cur_seq > mtime ? cur_seq - mtime : 0;
+}
+
+/*
+ * How much longer the valid blocks of @segno are expected to live. The
+ * segment's age is how long they have lived so far and the q1/q3 of
+ * @cluster in the last k-means run is how long they were expected to
+ * live; a block that already outlived its range is expected to live
+ * about as long again.
+ */
+static unsigned long long remaining_lifetime(struct f2fs_sb_info *sbi,
+			struct kmeans_history *kh, int cluster,
+			unsigned int segno, unsigned long long cur_seq)
+{
+	unsigned long long age, expect;
+
+	age = seg_age(sbi, segno, cur_seq);
+	expect = ((unsigned long long)kh->q1[cluster] + kh->q3[cluster]) / 2;
+
+	if (age < expect)
+		return expect - age;
+	if (age < kh->q3[cluster])
+		return kh->q3[cluster] - age;
+	return age;
+}
+#endif
+
+#ifdef F2FS_SSR_LIFETIME
+/*
+ * SSR on behalf of another stream: take @segno only if what is left in it
+ * is expected to die within the q1..q3 of the stream being written, so the
+ * recycled segment does not mix short- and long-lived blocks again.
+ */
+static bool ssr_lifetime_match(struct f2fs_sb_info *sbi, unsigned int segno,
+							int type)
+{
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	unsigned long long cur_seq = f2fs_cur_seq(sbi);
+	unsigned long long remain;
+	struct kmeans_history *kh;
+	unsigned int kmeans_num, seq;
+	int cluster, owner;
+
+	if (se->type == type)
+		return true;
+
+	do {
+		seq = read_seqbegin(&sbi->kmeans_lock);
+		kmeans_num = sbi->kmeans_count;
+	} while (read_seqretry(&sbi->kmeans_lock, seq));
+
+	if (kmeans_num == 0)
+		return false;
+	kh = &sbi->kmeans_history[kmeans_num - 1];
+
+	cluster = curseg_to_cluster(sbi, type);
+	owner = curseg_to_cluster(sbi, se->type);
+	if (cluster < 0 || cluster >= sbi->nr_cluster ||
+			owner < 0 || owner >= sbi->nr_cluster)
+		return false;
+
+	remain = remaining_lifetime(sbi, kh, owner, segno, cur_seq);
+	if (remain < kh->q1[cluster])
+		return false;
+	return cluster == sbi->nr_cluster - 1 || remain <= kh->q3[cluster];
+}
+#endif
+
 static unsigned int count_bits(const unsigned long *addr,
 				unsigned int offset, unsigned int len)
 {
@@ -608,6 +688,13 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 		if (gc_type == FG_GC && p.alloc_mode == LFS &&
 					no_fggc_candidate(sbi, secno))
 			goto next;
+#ifdef F2FS_SSR_LIFETIME
+		if (p.alloc_mode == SSR && sm->ssr_type != NO_CHECK_TYPE &&
+				!ssr_lifetime_match(sbi, segno, sm->ssr_type)) {
+			sbi->ssr_rejected++;
+			goto next;
+		}
+#endif
 
 		cost = get_gc_cost(sbi, segno, &p);
 
@@ -835,7 +922,90 @@ static bool is_alive(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 	return true;
 }
 
-static void move_encrypted_block(struct inode *inode, block_t bidx,
+#ifdef F2FS_GC_RELOC
+/*
+ * Pick the log for a data block GC is moving out of @segno.
+ *
+ * The rest of the block's expected lifetime (remaining_lifetime) goes to
+ * the stream whose range covers it. Without a k-means result yet this
+ * falls back to the cold logs like GC_RELOC_COLD.
+ */
+int f2fs_gc_reloc_type(struct f2fs_sb_info *sbi, struct inode *inode,
+						unsigned int segno)
+{
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	int old_type = get_seg_entry(sbi, segno)->type;
+	unsigned long long cur_seq = f2fs_cur_seq(sbi);
+	unsigned long long remain;
+	struct kmeans_history *kh;
+	unsigned int kmeans_num, seq;
+	int cluster, nr_gc, type;
+
+#ifdef F2FS_GC_RESEG
+	/* picked by the idle pass: follow the fgroup to its current stream */
+	if (sbi->reseg_moved[segno] && fi->i_filetype != FGROUP_INIT) {
+		type = get_pstream(sbi, fi->i_fgroup);
+		goto out;
+	}
+#endif
+	if (sbi->gc_reloc_policy == GC_RELOC_COLD)
+		goto cold;
+
+	do {
+		seq = read_seqbegin(&sbi->kmeans_lock);
+		kmeans_num = sbi->kmeans_count;
+	} while (read_seqretry(&sbi->kmeans_lock, seq));
+
+	if (kmeans_num == 0)
+		goto cold;
+	kh = &sbi->kmeans_history[kmeans_num - 1];
+
+	if (fi->i_filetype != FGROUP_INIT)
+		cluster = curseg_to_cluster(sbi, fi->i_pstream);
+	else
+		cluster = curseg_to_cluster(sbi, old_type);
+	if (cluster < 0 || cluster >= sbi->nr_cluster)
+		cluster = sbi->nr_cluster - 1;
+
+	remain = remaining_lifetime(sbi, kh, cluster, segno, cur_seq);
+
+	for (cluster = 0; cluster < sbi->nr_cluster - 1; cluster++)
+		if (remain <= kh->q3[cluster])
+			break;
+
+	nr_gc = NR_CLUSTER_LOGS - sbi->nr_cluster;
+	if (sbi->gc_reloc_policy == GC_RELOC_GC_LOG && nr_gc > 0)
+		type = CLUSTER_START_TYPE + sbi->nr_cluster - 1 +
+				cluster * nr_gc / sbi->nr_cluster;
+	else
+		type = cluster_to_curseg(sbi, cluster);
+	goto out;
+cold:
+	type = (old_type == CURSEG_COLD_DATA) ?
+			CURSEG_COLD_DATA : cold_fallback_curseg(sbi);
+out:
+	if (IS_DATASEG(old_type))
+		stat_inc_gc_reloc(sbi, old_type, type);
+	return type;
+}
+#endif
+
+#ifdef F2FS_GC_RESEG
+/* the file's fgroup was clustered into another stream since it was written */
+static bool reseg_mismatch(struct f2fs_sb_info *sbi, struct inode *inode,
+						unsigned int segno)
+{
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+
+	if (!S_ISREG(inode->i_mode) || fi->i_filetype == FGROUP_INIT)
+		return false;
+	return get_pstream(sbi, fi->i_fgroup) !=
+				get_seg_entry(sbi, segno)->type;
+}
+#endif
+
+/* returns true if the block was written to its new address */
+static bool move_encrypted_block(struct inode *inode, block_t bidx,
 							unsigned int segno, int off)
 {
 	struct f2fs_io_info fio = {
@@ -852,12 +1022,13 @@ static void move_encrypted_block(struct inode *inode, block_t bidx,
 	struct node_info ni;
 	struct page *page;
 	block_t newaddr;
+	bool moved = false;
 	int err;
 
 	/* do not read out */
 	page = f2fs_grab_cache_page(inode->i_mapping, bidx, false);
 	if (!page)
-		return;
+		return false;
 
 	if (!check_valid_map(F2FS_I_SB(inode), segno, off))
 		goto out;
@@ -888,8 +1059,13 @@ static void move_encrypted_block(struct inode *inode, block_t bidx,
 	fio.page = page;
 	fio.new_blkaddr = fio.old_blkaddr = dn.data_blkaddr;
 
+#ifdef F2FS_GC_RELOC
+	allocate_data_block(fio.sbi, NULL, fio.old_blkaddr, &newaddr, &sum,
+			f2fs_gc_reloc_type(fio.sbi, inode, segno), NULL, false);
+#else
 	allocate_data_block(fio.sbi, NULL, fio.old_blkaddr, &newaddr,
 					&sum, CURSEG_COLD_DATA, NULL, false);
+#endif
 
 	fio.encrypted_page = pagecache_get_page(META_MAPPING(fio.sbi), newaddr,
 					FGP_LOCK | FGP_CREAT, GFP_NOFS);
@@ -928,6 +1104,7 @@ static void move_encrypted_block(struct inode *inode, block_t bidx,
 	fio.op_flags = REQ_SYNC;
 	fio.new_blkaddr = newaddr;
 	f2fs_submit_page_write(&fio);
+	moved = true;
 
 	f2fs_update_data_blkaddr(&dn, newaddr);
 	set_inode_flag(inode, FI_APPEND_WRITE);
@@ -943,16 +1120,19 @@ put_out:
 	f2fs_put_dnode(&dn);
 out:
 	f2fs_put_page(page, 1);
+	return moved;
 }
 
-static void move_data_page(struct inode *inode, block_t bidx, int gc_type,
+/* returns true if the page was dirtied (BG) or written (FG) for the move */
+static bool move_data_page(struct inode *inode, block_t bidx, int gc_type,
 							unsigned int segno, int off)
 {
 	struct page *page;
+	bool moved = false;
 
 	page = get_lock_data_page(inode, bidx, true);
 	if (IS_ERR(page))
-		return;
+		return false;
 
 	if (!check_valid_map(F2FS_I_SB(inode), segno, off))
 		goto out;
@@ -974,6 +1154,7 @@ error
 			goto out;
 		set_page_dirty(page);
 		set_cold_data(page);
+		moved = true;
 	} else {
 		struct f2fs_io_info fio = {
 			.sbi = F2FS_I_SB(inode),
@@ -1004,9 +1185,11 @@ retry:
 			congestion_wait(BLK_RW_ASYNC, HZ/50);
 			goto retry;
 		}
+		moved = !err;
 	}
 out:
 	f2fs_put_page(page, 1);
+	return moved;
 }
 
 /*
@@ -1017,7 +1200,8 @@ out:
  * the victim data block is ignored.
  */
 static void gc_data_segment(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
-		struct gc_inode_list *gc_list, unsigned int segno, int gc_type)
+		struct gc_inode_list *gc_list, unsigned int segno, int gc_type,
+		bool reseg)
 {
 	struct super_block *sb = sbi->sb;
 	struct f2fs_summary *entry;
@@ -1071,6 +1255,12 @@ next_step:
 			inode = f2fs_iget(sb, dni.ino);
 			if (IS_ERR(inode) || is_bad_inode(inode))
 				continue;
+#ifdef F2FS_GC_RESEG
+			if (reseg && !reseg_mismatch(sbi, inode, segno)) {
+				iput(inode);
+				continue;
+			}
+#endif
 
 			/* if encrypted inode, let's go phase 3 */
 			if (f2fs_encrypted_inode(inode) &&
@@ -1098,6 +1288,7 @@ next_step:
 		if (inode) {
 			struct f2fs_inode_info *fi = F2FS_I(inode);
 			bool locked = false;
+			bool moved;
 
 			if (S_ISREG(inode->i_mode)) {
 				if (!down_write_trylock(&fi->dio_rwsem[READ]))
@@ -1113,15 +1304,27 @@ next_step:
 			start_bidx = start_bidx_of_node(nofs, inode)
 								+ ofs_in_node;
 			if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode))
-				move_encrypted_block(inode, start_bidx, segno, off);
+				moved = move_encrypted_block(inode, start_bidx,
+								segno, off);
 			else
-				move_data_page(inode, start_bidx, gc_type, segno, off);
+				moved = move_data_page(inode, start_bidx,
+							gc_type, segno, off);
 
 			if (locked) {
 				up_write(&fi->dio_rwsem[WRITE]);
 				up_write(&fi->dio_rwsem[READ]);
 			}
 
+#ifdef F2FS_GC_RESEG
+			if (reseg) {
+				/* skipped (writeback, stale) blocks stay put */
+				if (moved) {
+					sbi->reseg_moved[segno]++;
+					sbi->reseg_blocks++;
+				}
+				continue;
+			}
+#endif
 			stat_inc_data_blk_count(sbi, 1, gc_type);
 		}
 	}
@@ -1167,7 +1370,7 @@ static int do_garbage_collect(struct f2fs_sb_info *sbi,
 	/* reference all summary page */
 	while (segno < end_segno) {
 #ifdef F2FS_TRACE_ENABLE
-		seg_lifetime += (sbi->seg_lifetime[segno] >> sbi->log_blocks_per_seg);
+		seg_lifetime += f2fs_clock_to_seq(sbi, sbi->seg_lifetime[segno]);
 #endif
 		sum_page = get_sum_page(sbi, segno++);
 		unlock_page(sum_page);
@@ -1180,7 +1383,7 @@ static int do_garbage_collect(struct f2fs_sb_info *sbi,
 		int test_type = sentry->type;
 #ifdef F2FS_TRACE_ENABLE
 		unsigned int cost = get_valid_blocks(sbi, start_segno, true);
-		unsigned int cur_seq = user_data_blocks(sbi)/ 512;
+		unsigned int cur_seq = f2fs_cur_seq(sbi);
 		unsigned int free = 0;
 		int i;
 			
@@ -1192,7 +1395,8 @@ static int do_garbage_collect(struct f2fs_sb_info *sbi,
 			blkaddr = blkaddr % 4096;
 			free += blkaddr;
 		}
-		trace_printk("[F2FS-GC]\t%d\t%u\t%u\t%u\t%u\n", test_type, seg_lifetime, cur_seq, cost, free);
+		f2fs_mtrace(sbi, MTRACE_GC, test_type, seg_lifetime, cur_seq,
+				cost, free, 0, 0, NULL, NULL);
 #endif
 		stat_inc_gc_calls_mtype(sbi, test_type);
 	}
@@ -1228,8 +1432,16 @@ error
 			gc_node_segment(sbi, sum->entries, segno, gc_type);
 		}
 		else {
+#ifdef CONFIG_F2FS_MULTI_TYPE
+			sbi->cur_data_gc = segno;
+#endif
+#ifdef F2FS_GC_RESEG
+			/* blocks the idle pass took out need no copy now */
+			sbi->reseg_saved += sbi->reseg_moved[segno];
+			sbi->reseg_moved[segno] = 0;
+#endif
 			gc_data_segment(sbi, sum->entries, gc_list, segno,
-								gc_type);
+							gc_type, false);
 		}
 
 		stat_inc_seg_count(sbi, type, gc_type);
@@ -1250,10 +1462,100 @@ next:
 	stat_inc_call_count(sbi->stat_info);
 #ifdef CONFIG_F2FS_MULTI_TYPE
 	sbi->cur_node_gc = sbi->total_sections * sbi->segs_per_sec;
+	sbi->cur_data_gc = sbi->total_sections * sbi->segs_per_sec;
 #endif
 	return sec_freed;
 }
 
+#ifdef F2FS_GC_RESEG
+/*
+ * A segment that outlived the q3 of its stream holds blocks the stream did
+ * not expect; the coldest stream has nowhere colder to send them.
+ */
+static bool reseg_candidate(struct f2fs_sb_info *sbi, unsigned int segno,
+			struct kmeans_history *kh, unsigned long long cur_seq)
+{
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	int cluster;
+
+	if (!IS_DATASEG(se->type) || !se->valid_blocks)
+		return false;
+	cluster = curseg_to_cluster(sbi, se->type);
+	if (cluster < 0 || cluster >= sbi->nr_cluster - 1)
+		return false;
+	if (sec_usage_check(sbi, GET_SEC_FROM_SEG(sbi, segno)))
+		return false;
+
+	return seg_age(sbi, segno, cur_seq) > kh->q3[cluster];
+}
+
+/*
+ * Idle-time re-segregation. Blocks written before k-means moved their
+ * fgroup to another stream keep being copied by GC in the old one; move
+ * them to the fgroup's current stream while the device is idle instead.
+ * At most reseg_budget blocks per call, resuming where the last one
+ * stopped. Called with gc_mutex held.
+ */
+void f2fs_resegregate(struct f2fs_sb_info *sbi)
+{
+	struct gc_inode_list gc_list = {
+		.ilist = LIST_HEAD_INIT(gc_list.ilist),
+		.iroot = RADIX_TREE_INIT(GFP_NOFS),
+	};
+	unsigned long long cur_seq = f2fs_cur_seq(sbi);
+	unsigned long long start = sbi->reseg_blocks;
+	struct kmeans_history *kh;
+	struct blk_plug plug;
+	unsigned int kmeans_num, seq, segno, scanned;
+
+	do {
+		seq = read_seqbegin(&sbi->kmeans_lock);
+		kmeans_num = sbi->kmeans_count;
+	} while (read_seqretry(&sbi->kmeans_lock, seq));
+
+	if (kmeans_num == 0)
+		return;
+	kh = &sbi->kmeans_history[kmeans_num - 1];
+
+	sbi->reseg_passes++;
+	blk_start_plug(&plug);
+
+	segno = sbi->reseg_cursor;
+	for (scanned = 0; scanned < RESEG_SCAN_SEGS; scanned++, segno++) {
+		struct page *sum_page;
+		struct f2fs_summary_block *sum;
+
+		if (segno >= MAIN_SEGS(sbi))
+			segno = 0;
+		if (sbi->reseg_blocks - start >= sbi->reseg_budget ||
+				!is_idle(sbi) ||
+				has_not_enough_free_secs(sbi, 0, 0) ||
+				unlikely(f2fs_cp_error(sbi)))
+			break;
+		if (!reseg_candidate(sbi, segno, kh, cur_seq))
+			continue;
+
+		sum_page = get_sum_page(sbi, segno);
+		unlock_page(sum_page);
+
+		sum = page_address(sum_page);
+		if (PageUptodate(sum_page) &&
+				GET_SUM_TYPE((&sum->footer)) == SUM_TYPE_DATA) {
+			sbi->cur_data_gc = segno;
+			gc_data_segment(sbi, sum->entries, &gc_list, segno,
+							BG_GC, true);
+			sbi->reseg_segs++;
+		}
+		f2fs_put_page(sum_page, 0);
+	}
+	sbi->reseg_cursor = segno;
+	sbi->cur_data_gc = sbi->total_sections * sbi->segs_per_sec;
+
+	blk_finish_plug(&plug);
+	put_gc_inode(&gc_list);
+}
+#endif
+
 int f2fs_gc(struct f2fs_sb_info *sbi, bool sync,
 			bool background, unsigned int segno)
 {
@@ -1352,6 +1654,10 @@ void build_gc_manager(struct f2fs_sb_info *sbi)
 	sbi->fggc_threshold = div64_u64((main_count - ovp_count) *
 				BLKS_PER_SEC(sbi), (main_count - resv_count));
 
+#ifdef F2FS_GC_RELOC
+	sbi->gc_reloc_policy = DEF_GC_RELOC_POLICY;
+#endif
+
 	/* give warm/cold data area from slower device */
 	if (sbi->s_ndevs && sbi->segs_per_sec == 1)
 		SIT_I(sbi)->last_victim[ALLOC_NEXT] =
@@ -22,6 +22,17 @@
 /* Search max. number of dirty segments to select a victim segment */
 #define DEF_MAX_VICTIM_SEARCH 4096 /* covers 8GB */
 
+#ifdef F2FS_GC_RELOC
+/* where GC puts the valid blocks it moves (gc_reloc_policy) */
+enum {
+	GC_RELOC_COLD,		/* old behaviour: the cold logs */
+	GC_RELOC_LIFETIME,	/* stream covering the remaining lifetime */
+	GC_RELOC_GC_LOG,	/* same, but into the data logs nr_streams= leaves free */
+	NR_GC_RELOC,
+};
+#define DEF_GC_RELOC_POLICY	GC_RELOC_COLD	/* others through sysfs */
+#endif
+
 struct f2fs_gc_kthread {
 	struct task_struct *f2fs_gc_task;
 	wait_queue_head_t gc_wait_queue_head;
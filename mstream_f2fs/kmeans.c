@@ -95,7 +95,7 @@ static void choose_all_clusters_from_distances(int n, int k, unsigned long long
 static void calc_cluster_centroids_org(int n, int k, unsigned long long *data, int *index, 
 		unsigned long long *new_centroid)
 {
-	int cluster_member_count[16];
+	int cluster_member_count[MAX_CLUSTER];
 	int ii;
 
 	for (ii = 0; ii < k; ii++) {
@@ -126,7 +126,7 @@ static void calc_cluster_centroids_org(int n, int k, unsigned long long *data, i
 static void calc_cluster_centroids(int n, int k, unsigned long long *data, int *index, 
 		unsigned long long *new_centroid, int *weight)
 {
-	int cluster_member_count[16];
+	int cluster_member_count[MAX_CLUSTER];
 	int ii;
 
 	for (ii = 0; ii < k; ii++) {
@@ -231,6 +231,7 @@ static int kmeans_org(int n, int k, unsigned long long *data, unsigned long long
 		}
 		prev_totD = totD;
 		batch_iteration++;
+		cond_resched();
 	}
 
 	for (i = 0; i < n; i ++) {
@@ -298,6 +299,7 @@ static int kmeans(int n, int k, unsigned long long *data, unsigned long long *ce
 		}
 		prev_totD = totD;
 		batch_iteration++;
+		cond_resched();
 	}
 
 	for (i = 0; i < n; i ++) {
@@ -540,20 +542,22 @@ static int init_center(int n, int k, unsigned long long *data, unsigned long lon
 }
 
 
-static int kmeans_cluster_minmax(struct f2fs_sb_info* sbi, unsigned long long *data, int *weight, int *cluster, int n, int k)
+/* @max: this round's per-cluster max, not yet published in sbi->kmeans_max */
+static int kmeans_cluster_minmax(struct f2fs_sb_info* sbi, unsigned long long *data, int *weight, int *cluster, int n, int k,
+				unsigned long long *max)
 {
 	int min_pointer;
 	char *visit_bitmap;
 	int *sort_index;
 	int i, j;
 	unsigned long long interval;
-	int weight_sum[NR_CLUSTER];
-	int weight_minbound[NR_CLUSTER];
-	int weight_maxbound[NR_CLUSTER];
-	int weight_pointer[NR_CLUSTER];
-	int steps[NR_CLUSTER];
+	int weight_sum[MAX_CLUSTER];
+	int weight_minbound[MAX_CLUSTER];
+	int weight_maxbound[MAX_CLUSTER];
+	int weight_pointer[MAX_CLUSTER];
+	int steps[MAX_CLUSTER];
 	int kmeans_count = sbi->kmeans_count; 
-	unsigned long long cur_seq = user_data_blocks(sbi) / 512; 
+	unsigned long long cur_seq = f2fs_cur_seq(sbi);
 
 	if (kmeans_count >= MAX_HISTORY)
 		return 0;
@@ -636,19 +640,19 @@ static int kmeans_cluster_minmax(struct f2fs_sb_info* sbi, unsigned long long *d
 	}
 
 	sbi->kmeans_history[kmeans_count].q1[0] = 0;
-	sbi->kmeans_history[kmeans_count].q3[0] = sbi->kmeans_max[0]; 
+	sbi->kmeans_history[kmeans_count].q3[0] = max[0]; 
 	steps[0] = 2;
 
 	for (i = 0; i < k; i++) {
 		if (steps[i] == 0) {
 			if (i > 0) 
-				sbi->kmeans_history[kmeans_count].q1[i] = sbi->kmeans_max[i-1]; 
+				sbi->kmeans_history[kmeans_count].q1[i] = max[i-1]; 
 			else
 				sbi->kmeans_history[kmeans_count].q1[i] = 0;
 			steps[i] = 1;
 		}
 		if (steps[i] == 1) {
-			sbi->kmeans_history[kmeans_count].q3[i] = sbi->kmeans_max[i]; 
+			sbi->kmeans_history[kmeans_count].q3[i] = max[i]; 
 		}
 
 		printk("KMEANS\t%d\t%u\t%u\t%u\n", i, sbi->kmeans_history[kmeans_count].seq, sbi->kmeans_history[kmeans_count].q1[i], sbi->kmeans_history[kmeans_count].q3[i]);
@@ -666,7 +670,7 @@ static int uniform(int n, int k, unsigned long long *data, unsigned long long *c
 	char *visit_bitmap;
 	unsigned long long min_data = 2147483647;
 	unsigned long long max_data = 0;
-	unsigned long long center_temp[NR_CLUSTER];
+	unsigned long long center_temp[MAX_CLUSTER];
 	unsigned long long interval;
 	int *sort_index;
 	int max_data_count = 0;
@@ -739,7 +743,7 @@ static int uniform(int n, int k, unsigned long long *data, unsigned long long *c
 			break;
 	}
 
-	interval = weight_sum / (NR_CLUSTER);
+	interval = weight_sum / k;
 	if (interval == 0) {
 		vfree(visit_bitmap);
 		vfree(sort_index);
@@ -747,9 +751,9 @@ static int uniform(int n, int k, unsigned long long *data, unsigned long long *c
 	}
 	j = 0; 
 
-	for (i = 0; i < (NR_CLUSTER); i++) {
+	for (i = 0; i < k; i++) {
 		int sum_w = 0;
-		interval = weight_sum / (NR_CLUSTER - i);
+		interval = weight_sum / (k - i);
 		while (1) {
 			int index = sort_index[j]; 
 			if (index == -1)
@@ -761,7 +765,7 @@ static int uniform(int n, int k, unsigned long long *data, unsigned long long *c
 			if (sum_w >= interval) {
 				break;
 			}
-			if (NR_CLUSTER - i - 1 == n - j) {
+			if (k - i - 1 == n - j) {
 				break;	
 			}
 		}
@@ -774,18 +778,18 @@ static int uniform(int n, int k, unsigned long long *data, unsigned long long *c
 		int index = sort_index[j]; 
 		if (index == -1)
 			BUG_ON(1);
-		index_cur[index] = NR_CLUSTER - 1;
+		index_cur[index] = k - 1;
 		j++;
 	}
 
 	center[0] = (data[sort_index[0]] + center_temp[0]) / 2;
-	for (i = 1; i < (NR_CLUSTER); i++) {
+	for (i = 1; i < k; i++) {
 		center[i] = (center_temp[i-1] + center_temp[i]) / 2; 
 	}
 //	center[i] = center_temp[i];
 
 	printk("group_min:%llu\n", data[sort_index[0]]);
-	for (i = 0; i < (NR_CLUSTER); i++) {
+	for (i = 0; i < k; i++) {
 		printk("group_max[%d]:%llu\n", i, center_temp[i]);
 	}
 
@@ -848,12 +852,96 @@ static int fixed_center(int n, int k, unsigned long long *data, unsigned long lo
 #define KMEANS_ENABLE
 //#define FIX_HOT
 
+static unsigned long long calc_weighted_cost(int n, unsigned long long *data,
+			unsigned long long *center, int *index, int *weight)
+{
+	unsigned long long cost = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		unsigned long long c;
+
+		if (index[i] < 0)
+			continue;
+		c = center[index[i]];
+		cost += (c > data[i] ? c - data[i] : data[i] - c) *
+					(unsigned long long)weight[i];
+	}
+	return cost;
+}
+
+/*
+ * adaptive_k: cluster with k = 1..kmax and keep the k minimising
+ * W(k) + k * W(1) * kmeans_k_penalty / 100, W being the weighted distance
+ * to the centers.  An extra stream has to cut the cost by penalty% of
+ * the single-stream cost to be used.
+ */
+static int choose_cluster_count(struct f2fs_sb_info *sbi, int n, int kmax,
+			unsigned long long *data, int *weight,
+			unsigned long long *center, int *result)
+{
+	unsigned long long trial_center[MAX_CLUSTER];
+	unsigned long long cost, best_cost = ULLONG_MAX, lambda = 0;
+	int *trial_result;
+	int k, best_k = kmax;
+
+	trial_result = (int*) vmalloc(sizeof(int) * n);
+	if (!trial_result) {
+		init_center(n, kmax, data, center, weight);
+		kmeans_org(n, kmax, data, center, result);
+		return kmax;
+	}
+
+	for (k = 1; k <= kmax && k <= n; k++) {
+		init_center(n, k, data, trial_center, weight);
+		kmeans_org(n, k, data, trial_center, trial_result);
+		cost = calc_weighted_cost(n, data, trial_center,
+						trial_result, weight);
+		if (k == 1)
+			lambda = div_u64(cost, 100) * sbi->kmeans_k_penalty;
+		cost += lambda * k;
+		sbi->kmeans_k_cost[k - 1] = cost;
+
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_k = k;
+			memcpy(center, trial_center,
+					sizeof(unsigned long long) * k);
+			memcpy(result, trial_result, sizeof(int) * n);
+		}
+		cond_resched();
+	}
+	vfree(trial_result);
+
+#ifndef CLUSTER_TIME
+	printk("ADAPTIVE-K: %d of %d\n", best_k, kmax);
+#endif
+	return best_k;
+}
+
+/* charge the writes since the last round to the k that was in use */
+static void account_cluster_count(struct f2fs_sb_info *sbi)
+{
+	unsigned long long user = user_data_blocks(sbi), gc = 0;
+	int k = sbi->kmeans_k - 1;
+	int i;
+
+	for (i = 0; i < NR_CURSEG_TYPE; i++)
+		gc += sbi->type_gc[i];
+
+	sbi->kmeans_k_rounds[k]++;
+	sbi->kmeans_k_user[k] += user - sbi->kmeans_k_last_user;
+	sbi->kmeans_k_gc[k] += gc - sbi->kmeans_k_last_gc;
+	sbi->kmeans_k_last_user = user;
+	sbi->kmeans_k_last_gc = gc;
+}
+
 static int f2fs_update_cluster(struct f2fs_sb_info *sbi)
 {
 	unsigned long long *data;
 	int *result, *weight, *cluster_arr;
 	unsigned long long *fgroup;
-	int order_result[NR_CLUSTER];
+	int order_result[MAX_CLUSTER];
 	unsigned long long *center;
 	int i, j;
 	unsigned long long min_data = 2147483647;
@@ -862,10 +950,11 @@ static int f2fs_update_cluster(struct f2fs_sb_info *sbi)
 	struct rb_node *n;
 	unsigned long long max_value = 2147483647;
 	unsigned long long cur_seq = user_data_blocks(sbi);
-	int nr_cluster = NR_CLUSTER - 1;
+	int nr_cluster = sbi->nr_cluster - 1;
+	int kmax = nr_cluster;
 	int max_lifetime = 1;
 	int hot_count = 0;
-	unsigned long long max_cluster[NR_CLUSTER];
+	unsigned long long max_cluster[MAX_CLUSTER];
 #ifdef CLUSTER_TIME
 	 u64 start_time, end_time, exec_time;	
 #endif
@@ -882,6 +971,7 @@ static int f2fs_update_cluster(struct f2fs_sb_info *sbi)
 	printk("NR FGROUP: %d\n", nr_fgroup);
 
 	if (nr_fgroup <= nr_cluster) {
+		spin_unlock(&sbi->ftree_lock);
 		sbi->last_cluster = cur_seq + CLUSTER_T;
 		return 0;
 	}
@@ -921,9 +1011,9 @@ static int f2fs_update_cluster(struct f2fs_sb_info *sbi)
 #else
 #endif
 #ifdef FIX_HOT
-		else if (lifetime < 512 * 8 * 32) {
+		else if (lifetime < f2fs_seq_to_clock(sbi, 8 * 32)) {
 			entry->cluster = 0;
-			printk("H%d\t%d\t%llu\t%d\t%u\t%d\t%s\n", hot_count, 0, lifetime/512, count,entry->fgroup, filetype, entry->keyword);
+			printk("H%d\t%d\t%llu\t%d\t%u\t%d\t%s\n", hot_count, 0, f2fs_clock_to_seq(sbi, lifetime), count,entry->fgroup, filetype, entry->keyword);
 			nr_fgroup--;
 			n = rb_next(n);
 			hot_count++;
@@ -931,7 +1021,7 @@ static int f2fs_update_cluster(struct f2fs_sb_info *sbi)
 		}
 #endif
 		else {
-			lifetime = lifetime / 512;
+			lifetime = f2fs_clock_to_seq(sbi, lifetime);
 
 	        if (lifetime > max_lifetime)
     	        max_lifetime = lifetime;
@@ -988,23 +1078,28 @@ static int f2fs_update_cluster(struct f2fs_sb_info *sbi)
 #ifndef CLUSTER_TIME
 	printk("PREV: %d --> AFTER: %d\n", prev_fgroup, nr_fgroup);
 #endif
-	if (sbi->kmeans_count < 10)
-		init_center(nr_fgroup, nr_cluster, data, center, weight);
-	else {
-		for (i = 0; i < nr_cluster; i++)
-			center[i] = sbi->kmeans_center[i];
-	}
+	if (sbi->adaptive_k) {
+		nr_cluster = choose_cluster_count(sbi, nr_fgroup, kmax, data,
+						weight, center, result);
+	} else {
+		if (sbi->kmeans_count < 10 || sbi->kmeans_k != kmax)
+			init_center(nr_fgroup, nr_cluster, data, center, weight);
+		else {
+			for (i = 0; i < nr_cluster; i++)
+				center[i] = sbi->kmeans_center[i];
+		}
 
-	//convert_data(nr_fgroup, nr_cluster, data, center, weight);
-	kmeans_org(nr_fgroup, nr_cluster, data, center, result);
+		//convert_data(nr_fgroup, nr_cluster, data, center, weight);
+		kmeans_org(nr_fgroup, nr_cluster, data, center, result);
+	}
 #elif (defined FIX_HOT)
 	init_center(nr_fgroup, nr_cluster, data, center, weight);
 	kmeans_org(nr_fgroup, nr_cluster, data, center, result);
 
-//	fixed_center(nr_fgroup, NR_CLUSTER-1, data, center, result);
+//	fixed_center(nr_fgroup, sbi->nr_cluster-1, data, center, result);
 #else
 error
-	uniform(nr_fgroup, NR_CLUSTER, data, center, result, weight);
+	uniform(nr_fgroup, sbi->nr_cluster, data, center, result, weight);
 #endif
 
     for (i = 0; i < nr_cluster; i++) {
@@ -1030,6 +1125,9 @@ error
 	}
 
 	cluster_arr = (int*) vmalloc(sizeof(int) * nr_fgroup);
+
+	/* readers of entry->cluster see either the old or the new assignment */
+	spin_lock(&sbi->ftree_lock);
     for (j = 0; j < prev_fgroup; j++) {
         int cluster;
 		if (j < nr_fgroup) {
@@ -1062,7 +1160,10 @@ error
 			if (fgroup_entry != NULL) {
 				int filetype = fgroup_entry->fgroup & (31);
 #ifndef CLUSTER_TIME
-				printk("[CLUSTER]\t%u\t%llu\t%llu\t%llu\t%llu\t%d\t%s\n", cluster, data[j], fgroup_entry->cold, fgroup_entry->valid, fgroup_entry->count, filetype, fgroup_entry->keyword);
+				f2fs_mtrace(sbi, MTRACE_CLUSTER, cluster, data[j],
+						fgroup_entry->cold, fgroup_entry->valid,
+						fgroup_entry->count, filetype, 0,
+						fgroup_entry->keyword, NULL);
 #endif
 			}
 
@@ -1071,22 +1172,47 @@ error
 			}
 		}
     }
+	spin_unlock(&sbi->ftree_lock);
 
 #ifdef FIX_HOT
 	max_cluster[0] = 8*8;
 #endif
-	for (i = 0; i < nr_cluster; i++) {
+	/* fills kmeans_history[kmeans_count], not visible until count moves */
+	kmeans_cluster_minmax(sbi, data, weight, cluster_arr, nr_fgroup, nr_cluster,
+								max_cluster);
+
+	/*
+	 * Unused streams repeat the longest cluster so no lifetime maps to
+	 * them; cluster_to_curseg() folds their fgroups into stream k-1.
+	 */
+	for (i = nr_cluster; i < kmax; i++) {
+		max_cluster[i] = max_cluster[nr_cluster - 1];
+		center[i] = center[nr_cluster - 1];
+		if (sbi->kmeans_count < MAX_HISTORY) {
+			struct kmeans_history *kh =
+				&sbi->kmeans_history[sbi->kmeans_count];
+
+			kh->q1[i] = kh->q1[nr_cluster - 1];
+			kh->q3[i] = kh->q3[nr_cluster - 1];
+		}
+	}
+	account_cluster_count(sbi);
+
+	write_seqlock(&sbi->kmeans_lock);
+	for (i = 0; i < kmax; i++) {
 		sbi->kmeans_max[i] = max_cluster[i];
 		sbi->kmeans_center[i] = center[i];
+	}
+	sbi->kmeans_k = nr_cluster;
+	sbi->kmeans_count++;
+	write_sequnlock(&sbi->kmeans_lock);
+
+	for (i = 0; i < kmax; i++) {
 #ifndef CLUSTER_TIME
 		printk("KMENAS: center(%llu) max(%llu) curTime(%llu)\n", center[i], max_cluster[i], cur_seq);
 #endif
-	}
-	kmeans_cluster_minmax(sbi, data, weight, cluster_arr, nr_fgroup, nr_cluster);
-	for (i = 0; i < nr_cluster; i++) {
 		f2fs_issue_expect_lifetime(sbi, i);
 	}
-	sbi->kmeans_count++;
 
 	vfree(result);
 	vfree(center);
@@ -1107,43 +1233,70 @@ out:
 	return 0;
 }
 
-static struct task_struct *f2fs_cluster_task;
-
 static int f2fs_cluster_thread(void *arg)
 {
 	struct f2fs_sb_info *sbi = (struct f2fs_sb_info*)arg;
+	struct f2fs_cluster_kthread *cl_th = sbi->cluster_thread;
+	wait_queue_head_t *wq = &cl_th->cluster_wait_queue_head;
 
-	while (true)
-	{
-		f2fs_update_cluster(sbi);			
+	set_freezable();
+	set_user_nice(current, MAX_NICE);
+	do {
+		wait_event_interruptible(*wq,
+				kthread_should_stop() || freezing(current) ||
+				test_bit(0, &cl_th->cluster_pending));
 
 		if (try_to_freeze())
-			continue; 
+			continue;
 		if (kthread_should_stop())
 			break;
 
-		schedule_timeout_interruptible(msecs_to_jiffies(60000));
-	}
+		clear_bit(0, &cl_th->cluster_pending);
+		f2fs_update_cluster(sbi);
+
+		/* coalesce wakeups of a write burst into the next run */
+		schedule_timeout_interruptible(
+				msecs_to_jiffies(cl_th->min_interval));
+	} while (!kthread_should_stop());
 
 	return 0;
 }
 
 int start_cluster_thread(struct f2fs_sb_info *sbi)
 {
-	f2fs_cluster_task = kthread_run(f2fs_cluster_thread, sbi, "cluster");
-	if (IS_ERR(f2fs_cluster_task)) {
-		int err = PTR_ERR(f2fs_cluster_task);
-		f2fs_cluster_task = NULL;
-		return err;
+	struct f2fs_cluster_kthread *cl_th;
+	dev_t dev = sbi->sb->s_bdev->bd_dev;
+	int err = 0;
+
+	cl_th = f2fs_kmalloc(sbi, sizeof(struct f2fs_cluster_kthread), GFP_KERNEL);
+	if (!cl_th) {
+		err = -ENOMEM;
+		goto out;
 	}
-	return 0;
+
+	cl_th->cluster_pending = 0;
+	cl_th->min_interval = DEF_CLUSTER_MIN_INTERVAL;
+	init_waitqueue_head(&cl_th->cluster_wait_queue_head);
+
+	sbi->cluster_thread = cl_th;
+	cl_th->f2fs_cluster_task = kthread_run(f2fs_cluster_thread, sbi,
+			"f2fs_cluster-%u:%u", MAJOR(dev), MINOR(dev));
+	if (IS_ERR(cl_th->f2fs_cluster_task)) {
+		err = PTR_ERR(cl_th->f2fs_cluster_task);
+		kfree(cl_th);
+		sbi->cluster_thread = NULL;
+	}
+out:
+	return err;
 }
 
 void stop_cluster_thread(struct f2fs_sb_info *sbi)
 {
-	if (!f2fs_cluster_task)
+	struct f2fs_cluster_kthread *cl_th = sbi->cluster_thread;
+	if (!cl_th)
 		return;
-
-	kthread_stop(f2fs_cluster_task);
+	kthread_stop(cl_th->f2fs_cluster_task);
+	kfree(cl_th);
+	sbi->cluster_thread = NULL;
 }
 #endif
@@ -1562,6 +1562,121 @@ out:
 	return ret ? -EIO: 0;
 }
 
+/*
+ * Write one dirty node page picked by sync_node_pages(). Returns false
+ * for a page somebody else locked, wrote or truncated meanwhile; @ret is
+ * only set for a page that went to __write_node_page().
+ */
+static bool sync_one_node_page(struct f2fs_sb_info *sbi, struct page *page,
+		struct writeback_control *wbc, bool *submitted, int *ret)
+{
+lock_node:
+	if (!trylock_page(page))
+		return false;
+
+	if (unlikely(page->mapping != NODE_MAPPING(sbi))) {
+continue_unlock:
+		unlock_page(page);
+		return false;
+	}
+
+	if (!PageDirty(page)) {
+		/* someone wrote it for us */
+		goto continue_unlock;
+	}
+
+	/* flush inline_data */
+
+	if (is_inline_node(page)) {
+		clear_inline_node(page);
+		unlock_page(page);
+		flush_inline_data(sbi, ino_of_node(page));
+		goto lock_node;
+	}
+
+	f2fs_wait_on_page_writeback(page, NODE, true);
+
+	BUG_ON(PageWriteback(page));
+	if (!clear_page_dirty_for_io(page))
+		goto continue_unlock;
+
+	set_fsync_mark(page, 0);
+	set_dentry_mark(page, 0);
+
+	*ret = __write_node_page(page, false, submitted, wbc);
+	if (*ret)
+		unlock_page(page);
+	return true;
+}
+
+#ifdef F2FS_CP_GROUP
+/*
+ * A dnode is rewritten whenever a block it maps moves, so it lives about
+ * as long as its data: take the stream of the first data block it points
+ * to. Dnodes with no data yet are put with the longest-lived ones.
+ * Returns -1 for a page that can't be looked at or needs no writing.
+ */
+#define DNODE_CLUSTER_PROBE	16
+
+static int dnode_cluster(struct f2fs_sb_info *sbi, struct page *page)
+{
+	unsigned int ofs;
+	block_t blkaddr;
+	int cluster = sbi->nr_cluster - 1;
+
+	if (!trylock_page(page))
+		return -1;
+	if (unlikely(page->mapping != NODE_MAPPING(sbi)) ||
+						!PageDirty(page)) {
+		unlock_page(page);
+		return -1;
+	}
+
+	for (ofs = 0; ofs < DNODE_CLUSTER_PROBE; ofs++) {
+		int c;
+
+		blkaddr = datablock_addr(page, ofs);
+		if (blkaddr < MAIN_BLKADDR(sbi) || blkaddr >= MAX_BLKADDR(sbi))
+			continue;
+		c = curseg_to_cluster(sbi,
+			get_seg_entry(sbi, GET_SEGNO(sbi, blkaddr))->type);
+		if (c >= 0 && c < sbi->nr_cluster)
+			cluster = c;
+		break;
+	}
+	unlock_page(page);
+	return cluster;
+}
+
+/* write out one stream's bucket of dnodes as its own batch */
+static int sync_dnode_group(struct f2fs_sb_info *sbi, struct pagevec *pvec,
+			int group, struct writeback_control *wbc, int *nwritten)
+{
+	int i, gwritten = 0, ret = 0;
+
+	for (i = 0; i < pagevec_count(pvec); i++) {
+		bool submitted = false;
+
+		if (!wbc->nr_to_write || unlikely(f2fs_cp_error(sbi)))
+			break;
+		if (!sync_one_node_page(sbi, pvec->pages[i], wbc,
+						&submitted, &ret))
+			continue;
+		if (!ret && submitted)
+			gwritten++;
+		wbc->nr_to_write--;
+	}
+	pagevec_release(pvec);
+
+	sbi->cp_dnodes[group] += gwritten;
+	/* close this stream's bios before another one goes out */
+	if (gwritten)
+		f2fs_submit_merged_write(sbi, NODE);
+	*nwritten += gwritten;
+	return ret;
+}
+#endif
+
 int sync_node_pages(struct f2fs_sb_info *sbi, struct writeback_control *wbc)
 {
 	pgoff_t index, end;
@@ -1569,6 +1684,24 @@ int sync_node_pages(struct f2fs_sb_info *sbi, struct writeback_control *wbc)
 	int step = 0;
 	int nwritten = 0;
 	int ret = 0;
+#ifdef F2FS_CP_GROUP
+	/*
+	 * file dnodes of a sync flush are bucketed by data stream in one
+	 * scan; a full bucket and then all buckets, hot to cold, go out as
+	 * batches of their own
+	 */
+	bool grouped = sbi->cp_group && wbc->sync_mode == WB_SYNC_ALL;
+	struct pagevec *gvec = NULL;
+	int g;
+
+	if (grouped) {
+		gvec = kmalloc(sizeof(*gvec) * sbi->nr_cluster, GFP_NOFS);
+		if (!gvec)
+			grouped = false;
+		for (g = 0; grouped && g < sbi->nr_cluster; g++)
+			pagevec_init(&gvec[g], 0);
+	}
+#endif
 
 	pagevec_init(&pvec, 0);
 
@@ -1608,43 +1741,25 @@ next_step:
 			if (step == 2 && (!IS_DNODE(page) ||
 						!is_cold_node(page)))
 				continue;
-lock_node:
-			if (!trylock_page(page))
+#ifdef F2FS_CP_GROUP
+			if (step == 2 && grouped) {
+				g = dnode_cluster(sbi, page);
+				if (g < 0)
+					continue;
+				get_page(page);
+				if (!pagevec_add(&gvec[g], page))
+					ret = sync_dnode_group(sbi, &gvec[g], g,
+							wbc, &nwritten);
+				if (wbc->nr_to_write == 0)
+					break;
 				continue;
-
-			if (unlikely(page->mapping != NODE_MAPPING(sbi))) {
-continue_unlock:
-				unlock_page(page);
-				continue;
-			}
-
-			if (!PageDirty(page)) {
-				/* someone wrote it for us */
-				goto continue_unlock;
-			}
-
-			/* flush inline_data */
-
-			if (is_inline_node(page)) {
-				clear_inline_node(page);
-				unlock_page(page);
-				flush_inline_data(sbi, ino_of_node(page));
-				goto lock_node;
 			}
+#endif
 
-			f2fs_wait_on_page_writeback(page, NODE, true);
-
-			BUG_ON(PageWriteback(page));
-			if (!clear_page_dirty_for_io(page))
-				goto continue_unlock;
-
-			set_fsync_mark(page, 0);
-			set_dentry_mark(page, 0);
-
-			ret = __write_node_page(page, false, &submitted, wbc);
-			if (ret)
-				unlock_page(page);
-			else if (submitted)
+			if (!sync_one_node_page(sbi, page, wbc,
+							&submitted, &ret))
+				continue;
+			if (!ret && submitted)
 				nwritten++;
 
 			if (--wbc->nr_to_write == 0)
@@ -1663,7 +1778,20 @@ continue_unlock:
 		step++;
 		goto next_step;
 	}
+#ifdef F2FS_CP_GROUP
+	for (g = 0; grouped && g < sbi->nr_cluster; g++) {
+		int err = sync_dnode_group(sbi, &gvec[g], g, wbc, &nwritten);
+
+		if (err)
+			ret = err;
+	}
+#endif
 out:
+#ifdef F2FS_CP_GROUP
+	for (g = 0; grouped && g < sbi->nr_cluster; g++)
+		pagevec_release(&gvec[g]);
+	kfree(gvec);
+#endif
 	if (nwritten)
 		f2fs_submit_merged_write(sbi, NODE);
 	return ret;
@@ -648,18 +648,25 @@ static void f2fs_issue_setstream(struct f2fs_sb_info *sbi, unsigned int segno, i
 	int* stream_pointer = kvmalloc(sizeof(int), GFP_KERNEL);
 	sector_t block_addr = START_BLOCK(sbi, segno);
 	int stream = 0; 
+	int dtype = type;
+
+#ifdef F2FS_FGROUP
+	/* keep device stream ids dense whatever nr_streams= is */
+	if (type <= CURSEG_COLD_DATA)
+		dtype = curseg_to_cluster(sbi, type);
+#endif
 
 #ifdef F2FS_NODE_STREAM
 #ifdef F2FS_MHC_STREAM
 	if (type <= CURSEG_COLD_DATA)
-		stream = type + 2;
+		stream = dtype + 2;
 	else if (type == CURSEG_WARM_NODE)
 		stream = 1;
 	else if (type <= CURSEG_COLD_NODE)
 		stream = 0;
 #elif (defined F2FS_COLD_NODE) 
 	if (type <= CURSEG_COLD_DATA)
-		stream = type + 3;
+		stream = dtype + 3;
 	else if (type == CURSEG_WARM_NODE)
 		stream = 1;
 	else if (type == CURSEG_COLD_NODE)
@@ -668,7 +675,7 @@ static void f2fs_issue_setstream(struct f2fs_sb_info *sbi, unsigned int segno, i
 		stream = 0;
 #else
 	if (type <= CURSEG_COLD_DATA)
-		stream = type + 3;
+		stream = dtype + 3;
 	else if (type == CURSEG_WARM_NODE)
 		stream = 2;
 	else if (type <= CURSEG_COLD_NODE)
@@ -676,7 +683,7 @@ static void f2fs_issue_setstream(struct f2fs_sb_info *sbi, unsigned int segno, i
 #endif
 #else
 	if (type <= CURSEG_COLD_DATA)
-		stream = type + 1;
+		stream = dtype + 1;
 	else if (type <= CURSEG_COLD_NODE)
 		stream = 0;
 #endif
@@ -1604,20 +1611,119 @@ static void __set_sit_entry_type(struct f2fs_sb_info *sbi, int type,
 
 #define PREINVALID_ID	(100)
 #ifdef F2FS_PREINVALID_WAF
-static void f2fs_issue_preinvalid(struct f2fs_sb_info *sbi, block_t blkaddr, unsigned int size)
+/*
+ * Invalidated blocks are handed to the FTL in batches: contiguous blocks
+ * are merged into ranges and a whole batch goes down as one SETSTREAM bio
+ * carrying PREINVALID_BATCH_ID, at checkpoint or when the batch fills up.
+ * Must match the layout pblk_make_rq() expects.
+ */
+#define PREINVALID_BATCH_ID	(101)
+
+struct preinvalid_range {
+	__u32 lba;
+	__u32 len;
+} __packed;
+
+struct preinvalid_batch {
+	int id;				/* PREINVALID_BATCH_ID, must be first */
+	int nr;				/* # of ranges */
+	struct preinvalid_range range[0];
+} __packed;
+
+#define PREINVALID_BATCH_MAX						\
+	((PAGE_SIZE - sizeof(struct preinvalid_batch)) /		\
+				sizeof(struct preinvalid_range))
+
+/* This should be covered by global mutex, &sit_i->sentry_lock */
+static void f2fs_flush_preinvalid(struct f2fs_sb_info *sbi)
 {
-	struct bio *bio = f2fs_bio_alloc(0);
-	int ret;
-	int* inst_id = kvmalloc(sizeof(int), GFP_KERNEL);
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct preinvalid_batch *pb = sit_i->pi_batch;
+	struct preinvalid_batch *msg;
+	size_t size;
+	struct bio *bio;
+
+	if (!pb->nr)
+		return;
+
+	size = sizeof(*pb) + pb->nr * sizeof(struct preinvalid_range);
+	msg = kmalloc(size, GFP_NOFS);
+	if (!msg) {
+		sit_i->pi_dropped += pb->nr;
+		goto out;
+	}
+	memcpy(msg, pb, size);
 
+	bio = f2fs_bio_alloc(0);
 	bio->bi_opf = REQ_OP_WRITE | REQ_OP_SETSTREAM | REQ_NOMERGE;
 	bio_set_dev(bio, sbi->sb->s_bdev);
-	bio->bi_iter.bi_sector = SECTOR_FROM_BLOCK(blkaddr);
-	bio->bi_iter.bi_size = size << 12;
-	*inst_id = PREINVALID_ID;
-	bio->bi_private = inst_id;
+	bio->bi_iter.bi_sector = SECTOR_FROM_BLOCK(pb->range[0].lba);
+	bio->bi_iter.bi_size = 1 << 12;
+	bio->bi_private = msg;
 	bio->bi_end_io = f2fs_setstream_endio;
-	ret = submit_bio(bio);
+	submit_bio(bio);
+	sit_i->pi_bios++;
+out:
+	pb->nr = 0;
+	sit_i->pi_min = UINT_MAX;
+	sit_i->pi_max = 0;
+}
+
+static void f2fs_issue_preinvalid(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct preinvalid_batch *pb = sit_i->pi_batch;
+	struct preinvalid_range *last;
+
+	sit_i->pi_blocks++;
+	if (blkaddr < sit_i->pi_min)
+		sit_i->pi_min = blkaddr;
+	if (blkaddr > sit_i->pi_max)
+		sit_i->pi_max = blkaddr;
+
+	if (pb->nr) {
+		last = &pb->range[pb->nr - 1];
+		if (blkaddr == last->lba + last->len) {
+			last->len++;
+			return;
+		}
+		if (blkaddr + 1 == last->lba) {
+			last->lba--;
+			last->len++;
+			return;
+		}
+	}
+
+	if (pb->nr == PREINVALID_BATCH_MAX)
+		f2fs_flush_preinvalid(sbi);
+
+	pb->range[pb->nr].lba = blkaddr;
+	pb->range[pb->nr].len = 1;
+	pb->nr++;
+	sit_i->pi_ranges++;
+}
+
+/*
+ * A block invalidated in this checkpoint can be reused by SSR before the
+ * batch goes out; send the batch first so the FTL sees the hint before the
+ * new write that clears it.  The span only filters, the ranges decide.
+ */
+static void f2fs_reuse_preinvalid(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct preinvalid_batch *pb = sit_i->pi_batch;
+	int i;
+
+	if (blkaddr < sit_i->pi_min || blkaddr > sit_i->pi_max)
+		return;
+
+	for (i = pb->nr - 1; i >= 0; i--) {
+		if (blkaddr >= pb->range[i].lba &&
+			blkaddr < pb->range[i].lba + pb->range[i].len) {
+			f2fs_flush_preinvalid(sbi);
+			return;
+		}
+	}
 }
 #endif
 
@@ -1634,14 +1740,16 @@ void f2fs_issue_expect_lifetime(struct f2fs_sb_info *sbi, int cluster)
 	struct bio *bio = f2fs_bio_alloc(0);
 	int ret;
 	struct history_info *info = kvmalloc(sizeof(struct history_info), GFP_KERNEL);
+	/* latest published k-means result */
+	unsigned int kmeans_num = sbi->kmeans_count ? sbi->kmeans_count - 1 : 0;
 
 	bio->bi_opf = REQ_OP_WRITE | REQ_OP_CLUSTERLIFE | REQ_NOMERGE;
 	bio_set_dev(bio, sbi->sb->s_bdev);
 	bio->bi_iter.bi_sector = SECTOR_FROM_BLOCK(0);
 	bio->bi_iter.bi_size = 1 << 12;
 
-	info->min = sbi->kmeans_history[sbi->kmeans_count].q1[cluster];
-	info->max = sbi->kmeans_history[sbi->kmeans_count].q3[cluster];
+	info->min = sbi->kmeans_history[kmeans_num].q1[cluster];
+	info->max = sbi->kmeans_history[kmeans_num].q3[cluster];
 	info->cluster = cluster;
 #ifndef CLUSTER_TIME
 	printk("Cluster[%d] %d %d\n", info->cluster, info->min, info->max);
@@ -1653,6 +1761,44 @@ void f2fs_issue_expect_lifetime(struct f2fs_sb_info *sbi, int cluster)
 }
 #endif
 
+#ifdef F2FS_LIFETIME_HIST
+static inline int lifetime_bucket(unsigned long long age)
+{
+	return min_t(int, fls64(age), NR_LIFETIME_BUCKET - 1);
+}
+
+/* age of a dying block, approximated by the age of its segment */
+static void update_lifetime_hist(struct f2fs_sb_info *sbi,
+				struct seg_entry *se, unsigned int segno)
+{
+	unsigned long long now = f2fs_lifetime_clock(sbi);
+	unsigned long long born = sbi->seg_lifetime[segno];
+	int b = lifetime_bucket(now > born ? now - born : 0);
+
+	if (se->type >= NR_CURSEG_TYPE)
+		return;
+	if (SIT_I(sbi)->gc_move)
+		sbi->gc_age_hist[se->type][b]++;
+	else
+		sbi->lifetime_hist[se->type][b]++;
+}
+
+/* the old block is being migrated by GC rather than overwritten */
+static bool is_gc_move(struct f2fs_sb_info *sbi, block_t old_blkaddr,
+					struct f2fs_io_info *fio)
+{
+	unsigned int segno = GET_SEGNO(sbi, old_blkaddr);
+
+	if (segno == NULL_SEGNO)
+		return false;
+	if (segno == sbi->cur_node_gc || segno == sbi->cur_data_gc)
+		return true;
+	/* BG_GC data moves are only marked on the page */
+	return fio && fio->type == DATA && fio->page &&
+					is_cold_data(fio->page);
+}
+#endif
+
 static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 {
 	struct seg_entry *se;
@@ -1671,7 +1817,7 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 	se->valid_blocks = new_vblocks;
 	se->mtime = get_mtime(sbi);
 #ifdef F2FS_FORCE_GC_CB
-	SIT_I(sbi)->max_mtime = (user_data_blocks(sbi) >> sbi->log_blocks_per_seg); 
+	SIT_I(sbi)->max_mtime = f2fs_cur_seq(sbi);
 #else
 	SIT_I(sbi)->max_mtime = se->mtime;
 #endif
@@ -1689,6 +1835,9 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 
 	/* Update valid block bitmap */
 	if (del > 0) {
+#ifdef F2FS_PREINVALID_WAF
+		f2fs_reuse_preinvalid(sbi, blkaddr);
+#endif
 		if (f2fs_test_and_set_bit(offset, se->cur_valid_map)) {
 #ifdef CONFIG_F2FS_CHECK_FS
 			if (f2fs_test_and_set_bit(offset,
@@ -1730,7 +1879,18 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 			sbi->discard_blks++;
 
 #ifdef F2FS_PREINVALID_WAF
-		f2fs_issue_preinvalid(sbi, blkaddr, 1);
+		f2fs_issue_preinvalid(sbi, blkaddr);
+#endif
+#ifdef F2FS_LIFETIME_HIST
+		update_lifetime_hist(sbi, se, segno);
+#endif
+#ifdef F2FS_GC_RESEG
+		/* emptied by the user: GC would never have copied those */
+		if (!new_vblocks && !SIT_I(sbi)->gc_move &&
+						sbi->reseg_moved[segno]) {
+			sbi->reseg_unneeded += sbi->reseg_moved[segno];
+			sbi->reseg_moved[segno] = 0;
+		}
 #endif
 	}
 	if (!f2fs_test_bit(offset, se->ckpt_valid_map))
@@ -2245,6 +2405,48 @@ static void change_curseg(struct f2fs_sb_info *sbi, int type, bool reuse)
 	}
 }
 
+#ifdef F2FS_SSR_LIFETIME
+/*
+ * Data SSR out of the other streams, nearest cluster first. Under
+ * SSR_LIFETIME get_victim only takes segments whose valid blocks are
+ * expected to die within @type's range; sentry_lock keeps ssr_type ours.
+ */
+static int get_ssr_segment_cross(struct f2fs_sb_info *sbi, int type)
+{
+	struct curseg_info *curseg = CURSEG_I(sbi, type);
+	const struct victim_selection *v_ops = DIRTY_I(sbi)->v_ops;
+	struct sit_info *sit_i = SIT_I(sbi);
+	int cluster = curseg_to_cluster(sbi, type);
+	unsigned segno = NULL_SEGNO;
+	int d, c, i, ret = 0;
+
+	if (cluster < 0 || cluster >= sbi->nr_cluster)
+		return 0;
+
+	if (sbi->ssr_policy == SSR_LIFETIME)
+		sit_i->ssr_type = type;
+
+	for (d = 1; d < sbi->nr_cluster && !ret; d++) {
+		for (c = cluster - d; c <= cluster + d; c += 2 * d) {
+			if (c < 0 || c >= sbi->nr_cluster)
+				continue;
+			i = cluster_to_curseg(sbi, c);
+			if (i == type)
+				continue;
+			if (v_ops->get_victim(sbi, &segno, BG_GC, i, SSR)) {
+				curseg->next_segno = segno;
+				sbi->ssr_cross++;
+				ret = 1;
+				break;
+			}
+		}
+	}
+
+	sit_i->ssr_type = NO_CHECK_TYPE;
+	return ret;
+}
+#endif
+
 static int get_ssr_segment(struct f2fs_sb_info *sbi, int type)
 {
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
@@ -2256,6 +2458,10 @@ static int get_ssr_segment(struct f2fs_sb_info *sbi, int type)
 	/* need_SSR() already forces to do this */
 	if (v_ops->get_victim(sbi, &segno, BG_GC, type, SSR)) {
 		curseg->next_segno = segno;
+#ifdef F2FS_SSR_LIFETIME
+		if (IS_DATASEG(type))
+			sbi->ssr_same++;
+#endif
 		return 1;
 	}
 
@@ -2337,6 +2543,10 @@ static int get_ssr_segment(struct f2fs_sb_info *sbi, int type)
 
 		else 
 */
+#ifdef F2FS_SSR_LIFETIME
+		if (sbi->ssr_policy != SSR_SAME_STREAM)
+			return get_ssr_segment_cross(sbi, type);
+#endif
 		return 0;
 
 		for (; cnt-- > 0; reversed ? i-- : i++) {
@@ -2400,7 +2610,10 @@ static void allocate_segment_by_default(struct f2fs_sb_info *sbi,
 #ifdef CONFIG_F2FS_MULTI_TYPE
 	stat_inc_seg_mtype(sbi, curseg, type);
 #if (defined F2FS_FORCE_GC_CB || defined F2FS_FGROUP || defined F2FS_TRACE_ENABLE || defined F2FS_GC_DELAYED)
-	sbi->seg_lifetime[curseg->segno] = user_data_blocks(sbi);
+	sbi->seg_lifetime[curseg->segno] = f2fs_lifetime_clock(sbi);
+#endif
+#ifdef F2FS_GC_RESEG
+	sbi->reseg_moved[curseg->segno] = 0;
 #endif
 //	f2fs_issue_setstream(sbi, curseg->next_segno, type);
 #endif
@@ -2589,13 +2802,17 @@ static int __get_segment_type_hetero(struct f2fs_io_info *fio)
 		struct f2fs_inode_info *fi = F2FS_I(inode);
 		if (is_cold_data(fio->page)) {
 			unsigned int segno = GET_SEGNO(fio->sbi, fio->old_blkaddr);
+#ifdef F2FS_GC_RELOC
+			if (segno != NULL_SEGNO)
+				return f2fs_gc_reloc_type(fio->sbi, inode, segno);
+#endif
 			if (segno != NULL_SEGNO) {
 				struct seg_entry *se = get_seg_entry(fio->sbi, segno);
 				int old_type = se->type;
 				if (old_type == CURSEG_COLD_DATA)
 					return CURSEG_COLD_DATA;
 			}
-			return CURSEG_COLD_DATA -1;
+			return cold_fallback_curseg(fio->sbi);
 		} else {
 			#ifdef CONFIG_F2FS_2LEVEL_COLD
 			unsigned int segno = GET_SEGNO(fio->sbi, fio->old_blkaddr);
@@ -2762,7 +2979,13 @@ void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 	 * SIT information should be updated after segment allocation,
 	 * since we need to keep dirty segments precisely under SSR.
 	 */
+#ifdef F2FS_LIFETIME_HIST
+	sit_i->gc_move = is_gc_move(sbi, old_blkaddr, fio);
+#endif
 	refresh_sit_entry(sbi, old_blkaddr, *new_blkaddr);
+#ifdef F2FS_LIFETIME_HIST
+	sit_i->gc_move = false;
+#endif
 
 	mutex_unlock(&sit_i->sentry_lock);
 
@@ -2797,6 +3020,10 @@ static void do_write_page(struct f2fs_summary *sum, struct f2fs_io_info *fio)
 reallocate:
 	allocate_data_block(fio->sbi, fio->page, fio->old_blkaddr,
 			&fio->new_blkaddr, sum, type, fio, true);
+#ifdef F2FS_FGROUP
+	if (IS_DATASEG(type))
+		f2fs_wake_cluster_thread(sbi);
+#endif
 
 	/* writeout dirty page into bdev */
 	err = f2fs_submit_page_write(fio);
@@ -3217,7 +3444,7 @@ static int read_compacted_summaries(struct f2fs_sb_info *sbi)
 
 #ifdef CONFIG_F2FS_MULTI_TYPE
 #if (defined F2FS_FGROUP || defined F2FS_FORCE_GC_CB || defined F2FS_TRACE_ENABLE || defined F2FS_GC_DELAYED)
-		sbi->seg_lifetime[segno] = sbi->block_count[0] + sbi->block_count[1]; 
+		sbi->seg_lifetime[segno] = f2fs_lifetime_clock(sbi);
 #endif
 		if (IS_BMTSEG(sbi, seg_i->segno) && !(IS_DBSEG(sbi, seg_i->segno)) &&
 				((seg_i->segno % sbi->segs_per_sec) == 0)) {
@@ -3320,7 +3547,7 @@ static int read_normal_summaries(struct f2fs_sb_info *sbi, int type)
 	reset_curseg(sbi, type, 0);
 #if (defined F2FS_FGROUP || defined F2FS_FORCE_GC_CB || defined F2FS_TRACE_ENABLE)
 	if (1) {
-		sbi->seg_lifetime[segno] = sbi->block_count[0] + sbi->block_count[1]; 
+		sbi->seg_lifetime[segno] = f2fs_lifetime_clock(sbi);
 	}
 #endif
 
@@ -3617,6 +3844,10 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 
 	mutex_lock(&sit_i->sentry_lock);
 
+#ifdef F2FS_PREINVALID_WAF
+	f2fs_flush_preinvalid(sbi);
+#endif
+
 	if (!sit_i->dirty_sentries)
 		goto out;
 
@@ -3726,6 +3957,9 @@ static int build_sit_info(struct f2fs_sb_info *sbi)
 	sit_i = kzalloc(sizeof(struct sit_info), GFP_KERNEL);
 	if (!sit_i)
 		return -ENOMEM;
+#ifdef F2FS_SSR_LIFETIME
+	sit_i->ssr_type = NO_CHECK_TYPE;
+#endif
 
 	SM_I(sbi)->sit_info = sit_i;
 
@@ -3767,6 +4001,15 @@ static int build_sit_info(struct f2fs_sb_info *sbi)
 	if (!sit_i->tmp_map)
 		return -ENOMEM;
 
+#ifdef F2FS_PREINVALID_WAF
+	sit_i->pi_batch = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!sit_i->pi_batch)
+		return -ENOMEM;
+	sit_i->pi_batch->id = PREINVALID_BATCH_ID;
+	sit_i->pi_min = UINT_MAX;
+	sit_i->pi_max = 0;
+#endif
+
 	if (sbi->segs_per_sec > 1) {
 		sit_i->sec_entries = kvzalloc(MAIN_SECS(sbi) *
 					sizeof(struct sec_entry), GFP_KERNEL);
@@ -4062,7 +4305,7 @@ static void init_min_max_mtime(struct f2fs_sb_info *sbi)
 	}
 	sit_i->max_mtime = get_mtime(sbi);
 #else
-	sit_i->max_mtime = (user_data_blocks(sbi) >> sbi->log_blocks_per_seg);
+	sit_i->max_mtime = f2fs_cur_seq(sbi);
 #endif
 	mutex_unlock(&sit_i->sentry_lock);
 }
@@ -4116,6 +4359,12 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 
 	INIT_LIST_HEAD(&sm_info->sit_entry_set);
 
+#ifdef F2FS_GC_RESEG
+	sbi->reseg_moved = vzalloc(sizeof(unsigned short) * MAIN_SEGS(sbi));
+	if (!sbi->reseg_moved)
+		return -ENOMEM;
+#endif
+
 	if (!f2fs_readonly(sbi->sb)) {
 		err = create_flush_cmd_control(sbi);
 		if (err)
@@ -4227,6 +4476,9 @@ static void destroy_sit_info(struct f2fs_sb_info *sbi)
 		}
 	}
 	kfree(sit_i->tmp_map);
+#ifdef F2FS_PREINVALID_WAF
+	kfree(sit_i->pi_batch);
+#endif
 
 	kvfree(sit_i->sentries);
 	kvfree(sit_i->sec_entries);
@@ -4252,6 +4504,10 @@ void destroy_segment_manager(struct f2fs_sb_info *sbi)
 	destroy_curseg(sbi);
 	destroy_free_segmap(sbi);
 	destroy_sit_info(sbi);
+#ifdef F2FS_GC_RESEG
+	vfree(sbi->reseg_moved);
+	sbi->reseg_moved = NULL;
+#endif
 	sbi->sm_info = NULL;
 	kfree(sm_info);
 }
@@ -683,6 +683,22 @@ struct sit_info {
 	unsigned long long max_mtime;		/* max. modification time */
 
 	unsigned int last_victim[MAX_GC_POLICY]; /* last victim segment # */
+
+#ifdef F2FS_PREINVALID_WAF
+	/* invalidated ranges not yet sent to the FTL, under sentry_lock */
+	struct preinvalid_batch *pi_batch;
+	block_t pi_min, pi_max;			/* block span of pi_batch */
+	unsigned long long pi_blocks;		/* # of invalidated blocks hinted */
+	unsigned long long pi_ranges;		/* # of ranges after merging */
+	unsigned long long pi_bios;		/* # of hint bios issued */
+	unsigned long long pi_dropped;		/* # of ranges lost to -ENOMEM */
+#endif
+#ifdef F2FS_LIFETIME_HIST
+	bool gc_move;				/* old blocks are GC migrations */
+#endif
+#ifdef F2FS_SSR_LIFETIME
+	int ssr_type;				/* stream a cross-stream SSR is for */
+#endif
 };
 
 struct free_segmap_info {
@@ -995,6 +1011,17 @@ static inline int reserved_sections(struct f2fs_sb_info *sbi)
 	return GET_SEC_FROM_SEG(sbi, (unsigned int)reserved_segments(sbi));
 }
 
+#ifdef F2FS_SSR_LIFETIME
+/* which other streams' segments SSR may recycle for data (ssr_policy) */
+enum {
+	SSR_SAME_STREAM,	/* old behaviour: only the stream being written */
+	SSR_LIFETIME,		/* plus segments whose survivors fit its range */
+	SSR_ANY_STREAM,		/* plus any data stream, nearest cluster first */
+	NR_SSR_POLICY,
+};
+#define DEF_SSR_POLICY		SSR_SAME_STREAM
+#endif
+
 static inline bool need_SSR(struct f2fs_sb_info *sbi)
 {
 	int node_secs = get_blocktype_secs(sbi, F2FS_DIRTY_NODES);
@@ -39,6 +39,13 @@ static unsigned long __count_extent_cache(struct f2fs_sb_info *sbi)
 				atomic_read(&sbi->total_ext_node);
 }
 
+#ifdef F2FS_FGROUP
+static unsigned long __count_lifetime_entries(struct f2fs_sb_info *sbi)
+{
+	return sbi->nr_file_entries;
+}
+#endif
+
 unsigned long f2fs_shrink_count(struct shrinker *shrink,
 				struct shrink_control *sc)
 {
@@ -67,6 +74,11 @@ unsigned long f2fs_shrink_count(struct shrinker *shrink,
 		/* count free nids cache entries */
 		count += __count_free_nids(sbi);
 
+#ifdef F2FS_FGROUP
+		/* count lifetime tracker entries */
+		count += __count_lifetime_entries(sbi);
+#endif
+
 		spin_lock(&f2fs_list_lock);
 		p = p->next;
 		mutex_unlock(&sbi->umount_mutex);
@@ -115,6 +127,12 @@ unsigned long f2fs_shrink_scan(struct shrinker *shrink,
 		if (freed < nr)
 			freed += try_to_free_nids(sbi, nr - freed);
 
+#ifdef F2FS_FGROUP
+		/* shrink idle lifetime tracker entries */
+		if (freed < nr)
+			freed += f2fs_shrink_lifetime_entries(sbi, nr - freed);
+#endif
+
 		spin_lock(&f2fs_list_lock);
 		p = p->next;
 		list_move_tail(&sbi->s_list, &f2fs_list);
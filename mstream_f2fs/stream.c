@@ -1,6 +1,11 @@
+#include <linux/hash.h>
+
 #include "f2fs.h"
 
 #ifdef F2FS_FGROUP
+static struct kmem_cache *file_entry_slab;
+static struct kmem_cache *fgroup_entry_slab;
+
 static struct file_entry *lookup_file_entry(struct rb_root *root, 
 				unsigned int ino)
 {
@@ -25,7 +30,6 @@ static struct file_entry* insert_file_entry(struct f2fs_sb_info *sbi, struct rb_
 	struct rb_node **p = &root->rb_node;
 	struct rb_node *parent = NULL;
 	struct file_entry *re;
-	int i;
 
 	while (*p) {
 		parent = *p;
@@ -40,8 +44,12 @@ static struct file_entry* insert_file_entry(struct f2fs_sb_info *sbi, struct rb_
 		}
 	}
 
-	re = vmalloc(sizeof(struct file_entry));
+	/* called under ltree_lock; on failure the file is just not tracked */
+	re = kmem_cache_alloc(file_entry_slab, GFP_NOWAIT | __GFP_NOWARN);
+	if (!re)
+		return NULL;
 	re->ino = ino;
+	re->fgroup = 0;
 	re->last_0_update = 0;
 	re->last_offset = 0;
 	re->lifetime = 0;
@@ -50,22 +58,30 @@ static struct file_entry* insert_file_entry(struct f2fs_sb_info *sbi, struct rb_
 	re->cold = 1;
 
 	re->sample_avglifetime = 0;
-	re->sample_rate = 0;
-	for (i = 0; i < MAX_SAMPLE; i++) {
-		re->sample_lifetime[i] = 0;
-		re->sample_invalid[i] = 0;
-		re->sample_lastupdate[i] = 0;
-		re->sample_index[i] = -1;
-	}
+	re->sample = NULL;
 	re->max_range = 0;
 	re->last_kmeans = sbi->kmeans_count;
 
 	rb_link_node(&re->rb_node, parent, p);
 	rb_insert_color(&re->rb_node, root);
+	list_add_tail(&re->list, &sbi->lifetime_list);
+	sbi->nr_file_entries++;
 
 	return re;
 }
 
+static void free_file_entry(struct f2fs_sb_info *sbi, struct file_entry *re)
+{
+	rb_erase(&re->rb_node, &sbi->lifetime_tree);
+	list_del(&re->list);
+	if (re->sample) {
+		kfree(re->sample);
+		sbi->nr_file_samples--;
+	}
+	kmem_cache_free(file_entry_slab, re);
+	sbi->nr_file_entries--;
+}
+
 static int update_file_type(struct f2fs_sb_info *sbi, unsigned int ino, int filetype)
 {
 	struct file_entry *re;
@@ -104,10 +120,8 @@ int delete_file_entry(struct f2fs_sb_info *sbi, unsigned int ino)
 
 	spin_lock(&sbi->ltree_lock);
 	re = lookup_file_entry(root, ino);
-	if (re != NULL) {
-		rb_erase(&re->rb_node, root);
-		vfree(re);
-	}
+	if (re != NULL)
+		free_file_entry(sbi, re);
 	spin_unlock(&sbi->ltree_lock);
 
 	return 0;
@@ -499,17 +513,25 @@ int f2fs_lifetime_to_cluster(struct f2fs_sb_info *sbi, unsigned long long lifeti
 {
 	//unsigned long long min = 4294967295;
 	int i;
-	int cluster = NR_CLUSTER - 2;
+	int cluster;
+	unsigned int seq;
 
-	if (sbi->kmeans_max[0] == 0)
-		return 0;	
+	do {
+		seq = read_seqbegin(&sbi->kmeans_lock);
+		cluster = sbi->nr_cluster - 2;
 
-	for (i = 0; i < NR_CLUSTER - 1; i++) {
-		if (lifetime < sbi->kmeans_max[i] * 512) {
-			cluster = i;
-			break;
+		if (sbi->kmeans_max[0] == 0) {
+			cluster = 0;
+			continue;
 		}
-	}
+
+		for (i = 0; i < sbi->nr_cluster - 1; i++) {
+			if (lifetime < f2fs_seq_to_clock(sbi, sbi->kmeans_max[i])) {
+				cluster = i;
+				break;
+			}
+		}
+	} while (read_seqretry(&sbi->kmeans_lock, seq));
 
 	return cluster;
 }
@@ -559,15 +581,16 @@ unsigned long long update_new_ema(struct f2fs_sb_info *sbi, struct fgroup_entry
 			|| vtype == FGROUP_DCIM || vtype == FGROUP_MOVIE ||
 			vtype == FGROUP_MUSIC)
 	{
-		unsigned long long fgroup_age = user_data_blocks(sbi) - re->create_time;
-		re->cluster = NR_CLUSTER - 1;
-		printk("[COLDRATE]\t%u\t%llu\t%llu\t%d\t%llu\t%d\t%s\n", re->cluster, fgroup_age/512, re->cold, re->valid, re->count, vtype, re->keyword);
+		unsigned long long fgroup_age = f2fs_lifetime_clock(sbi) - re->create_time;
+		re->cluster = sbi->nr_cluster - 1;
+		f2fs_mtrace(sbi, MTRACE_COLDRATE, re->cluster, fgroup_age/512, re->cold,
+				re->valid, re->count, vtype, 0, re->keyword, NULL);
 		return 0;
 	}
 
 	if (re->update_ema == 0) {
-		unsigned long long fgroup_age = user_data_blocks(sbi) - re->create_time;
-		if (fgroup_age < PROFILE_T) {
+		unsigned long long fgroup_age = f2fs_lifetime_clock(sbi) - re->create_time;
+		if (fgroup_age < f2fs_seq_to_clock(sbi, PROFILE_T)) {
 #ifndef CLUSTER_TIME
 //			printk("[PROFILE]\t%u\t%llu\t%llu\t%d\t%llu\t%d\t%s\n", re->cluster, fgroup_age/512, re->cold, re->valid, re->count, vtype, re->keyword);
 #endif
@@ -578,7 +601,8 @@ unsigned long long update_new_ema(struct f2fs_sb_info *sbi, struct fgroup_entry
 			if (new_cluster > re->cluster)
 				re->cluster = new_cluster;
 #ifndef CLUSTER_TIME
-			printk("[COLDRATE]\t%u\t%llu\t%llu\t%d\t%llu\t%d\t%s\n", re->cluster, fgroup_age/512, re->cold, re->valid, re->count, vtype, re->keyword);
+			f2fs_mtrace(sbi, MTRACE_COLDRATE, re->cluster, fgroup_age/512, re->cold,
+				re->valid, re->count, vtype, 0, re->keyword, NULL);
 #endif
 			return 0;
 		} else if (re->latest_count == 0) {
@@ -586,7 +610,8 @@ unsigned long long update_new_ema(struct f2fs_sb_info *sbi, struct fgroup_entry
 			if (new_cluster > re->cluster)
 				re->cluster = new_cluster;
 #ifndef CLUSTER_TIME
-			printk("[COLDRATE]\t%u\t%llu\t%llu\t%d\t%llu\t%d\t%s\n", re->cluster, fgroup_age/512, re->cold, re->valid, re->count, vtype, re->keyword);
+			f2fs_mtrace(sbi, MTRACE_COLDRATE, re->cluster, fgroup_age/512, re->cold,
+				re->valid, re->count, vtype, 0, re->keyword, NULL);
 #endif
 			return 0;
 		}
@@ -613,8 +638,8 @@ unsigned long long update_new_ema(struct f2fs_sb_info *sbi, struct fgroup_entry
 		}
 		re->latest_count = 0;
 		re->latest_lifetime = 0;
-		printk("[EXPECTLIFE:L0]\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%s\n"
-	, num_active, num_invalid, 0, life_invalid, lifetime_value, re->ema, re->keyword);
+		f2fs_mtrace(sbi, MTRACE_EXPECTLIFE_L0, 0, num_active, num_invalid, 0,
+				life_invalid, lifetime_value, re->ema, re->keyword, NULL);
 		return re->ema;
 	}
 	else if ((re->latest_count + re->valid > 0)) {
@@ -639,8 +664,8 @@ unsigned long long update_new_ema(struct f2fs_sb_info *sbi, struct fgroup_entry
 	prev_ema = re->ema;
 	re->ema = re->ema * (EMA_W_DIV - EMA_W_NUM) / EMA_W_DIV + lifetime_value * EMA_W_NUM / EMA_W_DIV;
 
-	printk("[EXPECTLIFE]\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%s\n"
-	, num_active, num_invalid, prev_ema, life_invalid, lifetime_value, re->ema, re->keyword);
+	f2fs_mtrace(sbi, MTRACE_EXPECTLIFE, 0, num_active, num_invalid, prev_ema,
+			life_invalid, lifetime_value, re->ema, re->keyword, NULL);
 	return re->ema;
 }
 
@@ -662,7 +687,7 @@ static int insert_fgroup_history(struct f2fs_sb_info *sbi, struct fgroup_entry *
 	}
 
 	if (re->count == 0) {
-	    unsigned long long cur_seq = user_data_blocks(sbi);
+	    unsigned long long cur_seq = f2fs_lifetime_clock(sbi);
 		unsigned long long lifetime = cur_seq - re->create_time;
 		re->count += 1;
 		re->latest_count += 1;
@@ -676,6 +701,195 @@ static int insert_fgroup_history(struct f2fs_sb_info *sbi, struct fgroup_entry *
 	return 0;
 }
 
+static inline struct f2fs_model_entry *model_entry(void *model, int i)
+{
+	struct f2fs_model_block *blk = (struct f2fs_model_block *)
+			((char *)model + (i / MODEL_ENTRY_PER_BLOCK) * F2FS_BLKSIZE);
+
+	return &blk->entries[i % MODEL_ENTRY_PER_BLOCK];
+}
+
+static int lookup_model_entry(void *model, int nr_entries, char *keyword, int vtype)
+{
+	int i;
+
+	for (i = 0; i < nr_entries; i++) {
+		struct f2fs_model_entry *me = model_entry(model, i);
+
+		if (me->vtype == vtype &&
+				cmp_name(me->keyword, keyword, 50) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Serialize fgroup_history merged with the live fgroup entries, plus the
+ * latest k-means result, into F2FS_BLKSIZE blocks for the checkpoint pack.
+ * The header block comes last; cp_ver and crcs are filled by the caller.
+ */
+void *f2fs_build_fgroup_model(struct f2fs_sb_info *sbi, unsigned int *nr_blocks)
+{
+	struct f2fs_model_header *hdr;
+	struct f2fs_model_entry *me;
+	struct rb_node *n;
+	void *model;
+	int nr_entries = 0, nr_entry_blocks, i;
+	unsigned int seq;
+
+	/* under f2fs_lock_all, reclaim must not come back into f2fs */
+	model = kvzalloc(MODEL_MAX_BLOCKS * F2FS_BLKSIZE, GFP_NOFS);
+	if (!model)
+		return NULL;
+
+	spin_lock(&sbi->ftree_lock);
+	for (i = 0; i < sbi->history_count && nr_entries < MAX_HISTORY; i++) {
+		struct fgroup_history *fe = &sbi->fgroup_history[i];
+
+		me = model_entry(model, nr_entries++);
+		me->ema = cpu_to_le64(fe->ema);
+		me->count = cpu_to_le64(fe->count);
+		me->latest_lifetime = cpu_to_le64(fe->latest_lifetime);
+		me->latest_count = cpu_to_le64(fe->latest_count);
+		me->vtype = fe->vtype;
+		me->update_ema = fe->update_ema;
+		snprintf(me->keyword, MODEL_KEY_LEN, "%s", fe->keyword);
+	}
+
+	for (n = rb_first(&sbi->fgroup_tree); n; n = rb_next(n)) {
+		struct fgroup_entry *re = rb_entry(n, struct fgroup_entry, rb_node);
+		int vtype = re->fgroup & (31);
+
+		/* nothing learned yet */
+		if (re->count == 0 && re->update_ema == 0)
+			continue;
+
+		i = lookup_model_entry(model, nr_entries, re->keyword, vtype);
+		if (i < 0) {
+			if (nr_entries >= MAX_HISTORY)
+				continue;
+			i = nr_entries++;
+		}
+		me = model_entry(model, i);
+		me->ema = cpu_to_le64(re->ema);
+		me->count = cpu_to_le64(re->count);
+		me->latest_lifetime = cpu_to_le64(re->latest_lifetime);
+		me->latest_count = cpu_to_le64(re->latest_count);
+		me->vtype = vtype;
+		me->update_ema = re->update_ema;
+		snprintf(me->keyword, MODEL_KEY_LEN, "%s", re->keyword);
+	}
+	spin_unlock(&sbi->ftree_lock);
+
+	nr_entry_blocks = DIV_ROUND_UP(nr_entries, MODEL_ENTRY_PER_BLOCK);
+	for (i = 0; i < nr_entry_blocks; i++) {
+		struct f2fs_model_block *blk = (struct f2fs_model_block *)
+				((char *)model + i * F2FS_BLKSIZE);
+		int left = nr_entries - i * MODEL_ENTRY_PER_BLOCK;
+
+		blk->magic = cpu_to_le32(F2FS_MODEL_MAGIC);
+		blk->index = cpu_to_le32(i);
+		blk->nr_entries = cpu_to_le32(min_t(int, left,
+						MODEL_ENTRY_PER_BLOCK));
+	}
+
+	hdr = (struct f2fs_model_header *)
+			((char *)model + nr_entry_blocks * F2FS_BLKSIZE);
+	hdr->magic = cpu_to_le32(F2FS_MODEL_MAGIC);
+	hdr->nr_blocks = cpu_to_le32(nr_entry_blocks);
+	hdr->nr_entries = cpu_to_le32(nr_entries);
+	hdr->nr_cluster = cpu_to_le32(sbi->nr_cluster);
+	hdr->lifetime_clock = cpu_to_le32(sbi->lifetime_clock);
+	do {
+		seq = read_seqbegin(&sbi->kmeans_lock);
+		for (i = 0; i < sbi->nr_cluster; i++) {
+			hdr->kmeans_max[i] = cpu_to_le64(sbi->kmeans_max[i]);
+			hdr->kmeans_center[i] = cpu_to_le64(sbi->kmeans_center[i]);
+			if (sbi->kmeans_count > 0) {
+				struct kmeans_history *kh =
+					&sbi->kmeans_history[sbi->kmeans_count - 1];
+				hdr->q1[i] = cpu_to_le32(kh->q1[i]);
+				hdr->q3[i] = cpu_to_le32(kh->q3[i]);
+			}
+		}
+	} while (read_seqretry(&sbi->kmeans_lock, seq));
+
+	*nr_blocks = nr_entry_blocks + 1;
+	return model;
+}
+
+/* the clock never runs backwards, late or repeated calls are ignored */
+void f2fs_set_simul_time(struct f2fs_sb_info *sbi, u64 simul_time)
+{
+	s64 now = div_u64(ktime_get_boot_ns(), NSEC_PER_SEC);
+	s64 old = atomic64_read(&sbi->simul_offset);
+	s64 new = (s64)simul_time - now;
+	s64 cur;
+
+	while (new > old) {
+		cur = atomic64_cmpxchg(&sbi->simul_offset, old, new);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+/*
+ * Seed fgroup_history and the k-means state from a model read at mount, so
+ * insert_fgroup_entry() classifies known fgroups before PROFILE_T passes.
+ */
+void f2fs_restore_fgroup_model(struct f2fs_sb_info *sbi, void *model,
+						unsigned int nr_blocks)
+{
+	struct f2fs_model_header *hdr;
+	int nr_entries, i;
+
+	hdr = (struct f2fs_model_header *)
+			((char *)model + (nr_blocks - 1) * F2FS_BLKSIZE);
+	nr_entries = min_t(int, le32_to_cpu(hdr->nr_entries), MAX_HISTORY);
+	nr_entries = min_t(int, nr_entries,
+			(nr_blocks - 1) * MODEL_ENTRY_PER_BLOCK);
+
+	/* lifetimes learned on the other clock are in the wrong unit */
+	if (le32_to_cpu(hdr->lifetime_clock) != sbi->lifetime_clock) {
+		f2fs_msg(sbi->sb, KERN_INFO,
+			"fgroup model uses another lifetime_clock, ignored");
+		return;
+	}
+
+	spin_lock(&sbi->ftree_lock);
+	for (i = 0; i < nr_entries; i++) {
+		struct f2fs_model_entry *me = model_entry(model, i);
+		struct fgroup_history *fe = &sbi->fgroup_history[i];
+
+		memset(fe->keyword, 0, 51);
+		snprintf(fe->keyword, 50, "%s", me->keyword);
+		fe->vtype = me->vtype;
+		fe->ema = le64_to_cpu(me->ema);
+		fe->count = le64_to_cpu(me->count);
+		fe->latest_lifetime = le64_to_cpu(me->latest_lifetime);
+		fe->latest_count = le64_to_cpu(me->latest_count);
+		fe->update_ema = me->update_ema;
+	}
+	sbi->history_count = nr_entries;
+	spin_unlock(&sbi->ftree_lock);
+
+	/* k-means arrays are sized by nr_streams=, drop a mismatching result */
+	if (le32_to_cpu(hdr->nr_cluster) != sbi->nr_cluster)
+		return;
+
+	write_seqlock(&sbi->kmeans_lock);
+	for (i = 0; i < sbi->nr_cluster; i++) {
+		sbi->kmeans_max[i] = le64_to_cpu(hdr->kmeans_max[i]);
+		sbi->kmeans_center[i] = le64_to_cpu(hdr->kmeans_center[i]);
+		sbi->kmeans_history[0].q1[i] = le32_to_cpu(hdr->q1[i]);
+		sbi->kmeans_history[0].q3[i] = le32_to_cpu(hdr->q3[i]);
+	}
+	sbi->kmeans_history[0].seq = 0;
+	sbi->kmeans_count = 1;
+	write_sequnlock(&sbi->kmeans_lock);
+}
+
 struct fgroup_entry *lookup_fgroup_entry(struct rb_root *root, 
 				unsigned long long fgroup)
 {
@@ -700,7 +914,7 @@ static struct fgroup_entry* insert_fgroup_entry(struct f2fs_sb_info *sbi, struct
 	struct rb_node **p = &root->rb_node;
 	struct rb_node *parent = NULL;
 	struct fgroup_entry *re;
-	unsigned long long cur_seq = user_data_blocks(sbi);
+	unsigned long long cur_seq = f2fs_lifetime_clock(sbi);
 	struct fgroup_history *fe;
 	int vtype = 0;
 	int found = 0;
@@ -729,9 +943,12 @@ static struct fgroup_entry* insert_fgroup_entry(struct f2fs_sb_info *sbi, struct
 		}
 	}
 
-	re = vmalloc(sizeof(struct fgroup_entry));
+	/* called under ftree_lock */
+	re = kmem_cache_alloc(fgroup_entry_slab, GFP_NOWAIT | __GFP_NOWARN);
+	if (!re)
+		return NULL;
 	re->fgroup = fgroup;
-	re->cluster = NR_CLUSTER - 1;
+	re->cluster = sbi->nr_cluster - 1;
 	re->count = 0;
 	re->ema = 0;
 	re->latest_count = 0;
@@ -771,7 +988,7 @@ static struct fgroup_entry* insert_fgroup_entry(struct f2fs_sb_info *sbi, struct
 				re->cluster = f2fs_lifetime_to_cluster(sbi, lifetime_value);
 			}
 			else
-				re->cluster = NR_CLUSTER - 2;
+				re->cluster = sbi->nr_cluster - 2;
 		}
 	} else {
 		switch (vtype)
@@ -786,7 +1003,7 @@ static struct fgroup_entry* insert_fgroup_entry(struct f2fs_sb_info *sbi, struct
 			case FGROUP_DCIM:
 			case FGROUP_MOVIE:
 			case FGROUP_MUSIC:
-				re->cluster = NR_CLUSTER - 1;
+				re->cluster = sbi->nr_cluster - 1;
 				break;
 			case FGROUP_EXT_JOURNAL:
 			case FGROUP_EXT_SPECIAL_JOURNAL:
@@ -810,6 +1027,7 @@ static struct fgroup_entry* insert_fgroup_entry(struct f2fs_sb_info *sbi, struct
 	//printk("insert tree ino:%u\n", ino);
 	rb_link_node(&re->rb_node, parent, p);
 	rb_insert_color(&re->rb_node, root);
+	sbi->nr_fgroup_entries++;
 
 //	printk("insert fgroup: %llu %d\n", fgroup, re->cluster);
 
@@ -823,6 +1041,8 @@ static int update_fgroup_entry_valid(struct f2fs_sb_info *sbi, unsigned long lon
 	
 	if (entry == NULL)
 		entry = insert_fgroup_entry(sbi, &sbi->fgroup_tree, fgroup, name);
+	if (entry == NULL)
+		return 0;
 
 	if (valid < 0) {
 		int valid_size = 0 - valid;
@@ -881,6 +1101,8 @@ static int convert_fgroup_to_special_journal(struct f2fs_sb_info *sbi, struct in
 	jentry = lookup_fgroup_entry(&sbi->fgroup_tree, FGROUP_EXT_SPECIAL_JOURNAL);
 	if (jentry == NULL)
 		jentry = insert_fgroup_entry(sbi, &sbi->fgroup_tree, FGROUP_EXT_SPECIAL_JOURNAL, "KEY-7:JOURNAL");
+	if (jentry == NULL)
+		return 0;
 	
 	jentry->cold += fe->cold;
 	jentry->count += fe->count;
@@ -889,7 +1111,8 @@ static int convert_fgroup_to_special_journal(struct f2fs_sb_info *sbi, struct in
 	jentry->valid += fe->valid;
 
 	rb_erase(&fe->rb_node, root);
-	vfree(fe);
+	kmem_cache_free(fgroup_entry_slab, fe);
+	sbi->nr_fgroup_entries--;
 
 	return 0;
 }
@@ -901,6 +1124,8 @@ static int update_fgroup_entry(struct f2fs_sb_info *sbi, unsigned long long fgro
 	
 	if (entry == NULL)
 		entry = insert_fgroup_entry(sbi, &sbi->fgroup_tree, fgroup, name);
+	if (entry == NULL)
+		return 0;
 
 	entry->count += count;
 	entry->latest_count += count;
@@ -920,7 +1145,8 @@ int delete_fgroup_entry(struct f2fs_sb_info *sbi, unsigned int ino)
 		if (re != NULL) {
 			insert_fgroup_history(sbi, re);
 			rb_erase(&re->rb_node, root);
-			vfree(re);
+			kmem_cache_free(fgroup_entry_slab, re);
+			sbi->nr_fgroup_entries--;
 		}
 	}
 	spin_unlock(&sbi->ftree_lock);
@@ -964,17 +1190,13 @@ int get_pstream(struct f2fs_sb_info *sbi, unsigned long long fgroup)
 	int pstream;
 	pstream = get_cluster(sbi, fgroup);
 	if (pstream == -1) {
-		pstream = NR_CLUSTER - 1;
+		pstream = sbi->nr_cluster - 1;
 	}
-	pstream = pstream + CLUSTER_START_TYPE;
-	if (pstream >= CLUSTER_START_TYPE + NR_CLUSTER) {
+	if (pstream >= sbi->nr_cluster) {
 		printk("pstream:%d\n", pstream);
 	}
 
-	if (pstream == NR_CLUSTER - 1)
-		return CURSEG_COLD_DATA;
-
-	return pstream;
+	return cluster_to_curseg(sbi, pstream);
 }
 
 /////////////////////////////////////////
@@ -983,156 +1205,230 @@ int get_pstream(struct f2fs_sb_info *sbi, unsigned long long fgroup)
 ///////////////////////////////////////////
 
 #if 1
-#define RESET_RATE	(2)
-static int reset_sample_lifetime(struct f2fs_sb_info *sbi, struct file_entry *re)
+#define SAMPLE_SLOTS(fs)	(1U << (fs)->bits)
+#define SAMPLE_MASK(fs)		(SAMPLE_SLOTS(fs) - 1)
+
+static inline unsigned int sample_slot(struct file_sample *fs, u32 index)
+{
+	return hash_32(index, fs->bits);
+}
+
+/* smallest table that holds @pages at 3/4 load */
+static inline unsigned int sample_bits(unsigned int pages)
+{
+	return max_t(unsigned int, order_base_2(DIV_ROUND_UP(pages * 4, 3)), 2);
+}
+
+/* consistent hash: a page once dropped is not picked again as the file grows */
+static bool sample_selected(struct f2fs_sb_info *sbi, struct file_entry *re,
+							u32 index)
 {
-	unsigned long long cur_seq = user_data_blocks(sbi);
+	u32 h;
+
+	if (re->max_range < sbi->db_sample_pages)
+		return true;
+	h = hash_32(index ^ hash_32(re->ino, 32), 32);
+	return (((u64)h * ((u64)re->max_range + 1)) >> 32) <
+						sbi->db_sample_pages;
+}
+
+static int find_sample(struct file_sample *fs, u32 index)
+{
+	unsigned int pos = sample_slot(fs, index);
 	int i;
-	int delete_idx = re->last_kmeans % (RESET_RATE);
 
-	if (re->max_range < MAX_SAMPLE)
-		return 0;
+	for (i = 0; i < SAMPLE_SLOTS(fs); i++) {
+		if (!fs->slot[pos].lastupdate)
+			return -1;
+		if (fs->slot[pos].index == index)
+			return pos;
+		pos = (pos + 1) & SAMPLE_MASK(fs);
+	}
+	return -1;
+}
 
-	for (i = 0; i < MAX_SAMPLE; i++) {
-		int sample_index = re->sample_index[i];
-		if (i != delete_idx)
-			continue; 
-		delete_idx = delete_idx + RESET_RATE; 
-		if (sample_index < 0)
-			continue;
-		if (re->sample_lifetime[i] > 0) {
-			re->sample_lastupdate[i] = 0;
-			re->sample_lifetime[i] = 0;
-			re->sample_invalid[i] = 0;
-			re->sample_index[i] = -1;
+static void insert_sample(struct file_sample *fs, u32 index, u32 lastupdate)
+{
+	unsigned int pos = sample_slot(fs, index);
+
+	while (fs->slot[pos].lastupdate)
+		pos = (pos + 1) & SAMPLE_MASK(fs);
+	fs->slot[pos].index = index;
+	fs->slot[pos].lastupdate = lastupdate;
+	fs->nr_used++;
+}
+
+/* linear probing delete: shift later entries of the chain back */
+static void delete_sample(struct file_sample *fs, unsigned int pos)
+{
+	unsigned int next = pos, home;
+
+	fs->nr_used--;
+	for (;;) {
+		fs->slot[pos].lastupdate = 0;
+		for (;;) {
+			next = (next + 1) & SAMPLE_MASK(fs);
+			if (!fs->slot[next].lastupdate)
+				return;
+			home = sample_slot(fs, fs->slot[next].index);
+			if (next > pos ? (home <= pos || home > next) :
+					(home <= pos && home > next))
+				break;
 		}
+		fs->slot[pos] = fs->slot[next];
+		pos = next;
 	}
+}
 
-	return 0;
+/*
+ * Drop pages that fell out of the sampled subset since the file grew.
+ * Done in place: delete_sample() only pulls entries back into the slot
+ * being looked at or into slots already checked, so recheck the same slot.
+ */
+static void purge_samples(struct f2fs_sb_info *sbi, struct file_entry *re,
+						struct file_sample *fs)
+{
+	unsigned int i = 0;
+
+	while (i < SAMPLE_SLOTS(fs)) {
+		if (fs->slot[i].lastupdate &&
+				!sample_selected(sbi, re, fs->slot[i].index))
+			delete_sample(fs, i);
+		else
+			i++;
+	}
+	fs->purge_range = re->max_range;
+}
+
+static inline unsigned long long sample_lastupdate(struct file_sample *fs,
+							int pos)
+{
+	return fs->base + fs->slot[pos].lastupdate - 1;
+}
+
+static void set_sample_lastupdate(struct file_sample *fs, int pos, u32 index,
+					unsigned long long cur_seq)
+{
+	/* rebase once the u32 deltas run out, dropping in-flight samples */
+	if (cur_seq - fs->base >= U32_MAX) {
+		memset(fs->slot, 0, SAMPLE_SLOTS(fs) * sizeof(fs->slot[0]));
+		fs->nr_used = 0;
+		fs->base = cur_seq;
+		pos = -1;
+	}
+	if (pos < 0)
+		insert_sample(fs, index, cur_seq - fs->base + 1);
+	else
+		fs->slot[pos].lastupdate = cur_seq - fs->base + 1;
+}
+
+static void add_sample_lifetime(struct file_sample *fs,
+					unsigned long long lifetime)
+{
+	while (fs->lifetime_sum > ULLONG_MAX - lifetime ||
+			fs->lifetime_count >= DB_SAMPLE_MAX_COUNT) {
+		fs->lifetime_sum >>= 1;
+		fs->lifetime_count >>= 1;
+	}
+	fs->lifetime_sum += lifetime;
+	fs->lifetime_count++;
+}
+
+static struct file_sample *get_file_sample(struct f2fs_sb_info *sbi,
+					struct file_entry *re)
+{
+	struct file_sample *fs = re->sample;
+	unsigned int bits;
+
+	if (fs)
+		return fs;
+
+	/* called under ltree_lock */
+	bits = sample_bits(sbi->db_sample_pages);
+	fs = kzalloc(sizeof(*fs) + (sizeof(fs->slot[0]) << bits),
+					GFP_NOWAIT | __GFP_NOWARN);
+	if (!fs)
+		return NULL;
+	fs->bits = bits;
+	fs->base = f2fs_lifetime_clock(sbi);
+	fs->purge_range = re->max_range;
+	re->sample = fs;
+	sbi->nr_file_samples++;
+	return fs;
+}
+
+/* age the average by half every clustering round rather than forgetting it */
+static void decay_sample_lifetime(struct file_sample *fs)
+{
+	if (fs->lifetime_count < 2)
+		return;
+	fs->lifetime_sum >>= 1;
+	fs->lifetime_count >>= 1;
 }
 
 static unsigned long update_sample_lifetime(struct f2fs_sb_info *sbi, struct inode* inode, struct file_entry *re, int index, int unlink)
 {
-	unsigned long long cur_seq = user_data_blocks(sbi);
-	int i;
+	unsigned long long cur_seq = f2fs_lifetime_clock(sbi);
 	unsigned long lifetime = 0;
-	int sampling = 0;
 	struct f2fs_inode_info *ei = F2FS_I(inode);
-	int found = 0;
+	struct file_sample *fs;
+	int pos;
+
+	fs = get_file_sample(sbi, re);
+	if (!fs)
+		return re->sample_avglifetime;
 
 	if (sbi->kmeans_count > re->last_kmeans) {
-		reset_sample_lifetime(sbi, re);
+		decay_sample_lifetime(fs);
 		re->last_kmeans = sbi->kmeans_count;
 	}
 
-	re->sample_rate += 1;
-
 	if (re->max_range < index) {
 		re->max_range = index;
-//		if (re->max_range > MAX_SAMPLE)
-//			printk("max_range: %s %d\n", ei->i_name, re->max_range);
+		if (re->max_range >= 2 * fs->purge_range &&
+				re->max_range >= sbi->db_sample_pages)
+			purge_samples(sbi, re, fs);
 	}
 
-	// find sample 
-	for (i = 0; i < MAX_SAMPLE; i++) {
-		int sample_index = re->sample_index[i];
-		if (sample_index == index) {
-//			printk("[F]index:%d/%d %llu %s\n", index, i, cur_seq, ei->i_name);
-			if (unlink == -1) {
-				re->sample_lastupdate[i] = cur_seq;
-				re->sample_lifetime[i] = 0;
-				re->sample_invalid[i] = 0;
-				return 0; 
-			}
-			else if (re->sample_lastupdate[i] > 0) {
-				if (cur_seq == re->sample_lastupdate[i]) {
-				//	printk("cur_seq=sample_lastupdate: %s %llu\n", ei->i_name, cur_seq);
-				}
-				lifetime = (cur_seq - re->sample_lastupdate[i]);
-				re->sample_lifetime[i] += (cur_seq - re->sample_lastupdate[i]);
-				re->sample_invalid[i] += 1;
-//				if (strstr(ei->i_keyword, "icing-indexapi") != NULL)
-//					printk("[L]index:%d/%d %llu %s\n", index, i, lifetime, ei->i_name);
-			}
-
-			if (unlink == 1) {
-//				if (strstr(ei->i_keyword, "icing-indexapi") != NULL)
-//					printk("[D]index:%d/%d %s\n", index, i, ei->i_name);
-				re->sample_lastupdate[i] = 0;
-				re->sample_lifetime[i] = 0;
-				re->sample_invalid[i] = 0;
-				re->sample_index[i] = -1;
-			} else {
-				re->sample_lastupdate[i] = cur_seq;
-			}
-
-			if (lifetime == 0)
-				return 0;
-
-			found = 1;
-			break;
+	pos = find_sample(fs, index);
+	if (pos >= 0) {
+		if (unlink == -1) {
+			set_sample_lastupdate(fs, pos, index, cur_seq);
+			return 0;
 		}
-	}
 
-	if (found == 1) {
-		unsigned long lifetime_sum = 0;
-		int lifetime_count = 0;
-		for (i = 0; i < MAX_SAMPLE; i++) {
-			unsigned long sample_lifetime = re->sample_lifetime[i];
-			if (re->sample_index[i] >= 0 && re->sample_invalid[i] > 0) {
-				lifetime_sum += (sample_lifetime / re->sample_invalid[i]);
-				lifetime_count += 1;
-			}
-		}
-		if (lifetime_count > 0)
-			re->sample_avglifetime = lifetime_sum / lifetime_count;
+		lifetime = cur_seq - sample_lastupdate(fs, pos);
+		add_sample_lifetime(fs, lifetime);
+		re->sample_avglifetime = div64_u64(fs->lifetime_sum,
+							fs->lifetime_count);
+
+		if (unlink == 1)
+			delete_sample(fs, pos);
 		else
-			re->sample_avglifetime = 0;
+			set_sample_lastupdate(fs, pos, index, cur_seq);
+
+		if (lifetime == 0)
+			return 0;
 #ifdef F2FS_TRACE_ENABLE
-		trace_printk("[DB-lifetime]\t%lld\t%u\t%u\t%u\t%llu\t%s\t%s\n",
-				index, cur_seq - lifetime, 2, 0, cur_seq, ei->i_keyword, ei->i_name);
+		f2fs_mtrace(sbi, MTRACE_DB_LIFETIME, 2, index, cur_seq - lifetime,
+				0, cur_seq, 0, 0, ei->i_keyword, ei->i_name);
 #endif
-
 		return lifetime;
 	}
 
 	// new_sample
-	if (unlink != 1) {
-		if (re->max_range < MAX_SAMPLE) {
-			sampling = 1;
-		} 
-		else if (re->sample_rate >= SAMPLE_RATE) {	
-			sampling = 1;
-		}
-	}
-
-	if (sampling == 1) {
-		for (i = 0; i < MAX_SAMPLE; i++) {
-			int sample_index = re->sample_index[i];
-			if (sample_index == -1) {
-				re->sample_lastupdate[i] = cur_seq;
-				re->sample_lifetime[i] = 0;
-				re->sample_invalid[i] = 0;
-				re->sample_index[i] = index;
-//				if (strstr(ei->i_keyword, "icing-indexapi") != NULL)
-//					printk("[I]:%d/%d %s\n", index, i, ei->i_name);
-				break;
-			}
-		}
-		re->sample_rate = 0;
-	} else {
-//		if ((strstr(ei->i_keyword, "icing-indexapi") != NULL) && (unlink != 1))
-//			printk("no sampling:%d %s\n", index, ei->i_name);
-	}
+	/* the table was sized for db_sample_pages at the time it was made */
+	if (unlink != 1 && fs->nr_used < min_t(unsigned int,
+			sbi->db_sample_pages, SAMPLE_SLOTS(fs) * 3 / 4) &&
+			sample_selected(sbi, re, index))
+		set_sample_lastupdate(fs, -1, index, cur_seq);
 
 	if (unlink == -1)
 		return 0;
 
-//	if ((strstr(ei->i_keyword, "icing-indexapi") != NULL))
-//		printk("[Avg]:%d %s\n", index, ei->i_name);
 #ifdef F2FS_TRACE_ENABLE
-	trace_printk("[DB-lifetime]\t%lld\t%u\t%u\t%u\t%llu\t%s\t%s\n",
-			index, 0, 3, 0, re->sample_avglifetime, ei->i_keyword, ei->i_name);
+	f2fs_mtrace(sbi, MTRACE_DB_LIFETIME, 3, index, 0, 0,
+			re->sample_avglifetime, 0, 0, ei->i_keyword, ei->i_name);
 #endif
 
 	return re->sample_avglifetime;
@@ -1143,9 +1439,10 @@ static unsigned long update_sample_lifetime(struct f2fs_sb_info *sbi, struct ino
 int update_file_lifetime(struct f2fs_sb_info *sbi, struct inode *inode, loff_t range_start, long page_written, int unlink)
 {
 	struct file_entry *re;
-	unsigned long long cur_seq = user_data_blocks(sbi);
+	unsigned long long cur_seq = f2fs_lifetime_clock(sbi);
 	struct f2fs_inode_info *ei = F2FS_I(inode);
 	unsigned long long lifetime = 0;
+	int cold_valid = -1;
 
 	if (page_written == 0)
 		return 0;
@@ -1158,7 +1455,12 @@ int update_file_lifetime(struct f2fs_sb_info *sbi, struct inode *inode, loff_t r
 			return 0; 
 		}
 		re = insert_file_entry(sbi, &sbi->lifetime_tree, inode->i_ino);
+		if (re == NULL) {
+			spin_unlock(&sbi->ltree_lock);
+			return 0;
+		}
 	}
+	list_move_tail(&re->list, &sbi->lifetime_list);
 
 #if 1 
 	if (range_start == 0) {
@@ -1187,6 +1489,11 @@ int update_file_lifetime(struct f2fs_sb_info *sbi, struct inode *inode, loff_t r
 	} else 
 		lifetime = re->lifetime;
 
+	/* re may be reclaimed once ltree_lock is dropped */
+	if (lifetime > 0 && re->cold == 1) {
+		cold_valid = re->valid;
+		re->cold = 0;
+	}
 	spin_unlock(&sbi->ltree_lock);
 
 	if (lifetime > 0) {
@@ -1197,10 +1504,8 @@ int update_file_lifetime(struct f2fs_sb_info *sbi, struct inode *inode, loff_t r
 		}
 		spin_lock(&sbi->ftree_lock);
 		update_fgroup_entry(sbi, ei->i_fgroup, lifetime, page_written, ei->i_keyword);
-		if (re->cold == 1) {
-			clear_fgroup_cold(sbi, ei->i_fgroup, re->valid);
-			re->cold = 0;
-		}
+		if (cold_valid >= 0)
+			clear_fgroup_cold(sbi, ei->i_fgroup, cold_valid);
 		if (ei->i_filetype == FGROUP_EXT_JOURNAL) {
 			if (unlink == 1 && range_start == 0) {
 				convert_fgroup_to_special_journal(sbi, inode);
@@ -1211,8 +1516,9 @@ int update_file_lifetime(struct f2fs_sb_info *sbi, struct inode *inode, loff_t r
 			int i = 0;
 			for (i = 0; i < page_written; i++) {	 
 #ifdef F2FS_TRACE_ENABLE
-				trace_printk("[DB-lifetime]\t%lld\t%u\t%u\t%u\t%llu\t%s\t%s\n",
-					range_start+i, cur_seq - lifetime, 1, 0, cur_seq, ei->i_keyword, ei->i_name);
+				f2fs_mtrace(sbi, MTRACE_DB_LIFETIME, 1, range_start+i,
+					cur_seq - lifetime, 0, cur_seq, 0, 0,
+					ei->i_keyword, ei->i_name);
 #endif
 			}
 		}
@@ -1226,6 +1532,14 @@ int update_file_valid(struct f2fs_sb_info *sbi, struct inode *inode, int valid)
 	struct file_entry *re;
 	int update_valid = valid;
 	struct f2fs_inode_info *ei = F2FS_I(inode);
+	int cold;
+
+	/* resolve the fgroup first so the entry records where valid went */
+	if (ei->i_filetype == FGROUP_INIT) {
+		ei->i_fgroup = get_fgroup(sbi, inode, NULL); 
+	} else if (strstr(ei->i_keyword, "KEY-INIT") != NULL) {
+		ei->i_fgroup = get_fgroup(sbi, inode, NULL); 
+	}
 
 	spin_lock(&sbi->ltree_lock);
 	re = lookup_file_entry(&sbi->lifetime_tree, inode->i_ino); 
@@ -1235,7 +1549,12 @@ int update_file_valid(struct f2fs_sb_info *sbi, struct inode *inode, int valid)
 			return 0;
 		}
 		re = insert_file_entry(sbi, &sbi->lifetime_tree, inode->i_ino);
+		if (re == NULL) {
+			spin_unlock(&sbi->ltree_lock);
+			return 0;
+		}
 	}
+	list_move_tail(&re->list, &sbi->lifetime_list);
 
 	if (valid == 0) {
 		update_valid = 0 - re->valid;
@@ -1248,15 +1567,12 @@ int update_file_valid(struct f2fs_sb_info *sbi, struct inode *inode, int valid)
 	}
 
 	re->valid += update_valid; 
+	re->fgroup = ei->i_fgroup;
+	cold = re->cold;
 	spin_unlock(&sbi->ltree_lock);
 
-	if (ei->i_filetype == FGROUP_INIT) {
-		ei->i_fgroup = get_fgroup(sbi, inode, NULL); 
-	} else if (strstr(ei->i_keyword, "KEY-INIT") != NULL) {
-		ei->i_fgroup = get_fgroup(sbi, inode, NULL); 
-	}
 	spin_lock(&sbi->ftree_lock);
-	update_fgroup_entry_valid(sbi, ei->i_fgroup, update_valid, ei->i_keyword, re->cold);
+	update_fgroup_entry_valid(sbi, ei->i_fgroup, update_valid, ei->i_keyword, cold);
 	spin_unlock(&sbi->ftree_lock);
 
 	return 0;
@@ -1307,5 +1623,82 @@ int update_file_valid(struct ext4_sb_info *sbi, struct inode *inode)
     return 0;
 }
 #endif
-#endif
 
+/*
+ * Drop up to @nr_shrink file entries from the idle end of lifetime_list.
+ * The blocks they still count as valid (and cold) are taken back out of
+ * their fgroup, otherwise deleting the file later could not subtract them.
+ */
+unsigned long f2fs_shrink_lifetime_entries(struct f2fs_sb_info *sbi,
+						unsigned long nr_shrink)
+{
+	struct file_entry *re, *tmp;
+	struct fgroup_entry *fe;
+	unsigned long freed = 0;
+
+	spin_lock(&sbi->ftree_lock);
+	spin_lock(&sbi->ltree_lock);
+	list_for_each_entry_safe(re, tmp, &sbi->lifetime_list, list) {
+		if (freed >= nr_shrink)
+			break;
+
+		fe = lookup_fgroup_entry(&sbi->fgroup_tree, re->fgroup);
+		if (fe != NULL && re->valid > 0) {
+			fe->valid -= min(fe->valid, re->valid);
+			if (re->cold == 1)
+				fe->cold -= min_t(unsigned long long,
+							fe->cold, re->valid);
+		}
+		free_file_entry(sbi, re);
+		freed++;
+	}
+	spin_unlock(&sbi->ltree_lock);
+	spin_unlock(&sbi->ftree_lock);
+
+	return freed;
+}
+
+void f2fs_destroy_lifetime_tree(struct f2fs_sb_info *sbi)
+{
+	struct file_entry *re, *tmp;
+	struct rb_node *node;
+
+	spin_lock(&sbi->ltree_lock);
+	list_for_each_entry_safe(re, tmp, &sbi->lifetime_list, list)
+		free_file_entry(sbi, re);
+	spin_unlock(&sbi->ltree_lock);
+
+	spin_lock(&sbi->ftree_lock);
+	while ((node = rb_first(&sbi->fgroup_tree)) != NULL) {
+		rb_erase(node, &sbi->fgroup_tree);
+		kmem_cache_free(fgroup_entry_slab,
+				rb_entry(node, struct fgroup_entry, rb_node));
+	}
+	sbi->nr_fgroup_entries = 0;
+	spin_unlock(&sbi->ftree_lock);
+}
+
+int __init create_lifetime_caches(void)
+{
+	file_entry_slab = f2fs_kmem_cache_create("f2fs_file_entry",
+			sizeof(struct file_entry));
+	if (!file_entry_slab)
+		goto fail;
+	fgroup_entry_slab = f2fs_kmem_cache_create("f2fs_fgroup_entry",
+			sizeof(struct fgroup_entry));
+	if (!fgroup_entry_slab)
+		goto free_file_entry;
+	return 0;
+
+free_file_entry:
+	kmem_cache_destroy(file_entry_slab);
+fail:
+	return -ENOMEM;
+}
+
+void destroy_lifetime_caches(void)
+{
+	kmem_cache_destroy(fgroup_entry_slab);
+	kmem_cache_destroy(file_entry_slab);
+}
+#endif
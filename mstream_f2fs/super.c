@@ -109,6 +109,8 @@ enum {
 	Opt_nolazytime,
 	Opt_usrquota,
 	Opt_grpquota,
+	Opt_nr_streams,
+	Opt_lifetime_clock,
 	Opt_err,
 };
 
@@ -146,6 +148,8 @@ static match_table_t f2fs_tokens = {
 	{Opt_nolazytime, "nolazytime"},
 	{Opt_usrquota, "usrquota"},
 	{Opt_grpquota, "grpquota"},
+	{Opt_nr_streams, "nr_streams=%u"},
+	{Opt_lifetime_clock, "lifetime_clock=%s"},
 	{Opt_err, NULL},
 };
 
@@ -398,6 +402,39 @@ static int parse_options(struct super_block *sb, char *options)
 			f2fs_msg(sb, KERN_INFO,
 					"quota operations not supported");
 			break;
+#endif
+#ifdef F2FS_FGROUP
+		case Opt_nr_streams:
+			if (args->from && match_int(args, &arg))
+				return -EINVAL;
+			if (arg < 2 || arg > NR_CLUSTER_LOGS) {
+				f2fs_msg(sb, KERN_ERR,
+					"nr_streams should be 2 ~ %d", NR_CLUSTER_LOGS);
+				return -EINVAL;
+			}
+			sbi->nr_cluster = arg;
+			break;
+		case Opt_lifetime_clock:
+			name = match_strdup(&args[0]);
+
+			if (!name)
+				return -ENOMEM;
+			if (strlen(name) == 6 && !strncmp(name, "blocks", 6)) {
+				sbi->lifetime_clock = LIFETIME_CLOCK_BLOCKS;
+			} else if (strlen(name) == 4 && !strncmp(name, "time", 4)) {
+				sbi->lifetime_clock = LIFETIME_CLOCK_TIME;
+			} else {
+				kfree(name);
+				return -EINVAL;
+			}
+			kfree(name);
+			break;
+#else
+		case Opt_nr_streams:
+		case Opt_lifetime_clock:
+			f2fs_msg(sb, KERN_INFO,
+					"%s option not supported", p);
+			break;
 #endif
 		default:
 			f2fs_msg(sb, KERN_ERR,
@@ -637,6 +674,9 @@ static void f2fs_put_super(struct super_block *sb)
 	release_ino_entry(sbi, true);
 
 	f2fs_leave_shrinker(sbi);
+#ifdef F2FS_FGROUP
+	f2fs_destroy_lifetime_tree(sbi);
+#endif
 	mutex_unlock(&sbi->umount_mutex);
 
 	/* our cp_error case, we can wait for any writeback page */
@@ -823,6 +863,12 @@ static int f2fs_show_options(struct seq_file *seq, struct dentry *root)
 	if (test_opt(sbi, GRPQUOTA))
 		seq_puts(seq, ",grpquota");
 #endif
+#ifdef F2FS_FGROUP
+	seq_printf(seq, ",nr_streams=%d", sbi->nr_cluster);
+	seq_printf(seq, ",lifetime_clock=%s",
+			sbi->lifetime_clock == LIFETIME_CLOCK_TIME ?
+			"time" : "blocks");
+#endif
 
 	return 0;
 }
@@ -831,6 +877,10 @@ static void default_options(struct f2fs_sb_info *sbi)
 {
 	/* init some FS parameters */
 	sbi->active_logs = NR_CURSEG_TYPE;
+#ifdef F2FS_FGROUP
+	sbi->nr_cluster = NR_CLUSTER;
+	sbi->lifetime_clock = LIFETIME_CLOCK_BLOCKS;
+#endif
 
 	set_opt(sbi, BG_GC);
 	set_opt(sbi, INLINE_XATTR);
@@ -865,6 +915,10 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 	struct f2fs_mount_info org_mount_opt;
 	unsigned long old_sb_flags;
 	int err, active_logs;
+#ifdef F2FS_FGROUP
+	int nr_cluster;
+	unsigned int lifetime_clock;
+#endif
 	bool need_restart_gc = false;
 	bool need_stop_gc = false;
 	bool no_extent_cache = !test_opt(sbi, EXTENT_CACHE);
@@ -879,6 +933,10 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 	org_mount_opt = sbi->mount_opt;
 	old_sb_flags = sb->s_flags;
 	active_logs = sbi->active_logs;
+#ifdef F2FS_FGROUP
+	nr_cluster = sbi->nr_cluster;
+	lifetime_clock = sbi->lifetime_clock;
+#endif
 
 	/* recover superblocks we couldn't write due to previous RO mount */
 	if (!(*flags & MS_RDONLY) && is_sbi_flag_set(sbi, SBI_NEED_SB_WRITE)) {
@@ -921,6 +979,24 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 		goto restore_opts;
 	}
 
+#ifdef F2FS_FGROUP
+	/* disallow changing nr_streams dynamically */
+	if (nr_cluster != sbi->nr_cluster) {
+		err = -EINVAL;
+		f2fs_msg(sbi->sb, KERN_WARNING,
+				"switch nr_streams option is not allowed");
+		goto restore_opts;
+	}
+
+	/* recorded lifetimes would mix units */
+	if (lifetime_clock != sbi->lifetime_clock) {
+		err = -EINVAL;
+		f2fs_msg(sbi->sb, KERN_WARNING,
+				"switch lifetime_clock option is not allowed");
+		goto restore_opts;
+	}
+#endif
+
 	/*
 	 * We stop the GC thread if FS is mounted as RO
 	 * or if background_gc = off is passed in mount
@@ -977,6 +1053,10 @@ restore_gc:
 restore_opts:
 	sbi->mount_opt = org_mount_opt;
 	sbi->active_logs = active_logs;
+#ifdef F2FS_FGROUP
+	sbi->nr_cluster = nr_cluster;
+	sbi->lifetime_clock = lifetime_clock;
+#endif
 	sb->s_flags = old_sb_flags;
 #ifdef CONFIG_F2FS_FAULT_INJECTION
 	sbi->fault_info = ffi;
@@ -1582,6 +1662,21 @@ int sanity_check_ckpt(struct f2fs_sb_info *sbi)
 		}
 	}
 
+#ifdef F2FS_FGROUP
+	/* mkfs.f2fs leaves unused logs at NULL_SEGNO, see F2FS_WIDE_LOGS */
+	for (i = 0; i < MAX_ACTIVE_DATA_LOGS; i++) {
+		bool used = le32_to_cpu(ckpt->cur_data_segno[i]) != NULL_SEGNO;
+
+		if (used != (i < NR_CURSEG_DATA_TYPE)) {
+			f2fs_msg(sbi->sb, KERN_ERR,
+				"Wrong layout: built for %d data logs, "
+				"check F2FS_WIDE_LOGS and mkfs.f2fs",
+				NR_CURSEG_DATA_TYPE);
+			return 1;
+		}
+	}
+#endif
+
 	for (i = 0; i < NR_CURSEG_DATA_TYPE; i++) {
 		if (le32_to_cpu(ckpt->cur_data_segno[i]) >= main_segs ||
 			le16_to_cpu(ckpt->cur_data_blkoff[i]) >= blocks_per_seg) {
@@ -1648,6 +1743,15 @@ error
 	if (!sbi->seg_lifetime)
 		printk("ERROR seg lifetime\n");
 #endif
+#ifdef F2FS_GC_RESEG
+	sbi->reseg_budget = DEF_RESEG_BUDGET;
+#endif
+#ifdef F2FS_SSR_LIFETIME
+	sbi->ssr_policy = DEF_SSR_POLICY;
+#endif
+#ifdef F2FS_CP_GROUP
+	sbi->cp_group = 0;
+#endif
 
 #if (defined F2FS_FGROUP || defined F2FS_TRACE_ENABLE)
 	sbi->create_time_block = vmalloc(sizeof(unsigned int) * sbi->total_blocks);
@@ -1659,6 +1763,7 @@ error
 	}
 
 	sbi->cur_node_gc = sbi->total_sections * sbi->segs_per_sec;
+	sbi->cur_data_gc = sbi->total_sections * sbi->segs_per_sec;
 #endif
 
 #ifdef F2FS_TRACE_ENABLE
@@ -1692,19 +1797,30 @@ error
 	for (i = 0; i < FGROUP_ETC; i++)
 		sbi->fgroup_count[i] = 0;
 	sbi->lifetime_tree = RB_ROOT;
+	INIT_LIST_HEAD(&sbi->lifetime_list);
+	sbi->nr_file_entries = 0;
+	sbi->nr_file_samples = 0;
+	/* the simulated clock starts at 1s, 0 means "never" to the model */
+	atomic64_set(&sbi->simul_offset,
+			1 - (s64)div_u64(ktime_get_boot_ns(), NSEC_PER_SEC));
+	sbi->db_sample_pages = DEF_DB_SAMPLE_PAGES;
 	spin_lock_init(&sbi->ltree_lock);
 	sbi->fgroup_tree = RB_ROOT;
+	sbi->nr_fgroup_entries = 0;
 	spin_lock_init(&sbi->ftree_lock);
 
-	sbi->kmeans_max = vmalloc(sizeof(unsigned long long) * CLUSTER_NUM);
+	sbi->kmeans_max = vmalloc(sizeof(unsigned long long) * CLUSTER_NUM(sbi));
 	if (!sbi->kmeans_max)
 		printk("ERROR kmeans_max\n");
-	sbi->kmeans_center = vmalloc(sizeof(unsigned long long) * CLUSTER_NUM);
+	sbi->kmeans_center = vmalloc(sizeof(unsigned long long) * CLUSTER_NUM(sbi));
 	if (!sbi->kmeans_center)
 		printk("ERROR kmeans_center\n");
 	sbi->kmeans_history = vmalloc(sizeof(struct kmeans_history) * MAX_HISTORY);
 	sbi->kmeans_count = 0;
-	for (i = 0; i < CLUSTER_NUM; i++) {
+	sbi->kmeans_k = CLUSTER_NUM(sbi) - 1;
+	sbi->adaptive_k = 0;
+	sbi->kmeans_k_penalty = DEF_KMEANS_K_PENALTY;
+	for (i = 0; i < CLUSTER_NUM(sbi); i++) {
 		sbi->kmeans_max[i] = 0;
 		sbi->kmeans_center[i] = 0;
 	}
@@ -1730,8 +1846,8 @@ error
 	sbi->fgroup_history = vmalloc (sizeof(struct fgroup_history) * MAX_HISTORY);
 	sbi->history_count = 0;
 	sbi->last_cluster = CLUSTER_T;
-	
-	start_cluster_thread(sbi);
+	seqlock_init(&sbi->kmeans_lock);
+	sbi->cluster_thread = NULL;
 #endif
 	INIT_LIST_HEAD(&sbi->s_list);
 	mutex_init(&sbi->umount_mutex);
@@ -2161,6 +2277,9 @@ try_onemore:
 		f2fs_msg(sb, KERN_ERR, "Failed to get valid F2FS checkpoint");
 		goto free_meta_inode;
 	}
+#ifdef F2FS_FGROUP
+	f2fs_load_fgroup_model(sbi);
+#endif
 
 	/* Initialize device list */
 	err = f2fs_scan_devices(sbi);
@@ -2306,6 +2425,14 @@ skip_recovery:
 		if (err)
 			goto free_sysfs;
 	}
+#ifdef F2FS_FGROUP
+	/* sleeps until the write path crosses CLUSTER_T, even on RO mounts */
+	err = start_cluster_thread(sbi);
+	if (err) {
+		stop_gc_thread(sbi);
+		goto free_sysfs;
+	}
+#endif
 	kfree(options);
 
 	/* recover broken superblock */
@@ -2333,6 +2460,9 @@ free_node_inode:
 	mutex_lock(&sbi->umount_mutex);
 	release_ino_entry(sbi, true);
 	f2fs_leave_shrinker(sbi);
+#ifdef F2FS_FGROUP
+	f2fs_destroy_lifetime_tree(sbi);
+#endif
 	/*
 	 * Some dirty meta pages can be produced by recover_orphan_inodes()
 	 * failed by EIO. Then, iput(node_inode) can trigger balance_fs_bg()
@@ -2387,6 +2517,9 @@ static void kill_f2fs_super(struct super_block *sb)
 	if (sb->s_root) {
 		set_sbi_flag(F2FS_SB(sb), SBI_IS_CLOSE);
 		stop_gc_thread(F2FS_SB(sb));
+#ifdef F2FS_FGROUP
+		stop_cluster_thread(F2FS_SB(sb));
+#endif
 		stop_discard_thread(F2FS_SB(sb));
 	}
 	kill_block_super(sb);
@@ -2442,9 +2575,14 @@ static int __init init_f2fs_fs(void)
 	err = create_extent_cache();
 	if (err)
 		goto free_checkpoint_caches;
-	err = f2fs_register_sysfs();
+#ifdef F2FS_FGROUP
+	err = create_lifetime_caches();
 	if (err)
 		goto free_extent_cache;
+#endif
+	err = f2fs_register_sysfs();
+	if (err)
+		goto free_lifetime_caches;
 	err = register_shrinker(&f2fs_shrinker_info);
 	if (err)
 		goto free_sysfs;
@@ -2462,6 +2600,10 @@ free_shrinker:
 	unregister_shrinker(&f2fs_shrinker_info);
 free_sysfs:
 	f2fs_unregister_sysfs();
+free_lifetime_caches:
+#ifdef F2FS_FGROUP
+	destroy_lifetime_caches();
+#endif
 free_extent_cache:
 	destroy_extent_cache();
 free_checkpoint_caches:
@@ -2482,6 +2624,9 @@ static void __exit exit_f2fs_fs(void)
 	unregister_filesystem(&f2fs_fs_type);
 	unregister_shrinker(&f2fs_shrinker_info);
 	f2fs_unregister_sysfs();
+#ifdef F2FS_FGROUP
+	destroy_lifetime_caches();
+#endif
 	destroy_extent_cache();
 	destroy_checkpoint_caches();
 	destroy_segment_manager_caches();
@@ -112,6 +112,36 @@ static ssize_t f2fs_sbi_store(struct f2fs_attr *a,
 #ifdef CONFIG_F2FS_FAULT_INJECTION
 	if (a->struct_type == FAULT_INFO_TYPE && t >= (1 << FAULT_MAX))
 		return -EINVAL;
+#endif
+#ifdef F2FS_GC_RELOC
+	if (a->struct_type == F2FS_SBI &&
+		a->offset == offsetof(struct f2fs_sb_info, gc_reloc_policy) &&
+		t >= NR_GC_RELOC)
+		return -EINVAL;
+#endif
+#ifdef F2FS_SSR_LIFETIME
+	if (a->struct_type == F2FS_SBI &&
+		a->offset == offsetof(struct f2fs_sb_info, ssr_policy) &&
+		t >= NR_SSR_POLICY)
+		return -EINVAL;
+#endif
+#ifdef F2FS_CP_GROUP
+	if (a->struct_type == F2FS_SBI &&
+		a->offset == offsetof(struct f2fs_sb_info, cp_group) && t > 1)
+		return -EINVAL;
+#endif
+#ifdef F2FS_FGROUP
+	if (a->struct_type == F2FS_SBI &&
+		a->offset == offsetof(struct f2fs_sb_info, db_sample_pages) &&
+		(t < 1 || t > DB_SAMPLE_MAX_PAGES))
+		return -EINVAL;
+	if (a->struct_type == F2FS_SBI &&
+		a->offset == offsetof(struct f2fs_sb_info, adaptive_k) && t > 1)
+		return -EINVAL;
+	if (a->struct_type == F2FS_SBI &&
+		a->offset == offsetof(struct f2fs_sb_info, kmeans_k_penalty) &&
+		t > 100)
+		return -EINVAL;
 #endif
 	if (a->struct_type == RESERVED_BLOCKS) {
 		spin_lock(&sbi->stat_lock);
@@ -191,6 +221,23 @@ F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, max_victim_search, max_victim_search);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, dir_level, dir_level);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, cp_interval, interval_time[CP_TIME]);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, idle_interval, interval_time[REQ_TIME]);
+#ifdef F2FS_GC_RELOC
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, gc_reloc_policy, gc_reloc_policy);
+#endif
+#ifdef F2FS_GC_RESEG
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, reseg_budget, reseg_budget);
+#endif
+#ifdef F2FS_SSR_LIFETIME
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, ssr_policy, ssr_policy);
+#endif
+#ifdef F2FS_CP_GROUP
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, cp_group, cp_group);
+#endif
+#ifdef F2FS_FGROUP
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, db_sample_pages, db_sample_pages);
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, adaptive_k, adaptive_k);
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, kmeans_k_penalty, kmeans_k_penalty);
+#endif
 #ifdef CONFIG_F2FS_FAULT_INJECTION
 F2FS_RW_ATTR(FAULT_INFO_RATE, f2fs_fault_info, inject_rate, inject_rate);
 F2FS_RW_ATTR(FAULT_INFO_TYPE, f2fs_fault_info, inject_type, inject_type);
@@ -217,6 +264,23 @@ static struct attribute *f2fs_attrs[] = {
 	ATTR_LIST(dirty_nats_ratio),
 	ATTR_LIST(cp_interval),
 	ATTR_LIST(idle_interval),
+#ifdef F2FS_GC_RELOC
+	ATTR_LIST(gc_reloc_policy),
+#endif
+#ifdef F2FS_GC_RESEG
+	ATTR_LIST(reseg_budget),
+#endif
+#ifdef F2FS_SSR_LIFETIME
+	ATTR_LIST(ssr_policy),
+#endif
+#ifdef F2FS_CP_GROUP
+	ATTR_LIST(cp_group),
+#endif
+#ifdef F2FS_FGROUP
+	ATTR_LIST(db_sample_pages),
+	ATTR_LIST(adaptive_k),
+	ATTR_LIST(kmeans_k_penalty),
+#endif
 #ifdef CONFIG_F2FS_FAULT_INJECTION
 	ATTR_LIST(inject_rate),
 	ATTR_LIST(inject_type),
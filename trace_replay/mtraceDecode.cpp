@@ -0,0 +1,183 @@
+/*
+ * mtraceDecode: decode the binary mStream trace written by f2fs into
+ * /sys/kernel/debug/f2fs/mtrace-<dev>-<cpu>.
+ *
+ * Output is one tab separated line per event, ordered by time, with the
+ * same tag and columns the old printk/trace_printk lines had, so the
+ * existing grep based scripts keep working:
+ *
+ *   [EXPECTLIFE]	active	invalid	prev_ema	life_invalid	lifetime	ema	keyword
+ *   [COLDRATE]	cluster	age	cold	valid	count	vtype	keyword
+ *   [CLUSTER]	cluster	lifetime	cold	valid	count	filetype	keyword
+ *   [DB-lifetime]	index	lifetime	kind	0	seq_or_avg	keyword	name
+ *   [F2FS-GC]	type	seg_lifetime	cur_seq	cost	free
+ *
+ * usage: mtraceDecode [-t] [-e TAG] mtrace-dev-0 [mtrace-dev-1 ...]
+ *   -t      prefix every line with time(ns) and cpu columns
+ *   -e TAG  only print events whose tag contains TAG (e.g. -e CLUSTER)
+ *
+ * build: g++ -O2 -o mtraceDecode mtraceDecode.cpp
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+using namespace std;
+
+/* must match struct f2fs_mtrace_entry in mstream_f2fs/f2fs.h */
+#define MTRACE_NR_VAL		6
+#define MTRACE_KEY_LEN		64
+#define MTRACE_NAME_LEN		128
+
+enum {
+	MTRACE_EXPECTLIFE,
+	MTRACE_EXPECTLIFE_L0,
+	MTRACE_COLDRATE,
+	MTRACE_CLUSTER,
+	MTRACE_DB_LIFETIME,
+	MTRACE_GC,
+	NR_MTRACE_EVENT,
+};
+
+struct mtrace_entry {
+	uint64_t time;
+	uint32_t event;
+	int32_t arg;
+	uint64_t val[MTRACE_NR_VAL];
+	char key[MTRACE_KEY_LEN];
+	char name[MTRACE_NAME_LEN];
+};
+
+struct record {
+	mtrace_entry e;
+	int cpu;
+};
+
+static const char *tags[NR_MTRACE_EVENT] = {
+	"[EXPECTLIFE]",
+	"[EXPECTLIFE:L0]",
+	"[COLDRATE]",
+	"[CLUSTER]",
+	"[DB-lifetime]",
+	"[F2FS-GC]",
+};
+
+static bool by_time(const record &a, const record &b)
+{
+	return a.e.time < b.e.time;
+}
+
+static int read_file(const char *path, int cpu, vector<record> &out)
+{
+	FILE *fp = fopen(path, "rb");
+	record r;
+
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+	r.cpu = cpu;
+	while (fread(&r.e, sizeof(r.e), 1, fp) == 1) {
+		/* skip zero-filled slots, e.g. from a raw buffer dump */
+		if (r.e.time == 0 && r.e.event == 0)
+			continue;
+		if (r.e.event >= NR_MTRACE_EVENT)
+			continue;
+		r.e.key[MTRACE_KEY_LEN - 1] = '\0';
+		r.e.name[MTRACE_NAME_LEN - 1] = '\0';
+		out.push_back(r);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int cpu_of(const char *path)
+{
+	const char *p = strrchr(path, '-');
+
+	if (p == NULL)
+		return -1;
+	return atoi(p + 1);
+}
+
+static void print_record(const record &r, bool show_time)
+{
+	const mtrace_entry &e = r.e;
+	const uint64_t *v = e.val;
+
+	printf("%s", tags[e.event]);
+	if (show_time)
+		printf("\t%llu\t%d", (unsigned long long)e.time, r.cpu);
+
+	switch (e.event) {
+	case MTRACE_EXPECTLIFE:
+	case MTRACE_EXPECTLIFE_L0:
+		printf("\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%s\n",
+			(unsigned long long)v[0], (unsigned long long)v[1],
+			(unsigned long long)v[2], (unsigned long long)v[3],
+			(unsigned long long)v[4], (unsigned long long)v[5], e.key);
+		break;
+	case MTRACE_COLDRATE:
+	case MTRACE_CLUSTER:
+		printf("\t%d\t%llu\t%llu\t%llu\t%llu\t%llu\t%s\n", e.arg,
+			(unsigned long long)v[0], (unsigned long long)v[1],
+			(unsigned long long)v[2], (unsigned long long)v[3],
+			(unsigned long long)v[4], e.key);
+		break;
+	case MTRACE_DB_LIFETIME:
+		printf("\t%lld\t%llu\t%d\t%llu\t%llu\t%s\t%s\n",
+			(long long)v[0], (unsigned long long)v[1], e.arg,
+			(unsigned long long)v[2], (unsigned long long)v[3],
+			e.key, e.name);
+		break;
+	case MTRACE_GC:
+		printf("\t%d\t%llu\t%llu\t%llu\t%llu\n", e.arg,
+			(unsigned long long)v[0], (unsigned long long)v[1],
+			(unsigned long long)v[2], (unsigned long long)v[3]);
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	vector<record> records;
+	const char *filter = NULL;
+	bool show_time = false;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "te:")) != -1) {
+		switch (opt) {
+		case 't':
+			show_time = true;
+			break;
+		case 'e':
+			filter = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t] [-e TAG] mtrace-file...\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-t] [-e TAG] mtrace-file...\n", argv[0]);
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (read_file(argv[i], cpu_of(argv[i]), records) < 0)
+			return 1;
+	}
+	stable_sort(records.begin(), records.end(), by_time);
+
+	for (i = 0; i < (int)records.size(); i++) {
+		if (filter && strstr(tags[records[i].e.event], filter) == NULL)
+			continue;
+		print_record(records[i], show_time);
+	}
+	return 0;
+}
@@ -6,6 +6,7 @@ cat /sys/kernel/debug/f2fs/mtype > result/mtype_${logday}
 cat /sys/fs/ext4/temp_tg/user_writes > result/ext4_datawrites_${logday}
 cat /sys/devices/virtual/block/temp_tg/pblk/stats > result/pblk_${logday}
 dmesg > result/dmesg_${logday}
+./mtraceDecode /sys/kernel/debug/f2fs/mtrace-* > result/mtrace_${logday}
 echo ${logday} >> result/curtime
 date >> result/curtime
 df | grep "temp_tg" > result/df_${logday}